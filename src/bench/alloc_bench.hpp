@@ -0,0 +1,254 @@
+#ifndef ALLOC_BENCH_HPP
+#define ALLOC_BENCH_HPP
+
+#include <map>
+#include <random>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <optional>
+#include <functional>
+#include <boost/multiprecision/cpp_int.hpp>
+#include "alloc_counter.hpp"
+#include "../dhke/arena.hpp"
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Counts heap allocations per handshake phase, both sides of each handshake run in memory (no sockets) over a fixed group.
+ *
+ * - HandshakeMachine: a real listener and connector, with the count taken around every receive() and runWork() call,
+ *      for full and resumed handshakes.
+ *
+ * - HandshakeArena prototype: a model of the full handshake's steps with fixed width integers for powm as well as the
+ *      scratch space strings. The machine still uses cpp_int, so this is what the hot path could get down to, not what
+ *      a real handshake does.
+ */
+class AllocBench
+{
+private:
+    using Arena = HandshakeArena<512>;
+
+    // allocations per phase, summed over all iterations
+    std::map<std::string, std::size_t> counts_;
+    std::vector<std::string> order_;
+
+    void measure(const std::string &phase, const std::function<void()> &work)
+    {
+        if (this->counts_.find(phase) == this->counts_.end())
+            this->order_.push_back(phase);
+        std::size_t before = AllocationCounter::current();
+        work();
+        this->counts_[phase] += AllocationCounter::current() - before;
+    }
+
+    // the participants and ticket of one listener/connector pair, kept across handshakes like a long-lived peer's
+    struct Peers
+    {
+        DHKEParticipant listenerKeys{"Alice"};
+        DHKEParticipant connectorKeys{"Bob"};
+        ResumptionState resumption;
+    };
+
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, const DHGroup &group, const std::string &secret)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = secret;
+        config.expectedPeerId = peer;
+        config.primeBitLength = 512;
+        config.group = group;
+        return config;
+    }
+
+    // e.g. "listener opening: receive", the phase being what the machine was waiting for when it was called
+    static std::string label(const HandshakeMachine &machine, const char *call)
+    {
+        return std::string(machine.isListener() ? "listener " : "connector ") + machine.getPhase() + ": " + call;
+    }
+
+    // runs one side's pending work, then hands its output to the other side, counting each call on its own
+    bool step(HandshakeMachine &from, HandshakeMachine &to)
+    {
+        bool progressed = false;
+        if (from.status() == HandshakeStatus::NeedWork)
+        {
+            this->measure(label(from, "work"), [&]
+                          { from.runWork(); });
+            progressed = true;
+        }
+        if (from.hasOutput())
+        {
+            std::string bytes = from.takeOutput();
+            this->measure(label(to, "receive"), [&]
+                          { to.receive(bytes.data(), bytes.size()); });
+            progressed = true;
+        }
+        return progressed;
+    }
+
+    /**
+     * One handshake between two real HandshakeMachines over in-memory pipes, counting the allocations made inside each
+     *      receive() and runWork() call. Handing the output over is not counted, that string belongs to the transport
+     * @returns True if both sides agreed on a session key
+     */
+    bool machineHandshake(Peers &peers, SessionTicketManager &tickets, const DHGroup &group, const std::string &secret)
+    {
+        std::optional<HandshakeMachine> listener, connector;
+        this->measure("construct", [&]
+                      {
+            listener.emplace(HandshakeMachine::listener(makeConfig("Alice", "Bob", group, secret), peers.listenerKeys, tickets));
+            connector.emplace(HandshakeMachine::connector(makeConfig("Bob", "Alice", group, secret), peers.connectorKeys, peers.resumption)); });
+        while (this->step(*connector, *listener) | this->step(*listener, *connector))
+            ;
+        return listener->status() == HandshakeStatus::Done && connector->status() == HandshakeStatus::Done &&
+               listener->getSessionKey() == connector->getSessionKey();
+    }
+
+    /**
+     * The same handshake through the HandshakeArena: fixed width integers and per-session scratch space
+     * @returns The listener's session key (copied out of the arena, outside of any measured phase)
+     */
+    std::string arenaHandshake(Arena &listenerArena, Arena &connectorArena, const Arena::FixedGroup &group, std::string_view secret, std::mt19937_64 &rng)
+    {
+        Arena::FixedInt a, A, b, B, sharedL, sharedC, receivedA, receivedB;
+        Arena::FixedGroup received;
+        std::string_view flight1, flight2, mac, confirm, sessionKey;
+
+        this->measure("keygen", [&]
+                      { a = Arena::randomBelow(group.order, rng); });
+        this->measure("step1", [&]
+                      { A = boost::multiprecision::powm(group.generator, a, group.prime); });
+        this->measure("payload + mac", [&]
+                      { mac = listenerArena.mac(secret, listenerArena.payload(group, A, "LISTENER", "Alice", "Bob")); });
+        this->measure("serialize", [&]
+                      { flight1 = listenerArena.concat({"ID:Alice\nP:", listenerArena.decimal(group.prime), "\nQ:", listenerArena.decimal(group.order),
+                                                        "\nG:", listenerArena.decimal(group.generator), "\nPUB:", listenerArena.decimal(A), "\nMAC:", mac, "\n"}); });
+        this->measure("parse", [&]
+                      {
+            bool ok = Arena::parseDecimal(Arena::lineValue(flight1, "P:"), received.prime) &&
+                      Arena::parseDecimal(Arena::lineValue(flight1, "Q:"), received.order) &&
+                      Arena::parseDecimal(Arena::lineValue(flight1, "G:"), received.generator) &&
+                      Arena::parseDecimal(Arena::lineValue(flight1, "PUB:"), receivedA);
+            if (!ok)
+                throw std::runtime_error("Parse failure"); });
+        this->measure("payload + mac", [&]
+                      {
+            if (Arena::lineValue(flight1, "MAC:") != connectorArena.mac(secret, connectorArena.payload(received, receivedA, "LISTENER", "Alice", "Bob")))
+                throw std::runtime_error("MAC mismatch"); });
+        this->measure("keygen", [&]
+                      { b = Arena::randomBelow(received.order, rng); });
+        this->measure("step1", [&]
+                      { B = boost::multiprecision::powm(received.generator, b, received.prime); });
+        this->measure("step2", [&]
+                      {
+            if (boost::multiprecision::powm(receivedA, received.order, received.prime) != 1)
+                throw std::runtime_error("Key outside subgroup");
+            sharedC = boost::multiprecision::powm(receivedA, b, received.prime); });
+        this->measure("confirm + session key", [&]
+                      { confirm = connectorArena.mac(connectorArena.decimal(sharedC), "CONFIRM|CONNECTOR|Bob|Alice"); });
+        this->measure("payload + mac", [&]
+                      { mac = connectorArena.mac(secret, connectorArena.payload(received, B, "CONNECTOR", "Bob", "Alice")); });
+        this->measure("serialize", [&]
+                      { flight2 = connectorArena.concat({"ID:Bob\nPUB:", connectorArena.decimal(B), "\nMAC:", mac, "\nCONFIRM:", confirm, "\n"}); });
+        this->measure("parse", [&]
+                      {
+            if (!Arena::parseDecimal(Arena::lineValue(flight2, "PUB:"), receivedB))
+                throw std::runtime_error("Parse failure"); });
+        this->measure("payload + mac", [&]
+                      {
+            if (Arena::lineValue(flight2, "MAC:") != listenerArena.mac(secret, listenerArena.payload(group, receivedB, "CONNECTOR", "Bob", "Alice")))
+                throw std::runtime_error("MAC mismatch"); });
+        this->measure("step2", [&]
+                      {
+            if (boost::multiprecision::powm(receivedB, group.order, group.prime) != 1)
+                throw std::runtime_error("Key outside subgroup");
+            sharedL = boost::multiprecision::powm(receivedB, a, group.prime); });
+        this->measure("confirm + session key", [&]
+                      {
+            if (Arena::lineValue(flight2, "CONFIRM:") != listenerArena.mac(listenerArena.decimal(sharedL), "CONFIRM|CONNECTOR|Bob|Alice"))
+                throw std::runtime_error("Confirmation mismatch");
+            sessionKey = listenerArena.mac(listenerArena.decimal(sharedL), "SESSION_KEY"); });
+
+        std::string out(sessionKey);
+        listenerArena.reset();
+        connectorArena.reset();
+        return out;
+    }
+
+    void report(const std::string &title, int iterations)
+    {
+        std::cout << title << " (allocations per handshake, both sides)\n";
+        std::size_t total = 0;
+        for (const auto &phase : this->order_)
+        {
+            std::cout << "  " << std::left << std::setw(44) << phase << static_cast<double>(this->counts_[phase]) / iterations << "\n";
+            total += this->counts_[phase];
+        }
+        std::cout << "  " << std::left << std::setw(44) << "total" << static_cast<double>(total) / iterations << std::endl;
+    }
+
+public:
+    // steady state allocations per handshake the arena prototype is expected to stay at or below
+    static constexpr double arenaAllocationTarget = 0.0;
+
+    /**
+     * @param iterations Number of handshakes to run for each path
+     * @returns True if every machine handshake succeeded and the arena prototype met arenaAllocationTarget
+     */
+    static bool run(int iterations)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(512, 160);
+        std::string secret = "bench-secret";
+
+        // big enough that no redeemed ticket is evicted
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(2 * iterations + 4));
+        Peers peers;
+        // one warm-up handshake of each kind, so one-off lazy initialisation is not counted
+        AllocBench machineWarmUp;
+        machineWarmUp.machineHandshake(peers, tickets, group, secret);
+        machineWarmUp.machineHandshake(peers, tickets, group, secret);
+
+        AllocBench fullBench, resumedBench;
+        int failed = 0;
+        for (int i = 0; i < iterations; ++i)
+        {
+            peers.resumption = ResumptionState{};
+            failed += fullBench.machineHandshake(peers, tickets, group, secret) ? 0 : 1;
+            failed += resumedBench.machineHandshake(peers, tickets, group, secret) ? 0 : 1;
+        }
+        fullBench.report("HandshakeMachine, full handshake", iterations);
+        resumedBench.report("HandshakeMachine, resumed handshake", iterations);
+        if (failed > 0)
+        {
+            std::cout << failed << " machine handshakes failed" << std::endl;
+            return false;
+        }
+
+        // per-session state, set up once: the arenas, the RNG and the fixed width copy of the group
+        auto listenerArena = std::make_unique<Arena>();
+        auto connectorArena = std::make_unique<Arena>();
+        std::mt19937_64 rng(std::random_device{}());
+        Arena::FixedGroup fixedGroup = Arena::toFixed(group.prime, group.order, group.generator);
+        // one warm-up handshake, so any one-off lazy initialisation is not counted as steady state
+        AllocBench warmUp;
+        warmUp.arenaHandshake(*listenerArena, *connectorArena, fixedGroup, secret, rng);
+
+        AllocBench arenaBench;
+        for (int i = 0; i < iterations; ++i)
+            arenaBench.arenaHandshake(*listenerArena, *connectorArena, fixedGroup, secret, rng);
+        arenaBench.report("HandshakeArena prototype, fixed width integers (model of a full handshake)", iterations);
+
+        std::size_t arenaTotal = 0;
+        for (const auto &[phase, count] : arenaBench.counts_)
+            arenaTotal += count;
+        double perHandshake = static_cast<double>(arenaTotal) / iterations;
+        bool met = perHandshake <= arenaAllocationTarget;
+        std::cout << "arena target: <= " << arenaAllocationTarget << " allocations per handshake -> " << (met ? "met" : "NOT met") << std::endl;
+        return met;
+    }
+};
+
+#endif
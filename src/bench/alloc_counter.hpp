@@ -0,0 +1,68 @@
+#ifndef ALLOC_COUNTER_HPP
+#define ALLOC_COUNTER_HPP
+
+#include <atomic>
+#include <cstdlib>
+#include <cstddef>
+#include <new>
+
+/**
+ * Counts every heap allocation made through the global operator new.
+ *
+ * NOTE: this header replaces the global operator new/delete, so it must only be included by ONE translation unit of
+ *      an executable (for dhke_bench, that is bench_main.cpp).
+ */
+struct AllocationCounter
+{
+    static inline std::atomic<std::size_t> count{0};
+
+    // number of allocations made so far
+    static std::size_t current()
+    {
+        return count.load(std::memory_order_relaxed);
+    }
+};
+
+// kept out of line, otherwise GCC sees free() applied to what it knows came from operator new and warns about a mismatch
+#if defined(__GNUC__)
+__attribute__((noinline))
+#endif
+static void releaseAllocation(void *ptr) noexcept
+{
+    std::free(ptr);
+}
+
+void *operator new(std::size_t size)
+{
+    AllocationCounter::count.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size == 0 ? 1 : size))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](std::size_t size)
+{
+    return ::operator new(size);
+}
+
+void operator delete(void *ptr) noexcept
+{
+    releaseAllocation(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    releaseAllocation(ptr);
+}
+
+void operator delete(void *ptr, std::size_t) noexcept
+{
+    releaseAllocation(ptr);
+}
+
+void operator delete[](void *ptr, std::size_t) noexcept
+{
+    releaseAllocation(ptr);
+}
+
+#endif
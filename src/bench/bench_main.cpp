@@ -0,0 +1,196 @@
+#include <iostream>
+#include <string>
+#include <spdlog/spdlog.h>
+
+#include "alloc_bench.hpp"
+#include "exponent_bench.hpp"
+#include "handshake_bench.hpp"
+#include "latency_bench.hpp"
+#include "logging_bench.hpp"
+#include "mux_bench.hpp"
+#include "overload_bench.hpp"
+#include "parallel_bench.hpp"
+#include "puzzle_bench.hpp"
+#include "record_bench.hpp"
+#include "replay_bench.hpp"
+#include "sansio_bench.hpp"
+#include "session_bench.hpp"
+#include "shard_bench.hpp"
+#include "transport_bench.hpp"
+
+/**
+ * Prints help info for each benchmark
+ */
+void printBenchUsage()
+{
+    std::cout << "Benchmark usage:\n";
+    std::cout << "  dhke_bench alloc [iterations]\n";
+    std::cout << "  dhke_bench exp [prime_bits] [subgroup_bits] [iterations]\n";
+    std::cout << "  dhke_bench handshake [count] [full|resume] [port] [prime_bits]\n";
+    std::cout << "  dhke_bench latency [one_way_ms] [handshakes] [prime_bits] [subgroup_bits]\n";
+    std::cout << "  dhke_bench logging [handshakes] [prime_bits] [subgroup_bits]\n";
+    std::cout << "  dhke_bench mux [pings] [port]\n";
+    std::cout << "  dhke_bench overload [connectors] [stalled] [max_in_progress] [max_queued] [port] [prime_bits]\n";
+    std::cout << "  dhke_bench parallel [handshakes] [prime_bits] [subgroup_bits]\n";
+    std::cout << "  dhke_bench puzzle [max_bits] [iterations]\n";
+    std::cout << "  dhke_bench records [messages] [payload_bytes] [port]\n";
+    std::cout << "  dhke_bench replay <transcript> <auth_secret> [passes]\n";
+    std::cout << "  dhke_bench sansio [handshakes] [concurrent] [full|resume] [prime_bits] [subgroup_bits]\n";
+    std::cout << "  dhke_bench sessions [count] [ops]\n";
+    std::cout << "  dhke_bench shards [max_shards] [seconds] [full|resume] [port] [prime_bits]\n";
+    std::cout << "  dhke_bench transport [handshakes] [pings] [bulk_mib] [port]\n";
+    std::cout << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        printBenchUsage();
+        return 1;
+    }
+    // keep the benchmark output readable, the library code logs at info level
+    spdlog::set_level(spdlog::level::warn);
+
+    std::string bench = argv[1];
+    if (bench == "alloc")
+    {
+        int iterations = argc > 2 ? std::stoi(argv[2]) : 100;
+        return AllocBench::run(iterations) ? 0 : 1;
+    }
+    if (bench == "exp")
+    {
+        size_t primeBits = argc > 2 ? std::stoul(argv[2]) : 2048;
+        size_t orderBits = argc > 3 ? std::stoul(argv[3]) : 224;
+        int iterations = argc > 4 ? std::stoi(argv[4]) : 20;
+        ExponentBench::run(primeBits, orderBits, iterations);
+        return 0;
+    }
+
+    if (bench == "handshake")
+    {
+        int count = argc > 2 ? std::stoi(argv[2]) : 200;
+        bool resume = argc > 3 ? std::string(argv[3]) == "resume" : true;
+        int port = argc > 4 ? std::stoi(argv[4]) : 3900;
+        size_t primeBits = argc > 5 ? std::stoul(argv[5]) : 512;
+        HandshakeBench::run(count, resume, port, primeBits);
+        return 0;
+    }
+
+    if (bench == "latency")
+    {
+        double oneWayMillis = argc > 2 ? std::stod(argv[2]) : 50.0;
+        int handshakes = argc > 3 ? std::stoi(argv[3]) : 20;
+        size_t primeBits = argc > 4 ? std::stoul(argv[4]) : 1024;
+        size_t subgroupBits = argc > 5 ? std::stoul(argv[5]) : 160;
+        LatencyBench::run(oneWayMillis, handshakes, primeBits, subgroupBits);
+        return 0;
+    }
+
+    if (bench == "logging")
+    {
+        int handshakes = argc > 2 ? std::stoi(argv[2]) : 200;
+        size_t primeBits = argc > 3 ? std::stoul(argv[3]) : 512;
+        size_t subgroupBits = argc > 4 ? std::stoul(argv[4]) : 160;
+        LoggingBench::run(handshakes, primeBits, subgroupBits);
+        return 0;
+    }
+
+    if (bench == "mux")
+    {
+        int pings = argc > 2 ? std::stoi(argv[2]) : 2000;
+        int port = argc > 3 ? std::stoi(argv[3]) : 3930;
+        MuxBench::run(pings, port);
+        return 0;
+    }
+
+    if (bench == "overload")
+    {
+        int connectors = argc > 2 ? std::stoi(argv[2]) : 200;
+        int stalled = argc > 3 ? std::stoi(argv[3]) : 4;
+        AdmissionLimits limits;
+        limits.maxInProgress = argc > 4 ? std::stoul(argv[4]) : limits.maxInProgress;
+        limits.maxQueued = argc > 5 ? std::stoul(argv[5]) : 16;
+        int port = argc > 6 ? std::stoi(argv[6]) : 3920;
+        size_t primeBits = argc > 7 ? std::stoul(argv[7]) : 512;
+        OverloadBench::run(connectors, stalled, limits, port, primeBits);
+        return 0;
+    }
+
+    if (bench == "parallel")
+    {
+        int handshakes = argc > 2 ? std::stoi(argv[2]) : 100;
+        size_t primeBits = argc > 3 ? std::stoul(argv[3]) : 1024;
+        size_t subgroupBits = argc > 4 ? std::stoul(argv[4]) : 160;
+        return ParallelBench::run(handshakes, primeBits, subgroupBits) ? 0 : 1;
+    }
+
+    if (bench == "puzzle")
+    {
+        unsigned maxBits = argc > 2 ? static_cast<unsigned>(std::stoul(argv[2])) : 20;
+        int iterations = argc > 3 ? std::stoi(argv[3]) : 20;
+        PuzzleBench::run(maxBits, iterations);
+        return 0;
+    }
+
+    if (bench == "records")
+    {
+        int messages = argc > 2 ? std::stoi(argv[2]) : 200000;
+        size_t payloadBytes = argc > 3 ? std::stoul(argv[3]) : 64;
+        int port = argc > 4 ? std::stoi(argv[4]) : 3910;
+        RecordBench::run(messages, payloadBytes, port);
+        return 0;
+    }
+
+    if (bench == "replay")
+    {
+        if (argc < 4)
+        {
+            printBenchUsage();
+            return 1;
+        }
+        int passes = argc > 4 ? std::stoi(argv[4]) : 100;
+        return ReplayBench::run(argv[2], argv[3], passes) ? 0 : 1;
+    }
+
+    if (bench == "sansio")
+    {
+        int handshakes = argc > 2 ? std::stoi(argv[2]) : 2000;
+        int concurrent = argc > 3 ? std::stoi(argv[3]) : 1000;
+        bool resume = argc > 4 ? std::string(argv[4]) == "resume" : false;
+        size_t primeBits = argc > 5 ? std::stoul(argv[5]) : 512;
+        size_t subgroupBits = argc > 6 ? std::stoul(argv[6]) : 160;
+        SansIoBench::run(handshakes, concurrent, resume, primeBits, subgroupBits);
+        return 0;
+    }
+
+    if (bench == "sessions")
+    {
+        size_t count = argc > 2 ? std::stoul(argv[2]) : 100000;
+        size_t ops = argc > 3 ? std::stoul(argv[3]) : 2000000;
+        return SessionBench::run(count, ops) ? 0 : 1;
+    }
+
+    if (bench == "shards")
+    {
+        size_t maxShards = argc > 2 ? std::stoul(argv[2]) : std::max(1u, std::thread::hardware_concurrency());
+        double seconds = argc > 3 ? std::stod(argv[3]) : 3.0;
+        bool resume = argc > 4 ? std::string(argv[4]) == "resume" : false;
+        int port = argc > 5 ? std::stoi(argv[5]) : 3950;
+        size_t primeBits = argc > 6 ? std::stoul(argv[6]) : 512;
+        return ShardBench::run(maxShards, seconds, resume, port, primeBits) ? 0 : 1;
+    }
+
+    if (bench == "transport")
+    {
+        int handshakes = argc > 2 ? std::stoi(argv[2]) : 500;
+        int pings = argc > 3 ? std::stoi(argv[3]) : 5000;
+        size_t bulkMiB = argc > 4 ? std::stoul(argv[4]) : 256;
+        int port = argc > 5 ? std::stoi(argv[5]) : 3940;
+        TransportBench::run(handshakes, pings, bulkMiB, port);
+        return 0;
+    }
+
+    printBenchUsage();
+    return 1;
+}
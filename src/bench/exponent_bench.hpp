@@ -0,0 +1,60 @@
+#ifndef EXPONENT_BENCH_HPP
+#define EXPONENT_BENCH_HPP
+
+#include <chrono>
+#include <iostream>
+#include <boost/multiprecision/cpp_int.hpp>
+#include "../dhke/key_gen.hpp"
+
+/**
+ * Compares the cost of the exponentiations in one handshake (step 1 + step 2) when private keys are full length,
+ * versus when they are drawn from [1, q) for a known subgroup order q.
+ */
+class ExponentBench
+{
+public:
+    /**
+     * @param primeBitLength The bit length of the prime modulus
+     * @param orderBitLength The bit length of the subgroup order q
+     * @param iterations How many simulated handshakes to time for each key type
+     */
+    static void run(size_t primeBitLength, size_t orderBitLength, int iterations)
+    {
+        using boost::multiprecision::cpp_int;
+        DHGroup group = KeyGenerator::getSubgroupParameters(primeBitLength, orderBitLength);
+        // a full length exponent is the worst (and, for the same group, the most common) case for the legacy keys
+        cpp_int fullLengthUpper = group.prime - 1;
+
+        auto timeHandshakes = [&](auto drawKey)
+        {
+            std::chrono::nanoseconds total{0};
+            for (int i = 0; i < iterations; i++)
+            {
+                cpp_int a = drawKey();
+                cpp_int b = drawKey();
+                auto start = std::chrono::steady_clock::now();
+                // step 1 for both sides, then step 2 for one side (the other is identical in cost)
+                cpp_int A = boost::multiprecision::powm(group.generator, a, group.prime);
+                cpp_int B = boost::multiprecision::powm(group.generator, b, group.prime);
+                cpp_int shared = boost::multiprecision::powm(B, a, group.prime);
+                total += std::chrono::steady_clock::now() - start;
+                if (shared == 0 || A == 0)
+                    std::cout << "unexpected zero" << std::endl;
+            }
+            // three powm per iteration, one handshake side = two of them
+            return std::chrono::duration<double, std::micro>(total).count() / iterations * 2.0 / 3.0;
+        };
+
+        double fullUs = timeHandshakes([&]
+                                       { return KeyGenerator::getRandomBelow(fullLengthUpper); });
+        double shortUs = timeHandshakes([&]
+                                        { return KeyGenerator::getRandomBelow(group.order); });
+
+        std::cout << "p = " << primeBitLength << " bits, q = " << orderBitLength << " bits, " << iterations << " iterations\n";
+        std::cout << "  full length exponents:  " << fullUs << " us per handshake side (step 1 + step 2)\n";
+        std::cout << "  subgroup exponents:     " << shortUs << " us per handshake side (step 1 + step 2)\n";
+        std::cout << "  saving:                 " << 100.0 * (1.0 - shortUs / fullUs) << "%" << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,64 @@
+#ifndef HANDSHAKE_BENCH_HPP
+#define HANDSHAKE_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <string>
+#include <memory>
+#include "../dhke/client.hpp"
+#include "../dhke/transport_stats.hpp"
+
+/**
+ * Runs complete handshakes between a listener and a connector in this process over TCP loopback, and reports
+ *      handshakes/sec and socket syscalls per handshake (both sides together).
+ */
+class HandshakeBench
+{
+public:
+    /**
+     * @param handshakes Number of handshakes to run
+     * @param resume If true, only the first handshake runs the key exchange and the rest resume from tickets,
+     *      which takes the bignum work out and leaves mostly transport cost
+     * @param port The loopback port to listen on
+     * @param primeBitLength The prime bit length for the key exchange
+     */
+    static void run(int handshakes, bool resume, int port, size_t primeBitLength)
+    {
+        DHKEClient listener("BenchListener", port, "localhost", 0);
+        std::thread listenerThread([&]
+                                   { listener.performListenerHandshake("bench", "BenchConnector", primeBitLength, primeBitLength / 4, handshakes); });
+        // give the acceptor time to bind
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        auto connector = std::make_unique<DHKEClient>("BenchConnector", 0, "127.0.0.1", port);
+        int ok = 0;
+        std::chrono::nanoseconds elapsed{0};
+        for (int i = 0; i < handshakes; ++i)
+        {
+            // a fresh client has no ticket, so every handshake runs the full key exchange
+            if (!resume)
+                connector = std::make_unique<DHKEClient>("BenchConnector", 0, "127.0.0.1", port);
+            // the first (full) handshake of a resume run is excluded from the stats
+            if (resume && i == 1)
+            {
+                TransportStats::reset();
+                elapsed = std::chrono::nanoseconds{0};
+            }
+            auto start = std::chrono::steady_clock::now();
+            ok += connector->performConnectorHandshake("bench", "BenchListener", primeBitLength) ? 1 : 0;
+            elapsed += std::chrono::steady_clock::now() - start;
+        }
+        listenerThread.join();
+
+        int measured = resume ? handshakes - 1 : handshakes;
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        std::cout << (resume ? "resumed" : "full") << " handshakes: " << ok << "/" << handshakes << " ok\n";
+        std::cout << "  handshakes/sec:          " << measured / seconds << "\n";
+        std::cout << "  socket writes/handshake: " << static_cast<double>(TransportStats::writes) / measured << "\n";
+        std::cout << "  socket reads/handshake:  " << static_cast<double>(TransportStats::reads) / measured << "\n";
+        std::cout << "  bytes/handshake:         " << static_cast<double>(TransportStats::bytesWritten) / measured << std::endl;
+    }
+};
+
+#endif
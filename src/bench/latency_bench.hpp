@@ -0,0 +1,196 @@
+#ifndef LATENCY_BENCH_HPP
+#define LATENCY_BENCH_HPP
+
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <condition_variable>
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Compares the full handshake with the one round trip handshake over an emulated high-latency link. Each side runs
+ *      on its own thread and every flight is delivered a fixed one way delay after it was sent, so waiting on the
+ *      network and computing overlap the way they would across a real link.
+ *
+ * The connection setup is part of the measurement: nothing can be sent until one round trip after the connector
+ *      starts (the TCP handshake), and the connector is free to compute in the meantime. Both runs use the same group,
+ *      fixed on the listener for the full handshake and pre-agreed for the one round trip handshake, so the difference
+ *      is down to the protocol alone.
+ */
+class LatencyBench
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    // one direction of the emulated link
+    class Link
+    {
+    private:
+        std::mutex mutex_;
+        std::condition_variable ready_;
+        std::deque<std::pair<Clock::time_point, std::string>> flights_;
+
+    public:
+        void send(std::string bytes, Clock::time_point deliverAt)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->flights_.emplace_back(deliverAt, std::move(bytes));
+            this->ready_.notify_one();
+        }
+
+        // blocks until the next flight has arrived
+        std::string receive()
+        {
+            std::unique_lock<std::mutex> lock(this->mutex_);
+            this->ready_.wait(lock, [this]
+                              { return !this->flights_.empty(); });
+            auto [deliverAt, bytes] = std::move(this->flights_.front());
+            this->flights_.pop_front();
+            lock.unlock();
+            std::this_thread::sleep_until(deliverAt);
+            return bytes;
+        }
+    };
+
+    struct Side
+    {
+        double millis = 0.0;
+        int flights = 0;
+        bool ok = false;
+    };
+
+    /**
+     * Drives one side until it is done, sending each flight over the link once the connection is up
+     * @param connected When the connection is set up, nothing can be sent before then
+     */
+    static Side drive(HandshakeMachine &machine, Link &in, Link &out, Clock::time_point start, Clock::time_point connected,
+                      std::chrono::microseconds oneWay)
+    {
+        Side side;
+        while (true)
+        {
+            HandshakeStatus status = machine.status();
+            if (status == HandshakeStatus::NeedWork)
+            {
+                machine.runWork();
+                continue;
+            }
+            if (machine.hasOutput())
+            {
+                out.send(machine.takeOutput(), std::max(Clock::now(), connected) + oneWay);
+                side.flights++;
+            }
+            if (status != HandshakeStatus::NeedInput)
+            {
+                side.ok = status == HandshakeStatus::Done;
+                break;
+            }
+            std::string bytes = in.receive();
+            machine.receive(bytes.data(), bytes.size());
+        }
+        side.millis = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return side;
+    }
+
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, size_t primeBits)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = "bench";
+        config.expectedPeerId = peer;
+        config.primeBitLength = primeBits;
+        return config;
+    }
+
+    static void measure(const std::string &label, bool quick, const DHGroup &group, size_t primeBits, int handshakes,
+                        std::chrono::microseconds oneWay, SessionTicketManager &tickets)
+    {
+        std::vector<double> connectorMillis, listenerMillis;
+        int flights = 0, failed = 0;
+        for (int i = 0; i < handshakes; ++i)
+        {
+            HandshakeConfig listenerConfig = makeConfig("BenchListener", "BenchConnector", primeBits);
+            HandshakeConfig connectorConfig = makeConfig("BenchConnector", "BenchListener", primeBits);
+            if (quick)
+            {
+                listenerConfig.preagreedGroup = group;
+                connectorConfig.preagreedGroup = group;
+            }
+            else
+            {
+                listenerConfig.group = group;
+            }
+
+            DHKEParticipant listenerKeys("BenchListener"), connectorKeys("BenchConnector");
+            ResumptionState resumption;
+            Link toListener, toConnector;
+            // the connector starts connecting now, the SYN reaches the listener one way later and the connection is
+            //      usable a full round trip after we start
+            Clock::time_point start = Clock::now();
+            Clock::time_point connected = start + 2 * oneWay;
+            Side listenerSide, connectorSide;
+
+            std::thread listenerThread([&]
+                                       {
+                auto listener = HandshakeMachine::listener(listenerConfig, listenerKeys, tickets);
+                std::this_thread::sleep_until(start + oneWay);
+                listenerSide = drive(listener, toListener, toConnector, start, connected, oneWay); });
+            auto connector = HandshakeMachine::connector(connectorConfig, connectorKeys, resumption);
+            connectorSide = drive(connector, toConnector, toListener, start, connected, oneWay);
+            listenerThread.join();
+
+            if (!connectorSide.ok || !listenerSide.ok || connector.getSessionKey().empty())
+            {
+                failed++;
+                continue;
+            }
+            connectorMillis.push_back(connectorSide.millis);
+            listenerMillis.push_back(listenerSide.millis);
+            flights = connectorSide.flights + listenerSide.flights;
+        }
+
+        auto median = [](std::vector<double> values)
+        {
+            if (values.empty())
+                return 0.0;
+            std::sort(values.begin(), values.end());
+            return values[values.size() / 2];
+        };
+        double rtt = 2.0 * std::chrono::duration<double, std::milli>(oneWay).count();
+        double connectorP50 = median(connectorMillis);
+        // the connection setup, then one round trip per pair of flights
+        int roundTrips = 1 + (flights + 1) / 2;
+        std::cout << label << ": " << roundTrips << " round trips incl. connect (" << flights << " flights), connector done p50 "
+                  << connectorP50 << " ms, listener done p50 " << median(listenerMillis) << " ms, of which compute ~"
+                  << std::max(0.0, connectorP50 - roundTrips * rtt) << " ms" << (failed ? ", FAILED: " + std::to_string(failed) : "") << std::endl;
+    }
+
+public:
+    /**
+     * @param oneWayMillis The emulated one way delay, half the round trip time
+     * @param handshakes Handshakes per protocol
+     * @param primeBits The prime bit length
+     * @param subgroupBits The subgroup order bit length
+     */
+    static void run(double oneWayMillis, int handshakes, size_t primeBits, size_t subgroupBits)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(primeBits, subgroupBits);
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(handshakes) * 4);
+        auto oneWay = std::chrono::microseconds(static_cast<long long>(oneWayMillis * 1000.0));
+
+        std::cout << handshakes << " handshakes per protocol over a " << 2.0 * oneWayMillis << " ms round trip link ("
+                  << primeBits << "/" << subgroupBits << " bit group)\n";
+        measure("full handshake (listener's fixed group)", false, group, primeBits, handshakes, oneWay, tickets);
+        measure("one round trip (pre-agreed group)      ", true, group, primeBits, handshakes, oneWay, tickets);
+    }
+};
+
+#endif
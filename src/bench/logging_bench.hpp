@@ -0,0 +1,150 @@
+#ifndef LOGGING_BENCH_HPP
+#define LOGGING_BENCH_HPP
+
+#include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/basic_file_sink.h>
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Measures what logging costs a handshake. Full handshakes run back to back in memory (see SansIoBench), with the
+ *      log going to a file so the writes are real but the console stays readable, for:
+ *
+ * - a synchronous logger at info, where the handshake thread also does the file writes
+ *
+ * - the asynchronous logger (as set up by Logging::initAsync) at debug, info and off
+ *
+ * With a DHKE_STRIP_DEBUG_LOGS build, the debug run should match the info run, since the debug calls are compiled out.
+ *
+ * Parameter validation dominates a full handshake, so the logging itself is also measured on its own: the cost of
+ *      step 1's parameter message when the values are formatted eagerly with str() (as before), or lazily.
+ */
+class LoggingBench
+{
+private:
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, size_t primeBits, const DHGroup &group)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = "bench";
+        config.expectedPeerId = peer;
+        config.primeBitLength = primeBits;
+        config.group = group;
+        return config;
+    }
+
+    // runs one full handshake to completion, returns its latency in microseconds
+    static double handshake(size_t primeBits, const DHGroup &group, SessionTicketManager &tickets)
+    {
+        DHKEParticipant listenerKeys("BenchListener"), connectorKeys("BenchConnector");
+        ResumptionState resumption;
+        auto begin = std::chrono::steady_clock::now();
+        auto listener = HandshakeMachine::listener(makeConfig("BenchListener", "BenchConnector", primeBits, group), listenerKeys, tickets);
+        auto connector = HandshakeMachine::connector(makeConfig("BenchConnector", "BenchListener", primeBits, group), connectorKeys, resumption);
+        auto pending = [](const HandshakeMachine &m)
+        { return m.status() == HandshakeStatus::NeedWork || m.hasOutput(); };
+        while (pending(listener) || pending(connector))
+        {
+            for (auto [from, to] : {std::pair{&connector, &listener}, std::pair{&listener, &connector}})
+            {
+                from->runWork();
+                if (from->hasOutput())
+                {
+                    std::string bytes = from->takeOutput();
+                    to->receive(bytes.data(), bytes.size());
+                }
+            }
+        }
+        if (listener.status() != HandshakeStatus::Done || connector.status() != HandshakeStatus::Done)
+            throw std::runtime_error("Benchmark handshake failed");
+        return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    static void measure(const std::string &label, const std::shared_ptr<spdlog::logger> &logger, spdlog::level::level_enum level,
+                        int handshakes, size_t primeBits, const DHGroup &group, SessionTicketManager &tickets)
+    {
+        logger->set_level(level);
+        spdlog::set_default_logger(logger);
+        std::vector<double> micros;
+        for (int i = 0; i < handshakes; ++i)
+            micros.push_back(handshake(primeBits, group, tickets));
+        logger->flush();
+        spdlog::set_level(spdlog::level::warn);
+
+        std::sort(micros.begin(), micros.end());
+        double total = 0.0;
+        for (double m : micros)
+            total += m;
+        std::cout << label << ": mean " << total / handshakes << " us, p50 " << micros[micros.size() / 2]
+                  << " us, p99 " << micros[std::min(micros.size() - 1, micros.size() * 99 / 100)] << " us" << std::endl;
+    }
+
+    // the cost of one step 1 style message (three big values), in nanoseconds
+    template <typename Log>
+    static double perMessage(const std::shared_ptr<spdlog::logger> &logger, spdlog::level::level_enum level, Log log)
+    {
+        const int messages = 20000;
+        logger->set_level(level);
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < messages; ++i)
+            log(*logger);
+        double nanos = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / messages;
+        logger->flush();
+        return nanos;
+    }
+
+    static void measureMessages(const std::shared_ptr<spdlog::logger> &logger, const DHGroup &group)
+    {
+        boost::multiprecision::cpp_int privateKey = KeyGenerator::getRandomBelow(group.order);
+        auto eager = [&](spdlog::logger &l)
+        { l.info("{} parameters: g = {}, private = {}, prime = {}", "Bench", group.generator.str(), privateKey.str(), group.prime.str()); };
+        auto lazy = [&](spdlog::logger &l)
+        { l.info("{} parameters: g = {}, private = {}, prime = {}", "Bench", LazyBigInt{group.generator}, LazyBigInt{privateKey}, LazyBigInt{group.prime}); };
+
+        std::cout << "one step 1 parameter message, async logger:\n";
+        std::cout << "  eager str(), written:      " << perMessage(logger, spdlog::level::info, eager) << " ns\n";
+        std::cout << "  lazy, written:             " << perMessage(logger, spdlog::level::info, lazy) << " ns\n";
+        std::cout << "  eager str(), level off:    " << perMessage(logger, spdlog::level::off, eager) << " ns\n";
+        std::cout << "  lazy, level off:           " << perMessage(logger, spdlog::level::off, lazy) << " ns" << std::endl;
+    }
+
+public:
+    /**
+     * @param handshakes Number of full handshakes per run
+     * @param primeBits The prime bit length
+     * @param subgroupBits The subgroup order bit length
+     */
+    static void run(int handshakes, size_t primeBits, size_t subgroupBits)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(primeBits, subgroupBits);
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(handshakes) * 4);
+        std::string path = (std::filesystem::temp_directory_path() / "dhke_logging_bench.log").string();
+        auto previous = spdlog::default_logger();
+
+        std::cout << handshakes << " full handshakes per run (" << primeBits << "/" << subgroupBits << " bit group), logging to " << path << "\n";
+        auto fileSink = std::make_shared<spdlog::sinks::basic_file_sink_mt>(path, true);
+        auto syncLogger = std::make_shared<spdlog::logger>("bench_sync", fileSink);
+        measure("sync logger, info  ", syncLogger, spdlog::level::info, handshakes, primeBits, group, tickets);
+
+        spdlog::init_thread_pool(8192, 1);
+        auto asyncLogger = std::make_shared<spdlog::async_logger>("bench_async", fileSink, spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+        measure("async logger, debug", asyncLogger, spdlog::level::debug, handshakes, primeBits, group, tickets);
+        measure("async logger, info ", asyncLogger, spdlog::level::info, handshakes, primeBits, group, tickets);
+        measure("async logger, off  ", asyncLogger, spdlog::level::off, handshakes, primeBits, group, tickets);
+        measureMessages(asyncLogger, group);
+
+        spdlog::set_default_logger(previous);
+    }
+};
+
+#endif
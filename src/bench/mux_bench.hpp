@@ -0,0 +1,215 @@
+#ifndef MUX_BENCH_HPP
+#define MUX_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+#include <unordered_map>
+#include <asio.hpp>
+#include "../dhke/crypto.hpp"
+#include "../dhke/record_layer.hpp"
+#include "../dhke/stream_mux.hpp"
+
+/**
+ * Runs a latency-sensitive ping/pong conversation next to a bulk transfer over one session on TCP loopback, and
+ *      reports the ping round trip times and the bulk throughput for:
+ *
+ * - the pings alone
+ *
+ * - pings and bulk data on separate streams of one StreamMux, so the scheduler takes turns between them, with the
+ *      default stream window and again with a smaller one, which bounds how much bulk data is in flight ahead of a ping
+ *
+ * - pings and bulk data on one shared stream, i.e. one ordered channel as without multiplexing, where each ping waits
+ *      behind whatever bulk data was queued before it
+ *
+ * Messages are framed as [u32 length][u8 kind][body], so the listener can pick the pings out of a shared stream.
+ */
+class MuxBench
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr char pingKind = 'P';
+    static constexpr char bulkKind = 'B';
+    static constexpr size_t bulkMessageBytes = 64 * 1024;
+    // how much bulk data the connector keeps queued, so the link never runs dry
+    static constexpr size_t bulkBacklogBytes = 1024 * 1024;
+
+    static std::string frame(char kind, std::string_view body)
+    {
+        std::string out(5, '\0');
+        std::uint32_t length = static_cast<std::uint32_t>(body.size());
+        std::memcpy(out.data(), &length, 4);
+        out[4] = kind;
+        out.append(body);
+        return out;
+    }
+
+    // takes the complete messages out of a stream's buffered bytes
+    static std::vector<std::pair<char, std::string>> unframe(std::string &buffer)
+    {
+        std::vector<std::pair<char, std::string>> messages;
+        size_t offset = 0;
+        while (buffer.size() - offset >= 5)
+        {
+            std::uint32_t length;
+            std::memcpy(&length, buffer.data() + offset, 4);
+            if (buffer.size() - offset - 5 < length)
+                break;
+            messages.emplace_back(buffer[offset + 4], buffer.substr(offset + 5, length));
+            offset += 5 + length;
+        }
+        buffer.erase(0, offset);
+        return messages;
+    }
+
+    // pump() flushes after every round, so the latency only has to be long enough to keep a round together
+    static RecordLayerOptions batched()
+    {
+        RecordLayerOptions options;
+        options.flushLatency = std::chrono::microseconds(200);
+        return options;
+    }
+
+    static double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+            return 0.0;
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+    }
+
+    // the listener: echoes every ping on the stream it came in on and throws the bulk data away
+    static void echo(asio::ip::tcp::socket &socket, const std::string &sessionKey)
+    {
+        asio::streambuf buffer;
+        RecordLayer records(socket, buffer, sessionKey, true, batched());
+        StreamMux mux(records, true);
+        std::unordered_map<std::uint32_t, std::string> partial;
+        while (true)
+        {
+            auto event = mux.poll(!mux.hasSendable());
+            if (!event)
+            {
+                if (mux.isPeerClosed())
+                    break;
+                mux.pump();
+                continue;
+            }
+            if (event->type == StreamEvent::Type::Finished)
+            {
+                mux.finish(event->stream);
+            }
+            else if (event->type == StreamEvent::Type::Data)
+            {
+                std::string &pending = partial[event->stream];
+                pending += mux.read(event->stream);
+                for (auto &[kind, body] : unframe(pending))
+                {
+                    if (kind == pingKind)
+                        mux.write(event->stream, frame(pingKind, body));
+                }
+            }
+            mux.pump();
+        }
+    }
+
+    static void measure(const std::string &label, int pings, bool bulk, bool shareStream, int port, StreamMuxOptions options = StreamMuxOptions())
+    {
+        const std::string sessionKey = CryptoUtils::randomHex(16);
+        asio::io_context io;
+        asio::ip::tcp::acceptor acceptor(io, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+        asio::ip::tcp::socket listening(io);
+        std::thread listenerThread([&]
+                                   {
+            acceptor.accept(listening);
+            listening.set_option(asio::ip::tcp::no_delay(true));
+            try
+            {
+                echo(listening, sessionKey);
+            }
+            catch (const std::exception &ex)
+            {
+                std::cerr << "listener: " << ex.what() << std::endl;
+            } });
+
+        asio::ip::tcp::socket socket(io);
+        socket.connect(acceptor.local_endpoint());
+        socket.set_option(asio::ip::tcp::no_delay(true));
+        asio::streambuf buffer;
+        RecordLayer records(socket, buffer, sessionKey, false, batched());
+        StreamMux mux(records, false, options);
+
+        std::uint32_t pingStream = mux.open();
+        std::uint32_t bulkStream = shareStream ? pingStream : mux.open();
+        const std::string bulkMessage = frame(bulkKind, std::string(bulkMessageBytes, 'b'));
+        std::vector<double> rttMicros;
+        std::string pongs;
+        bool outstanding = false;
+        Clock::time_point pingSent;
+        std::uint64_t bulkBytes = 0;
+
+        auto start = Clock::now();
+        while (static_cast<int>(rttMicros.size()) < pings)
+        {
+            while (bulk && mux.pending(bulkStream) < bulkBacklogBytes)
+            {
+                mux.write(bulkStream, bulkMessage);
+                bulkBytes += bulkMessage.size();
+            }
+            if (!outstanding)
+            {
+                pingSent = Clock::now();
+                mux.write(pingStream, frame(pingKind, std::string(16, 'p')));
+                outstanding = true;
+            }
+            mux.pump();
+
+            auto event = mux.poll(!mux.hasSendable());
+            if (!event || event->type != StreamEvent::Type::Data || event->stream != pingStream)
+                continue;
+            pongs += mux.read(pingStream);
+            for (auto &message : unframe(pongs))
+            {
+                (void)message;
+                rttMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - pingSent).count());
+                outstanding = false;
+            }
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        // whatever bulk data is still queued never went out, don't count it
+        bulkBytes -= mux.pending(bulkStream);
+        StreamMuxStats stats = mux.getStats();
+        records.close();
+        listenerThread.join();
+
+        std::cout << label << ": ping rtt p50 " << percentile(rttMicros, 0.5) << " us, p99 " << percentile(rttMicros, 0.99) << " us";
+        if (bulk)
+            std::cout << ", bulk " << bulkBytes / seconds / (1024.0 * 1024.0) << " MiB/s, credit stalls " << stats.creditStalls;
+        std::cout << std::endl;
+    }
+
+public:
+    /**
+     * @param pings Ping round trips per run
+     * @param port The loopback port to use
+     */
+    static void run(int pings, int port)
+    {
+        StreamMuxOptions defaults;
+        std::cout << pings << " pings per run, " << defaults.quantum / 1024 << " KiB quantum, " << defaults.initialWindow / 1024
+                  << " KiB stream window, " << bulkBacklogBytes / 1024 << " KiB of bulk data kept queued\n";
+        measure("pings alone", pings, false, false, port);
+        measure("pings + bulk, separate streams", pings, true, false, port);
+        StreamMuxOptions smallWindow;
+        smallWindow.initialWindow = 64 * 1024;
+        measure("pings + bulk, separate streams, 64 KiB window", pings, true, false, port, smallWindow);
+        measure("pings + bulk, one shared stream", pings, true, true, port);
+    }
+};
+
+#endif
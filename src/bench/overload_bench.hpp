@@ -0,0 +1,159 @@
+#ifndef OVERLOAD_BENCH_HPP
+#define OVERLOAD_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <string>
+#include <memory>
+#include <iostream>
+#include <algorithm>
+#include <asio.hpp>
+#include "../dhke/client.hpp"
+#include "../dhke/handshake_server.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Points a burst of connectors at a HandshakeServer with tight admission limits, together with a few peers that
+ *      connect and never send anything, and reports how the server held up:
+ *
+ * - how many handshakes completed, and their latency
+ *
+ * - how many connectors were turned away as busy, and how quickly they were told
+ *
+ * - whether the stalled peers were cut off by the opening deadline without ever taking a slot
+ *
+ * Every connector makes a single attempt, so the numbers show the shedding itself rather than the retries.
+ */
+class OverloadBench
+{
+private:
+    struct Attempt
+    {
+        bool ok = false;
+        bool busy = false;
+        double millis = 0.0;
+    };
+
+    static double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+            return 0.0;
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+    }
+
+public:
+    /**
+     * @param connectors Number of connectors started at once
+     * @param stalled Number of peers that connect and then send nothing
+     * @param limits The server's admission limits
+     * @param port The loopback port to listen on
+     * @param primeBits The prime bit length (the group is generated once up front)
+     */
+    static void run(int connectors, int stalled, const AdmissionLimits &limits, int port, size_t primeBits)
+    {
+        HandshakeConfig config;
+        config.name = "BenchListener";
+        config.authSecret = "bench";
+        config.expectedPeerId = "BenchConnector";
+        config.primeBitLength = primeBits;
+        config.group = KeyGenerator::getSubgroupParameters(primeBits, primeBits / 4);
+
+        HandshakeDeadlines deadlines;
+        deadlines.opening = std::chrono::milliseconds(1000);
+        deadlines.flight = std::chrono::milliseconds(2000);
+
+        asio::io_context io;
+        auto workGuard = asio::make_work_guard(io);
+        SessionTicketManager tickets;
+        HandshakeServer server(io, config, tickets, limits, deadlines);
+        server.setOutcomeHandler([](HandshakeOutcome outcome)
+                                 {
+            if (outcome.socket)
+            {
+                asio::error_code ignored;
+                outcome.socket->close(ignored);
+            } });
+        server.start(port);
+        std::thread ioThread([&io]
+                             { io.run(); });
+
+        // the stalled peers get in first. They never send an opening line, so they should never be admitted
+        asio::io_context clientIo;
+        std::vector<std::unique_ptr<asio::ip::tcp::socket>> idle;
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), static_cast<unsigned short>(port));
+        for (int i = 0; i < stalled; ++i)
+        {
+            idle.push_back(std::make_unique<asio::ip::tcp::socket>(clientIo));
+            idle.back()->connect(endpoint);
+        }
+
+        std::vector<Attempt> attempts(connectors);
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::steady_clock::now();
+        for (int i = 0; i < connectors; ++i)
+        {
+            threads.emplace_back([&, i]
+                                 {
+                DHKEClient client("BenchConnector");
+                client.setSessionHandler([](StreamRef, asio::streambuf &, const std::string &)
+                                         { return true; });
+                asio::io_context threadIo;
+                asio::ip::tcp::socket socket(threadIo);
+                auto start = std::chrono::steady_clock::now();
+                try
+                {
+                    socket.connect(endpoint);
+                    attempts[i].ok = client.performConnectorHandshake(socket, "bench", "BenchListener", primeBits);
+                }
+                catch (const std::exception &)
+                {
+                }
+                attempts[i].busy = client.getLastRetryAfter().count() > 0;
+                attempts[i].millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count(); });
+        }
+        for (auto &thread : threads)
+            thread.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        // give the deadlines time to catch the stalled peers
+        std::this_thread::sleep_for(deadlines.opening + std::chrono::milliseconds(200));
+
+        std::vector<double> completedMillis, busyMillis;
+        int failed = 0;
+        for (const auto &attempt : attempts)
+        {
+            if (attempt.ok)
+                completedMillis.push_back(attempt.millis);
+            else if (attempt.busy)
+                busyMillis.push_back(attempt.millis);
+            else
+                failed++;
+        }
+
+        const auto &metrics = server.getMetrics();
+        std::cout << connectors << " connectors at once and " << stalled << " stalled peers, " << limits.maxInProgress
+                  << " handshakes in progress and " << limits.maxQueued << " queued at most (" << primeBits << " bit group)\n";
+        std::cout << "  completed:              " << completedMillis.size() << " (p50 " << percentile(completedMillis, 0.5)
+                  << " ms, p99 " << percentile(completedMillis, 0.99) << " ms)\n";
+        std::cout << "  told busy:              " << busyMillis.size() << " (p50 " << percentile(busyMillis, 0.5)
+                  << " ms, p99 " << percentile(busyMillis, 0.99) << " ms)\n";
+        std::cout << "  failed otherwise:       " << failed << "\n";
+        std::cout << "  burst handled in:       " << seconds * 1000.0 << " ms\n";
+        std::cout << "  server: accepted " << metrics.accepted << ", completed " << metrics.completed << ", timed out "
+                  << metrics.timedOut << ", shed " << metrics.shed() << " (queue full " << metrics.shedQueueFull
+                  << ", queue wait expired " << metrics.shedQueueExpired << "), not admitted " << metrics.notAdmitted << ", queue wait avg "
+                  << metrics.averageQueueWaitMillis() << " ms" << std::endl;
+
+        idle.clear();
+        server.stop();
+        workGuard.reset();
+        io.stop();
+        ioThread.join();
+    }
+};
+
+#endif
@@ -0,0 +1,208 @@
+#ifndef PARALLEL_BENCH_HPP
+#define PARALLEL_BENCH_HPP
+
+#include <chrono>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+#include <thread>
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Connector handshake latency with and without parallel validation (see HandshakeConfig::parallelValidation).
+ *
+ * Full handshakes run one at a time between HandshakeMachines over in-memory pipes, the listener serving one group
+ *      generated up front. For each mode it reports the time the connector spends on the listener's flight (its only
+ *      CPU-heavy step) and the whole handshake, both as medians. The steps are also timed on their own, to give the
+ *      critical path parallel mode approaches when each of its threads gets a core, instead of the sum of the steps.
+ *
+ * It also checks that a connector handed a bad group fails without sending anything, in both modes.
+ */
+class ParallelBench
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Result
+    {
+        double connectorMicros;
+        double handshakeMicros;
+        bool ok;
+    };
+
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, size_t primeBits, const DHGroup &group, bool parallel)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = "bench";
+        config.expectedPeerId = peer;
+        config.primeBitLength = primeBits;
+        config.group = group;
+        config.parallelValidation = parallel;
+        return config;
+    }
+
+    static double micros(Clock::duration elapsed)
+    {
+        return std::chrono::duration<double, std::micro>(elapsed).count();
+    }
+
+    static double median(std::vector<double> values)
+    {
+        if (values.empty())
+            return 0.0;
+        std::sort(values.begin(), values.end());
+        return values[values.size() / 2];
+    }
+
+    // one full handshake, stepped to completion on this thread
+    static Result handshake(const DHGroup &group, size_t primeBits, bool parallel, SessionTicketManager &tickets)
+    {
+        DHKEParticipant listenerKeys("BenchListener"), connectorKeys("BenchConnector");
+        ResumptionState resumption;
+        auto start = Clock::now();
+        auto listener = HandshakeMachine::listener(makeConfig("BenchListener", "BenchConnector", primeBits, group, false), listenerKeys, tickets);
+        auto connector = HandshakeMachine::connector(makeConfig("BenchConnector", "BenchListener", primeBits, group, parallel), connectorKeys, resumption);
+        Clock::duration connectorWork{0};
+        auto finished = [](const HandshakeMachine &m)
+        { return m.status() == HandshakeStatus::Done || m.status() == HandshakeStatus::Failed; };
+        while (!(finished(listener) && finished(connector) && !listener.hasOutput() && !connector.hasOutput()))
+        {
+            if (connector.hasOutput())
+            {
+                std::string bytes = connector.takeOutput();
+                listener.receive(bytes.data(), bytes.size());
+            }
+            if (listener.status() == HandshakeStatus::NeedWork)
+                listener.runWork();
+            if (listener.hasOutput())
+            {
+                std::string bytes = listener.takeOutput();
+                connector.receive(bytes.data(), bytes.size());
+            }
+            if (connector.status() == HandshakeStatus::NeedWork)
+            {
+                auto begin = Clock::now();
+                connector.runWork();
+                connectorWork += Clock::now() - begin;
+            }
+            if (finished(connector) && connector.status() == HandshakeStatus::Failed)
+                break;
+        }
+        bool ok = listener.status() == HandshakeStatus::Done && connector.status() == HandshakeStatus::Done &&
+                  listener.getSessionKey() == connector.getSessionKey();
+        return {micros(connectorWork), micros(Clock::now() - start), ok};
+    }
+
+    // a connector given a composite prime must fail, and must not have sent its key share
+    static bool rejectsBadGroup(DHGroup group, size_t primeBits, bool parallel, SessionTicketManager &tickets)
+    {
+        do
+            group.prime += 2;
+        while (boost::multiprecision::miller_rabin_test(group.prime, 25));
+        DHKEParticipant listenerKeys("BenchListener"), connectorKeys("BenchConnector");
+        ResumptionState resumption;
+        auto listener = HandshakeMachine::listener(makeConfig("BenchListener", "BenchConnector", primeBits, group, false), listenerKeys, tickets);
+        auto connector = HandshakeMachine::connector(makeConfig("BenchConnector", "BenchListener", primeBits, group, parallel), connectorKeys, resumption);
+        std::string hello = connector.takeOutput();
+        listener.receive(hello.data(), hello.size());
+        listener.runWork();
+        std::string flight = listener.takeOutput();
+        connector.receive(flight.data(), flight.size());
+        connector.runWork();
+        return connector.status() == HandshakeStatus::Failed && !connector.hasOutput();
+    }
+
+    template <typename Step>
+    static double timeStep(int iterations, Step step)
+    {
+        auto begin = Clock::now();
+        for (int i = 0; i < iterations; ++i)
+            step();
+        return micros(Clock::now() - begin) / iterations;
+    }
+
+public:
+    /**
+     * @param handshakes Full handshakes per mode
+     * @param primeBits The prime bit length
+     * @param subgroupBits The subgroup order bit length
+     * @returns False if any handshake failed, or a bad group got a reply
+     */
+    static bool run(int handshakes, size_t primeBits, size_t subgroupBits)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(primeBits, subgroupBits);
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(2 * handshakes + 4));
+
+        // the steps on their own
+        DHKEParticipant peer("BenchPeer"), ours("BenchConnector");
+        peer.setGroup(group);
+        peer.generatePrivateKey(primeBits);
+        auto peerPublic = peer.step1();
+        ours.setGroup(group);
+        int iterations = std::max(1, handshakes / 4);
+        auto primality = [&](unsigned rounds)
+        {
+            return timeStep(iterations, [&]
+                            { boost::multiprecision::miller_rabin_test(group.prime, rounds); });
+        };
+        double primeMicros = primality(10);
+        double subgroupMicros = timeStep(iterations, [&]
+                                         { HandshakeMachine::checkSubgroup(group, peerPublic); });
+        double step1Micros = timeStep(iterations, [&]
+                                      { ours.generatePrivateKey(primeBits); ours.step1(); });
+        double step2Micros = timeStep(iterations, [&]
+                                      { ours.step2(peerPublic); });
+
+        std::cout << handshakes << " full handshakes per mode, " << primeBits << "/" << subgroupBits << " bit group, "
+                  << std::thread::hardware_concurrency() << " hardware threads\n";
+        std::cout << "  steps alone: prime primality " << primeMicros << " us, subgroup checks " << subgroupMicros << " us, keygen + step 1 "
+                  << step1Micros << " us, step 2 " << step2Micros << " us (sequential sum " << primeMicros + subgroupMicros + step1Micros + step2Micros << " us)\n";
+        // parallel mode splits the prime's 10 rounds over all but two cores, each share pays for its own Fermat pre-test
+        std::cout << "  parallel critical path, if every thread gets a core:";
+        for (unsigned cores : {2u, 4u, 8u})
+        {
+            unsigned chunks = std::min(10u, cores > 3 ? cores - 2 : 1u);
+            double path = std::max({primality((10 + chunks - 1) / chunks), subgroupMicros, step1Micros, step2Micros});
+            std::cout << " " << cores << " cores " << path << " us;";
+        }
+        std::cout << "\n";
+
+        bool ok = true;
+        double sequentialConnector = 0.0;
+        for (bool parallel : {false, true})
+        {
+            std::vector<double> connectorMicros, handshakeMicros;
+            int failed = 0;
+            for (int i = 0; i < handshakes; ++i)
+            {
+                Result result = handshake(group, primeBits, parallel, tickets);
+                if (!result.ok)
+                {
+                    failed++;
+                    continue;
+                }
+                connectorMicros.push_back(result.connectorMicros);
+                handshakeMicros.push_back(result.handshakeMicros);
+            }
+            bool rejected = rejectsBadGroup(group, primeBits, parallel, tickets);
+            ok = ok && failed == 0 && rejected;
+            double connector = median(connectorMicros);
+            std::cout << "  " << (parallel ? "parallel:  " : "sequential:") << " connector step p50 " << connector << " us, handshake p50 "
+                      << median(handshakeMicros) << " us";
+            if (parallel && sequentialConnector > 0.0)
+                std::cout << " (connector step " << 100.0 * (1.0 - connector / sequentialConnector) << "% faster)";
+            std::cout << (failed ? ", " + std::to_string(failed) + " FAILED" : "")
+                      << (rejected ? ", bad group rejected before sending" : ", BAD GROUP GOT A REPLY") << std::endl;
+            if (!parallel)
+                sequentialConnector = connector;
+        }
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,52 @@
+#ifndef PUZZLE_BENCH_HPP
+#define PUZZLE_BENCH_HPP
+
+#include <chrono>
+#include <string>
+#include <iostream>
+#include "../dhke/cookie.hpp"
+
+/**
+ * Measures the cost asymmetry of the cookie gate at each puzzle difficulty: what it costs the listener to issue and
+ *      check a cookie, against what it costs a connector to solve the puzzle. The listener's cost should stay flat
+ *      while the connector's doubles with every bit.
+ */
+class PuzzleBench
+{
+public:
+    /**
+     * @param maxBits The highest difficulty to measure, starting from 0
+     * @param iterations Cookies solved and checked per difficulty
+     */
+    static void run(unsigned maxBits, int iterations)
+    {
+        std::cout << "difficulty   listener us/cookie   connector us/solve" << std::endl;
+        for (unsigned bits = 0; bits <= maxBits; bits += 2)
+        {
+            // pin the difficulty by running the gate at full load with a single-value range
+            CookieGate gate(PuzzleDifficulty{bits, bits});
+            gate.setLoad(1.0);
+            std::chrono::nanoseconds listener{0}, connector{0};
+            int ok = 0;
+            for (int i = 0; i < iterations; ++i)
+            {
+                auto begin = std::chrono::steady_clock::now();
+                std::string cookie = gate.issue("127.0.0.1");
+                listener += std::chrono::steady_clock::now() - begin;
+
+                begin = std::chrono::steady_clock::now();
+                std::string solution = CookieGate::solve(cookie, "BenchConnector");
+                connector += std::chrono::steady_clock::now() - begin;
+
+                begin = std::chrono::steady_clock::now();
+                ok += gate.verify(cookie, "127.0.0.1", solution, "BenchConnector") ? 1 : 0;
+                listener += std::chrono::steady_clock::now() - begin;
+            }
+            std::cout << "  " << bits << " bits     " << std::chrono::duration<double, std::micro>(listener).count() / iterations
+                      << "            " << std::chrono::duration<double, std::micro>(connector).count() / iterations
+                      << (ok == iterations ? "" : "   (verification failures!)") << std::endl;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,138 @@
+#ifndef RECORD_BENCH_HPP
+#define RECORD_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <iostream>
+#include <string>
+#include <functional>
+#include <asio.hpp>
+#include "../dhke/crypto.hpp"
+#include "../dhke/line_io.hpp"
+#include "../dhke/record_layer.hpp"
+#include "../dhke/transport_stats.hpp"
+
+/**
+ * Sends a stream of small application messages over TCP loopback and reports messages/sec, bytes on the wire per
+ *      message and socket writes per message, for:
+ *
+ * - the original one "ENC:<hex>" line per message format
+ *
+ * - the record layer with every record written immediately
+ *
+ * - the record layer with back-to-back records coalesced into batched writes
+ *
+ * - the batched record layer again, ratcheting its keys every 64 KiB, to show what in-band rekeying costs
+ */
+class RecordBench
+{
+private:
+    using Sender = std::function<void(asio::ip::tcp::socket &, asio::streambuf &)>;
+    using Receiver = std::function<int(asio::ip::tcp::socket &, asio::streambuf &)>;
+
+    /**
+     * Runs one sender/receiver pair over a fresh loopback connection and prints the results
+     */
+    static void measure(const std::string &label, int messages, int port, const Sender &sender, const Receiver &receiver)
+    {
+        asio::io_context io;
+        asio::ip::tcp::acceptor acceptor(io, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port));
+        asio::ip::tcp::socket receiving(io);
+        int received = 0;
+        std::thread receiverThread([&]
+                                   {
+            acceptor.accept(receiving);
+            asio::streambuf buffer;
+            received = receiver(receiving, buffer); });
+
+        asio::ip::tcp::socket sending(io);
+        sending.connect(acceptor.local_endpoint());
+        sending.set_option(asio::ip::tcp::no_delay(true));
+        asio::streambuf buffer;
+
+        TransportStats::reset();
+        auto start = std::chrono::steady_clock::now();
+        sender(sending, buffer);
+        receiverThread.join();
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        std::cout << label << ": " << received << "/" << messages << " messages\n";
+        std::cout << "  messages/sec:         " << messages / seconds << "\n";
+        std::cout << "  wire bytes/message:   " << static_cast<double>(TransportStats::bytesWritten) / messages << "\n";
+        std::cout << "  socket writes/message: " << static_cast<double>(TransportStats::writes) / messages << std::endl;
+    }
+
+public:
+    /**
+     * @param messages Number of messages to send in each run
+     * @param payloadBytes Size of each message
+     * @param port The loopback port to use
+     */
+    static void run(int messages, size_t payloadBytes, int port)
+    {
+        const std::string sessionKey = CryptoUtils::randomHex(16);
+        const std::string message(payloadBytes, 'm');
+
+        measure("ENC lines", messages, port, [&](asio::ip::tcp::socket &socket, asio::streambuf &)
+                {
+                    for (int i = 0; i < messages; ++i)
+                        LineIO::sendLine(socket, "ENC:" + CryptoUtils::hexEncode(CryptoUtils::xorWithKey(message, sessionKey)));
+                    LineIO::sendLine(socket, "END"); },
+                [&](asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+                {
+                    int count = 0;
+                    while (true)
+                    {
+                        std::string line = LineIO::readLine(socket, buffer);
+                        if (line.rfind("ENC:", 0) != 0)
+                            return count;
+                        std::string plain = CryptoUtils::xorWithKey(CryptoUtils::hexDecode(line.substr(4)), sessionKey);
+                        count += plain.size() == payloadBytes ? 1 : 0;
+                    }
+                });
+
+        for (int latencyMicros : {0, 200})
+        {
+            RecordLayerOptions options;
+            options.flushLatency = std::chrono::microseconds(latencyMicros);
+            std::string label = latencyMicros == 0 ? "records, unbatched" : "records, batched (" + std::to_string(latencyMicros) + " us flush latency)";
+            measure(label, messages, port, [&](asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+                    {
+                        RecordLayer records(socket, buffer, sessionKey, false, options);
+                        for (int i = 0; i < messages; ++i)
+                            records.send(message);
+                        records.close(); },
+                    [&](asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+                    {
+                        RecordLayer records(socket, buffer, sessionKey, true, options);
+                        int count = 0;
+                        while (auto record = records.receive())
+                            count += record->payload.size() == payloadBytes ? 1 : 0;
+                        return count;
+                    });
+        }
+
+        RecordLayerOptions rekeying;
+        rekeying.flushLatency = std::chrono::microseconds(200);
+        rekeying.rekeyAfterBytes = 64 * 1024;
+        std::uint64_t rekeys = 0;
+        measure("records, batched, rekey every 64 KiB", messages, port, [&](asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+                {
+                    RecordLayer records(socket, buffer, sessionKey, false, rekeying);
+                    for (int i = 0; i < messages; ++i)
+                        records.send(message);
+                    records.close();
+                    rekeys = records.getStats().rekeysSent; },
+                [&](asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+                {
+                    RecordLayer records(socket, buffer, sessionKey, true, rekeying);
+                    int count = 0;
+                    while (auto record = records.receive())
+                        count += record->payload.size() == payloadBytes ? 1 : 0;
+                    return count;
+                });
+        std::cout << "  rekeys:               " << rekeys << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,405 @@
+#ifndef REPLAY_BENCH_HPP
+#define REPLAY_BENCH_HPP
+
+#include <chrono>
+#include <string>
+#include <algorithm>
+#include <vector>
+#include <iostream>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <spdlog/spdlog.h>
+#include "../dhke/group.hpp"
+#include "../dhke/handshake.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+#include "../dhke/transcript.hpp"
+
+/**
+ * Replays a captured transcript (see TranscriptWriter) through the receive side of the handshake, in-process and with
+ *      no network: every key share flight the peer sent is fed to a HandshakeMachine with receive(), which parses it and
+ *      checks its MAC, and the machine's runWork() then validates it, as fast as the CPU allows.
+ *
+ * This gives a deterministic benchmark of the machine's parsing, MAC and validation paths over real traffic, and the
+ *      verification results double as a regression check: a transcript of good handshakes should always replay with no
+ *      MAC mismatches or validation failures.
+ *
+ * The transcript holds neither side's private keys, cookie secret or ticket keys, so a replay can't continue a captured
+ *      handshake. Each key share flight gets a fresh machine instead, brought to the state that receives it through its
+ *      public API: a connector is simply started, a listener is handed a HELLO and runs its parameter flight with the
+ *      group from the flight we sent in the capture. What the machine sends itself is thrown away. The checks that need
+ *      the missing secrets (confirmation tags, cookies, tickets) are therefore not replayed, and flights without a key
+ *      share are counted as skipped. Records are only counted, the transcript holds their shapes and not their contents.
+ *
+ * A flight the machine rejects as malformed, or a transcript entry that doesn't decode, is counted as malformed and the
+ *      replay carries on with the next one.
+ */
+class ReplayBench
+{
+private:
+    struct Connection
+    {
+        bool isListener = false;
+        std::string name;
+        std::string peer;
+        std::optional<DHGroup> preagreed;
+        // the group from our own last parameter flight, the listener has to have sent it to check the connector's reply
+        std::optional<DHGroup> sentGroup;
+        std::string sentPartial;
+        std::string receivedPartial;
+        // received lines not handed to a machine yet, since the end of the last key share flight
+        std::vector<std::string> lines;
+        // the machine receiving the current key share flight, until it has all of it
+        std::optional<HandshakeMachine> machine;
+    };
+
+    // what the machines need that isn't in the transcript, shared by every replayed flight
+    struct Context
+    {
+        std::string authSecret;
+        DHKEParticipant keys{"Replay"};
+        SessionTicketManager tickets;
+        ResumptionState resumption;
+    };
+
+    struct Totals
+    {
+        std::uint64_t connections = 0;
+        std::uint64_t completed = 0;
+        std::uint64_t lines = 0;
+        std::uint64_t flights = 0;
+        std::uint64_t verified = 0;
+        std::uint64_t macMismatches = 0;
+        std::uint64_t invalid = 0;
+        std::uint64_t malformed = 0;
+        // turned down by the machine for anything else, such as an unexpected identity or an unknown QUICK group
+        std::uint64_t rejected = 0;
+        std::uint64_t skipped = 0;
+        std::uint64_t recordsSent = 0;
+        std::uint64_t recordsReceived = 0;
+        std::uint64_t recordBytes = 0;
+        std::chrono::nanoseconds receive{0};
+        std::chrono::nanoseconds work{0};
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    // calls onLine for every complete line in the buffer, keeping any partial line for the next chunk
+    template <typename OnLine>
+    static void splitLines(std::string &partial, std::string_view bytes, OnLine onLine)
+    {
+        partial.append(bytes);
+        size_t start = 0, newline;
+        while ((newline = partial.find('\n', start)) != std::string::npos)
+        {
+            onLine(std::string_view(partial).substr(start, newline - start));
+            start = newline + 1;
+        }
+        partial.erase(0, start);
+    }
+
+    static bool startsWith(std::string_view text, std::string_view prefix)
+    {
+        return text.substr(0, prefix.size()) == prefix;
+    }
+
+    static std::optional<DHGroup> groupFrom(const std::unordered_map<std::string, std::string> &fields)
+    {
+        auto p = fields.find("P"), q = fields.find("Q"), g = fields.find("G");
+        if (p == fields.end() || g == fields.end())
+            return std::nullopt;
+        DHGroup group;
+        group.prime = boost::multiprecision::cpp_int(p->second);
+        group.generator = boost::multiprecision::cpp_int(g->second);
+        group.order = q == fields.end() || q->second.empty() ? 0 : boost::multiprecision::cpp_int(q->second);
+        return group;
+    }
+
+    static void begin(Connection &connection, const std::string &data, Totals &totals)
+    {
+        std::unordered_map<std::string, std::string> fields;
+        std::string partial;
+        splitLines(partial, data, [&](std::string_view line)
+                   {
+            size_t colon = line.find(':');
+            if (colon != std::string_view::npos)
+                fields[std::string(line.substr(0, colon))] = std::string(line.substr(colon + 1)); });
+        connection.isListener = fields["ROLE"] == "LISTENER";
+        connection.name = fields["NAME"];
+        connection.peer = fields["PEER"];
+        try
+        {
+            connection.preagreed = groupFrom(fields);
+        }
+        catch (const std::exception &)
+        {
+            totals.malformed++;
+        }
+    }
+
+    static HandshakeConfig makeConfig(const Connection &connection, const Context &context, const std::optional<DHGroup> &group, const std::optional<DHGroup> &preagreed)
+    {
+        HandshakeConfig config;
+        config.name = connection.name;
+        config.authSecret = context.authSecret;
+        config.expectedPeerId = connection.peer;
+        config.group = group;
+        config.preagreedGroup = preagreed;
+        if (group && group->prime > 0)
+            config.primeBitLength = boost::multiprecision::msb(group->prime) + 1;
+        return config;
+    }
+
+    /**
+     * Creates the machine that receives the given key share flight, in the state it would be in
+     * @returns The machine, or std::nullopt if the capture doesn't hold what it takes to get there
+     */
+    static std::optional<HandshakeMachine> receiverFor(const Connection &connection, const std::vector<std::string> &flight, Context &context)
+    {
+        std::optional<HandshakeMachine> machine;
+        if (connection.isListener)
+        {
+            // a QUICK opening is the first flight, otherwise this is the connector's reply to our parameter flight
+            bool quick = startsWith(flight.front(), "QUICK:");
+            const auto &group = quick ? connection.preagreed : connection.sentGroup;
+            if (!group)
+                return std::nullopt;
+            machine.emplace(HandshakeMachine::listener(makeConfig(connection, context, group, connection.preagreed), context.keys, context.tickets));
+            if (!quick)
+            {
+                std::string hello = "HELLO:" + connection.peer + "\n";
+                machine->receive(hello.data(), hello.size());
+                machine->runWork();
+            }
+        }
+        else
+        {
+            // the listener's parameter flight answers HELLO, anything else with a key share is a QUICK reply
+            bool parameters = std::any_of(flight.begin(), flight.end(), [](const std::string &line)
+                                          { return startsWith(line, "P:"); });
+            if (!parameters && !connection.preagreed)
+                return std::nullopt;
+            context.resumption = ResumptionState{};
+            machine.emplace(HandshakeMachine::connector(makeConfig(connection, context, std::nullopt, parameters ? std::nullopt : connection.preagreed),
+                                                        context.keys, context.resumption));
+            // with a pre-agreed group, this computes the QUICK flight
+            machine->runWork();
+        }
+        machine->takeOutput();
+        if (machine->status() != HandshakeStatus::NeedInput)
+            return std::nullopt;
+        return machine;
+    }
+
+    // once the machine has the whole flight: sorts out how it fared, running its work (the validation) if it got that far
+    static void conclude(Connection &connection, Totals &totals)
+    {
+        HandshakeMachine &machine = *connection.machine;
+        // a listener that can't take a QUICK flight falls back to the full handshake rather than failing
+        bool fellBack = machine.hasOutput() && startsWith(machine.takeOutput(), "QUICK_REJECTED");
+        if (machine.status() == HandshakeStatus::NeedWork && !fellBack)
+        {
+            auto begin = Clock::now();
+            machine.runWork();
+            totals.work += Clock::now() - begin;
+            // the confirmation tag can't match without the captured private keys, getting past validation is what counts
+            const std::string &error = machine.getError();
+            if (machine.status() == HandshakeStatus::Failed && (startsWith(error, "Parameter validation failed") || startsWith(error, "Peer public key validation failed")))
+                totals.invalid++;
+            else
+                totals.verified++;
+        }
+        else if (machine.status() == HandshakeStatus::Failed && startsWith(machine.getError(), "MAC mismatch"))
+        {
+            totals.macMismatches++;
+        }
+        else if (machine.status() == HandshakeStatus::Failed && startsWith(machine.getError(), "Malformed handshake message"))
+        {
+            totals.malformed++;
+        }
+        else
+        {
+            totals.rejected++;
+        }
+        connection.machine.reset();
+    }
+
+    // hands one line to the machine receiving the current flight, timing it as receive work
+    static void feed(Connection &connection, std::string_view line, Totals &totals)
+    {
+        std::string bytes(line);
+        bytes += '\n';
+        auto begin = Clock::now();
+        connection.machine->receive(bytes.data(), bytes.size());
+        totals.receive += Clock::now() - begin;
+        if (connection.machine->status() != HandshakeStatus::NeedInput)
+            conclude(connection, totals);
+    }
+
+    /**
+     * Takes one received line. Every flight carrying a key share has a MAC line after it, so once one arrives the flight
+     *      is found by its opening line (QUICK, or the last ID) and replayed into a machine, which then gets the lines that
+     *      follow until it has the whole flight
+     */
+    static void received(Connection &connection, std::string_view line, Context &context, Totals &totals)
+    {
+        totals.lines++;
+        if (connection.machine)
+            return feed(connection, line, totals);
+        connection.lines.emplace_back(line);
+        if (!startsWith(line, "MAC:"))
+            return;
+
+        totals.flights++;
+        auto &lines = connection.lines;
+        size_t start = lines.size();
+        for (size_t i = lines.size(); i-- > 0 && start == lines.size();)
+        {
+            if (startsWith(lines[i], "QUICK:"))
+                start = i;
+        }
+        for (size_t i = lines.size(); i-- > 0 && start == lines.size();)
+        {
+            if (startsWith(lines[i], "ID:"))
+                start = i;
+        }
+        bool keyShare = false;
+        for (size_t i = start; i < lines.size(); ++i)
+            keyShare = keyShare || startsWith(lines[i], "PUB:");
+
+        std::vector<std::string> flight(lines.begin() + static_cast<std::ptrdiff_t>(std::min(start, lines.size())), lines.end());
+        lines.clear();
+        if (!keyShare || !(connection.machine = receiverFor(connection, flight, context)))
+        {
+            totals.skipped++;
+            return;
+        }
+        for (const auto &flightLine : flight)
+        {
+            if (!connection.machine)
+                break;
+            feed(connection, flightLine, totals);
+        }
+    }
+
+    // our own parameter flight, for the group the peer's reply is checked against
+    static void sent(Connection &connection, std::string_view bytes, Totals &totals)
+    {
+        splitLines(connection.sentPartial, bytes, [&](std::string_view line)
+                   {
+            if (startsWith(line, "P:"))
+                connection.sentGroup = DHGroup{};
+            if (!connection.sentGroup || line.size() < 2 || line[1] != ':')
+                return;
+            boost::multiprecision::cpp_int value;
+            try
+            {
+                value = boost::multiprecision::cpp_int(std::string(line.substr(2)));
+            }
+            catch (const std::exception &)
+            {
+                // there is no group to check the peer's reply against
+                connection.sentGroup.reset();
+                totals.malformed++;
+                return;
+            }
+            if (line[0] == 'P')
+                connection.sentGroup->prime = value;
+            else if (line[0] == 'Q')
+                connection.sentGroup->order = value;
+            else if (line[0] == 'G')
+                connection.sentGroup->generator = value; });
+    }
+
+    static void replay(TranscriptReader &reader, Context &context, Totals &totals)
+    {
+        std::unordered_map<std::uint64_t, Connection> connections;
+        while (auto entry = reader.next())
+        {
+            Connection &connection = connections[entry->connection];
+            switch (entry->event)
+            {
+            case TranscriptEvent::Begin:
+                totals.connections++;
+                begin(connection, entry->data, totals);
+                break;
+            case TranscriptEvent::Sent:
+                sent(connection, entry->data, totals);
+                break;
+            case TranscriptEvent::Received:
+                splitLines(connection.receivedPartial, entry->data, [&](std::string_view line)
+                           { received(connection, line, context, totals); });
+                break;
+            case TranscriptEvent::RecordSent:
+            case TranscriptEvent::RecordReceived:
+            {
+                try
+                {
+                    TranscriptRecord record = TranscriptFormat::decodeRecord(entry->data);
+                    (entry->event == TranscriptEvent::RecordSent ? totals.recordsSent : totals.recordsReceived)++;
+                    totals.recordBytes += record.length;
+                }
+                catch (const std::exception &)
+                {
+                    totals.malformed++;
+                }
+                break;
+            }
+            case TranscriptEvent::End:
+                totals.completed += entry->data == "1" ? 1 : 0;
+                break;
+            }
+        }
+    }
+
+public:
+    /**
+     * @param path The transcript to replay
+     * @param authSecret The shared secret the captured peers used, needed to check the MACs
+     * @param passes How many times to replay the whole transcript
+     * @returns True if every key share parsed and checked out, so a corpus of good handshakes can be used as a regression check
+     */
+    static bool run(const std::string &path, const std::string &authSecret, int passes)
+    {
+        TranscriptReader reader(path);
+        Context context;
+        context.authSecret = authSecret;
+        Totals totals;
+        std::chrono::nanoseconds receive{0}, work{0};
+        // every replayed full handshake fails at its confirmation tag, and each machine would log it
+        auto level = spdlog::get_level();
+        spdlog::set_level(spdlog::level::off);
+        auto begin = Clock::now();
+        for (int pass = 0; pass < passes; ++pass)
+        {
+            // every pass sees the same traffic, so the counts come from the last one and the times from all of them
+            reader.rewind();
+            totals = Totals{};
+            replay(reader, context, totals);
+            receive += totals.receive;
+            work += totals.work;
+        }
+        spdlog::set_level(level);
+        double passMillis = std::chrono::duration<double, std::milli>(Clock::now() - begin).count() / passes;
+
+        auto perFlight = [&](std::chrono::nanoseconds total)
+        {
+            double flights = static_cast<double>(totals.flights) * passes;
+            return flights == 0 ? 0.0 : std::chrono::duration<double, std::micro>(total).count() / flights;
+        };
+        std::cout << path << ": " << reader.getFileSize() << " bytes, " << totals.connections << " connections (" << totals.completed
+                  << " handshakes completed), " << totals.lines << " lines received, " << totals.flights << " MAC'd flights"
+                  << (reader.isTruncated() ? ", last entry truncated" : "") << "\n";
+        std::cout << "  records: " << totals.recordsSent << " sent, " << totals.recordsReceived << " received, " << totals.recordBytes << " payload bytes\n";
+        std::cout << "  replay: " << passMillis << " ms per pass (" << passes << " passes), per flight: receive (parsing, MAC) "
+                  << perFlight(receive) << " us, work (validation, exponentiation) " << perFlight(work) << " us\n";
+        std::cout << "  results: " << totals.verified << " verified, " << totals.macMismatches << " MAC mismatches, " << totals.invalid
+                  << " failed validation, " << totals.malformed << " malformed, " << totals.rejected << " rejected, " << totals.skipped
+                  << " skipped (no key share, or nothing to check it against)" << std::endl;
+        return totals.macMismatches == 0 && totals.invalid == 0 && totals.malformed == 0 && totals.rejected == 0;
+    }
+};
+
+#endif
@@ -0,0 +1,178 @@
+#ifndef SANSIO_BENCH_HPP
+#define SANSIO_BENCH_HPP
+
+#include <chrono>
+#include <memory>
+#include <vector>
+#include <string>
+#include <optional>
+#include <iostream>
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Runs handshakes between pairs of HandshakeMachines connected by in-memory pipes, with no sockets involved, so the
+ *      numbers are the protocol's own CPU cost. A single thread interleaves many handshakes at once, stepping each pair
+ *      in turn, the way an event loop would.
+ *
+ * The group is generated once up front and handed to every listener, so parameter generation is not measured.
+ * Time is split between the CPU work steps (validation and modular exponentiation) and everything else (parsing,
+ *      MACs, tickets and flight building).
+ */
+class SansIoBench
+{
+private:
+    struct Pair
+    {
+        DHKEParticipant listenerKeys{"BenchListener"};
+        DHKEParticipant connectorKeys{"BenchConnector"};
+        ResumptionState resumption;
+        std::optional<HandshakeMachine> listener;
+        std::optional<HandshakeMachine> connector;
+    };
+
+    struct Timings
+    {
+        std::chrono::nanoseconds work{0};
+        std::chrono::nanoseconds protocol{0};
+    };
+
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, size_t primeBits, const DHGroup &group)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = "bench";
+        config.expectedPeerId = peer;
+        config.primeBitLength = primeBits;
+        config.group = group;
+        return config;
+    }
+
+    static void start(Pair &pair, bool resume, SessionTicketManager &tickets, size_t primeBits, const DHGroup &group, Timings &timings)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        // without a ticket the connector runs the full key exchange
+        if (!resume)
+            pair.resumption = ResumptionState{};
+        pair.listener.reset();
+        pair.connector.reset();
+        pair.listener.emplace(HandshakeMachine::listener(makeConfig("BenchListener", "BenchConnector", primeBits, group), pair.listenerKeys, tickets));
+        pair.connector.emplace(HandshakeMachine::connector(makeConfig("BenchConnector", "BenchListener", primeBits, group), pair.connectorKeys, pair.resumption));
+        timings.protocol += std::chrono::steady_clock::now() - begin;
+    }
+
+    // moves output from one side to the other
+    static void transfer(HandshakeMachine &from, HandshakeMachine &to, Timings &timings)
+    {
+        auto begin = std::chrono::steady_clock::now();
+        if (from.hasOutput())
+        {
+            std::string bytes = from.takeOutput();
+            to.receive(bytes.data(), bytes.size());
+        }
+        timings.protocol += std::chrono::steady_clock::now() - begin;
+    }
+
+    static void work(HandshakeMachine &machine, Timings &timings)
+    {
+        if (machine.status() != HandshakeStatus::NeedWork)
+            return;
+        auto begin = std::chrono::steady_clock::now();
+        machine.runWork();
+        timings.work += std::chrono::steady_clock::now() - begin;
+    }
+
+    /**
+     * Advances one pair by one step: at most one work item per side, and one delivery in each direction
+     * @returns True once both sides are finished (successfully or not)
+     */
+    static bool step(Pair &pair, Timings &timings)
+    {
+        transfer(*pair.connector, *pair.listener, timings);
+        work(*pair.listener, timings);
+        transfer(*pair.listener, *pair.connector, timings);
+        work(*pair.connector, timings);
+        transfer(*pair.connector, *pair.listener, timings);
+        auto finished = [](const HandshakeMachine &m)
+        { return m.status() == HandshakeStatus::Done || m.status() == HandshakeStatus::Failed; };
+        return finished(*pair.listener) && finished(*pair.connector) && !pair.listener->hasOutput() && !pair.connector->hasOutput();
+    }
+
+    static bool succeeded(const Pair &pair)
+    {
+        return pair.listener->status() == HandshakeStatus::Done && pair.connector->status() == HandshakeStatus::Done &&
+               pair.listener->getSessionKey() == pair.connector->getSessionKey();
+    }
+
+public:
+    /**
+     * @param handshakes Total number of handshakes to run
+     * @param concurrent How many handshakes are in flight at once, interleaved on this thread
+     * @param resume If true, every pair first runs one (unmeasured) full handshake, and the measured ones resume from tickets
+     * @param primeBits The prime bit length
+     * @param subgroupBits The subgroup order bit length
+     */
+    static void run(int handshakes, int concurrent, bool resume, size_t primeBits, size_t subgroupBits)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(primeBits, subgroupBits);
+        // big enough that no redeemed ticket is evicted, eviction would reject every ticket issued in the same second
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(handshakes + concurrent));
+        std::vector<std::unique_ptr<Pair>> pairs;
+        for (int i = 0; i < concurrent; ++i)
+            pairs.push_back(std::make_unique<Pair>());
+
+        Timings timings;
+        if (resume)
+        {
+            for (auto &pair : pairs)
+            {
+                start(*pair, resume, tickets, primeBits, group, timings);
+                while (!step(*pair, timings))
+                    ;
+            }
+            timings = Timings{};
+        }
+
+        int started = 0, completed = 0, ok = 0;
+        auto begin = std::chrono::steady_clock::now();
+        for (auto &pair : pairs)
+        {
+            if (started < handshakes)
+            {
+                start(*pair, resume, tickets, primeBits, group, timings);
+                started++;
+            }
+        }
+        while (completed < started)
+        {
+            // round robin over every in-flight handshake, like an event loop servicing ready connections
+            for (auto &pair : pairs)
+            {
+                if (!pair->listener || !step(*pair, timings))
+                    continue;
+                completed++;
+                ok += succeeded(*pair) ? 1 : 0;
+                pair->listener.reset();
+                pair->connector.reset();
+                if (started < handshakes)
+                {
+                    start(*pair, resume, tickets, primeBits, group, timings);
+                    started++;
+                }
+            }
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        double workMicros = std::chrono::duration<double, std::micro>(timings.work).count() / completed;
+        double protocolMicros = std::chrono::duration<double, std::micro>(timings.protocol).count() / completed;
+        std::cout << (resume ? "resumed" : "full") << " handshakes in memory (" << primeBits << "/" << subgroupBits << " bit group, "
+                  << concurrent << " interleaved on one thread): " << ok << "/" << completed << " ok\n";
+        std::cout << "  handshakes/sec:              " << completed / seconds << "\n";
+        std::cout << "  CPU work us/handshake:       " << workMicros << "\n";
+        std::cout << "  protocol us/handshake:       " << protocolMicros << std::endl;
+    }
+};
+
+#endif
@@ -0,0 +1,303 @@
+#ifndef SESSION_BENCH_HPP
+#define SESSION_BENCH_HPP
+
+#include <chrono>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#include "../dhke/crypto.hpp"
+#include "../dhke/group.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/record_layer.hpp"
+#include "../dhke/session_table.hpp"
+
+/**
+ * Memory and cache behaviour of many established sessions, kept two ways:
+ *
+ * - one object per session, holding what a client object holds today: the participant with all of its big integers,
+ *      a copy of the group, the peer id, host and session key as strings, and the record keys
+ *
+ * - a SessionTable, which keeps only the record keys, sequence numbers, a peer index and a timestamp per session
+ *
+ * For each it reports the heap bytes per session, the time (and, where the CPU's counters can be read, the cache misses)
+ *      per record sealed for a randomly chosen session, and per session for an idle sweep over all of them. The same
+ *      random sealing over a small, cache-resident set shows how much of the cost is the misses.
+ */
+class SessionBench
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t residentSessions = 1024;
+    static constexpr size_t payloadBytes = 64;
+
+    struct ObjectSession
+    {
+        explicit ObjectSession(const std::string &name) : keys(name) {}
+
+        DHKEParticipant keys;
+        DHGroup group;
+        std::string peerId;
+        std::string host;
+        std::string sessionKey;
+        std::string sendSecret;
+        std::string receiveSecret;
+        RecordLayer::DirectionKeys sendKeys;
+        RecordLayer::DirectionKeys receiveKeys;
+        std::uint64_t sendSequence = 0;
+        std::uint64_t receiveSequence = 0;
+        Clock::time_point lastActive;
+    };
+
+    // last level cache misses of this thread, user space only, if the kernel lets us count them
+    class CacheMissCounter
+    {
+    private:
+        int fd_ = -1;
+
+    public:
+        CacheMissCounter()
+        {
+#if defined(__linux__)
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            this->fd_ = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#endif
+        }
+
+        ~CacheMissCounter()
+        {
+            if (this->fd_ >= 0)
+                ::close(this->fd_);
+        }
+
+        bool available() const
+        {
+            return this->fd_ >= 0;
+        }
+
+        void start()
+        {
+#if defined(__linux__)
+            if (this->fd_ >= 0)
+            {
+                ioctl(this->fd_, PERF_EVENT_IOC_RESET, 0);
+                ioctl(this->fd_, PERF_EVENT_IOC_ENABLE, 0);
+            }
+#endif
+        }
+
+        std::uint64_t stop()
+        {
+            std::uint64_t count = 0;
+#if defined(__linux__)
+            if (this->fd_ >= 0)
+            {
+                ioctl(this->fd_, PERF_EVENT_IOC_DISABLE, 0);
+                if (read(this->fd_, &count, sizeof(count)) != sizeof(count))
+                    count = 0;
+            }
+#endif
+            return count;
+        }
+    };
+
+    struct Measurement
+    {
+        double nanos;
+        double misses;
+    };
+
+    // heap bytes in use, zero if the C library can't tell us
+    static size_t heapInUse()
+    {
+#if defined(__GLIBC__)
+        struct mallinfo2 info = mallinfo2();
+        // large blocks (such as the table's columns) are mapped separately, and only counted in hblkhd
+        return info.uordblks + info.hblkhd;
+#else
+        return 0;
+#endif
+    }
+
+    // runs body() count times, returning the time and cache misses per call
+    template <typename Body>
+    static Measurement measure(CacheMissCounter &counter, size_t count, Body body)
+    {
+        counter.start();
+        auto start = Clock::now();
+        for (size_t i = 0; i < count; ++i)
+            body(i);
+        double nanos = std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        std::uint64_t misses = counter.stop();
+        return {nanos / static_cast<double>(count), static_cast<double>(misses) / static_cast<double>(count)};
+    }
+
+    static std::string misses(const CacheMissCounter &counter, double value)
+    {
+        if (!counter.available())
+            return "n/a";
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(2) << value;
+        return out.str();
+    }
+
+    // the order sessions are sealed for, fixed up front so both layouts see the same accesses
+    static std::vector<std::uint32_t> randomOrder(size_t sessions, size_t ops)
+    {
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<std::uint32_t> pick(0, static_cast<std::uint32_t>(sessions - 1));
+        std::vector<std::uint32_t> order(ops);
+        for (auto &index : order)
+            index = pick(rng);
+        return order;
+    }
+
+    // checks that a record sealed by one table opens in another, across a rekey, so the numbers are for working code
+    static bool roundTrip(const std::shared_ptr<const DHGroup> &group)
+    {
+        SessionTable listener, connector;
+        std::string key = CryptoUtils::randomHex(16);
+        std::string copy = key;
+        SessionHandle ours = listener.insert("Connector", key, true, group);
+        SessionHandle theirs = connector.insert("Listener", copy, false, group);
+        std::vector<char> wire(RecordLayer::headerBytes + payloadBytes + RecordLayer::tagBytes);
+        for (RecordType type : {RecordType::Application, RecordType::Rekey, RecordType::Application})
+        {
+            std::string payload = type == RecordType::Rekey ? "" : CryptoUtils::randomHex(payloadBytes / 2);
+            listener.seal(ours, type, 0, payload, wire.data());
+            auto record = connector.open(theirs, wire.data());
+            if (!record || record->type != type || record->payload != payload)
+                return false;
+        }
+        return true;
+    }
+
+public:
+    /**
+     * @param sessions The number of established sessions to hold
+     * @param ops Records to seal, each for a randomly chosen session
+     * @returns False if records sealed by the table don't open
+     */
+    static bool run(size_t sessions, size_t ops)
+    {
+        auto group = std::make_shared<const DHGroup>(KeyGenerator::getSubgroupParameters(512, 160));
+        if (!roundTrip(group))
+        {
+            std::cout << "session table records failed to round trip" << std::endl;
+            return false;
+        }
+        CacheMissCounter counter;
+        auto now = Clock::now();
+
+        // one object per session, as left behind by a real handshake
+        std::vector<std::unique_ptr<ObjectSession>> objects;
+        objects.reserve(sessions);
+        size_t heapBefore = heapInUse();
+        for (size_t i = 0; i < sessions; ++i)
+        {
+            auto session = std::make_unique<ObjectSession>("Listener");
+            session->group = *group;
+            session->keys.setGroup(session->group);
+            session->keys.generatePrivateKey(512);
+            session->keys.step2(session->keys.step1());
+            session->peerId = "Connector-" + std::to_string(i);
+            session->host = "10." + std::to_string(i >> 16 & 255) + "." + std::to_string(i >> 8 & 255) + "." + std::to_string(i & 255);
+            session->sessionKey = CryptoUtils::randomHex(16);
+            session->sendSecret = RecordLayer::initialSecret(session->sessionKey, true);
+            session->receiveSecret = RecordLayer::initialSecret(session->sessionKey, false);
+            session->sendKeys = RecordLayer::deriveKeys(session->sendSecret);
+            session->receiveKeys = RecordLayer::deriveKeys(session->receiveSecret);
+            session->lastActive = now;
+            objects.push_back(std::move(session));
+        }
+        size_t objectBytes = heapInUse() - heapBefore;
+        std::vector<std::string> sessionKeys;
+        sessionKeys.reserve(sessions);
+        for (const auto &session : objects)
+            sessionKeys.push_back(session->sessionKey);
+
+        // the same sessions in a table, the handshake state goes away as each one is inserted
+        heapBefore = heapInUse();
+        SessionTable table(sessions);
+        std::vector<SessionHandle> handles;
+        handles.reserve(sessions);
+        for (size_t i = 0; i < sessions; ++i)
+            handles.push_back(table.insert(objects[i]->peerId, sessionKeys[i], true, group, now));
+        size_t tableBytes = heapInUse() - heapBefore - handles.capacity() * sizeof(SessionHandle);
+
+        std::cout << sessions << " sessions, 512-bit group, " << ops << " records of " << payloadBytes << " bytes sealed for random sessions\n";
+        if (heapBefore > 0)
+        {
+            std::cout << "heap per session: objects " << objectBytes / sessions << " B, table " << tableBytes / sessions
+                      << " B (table's own count " << table.memoryBytes() / sessions << " B)\n";
+        }
+        else
+        {
+            std::cout << "heap per session: n/a, table's own count " << table.memoryBytes() / sessions << " B\n";
+        }
+        if (!counter.available())
+            std::cout << "cache misses: n/a (no hardware counters here), compare against the cache-resident runs instead\n";
+
+        std::vector<char> out(RecordLayer::headerBytes + payloadBytes + RecordLayer::tagBytes);
+        const std::string payload(payloadBytes, 'p');
+        for (size_t population : {std::min(residentSessions, sessions), sessions})
+        {
+            auto order = randomOrder(population, ops);
+            std::vector<ObjectSession *> objectOrder(ops);
+            std::vector<SessionHandle> handleOrder(ops);
+            for (size_t i = 0; i < ops; ++i)
+            {
+                objectOrder[i] = objects[order[i]].get();
+                handleOrder[i] = handles[order[i]];
+            }
+            Measurement object = measure(counter, ops, [&](size_t i)
+                                         {
+                ObjectSession &session = *objectOrder[i];
+                RecordLayer::sealRecord(session.sendKeys, session.sendSequence++, RecordType::Application, 0, payload, out.data()); });
+            Measurement tabled = measure(counter, ops, [&](size_t i)
+                                         { table.seal(handleOrder[i], payload, out.data()); });
+            std::cout << "random seal over " << std::setw(7) << population << " sessions: objects " << std::fixed << std::setprecision(1)
+                      << object.nanos << " ns, " << misses(counter, object.misses) << " misses | table " << tabled.nanos << " ns, "
+                      << misses(counter, tabled.misses) << " misses\n";
+        }
+
+        // idle sweeps with nothing to expire, so both read every session and change none
+        auto cutoff = now - std::chrono::hours(1);
+        size_t idle = 0;
+        Measurement objectSweep = measure(counter, sessions, [&](size_t i)
+                                          { idle += objects[i]->lastActive < cutoff; });
+        Measurement tableSweep = measure(counter, 1, [&](size_t)
+                                         { idle += table.expireIdle(std::chrono::hours(1), now); });
+        tableSweep.nanos /= static_cast<double>(sessions);
+        tableSweep.misses /= static_cast<double>(sessions);
+        std::cout << "idle sweep per session: objects " << objectSweep.nanos << " ns, " << misses(counter, objectSweep.misses)
+                  << " misses | table " << tableSweep.nanos << " ns, " << misses(counter, tableSweep.misses) << " misses"
+                  << (idle ? " (" + std::to_string(idle) + " EXPIRED)" : "") << std::endl;
+        return idle == 0;
+    }
+};
+
+#endif
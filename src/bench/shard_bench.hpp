@@ -0,0 +1,154 @@
+#ifndef SHARD_BENCH_HPP
+#define SHARD_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <asio.hpp>
+#include "../dhke/client.hpp"
+#include "../dhke/handshake_server.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/sharded_server.hpp"
+#include "../dhke/ticket.hpp"
+
+/**
+ * Handshake throughput of a ShardedHandshakeServer as the number of shards grows: 1, 2, 4, ... up to the given
+ *      maximum. For each count, connector threads (four per shard) handshake with it back to back over loopback TCP
+ *      for a fixed time, and it reports handshakes per second, the speedup over one shard and how evenly the kernel
+ *      spread the connections over the shards.
+ *
+ * The listener serves one group generated up front and sets no puzzle, so a full handshake costs it key generation
+ *      and two exponentiations. In resume mode each connector thread keeps its ticket, so after its first handshake
+ *      the listener only does the ticket check and the I/O. The connectors run in this process too, so scaling only
+ *      shows while there are cores to spare for them: on a machine with fewer cores than shards plus connectors the
+ *      curve flattens for lack of CPU, not because the shards contend.
+ */
+class ShardBench
+{
+private:
+    struct Run
+    {
+        size_t shards;
+        double perSecond;
+        int failed;
+        std::uint64_t fewest;
+        std::uint64_t most;
+    };
+
+    static Run measure(size_t shards, double seconds, bool resume, int port, size_t primeBits, const HandshakeConfig &config)
+    {
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), 1 << 20);
+        ShardOptions options;
+        options.shards = shards;
+        options.pinThreads = true;
+        ShardedHandshakeServer server(config, tickets, options, AdmissionLimits(), HandshakeDeadlines(), PuzzleDifficulty{0, 0});
+        server.setOutcomeHandler([](HandshakeOutcome outcome)
+                                 {
+            if (outcome.socket)
+            {
+                asio::error_code ignored;
+                outcome.socket->close(ignored);
+            } });
+        server.start(port);
+
+        asio::ip::tcp::endpoint endpoint(asio::ip::make_address("127.0.0.1"), static_cast<unsigned short>(port));
+        std::atomic<bool> stopping{false};
+        std::atomic<int> completed{0}, failed{0};
+        std::vector<std::thread> connectors;
+        auto begin = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < 4 * shards; ++i)
+        {
+            connectors.emplace_back([&]
+                                    {
+                auto makeClient = []
+                {
+                    auto client = std::make_unique<DHKEClient>("BenchConnector");
+                    client->setSessionHandler([](StreamRef, asio::streambuf &, const std::string &)
+                                              { return true; });
+                    return client;
+                };
+                auto client = makeClient();
+                asio::io_context io;
+                while (!stopping)
+                {
+                    // a fresh client holds no ticket, so it has to run the full handshake
+                    if (!resume)
+                        client = makeClient();
+                    asio::ip::tcp::socket socket(io);
+                    bool ok = false;
+                    try
+                    {
+                        socket.connect(endpoint);
+                        ok = client->performConnectorHandshake(socket, "bench", "BenchListener", primeBits);
+                    }
+                    catch (const std::exception &)
+                    {
+                    }
+                    (ok ? completed : failed)++;
+                } });
+        }
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        stopping = true;
+        for (auto &connector : connectors)
+            connector.join();
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        Run run{shards, completed / elapsed, failed.load(), UINT64_MAX, 0};
+        for (size_t i = 0; i < server.shardCount(); ++i)
+        {
+            std::uint64_t count = server.getShardMetrics(i).completed;
+            run.fewest = std::min(run.fewest, count);
+            run.most = std::max(run.most, count);
+        }
+        server.stop();
+        return run;
+    }
+
+public:
+    /**
+     * @param maxShards The largest shard count to measure
+     * @param seconds How long to run each shard count for
+     * @param resume Measure resumed handshakes instead of full ones
+     * @param port The first loopback port to listen on, each shard count gets the next one
+     * @param primeBits The prime bit length (the group is generated once up front)
+     * @returns False if any handshake failed
+     */
+    static bool run(size_t maxShards, double seconds, bool resume, int port, size_t primeBits)
+    {
+        HandshakeConfig config;
+        config.name = "BenchListener";
+        config.authSecret = "bench";
+        config.expectedPeerId = "BenchConnector";
+        config.primeBitLength = primeBits;
+        config.group = KeyGenerator::getSubgroupParameters(primeBits, primeBits / 4);
+
+        std::vector<size_t> counts;
+        for (size_t shards = 1; shards < maxShards; shards *= 2)
+            counts.push_back(shards);
+        counts.push_back(std::max<size_t>(1, maxShards));
+
+        std::cout << (resume ? "Resumed" : "Full") << " handshakes for " << seconds << " s per shard count, four connector threads per shard, "
+                  << primeBits << " bit group, " << std::thread::hardware_concurrency() << " hardware threads\n";
+        bool ok = true;
+        double single = 0.0;
+        for (size_t i = 0; i < counts.size(); ++i)
+        {
+            Run run = measure(counts[i], seconds, resume, port + static_cast<int>(i), primeBits, config);
+            if (run.shards == 1)
+                single = run.perSecond;
+            double speedup = single > 0.0 ? run.perSecond / single : 0.0;
+            std::cout << "  " << run.shards << (run.shards == 1 ? " shard:  " : " shards: ") << run.perSecond << " handshakes/s, speedup "
+                      << speedup << "x (" << 100.0 * speedup / static_cast<double>(run.shards) << "% per shard), completed per shard "
+                      << run.fewest << " to " << run.most << (run.failed ? ", " + std::to_string(run.failed) + " FAILED" : "") << std::endl;
+            ok = ok && run.failed == 0;
+        }
+        return ok;
+    }
+};
+
+#endif
@@ -0,0 +1,298 @@
+#ifndef TRANSPORT_BENCH_HPP
+#define TRANSPORT_BENCH_HPP
+
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <string>
+#include <iostream>
+#include <algorithm>
+#include <filesystem>
+#include <asio.hpp>
+#include "../dhke/client.hpp"
+#include "../dhke/crypto.hpp"
+#include "../dhke/handshake.hpp"
+#include "../dhke/key_gen.hpp"
+#include "../dhke/participant.hpp"
+#include "../dhke/record_layer.hpp"
+#if defined(__linux__)
+#include "../dhke/shm_stream.hpp"
+#endif
+#include "../dhke/ticket.hpp"
+
+/**
+ * Compares the transports for co-located peers: TCP loopback, a Unix domain socket and the shared memory ring. The
+ *      same handshake and record layer code runs over each, only the stream underneath changes. For each transport:
+ *
+ * - connection setup plus a resumed handshake, on a fresh connection every time (the full handshake is dominated by
+ *      the modular exponentiation, which is the same over any transport)
+ *
+ * - round trip time of small records (64 bytes, written immediately), one connection
+ *
+ * - bulk throughput of 16 KiB records in one direction, batched with a 200 us flush latency
+ */
+class TransportBench
+{
+private:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr size_t pingBytes = 64;
+    static constexpr size_t bulkRecordBytes = 16 * 1024;
+
+    class TcpTransport
+    {
+    private:
+        asio::io_context io_;
+        asio::ip::tcp::acceptor acceptor_;
+
+    public:
+        using Stream = asio::ip::tcp::socket;
+
+        explicit TcpTransport(int port) : acceptor_(io_, asio::ip::tcp::endpoint(asio::ip::make_address("127.0.0.1"), port)) {}
+
+        Stream accept()
+        {
+            Stream socket(this->io_);
+            this->acceptor_.accept(socket);
+            socket.set_option(asio::ip::tcp::no_delay(true));
+            return socket;
+        }
+
+        Stream connect()
+        {
+            Stream socket(this->io_);
+            socket.connect(this->acceptor_.local_endpoint());
+            socket.set_option(asio::ip::tcp::no_delay(true));
+            return socket;
+        }
+    };
+
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+    class UnixTransport
+    {
+    private:
+        std::string path_;
+        asio::io_context io_;
+        asio::local::stream_protocol::acceptor acceptor_;
+
+        static const std::string &unlinked(const std::string &path)
+        {
+            std::error_code ignored;
+            std::filesystem::remove(path, ignored);
+            return path;
+        }
+
+    public:
+        using Stream = asio::local::stream_protocol::socket;
+
+        explicit UnixTransport(std::string path)
+            : path_(std::move(path)), acceptor_(io_, asio::local::stream_protocol::endpoint(unlinked(path_))) {}
+
+        ~UnixTransport()
+        {
+            std::error_code ignored;
+            std::filesystem::remove(this->path_, ignored);
+        }
+
+        Stream accept()
+        {
+            Stream socket(this->io_);
+            this->acceptor_.accept(socket);
+            return socket;
+        }
+
+        Stream connect()
+        {
+            Stream socket(this->io_);
+            socket.connect(asio::local::stream_protocol::endpoint(this->path_));
+            return socket;
+        }
+    };
+
+#endif
+
+#if defined(__linux__)
+    class ShmTransport
+    {
+    private:
+        std::string name_;
+        ShmAcceptor acceptor_;
+
+    public:
+        using Stream = ShmStream;
+
+        explicit ShmTransport(std::string name) : name_(std::move(name)), acceptor_(name_) {}
+
+        Stream accept()
+        {
+            return this->acceptor_.accept();
+        }
+
+        Stream connect()
+        {
+            return ShmAcceptor::connect(this->name_);
+        }
+    };
+#endif
+
+    static double percentile(std::vector<double> values, double p)
+    {
+        if (values.empty())
+            return 0.0;
+        std::sort(values.begin(), values.end());
+        return values[std::min(values.size() - 1, static_cast<size_t>(p * values.size()))];
+    }
+
+    static HandshakeConfig makeConfig(const std::string &name, const std::string &peer, const DHGroup &group)
+    {
+        HandshakeConfig config;
+        config.name = name;
+        config.authSecret = "bench";
+        config.expectedPeerId = peer;
+        config.group = group;
+        return config;
+    }
+
+    // runs body on a thread with the listener's end of the next connection, reporting (not throwing) its errors
+    template <typename Transport, typename Body>
+    static std::thread serve(Transport &transport, int connections, Body body)
+    {
+        return std::thread([&transport, connections, body]
+                           {
+            try
+            {
+                for (int i = 0; i < connections; ++i)
+                {
+                    auto stream = transport.accept();
+                    body(stream);
+                }
+            }
+            catch (const std::exception &ex)
+            {
+                std::cerr << "listener: " << ex.what() << std::endl;
+            } });
+    }
+
+    template <typename Transport>
+    static void measure(const std::string &label, Transport &transport, int handshakes, int pings, size_t bulkBytes, const DHGroup &group)
+    {
+        SessionTicketManager tickets(std::chrono::hours(1), std::chrono::hours(1), static_cast<size_t>(handshakes) * 4);
+        DHKEParticipant listenerKeys("BenchListener"), connectorKeys("BenchConnector");
+        ResumptionState resumption;
+        HandshakeConfig listenerConfig = makeConfig("BenchListener", "BenchConnector", group);
+        HandshakeConfig connectorConfig = makeConfig("BenchConnector", "BenchListener", group);
+
+        // one full handshake for a ticket, then resumed handshakes on fresh connections
+        std::vector<double> handshakeMicros;
+        int failed = 0;
+        std::thread listener = serve(transport, handshakes + 1, [&](typename Transport::Stream &stream)
+                                     {
+            asio::streambuf buffer;
+            auto machine = HandshakeMachine::listener(listenerConfig, listenerKeys, tickets);
+            DHKEClient::driveHandshake(machine, stream, buffer); });
+        for (int i = 0; i <= handshakes; ++i)
+        {
+            auto start = Clock::now();
+            auto stream = transport.connect();
+            asio::streambuf buffer;
+            auto machine = HandshakeMachine::connector(connectorConfig, connectorKeys, resumption);
+            bool ok = DHKEClient::driveHandshake(machine, stream, buffer).has_value();
+            if (i == 0)
+                continue;
+            if (!ok || !machine.wasResumed())
+                failed++;
+            else
+                handshakeMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+        }
+        listener.join();
+
+        const std::string sessionKey = CryptoUtils::randomHex(16);
+        // records go out one write each by default, the bulk run batches them
+        RecordLayerOptions batched;
+        batched.flushLatency = std::chrono::microseconds(200);
+        std::vector<double> rttMicros;
+        listener = serve(transport, 1, [&](typename Transport::Stream &stream)
+                         {
+            asio::streambuf buffer;
+            RecordLayer records(stream, buffer, sessionKey, true);
+            while (auto record = records.receive())
+                records.send(record->payload); });
+        {
+            auto stream = transport.connect();
+            asio::streambuf buffer;
+            RecordLayer records(stream, buffer, sessionKey, false);
+            const std::string ping(pingBytes, 'p');
+            for (int i = 0; i < pings; ++i)
+            {
+                auto start = Clock::now();
+                records.send(ping);
+                if (!records.receive())
+                    break;
+                rttMicros.push_back(std::chrono::duration<double, std::micro>(Clock::now() - start).count());
+            }
+            records.close();
+            listener.join();
+        }
+
+        size_t received = 0;
+        listener = serve(transport, 1, [&](typename Transport::Stream &stream)
+                         {
+            asio::streambuf buffer;
+            RecordLayer records(stream, buffer, sessionKey, true);
+            while (auto record = records.receive())
+                received += record->payload.size(); });
+        double bulkSeconds;
+        {
+            auto start = Clock::now();
+            auto stream = transport.connect();
+            asio::streambuf buffer;
+            RecordLayer records(stream, buffer, sessionKey, false, batched);
+            const std::string chunk(bulkRecordBytes, 'b');
+            for (size_t sent = 0; sent < bulkBytes; sent += chunk.size())
+                records.send(chunk);
+            records.close();
+            listener.join();
+            bulkSeconds = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+
+        std::cout << label << ": connect + resumed handshake p50 " << percentile(handshakeMicros, 0.5) << " us, p99 "
+                  << percentile(handshakeMicros, 0.99) << " us" << (failed ? " (" + std::to_string(failed) + " FAILED)" : "")
+                  << " | record rtt p50 " << percentile(rttMicros, 0.5) << " us, p99 " << percentile(rttMicros, 0.99)
+                  << " us | bulk " << received / bulkSeconds / (1024.0 * 1024.0) << " MiB/s" << std::endl;
+    }
+
+public:
+    /**
+     * @param handshakes Resumed handshakes per transport
+     * @param pings Record round trips per transport
+     * @param bulkMiB Megabytes of bulk data per transport
+     * @param port The TCP loopback port to use
+     */
+    static void run(int handshakes, int pings, size_t bulkMiB, int port)
+    {
+        DHGroup group = KeyGenerator::getSubgroupParameters(512, 160);
+        size_t bulkBytes = bulkMiB * 1024 * 1024;
+        std::cout << handshakes << " handshakes, " << pings << " record round trips and " << bulkMiB << " MiB of bulk data per transport, "
+                  << std::thread::hardware_concurrency() << " hardware threads\n";
+        {
+            TcpTransport tcp(port);
+            measure("tcp loopback", tcp, handshakes, pings, bulkBytes, group);
+        }
+        // unique per run, so runs side by side don't collide
+        std::string suffix = std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        {
+            UnixTransport local((std::filesystem::temp_directory_path() / ("dhke_bench_" + suffix + ".sock")).string());
+            measure("unix socket ", local, handshakes, pings, bulkBytes, group);
+        }
+#endif
+#if defined(__linux__)
+        {
+            ShmTransport shm("/dhke_bench_" + suffix);
+            measure("shm ring    ", shm, handshakes, pings, bulkBytes, group);
+        }
+#endif
+    }
+};
+
+#endif
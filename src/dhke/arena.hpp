@@ -0,0 +1,258 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <array>
+#include <string>
+#include <cstddef>
+#include <cstring>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <stdexcept>
+#include <string_view>
+#include <memory_resource>
+#include <boost/multiprecision/cpp_int.hpp>
+
+/**
+ * The HandshakeArena provides allocation-free versions of the handshake's hot path operations: formatting and parsing
+ *      the big numbers, building the MAC payload, computing MACs and building/parsing flights.
+ *
+ * - Big numbers use a fixed width cpp_int (twice the largest supported prime, so products fit), which keeps the limbs
+ *      inline instead of on the heap. powm on these does no allocation at all.
+ *
+ * - Every string the handshake produces is carved out of a per-session monotonic buffer that lives inside the arena.
+ *      reset() hands the whole buffer back at once at the end of a handshake, so steady state handshakes never touch the
+ *      heap. If a handshake ever needs more than ScratchBytes, the overflow falls back to the heap (and shows up in the
+ *      allocation counts) rather than failing.
+ *
+ * The output is byte-for-byte the same as the std::string based helpers in HandshakeMachine and CryptoUtils, so both paths
+ *      interoperate on the wire. HandshakeMachine builds its payloads, MACs and flights in one of these as scratch space.
+ *      The fixed width integers are still a prototype: the machine keeps cpp_int for its arithmetic, and only dhke_bench
+ *      alloc runs powm through FixedInt.
+ *
+ * @tparam MaxPrimeBits The largest prime bit length the arena supports
+ * @tparam ScratchBytes The size of the inline scratch buffer used for strings
+ */
+template <unsigned MaxPrimeBits = 512, size_t ScratchBytes = 8192>
+class HandshakeArena
+{
+public:
+    // fixed width integer, twice the prime size so the products inside powm don't overflow
+    using FixedInt = boost::multiprecision::number<
+        boost::multiprecision::cpp_int_backend<2 * MaxPrimeBits, 2 * MaxPrimeBits, boost::multiprecision::unsigned_magnitude, boost::multiprecision::unchecked, void>>;
+
+    // group parameters in fixed width form, converted once when the group is set up
+    struct FixedGroup
+    {
+        FixedInt prime;
+        FixedInt order;
+        FixedInt generator;
+    };
+
+private:
+    // most decimal digits a FixedInt can have (log10(2) < 0.302)
+    static constexpr size_t maxDecimalDigits = (2 * MaxPrimeBits * 302) / 1000 + 2;
+
+    alignas(std::max_align_t) std::array<std::byte, ScratchBytes> storage_;
+    std::pmr::monotonic_buffer_resource resource_;
+
+    // reserves n bytes of scratch space for the current handshake
+    char *allocate(size_t n)
+    {
+        return static_cast<char *>(this->resource_.allocate(n == 0 ? 1 : n, 1));
+    }
+
+public:
+    HandshakeArena() : resource_(storage_.data(), storage_.size(), std::pmr::new_delete_resource())
+    {
+    }
+
+    HandshakeArena(const HandshakeArena &) = delete;
+    HandshakeArena &operator=(const HandshakeArena &) = delete;
+
+    // the arena's memory resource, for callers that want their own pmr containers in the same scratch space
+    std::pmr::memory_resource *resource()
+    {
+        return &this->resource_;
+    }
+
+    // releases everything handed out for the previous handshake, the inline buffer is reused from the start
+    void reset()
+    {
+        this->resource_.release();
+    }
+
+    /**
+     * Converts arbitrary precision group parameters into fixed width form (allocates, do this once per group)
+     * @throws std::invalid_argument If the prime is wider than MaxPrimeBits, or the order or generator not below it,
+     *      rather than silently keeping only their low bits
+     */
+    static FixedGroup toFixed(const boost::multiprecision::cpp_int &prime, const boost::multiprecision::cpp_int &order, const boost::multiprecision::cpp_int &generator)
+    {
+        if (prime <= 0 || boost::multiprecision::msb(prime) + 1 > MaxPrimeBits)
+            throw std::invalid_argument("Prime of " + std::to_string(prime > 0 ? boost::multiprecision::msb(prime) + 1 : 0) +
+                                        " bits does not fit a " + std::to_string(MaxPrimeBits) + " bit arena");
+        if (order < 0 || order >= prime || generator < 0 || generator >= prime)
+            throw std::invalid_argument("Group order and generator must be below the prime");
+        return FixedGroup{FixedInt(prime), FixedInt(order), FixedInt(generator)};
+    }
+
+    /**
+     * Draws a random value uniformly from [1, upper), like KeyGenerator::getRandomBelow but without allocating
+     * @param upper The exclusive upper bound, must be > 1
+     * @param rng The random engine, seeded once per session (or thread) rather than per key
+     */
+    static FixedInt randomBelow(const FixedInt &upper, std::mt19937_64 &rng)
+    {
+        std::size_t bitLength = boost::multiprecision::msb(upper) + 1;
+        std::size_t chunks = (bitLength + 63) / 64;
+        FixedInt mask = (FixedInt(1) << bitLength) - 1;
+        while (true)
+        {
+            FixedInt value = 0;
+            for (std::size_t i = 0; i < chunks; i++)
+            {
+                value <<= 64;
+                value |= rng();
+            }
+            value &= mask;
+            if (value >= 1 && value < upper)
+                return value;
+        }
+    }
+
+    /**
+     * Concatenates the given pieces into one string in scratch space
+     * @returns A view of the result, valid until reset()
+     */
+    std::string_view concat(std::initializer_list<std::string_view> parts)
+    {
+        size_t total = 0;
+        for (auto part : parts)
+            total += part.size();
+        char *out = this->allocate(total);
+        size_t offset = 0;
+        for (auto part : parts)
+        {
+            std::memcpy(out + offset, part.data(), part.size());
+            offset += part.size();
+        }
+        return std::string_view(out, total);
+    }
+
+    /**
+     * Formats a number in decimal, like cpp_int::str() does
+     * @returns A view of the digits, valid until reset()
+     */
+    std::string_view decimal(const FixedInt &value)
+    {
+        // peel off 19 digits at a time (the most that fit in a uint64), filling the digit buffer from the back
+        constexpr std::uint64_t chunk = 10000000000000000000ull;
+        char digits[maxDecimalDigits];
+        size_t pos = maxDecimalDigits;
+        FixedInt remaining = value;
+        do
+        {
+            std::uint64_t low = static_cast<std::uint64_t>(remaining % chunk);
+            remaining /= chunk;
+            for (int i = 0; i < 19 && (low != 0 || remaining != 0); ++i)
+            {
+                digits[--pos] = static_cast<char>('0' + low % 10);
+                low /= 10;
+            }
+        } while (remaining != 0);
+        if (pos == maxDecimalDigits)
+            digits[--pos] = '0';
+
+        char *out = this->allocate(maxDecimalDigits - pos);
+        std::memcpy(out, digits + pos, maxDecimalDigits - pos);
+        return std::string_view(out, maxDecimalDigits - pos);
+    }
+
+    /**
+     * Formats an arbitrary precision number in decimal, like cpp_int::str() does. Anything that fits a FixedInt is
+     *      formatted without allocating, anything else (only ever a malformed value from the peer) through str()
+     * @returns A view of the digits, valid until reset()
+     */
+    std::string_view decimal(const boost::multiprecision::cpp_int &value)
+    {
+        if (value >= 0 && (value == 0 || boost::multiprecision::msb(value) < 2 * MaxPrimeBits))
+            return this->decimal(FixedInt(value));
+        std::string text = value.str();
+        return this->concat({text});
+    }
+
+    /**
+     * Parses a decimal number without allocating
+     * @param text The digits
+     * @param out Set to the parsed value
+     * @returns False if the text is empty, not all digits, or longer than a MaxPrimeBits number can be
+     */
+    static bool parseDecimal(std::string_view text, FixedInt &out)
+    {
+        // anything on the wire is at most as long as the prime, which also guarantees the FixedInt can't overflow
+        if (text.empty() || text.size() > (MaxPrimeBits * 302) / 1000 + 1)
+            return false;
+        out = 0;
+        for (char c : text)
+        {
+            if (c < '0' || c > '9')
+                return false;
+            out *= 10;
+            out += static_cast<unsigned>(c - '0');
+        }
+        return true;
+    }
+
+    /**
+     * Same as CryptoUtils::computeMac: hash of secret|payload, as unpadded lowercase hex
+     * @returns A view of the MAC, valid until reset()
+     */
+    std::string_view mac(std::string_view secret, std::string_view payload)
+    {
+        // std::hash of a string_view is defined to equal std::hash of a std::string with the same characters
+        std::size_t hash = std::hash<std::string_view>{}(this->concat({secret, "|", payload}));
+        static const char *hex = "0123456789abcdef";
+        char digits[sizeof(std::size_t) * 2];
+        size_t pos = sizeof(digits);
+        do
+        {
+            digits[--pos] = hex[hash & 0x0F];
+            hash >>= 4;
+        } while (hash != 0);
+        char *out = this->allocate(sizeof(digits) - pos);
+        std::memcpy(out, digits + pos, sizeof(digits) - pos);
+        return std::string_view(out, sizeof(digits) - pos);
+    }
+
+    /**
+     * Same format as HandshakeMachine::buildPayload: prime|order|generator|publicKey|role|sender|receiver
+     * @returns A view of the payload, valid until reset()
+     */
+    std::string_view payload(const FixedGroup &group, const FixedInt &publicKey, std::string_view role, std::string_view senderId, std::string_view receiverId)
+    {
+        return this->concat({this->decimal(group.prime), "|", this->decimal(group.order), "|", this->decimal(group.generator), "|",
+                             this->decimal(publicKey), "|", role, "|", senderId, "|", receiverId});
+    }
+
+    /**
+     * Finds the value of the first line in a flight that starts with the given prefix (e.g. "PUB:")
+     * @returns The value after the prefix, or an empty view if there is no such line
+     */
+    static std::string_view lineValue(std::string_view flight, std::string_view prefix)
+    {
+        while (!flight.empty())
+        {
+            size_t end = flight.find('\n');
+            std::string_view line = flight.substr(0, end);
+            if (line.substr(0, prefix.size()) == prefix)
+                return line.substr(prefix.size());
+            if (end == std::string_view::npos)
+                break;
+            flight.remove_prefix(end + 1);
+        }
+        return {};
+    }
+};
+
+#endif
@@ -2,13 +2,31 @@
 #define CLIENT_HPP
 
 #include <string>
-#include <sstream>
+#include <deque>
+#include <mutex>
+#include <thread>
 #include <functional>
+#include <condition_variable>
+#include <chrono>
+#include <optional>
+#include <stdexcept>
+#include <filesystem>
 #include <asio.hpp>
-#include <boost/multiprecision/miller_rabin.hpp>
 #include <spdlog/spdlog.h>
+#include "crypto.hpp"
+#include "ticket.hpp"
+#include "handshake.hpp"
+#include "handshake_server.hpp"
+#include "sharded_server.hpp"
+#include "param_store.hpp"
+#include "line_io.hpp"
+#include "record_layer.hpp"
+#include "transcript.hpp"
+#include "transport.hpp"
+#if defined(__linux__)
+#include "shm_stream.hpp"
+#endif
 #include "participant.hpp"
-#include "key_gen.hpp"
 #include "../InputHandler.hpp"
 
 /**
@@ -23,205 +41,232 @@ private:
     int remotePeerPort_;
     // user's port to listen on
     int userListeningPort_;
-
-    /**
-     * Helper method to format the payload sent over the P2P communication
-     * @param prime The public prime number
-     * @param generator The public generator
-     * @param publicKey The participant's public key
-     * @param role The participant's role in the exchange (LISTENER or CONNECTOR)
-     * @param senderId The sender's identity
-     * @param receiverId The receiver's identity
-     * @returns The formatted payload string
-     */
-    static std::string buildPayload(
-        const boost::multiprecision::cpp_int &prime,
-        int generator,
-        const boost::multiprecision::cpp_int &publicKey,
-        const std::string &role,
-        const std::string &senderId,
-        const std::string &receiverId)
+    // listener: a Unix socket or shared memory name to listen on instead of the TCP port, if set
+    TransportAddress listenTransport_;
+    // listener side: issues and redeems session resumption tickets
+    SessionTicketManager ticketManager_;
+    // connector side: the most recent ticket received, used to resume the session on reconnect
+    ResumptionState resumption_;
+    // outcome of the most recent handshake, for latency reporting
+    bool lastHandshakeResumed_ = false;
+    double lastHandshakeMillis_ = 0.0;
+    // session key derived by the most recent successful handshake
+    std::string sessionKey_;
+    // runs the established session in place of the demo message exchange, if set
+    std::function<bool(StreamRef, asio::streambuf &, const std::string &)> sessionHandler_;
+    // listener: admission control and deadlines for the handshake server
+    AdmissionLimits admissionLimits_;
+    HandshakeDeadlines handshakeDeadlines_;
+    PuzzleDifficulty puzzleDifficulty_;
+    // listener: if set, handshakes run on a ShardedHandshakeServer (one shard per core) instead of one I/O thread
+    std::optional<ShardOptions> listenerShards_;
+    // listener: pre-generated groups to serve instead of generating one per handshake, if set
+    std::shared_ptr<ParameterStore> parameterStore_;
+    // both sides: the group agreed on out of band, enabling the one round trip handshake
+    std::optional<DHGroup> preagreedGroup_;
+    // connector: validate the listener's parameters concurrently with our own exponentiations
+    bool parallelValidation_ = false;
+    // connector: set when the listener turned us away as busy
+    std::chrono::milliseconds lastRetryAfter_{0};
+    // both sides: if set, handshake traffic and record shapes are captured here
+    std::shared_ptr<TranscriptWriter> transcript_;
+
+    // handshake settings for this client
+    HandshakeConfig makeConfig(const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength, size_t subgroupBitLength) const
     {
-        std::ostringstream oss;
-        oss << prime << "|" << generator << "|" << publicKey << "|" << role << "|" << senderId << "|" << receiverId;
-        return oss.str();
+        HandshakeConfig config;
+        config.name = this->name;
+        config.authSecret = authSecret;
+        config.expectedPeerId = expectedPeerId;
+        config.primeBitLength = primeBitLength;
+        config.subgroupBitLength = subgroupBitLength;
+        config.parameterStore = this->parameterStore_.get();
+        config.preagreedGroup = this->preagreedGroup_;
+        config.parallelValidation = this->parallelValidation_;
+        return config;
     }
 
     /**
-     * Computes a Message Authentication Code (MAC)
-     *
-     * @note Currently builds a simplified MAC using std::hash for demonstration purposes
-     * @param secret The secret key used for MAC computation
-     * @param payload The payload to be authenticated
-     * @returns The computed MAC as a hexadecimal string
+     * Demonstration of encrypted message exchange: the listener sends two messages and the connector replies to each.
+     * This is to show that both parties have derived the same session key, and can encrypt/decrypt communications successfully.
+     * Messages are sent as records over the RecordLayer
+     * @param isListener True for the listener side (which sends first)
+     * @param transcriptConnection The connection's id in our transcript, if capturing
+     * @returns True if both exchanges completed
      */
-    static std::string computeMac(const std::string &secret, const std::string &payload)
-    {
-        std::hash<std::string> hasher;
-        std::ostringstream oss;
-        /**
-         * What's happening below:
-         *  1. 'oss' is essentially the buffer we want to write our data to. In C++, the stream insertion operator, "<<"
-         *           allows for passing data into a stream buffer object
-         *  2. 'std::hex' is an I/O manipulator, meaning it converts any supplied data into hexadecimal base
-         *  3. The hasher() function uses std::hash, which computes a hash of the supplied data, in our case the secret and the payload concatenated
-         *
-         * In summary: hashed secret + payload value -> converted into hexadecimal -> passed into the buffer, then returned as a regular string value
-         */
-        oss << std::hex << hasher(secret + "|" + payload);
-        return oss.str();
-    }
-
-    /**
-     * Helper method to derive and format the confirmation tag for the key exchange
-     * @param shared The shared secret
-     * @param role The participant's role in the exchange (LISTENER or CONNECTOR)
-     * @param self The participant's identity
-     * @param peer The peer's identity
-     * @returns The confirmation tag as a hexadecimal string
-     */
-    static std::string deriveConfirmTag(const boost::multiprecision::cpp_int &shared, const std::string &role, const std::string &self, const std::string &peer)
+    template <typename SyncStream>
+    bool exchangeDemoMessages(SyncStream &socket, asio::streambuf &buffer, const std::string &sessionKey, bool isListener,
+                              std::uint64_t transcriptConnection = 0)
     {
-        return computeMac(shared.str(), "CONFIRM|" + role + "|" + self + "|" + peer);
-    }
+        RecordLayer records(socket, buffer, sessionKey, isListener);
+        if (this->transcript_)
+            records.setTranscript(this->transcript_.get(), transcriptConnection);
+        if (isListener)
+        {
+            records.send("Hello from " + this->name + " (listener)");
+            auto reply1 = records.receive();
+            if (!reply1)
+            {
+                spdlog::error("[{}] Expected encrypted reply", this->name);
+                return false;
+            }
+            spdlog::info("[{}] Decrypted reply (record {}): {}", this->name, reply1->sequence, reply1->payload);
 
-    /**
-     * Helper method to derive session MAC key from the shared secret
-     * @param shared The shared secret
-     * @returns The session key as a hexadecimal string
-     */
-    static std::string deriveSessionKey(const boost::multiprecision::cpp_int &shared)
-    {
-        return computeMac(shared.str(), "SESSION_KEY");
+            records.send("Second message from " + this->name);
+            auto reply2 = records.receive();
+            if (!reply2)
+            {
+                spdlog::error("[{}] Expected second encrypted reply", this->name);
+                return false;
+            }
+            spdlog::info("[{}] Decrypted second reply (record {}): {}", this->name, reply2->sequence, reply2->payload);
+            return true;
+        }
+
+        // connector replies to two messages
+        auto msg1 = records.receive();
+        if (!msg1)
+        {
+            spdlog::error("[{}] Expected encrypted message from listener", this->name);
+            return false;
+        }
+        spdlog::info("[{}] Decrypted message 1 (record {}): {}", this->name, msg1->sequence, msg1->payload);
+        records.send("Ack from " + this->name + " #1");
+
+        auto msg2 = records.receive();
+        if (!msg2)
+        {
+            spdlog::error("[{}] Expected second encrypted message from listener", this->name);
+            return false;
+        }
+        spdlog::info("[{}] Decrypted message 2 (record {}): {}", this->name, msg2->sequence, msg2->payload);
+        records.send("Ack from " + this->name + " #2");
+        records.flush();
+        return true;
     }
 
-    /**
-     * Helper method to create a shortened hash representation of a big integer
-     * @param value The big integer value
-     * @returns The shortened hash as a hexadecimal string
-     */
-    static std::string shortHash(const boost::multiprecision::cpp_int &value)
+    // runs the established session: the session handler if one is set, the demo message exchange otherwise
+    template <typename SyncStream>
+    bool runSession(SyncStream &socket, asio::streambuf &buffer, const std::string &sessionKey, bool isListener, std::uint64_t transcriptConnection)
     {
-        std::hash<std::string> hasher;
-        std::ostringstream oss;
-        oss << std::hex << hasher(value.str());
-        return oss.str();
+        if (!this->sessionHandler_)
+            return this->exchangeDemoMessages(socket, buffer, sessionKey, isListener, transcriptConnection);
+        return this->sessionHandler_(StreamRef(socket), buffer, sessionKey);
     }
 
     /**
-     * Simple XOR cipher for demonstration purposes, uses the provided key to XOR the data
-     * @param data The data to perform XOR on
-     * @param key The key used for XOR operation
-     * @returns The XOR result
+     * Listener side of one handshake and session on a local connection, on the calling thread
+     * @param socket The accepted connection
+     * @param config Settings for the handshake
+     * @returns True if the handshake and the session succeeded
      */
-    static std::string xorWithKey(const std::string &data, const std::string &key)
+    template <typename SyncStream>
+    bool serveLocalConnection(SyncStream &socket, const HandshakeConfig &config)
     {
-        if (key.empty())
-            return {};
-        std::string out(data.size(), '\0');
-        for (size_t i = 0; i < data.size(); ++i)
+        auto start = std::chrono::steady_clock::now();
+        asio::streambuf buffer;
+        auto machine = HandshakeMachine::listener(config, *this, this->ticketManager_);
+        std::uint64_t transcriptConnection = this->transcript_ ? this->transcript_->begin(true, this->name, config.expectedPeerId, this->preagreedGroup_) : 0;
+        std::optional<std::string> sessionKey;
+        try
         {
-            out[i] = data[i] ^ key[i % key.size()];
+            sessionKey = driveHandshake(machine, socket, buffer, this->transcript_.get(), transcriptConnection);
         }
-        return out;
-    }
-
-    /**
-     * Encodes string data into hexadecimal representation
-     * @param data The data to encode
-     * @returns The hex-encoded string
-     */
-    static std::string hexEncode(const std::string &data)
-    {
-        static const char *hex = "0123456789abcdef"; // valid hex characters
-        std::string out;
-        // one hex character represents 4 bits, so each full byte requires two hex characters, hence reserving double the memory size of 'data'
-        out.reserve(data.size() * 2);
-        for (unsigned char c : data)
+        catch (const std::exception &ex)
         {
-            // shift right by 4 bits to get the first hex digit, and bitwise AND with 0x0F to get the second hex digit
-            out.push_back(hex[c >> 4]);
-            out.push_back(hex[c & 0x0F]);
+            spdlog::warn("[{}] Connection lost during {}: {}", this->name, machine.getPhase(), ex.what());
         }
-        return out;
-    }
+        if (this->transcript_)
+            this->transcript_->end(transcriptConnection, sessionKey.has_value());
+        if (!sessionKey)
+            return false;
 
-    /**
-     * Decodes a hex-encoded string back into its original representation
-     * @param hexData The hex-encoded string
-     * @returns The decoded string
-     */
-    static std::string hexDecode(const std::string &hexData)
-    {
-        if (hexData.size() % 2 != 0)
-            throw std::invalid_argument("Invalid hex length");
-        std::string out;
-        // opposite of above, each pair of hex characters represents one byte, so only need half the memory size
-        out.reserve(hexData.size() / 2);
-        for (size_t i = 0; i < hexData.size(); i += 2)
+        this->lastHandshakeResumed_ = machine.wasResumed();
+        this->sessionKey_ = *sessionKey;
+        this->lastHandshakeMillis_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        spdlog::info("[{}] {} handshake completed in {:.2f} ms", this->name, this->lastHandshakeResumed_ ? "Resumed" : "Full", this->lastHandshakeMillis_);
+        try
         {
-            // the stoul function converts a substring of two hex characters into an unsigned long integer, base 16
-            // we then static_cast it to a char and append to the output string -> giving us the original string value
-            unsigned int byte = std::stoul(hexData.substr(i, 2), nullptr, 16);
-            out.push_back(static_cast<char>(byte));
+            return this->runSession(socket, buffer, *sessionKey, true, transcriptConnection);
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::error("[{}] Session with {} failed: {}", this->name, machine.getPeerId(), ex.what());
+            return false;
         }
-        return out;
     }
 
     /**
-     * Helper method for sending a line over ASIO network socket
-     * @param socket The ASIO TCP socket object
-     * @param line The string to send
+     * Listener side over a Unix domain socket or shared memory. Local peers connect one after the other, and each
+     *      handshake and session runs on the calling thread. The TCP server's admission limits, deadlines and cookies
+     *      defend against remote peers, so they don't apply here
      */
-    static void sendLine(asio::ip::tcp::socket &socket, const std::string &line)
+    bool performLocalListenerHandshake(const HandshakeConfig &config, int connections)
     {
-        asio::write(socket, asio::buffer(line + "\n"));
+        const std::string &location = this->listenTransport_.location;
+        bool allOk = true;
+        std::error_code ignored;
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+        if (this->listenTransport_.kind == TransportAddress::Kind::Unix)
+        {
+            asio::io_context io;
+            // a socket file left by an earlier run would make the bind fail
+            std::filesystem::remove(location, ignored);
+            asio::local::stream_protocol::acceptor acceptor(io, asio::local::stream_protocol::endpoint(location));
+            for (int i = 0; i < connections; ++i)
+            {
+                asio::local::stream_protocol::socket socket(io);
+                acceptor.accept(socket);
+                allOk = this->serveLocalConnection(socket, config) && allOk;
+            }
+            acceptor.close();
+            std::filesystem::remove(location, ignored);
+        }
+#endif
+#if defined(__linux__)
+        if (this->listenTransport_.kind == TransportAddress::Kind::Shm)
+        {
+            ShmAcceptor acceptor(location);
+            for (int i = 0; i < connections; ++i)
+            {
+                ShmStream stream = acceptor.accept();
+                allOk = this->serveLocalConnection(stream, config) && allOk;
+            }
+        }
+#endif
+        return allOk;
     }
 
-    /**
-     * Helper method for reading a line from ASIO network socket, delimited by a newline character
-     * @param socket The ASIO TCP socket object
-     * @param buffer The ASIO stream buffer to read into -> where to store the data temporarily
-     * @returns The read line as a string
-     */
-    static std::string readLine(asio::ip::tcp::socket &socket, asio::streambuf &buffer)
+    // connector side of the handshake and session on a connected socket or stream, see performConnectorHandshake
+    template <typename SyncStream>
+    bool runConnectorHandshake(SyncStream &socket, const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength)
     {
-        asio::read_until(socket, buffer, "\n");
-        std::istream is(&buffer);
-        std::string line;
-        std::getline(is, line);
-        return line;
-    }
+        try
+        {
+            auto start = std::chrono::steady_clock::now();
+            asio::streambuf buffer;
+            // if the listener rejects our ticket, it carries straight on with the full handshake on this connection
+            auto machine = HandshakeMachine::connector(this->makeConfig(authSecret, expectedPeerId, primeBitLength, 0), *this, this->resumption_);
+            std::uint64_t transcriptConnection = this->transcript_ ? this->transcript_->begin(false, this->name, expectedPeerId, this->preagreedGroup_) : 0;
+            std::optional<std::string> sessionKey = driveHandshake(machine, socket, buffer, this->transcript_.get(), transcriptConnection);
+            if (this->transcript_)
+                this->transcript_->end(transcriptConnection, sessionKey.has_value());
+            this->lastRetryAfter_ = machine.getRetryAfter();
+            if (!sessionKey)
+                return false;
+            this->lastHandshakeResumed_ = machine.wasResumed();
 
-    /**
-     * Validates the DHKE parameters received from the peer. Checks the following conditions:
-     *
-     * - Prime number is > 3 and odd
-     *
-     * - Prime number passes Miller-Rabin primality test
-     *
-     * - Generator is > 1 and < prime
-     *
-     * - Peer public key is > 1 and < (prime - 1)
-     *
-     * @param prime The public prime number
-     * @param generator The public generator
-     * @param peerPartial The peer's public key
-     * @returns True if parameters are valid, false otherwise
-     */
-    static bool validateParameters(const boost::multiprecision::cpp_int &prime,
-                                   int generator,
-                                   const boost::multiprecision::cpp_int &peerPartial)
-    {
-        if (prime <= 3 || (prime & 1) == 0)
-            return false;
-        if (!boost::multiprecision::miller_rabin_test(prime, 10))
-            return false;
-        if (generator <= 1 || generator >= prime)
-            return false;
-        if (peerPartial <= 1 || peerPartial >= (prime - 1))
+            this->sessionKey_ = *sessionKey;
+            this->lastHandshakeMillis_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            spdlog::info("[{}] {} handshake completed in {:.2f} ms", this->name, this->lastHandshakeResumed_ ? "Resumed" : "Full", this->lastHandshakeMillis_);
+
+            return this->runSession(socket, buffer, *sessionKey, false, transcriptConnection);
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::error("[{}] Connector handshake failed: {}", this->name, ex.what());
             return false;
-        return true;
+        }
     }
 
 public:
@@ -328,151 +373,227 @@ public:
         this->userListeningPort_ = port;
     }
 
+    // listener: listen on a Unix domain socket or shared memory name ("unix:/path" or "shm:/name") instead of the TCP port
+    void setListenTransport(const TransportAddress &address)
+    {
+        this->listenTransport_ = address;
+    }
+
+    // true if the most recent handshake resumed a session from a ticket instead of running the key exchange
+    bool wasLastHandshakeResumed()
+    {
+        return this->lastHandshakeResumed_;
+    }
+
+    // wall-clock time of the most recent handshake in milliseconds, from connecting to the session key being ready
+    double getLastHandshakeMillis()
+    {
+        return this->lastHandshakeMillis_;
+    }
+
+    // session key derived by the most recent successful handshake
+    std::string getSessionKey()
+    {
+        return this->sessionKey_;
+    }
+
+    /**
+     * Sets what happens on the connection once the handshake has succeeded, instead of the demo message exchange.
+     * @param handler Called with the connection (a TCP or Unix socket, or a shared memory stream), the read buffer (which may
+     *      already hold data from the peer) and the session key. Its return value becomes the handshake's result.
+     */
+    void setSessionHandler(std::function<bool(StreamRef, asio::streambuf &, const std::string &)> handler)
+    {
+        this->sessionHandler_ = std::move(handler);
+    }
+
+    // listener: how many handshakes run at once, and how many connectors may queue for a slot before being told to retry
+    void setAdmissionLimits(const AdmissionLimits &limits)
+    {
+        this->admissionLimits_ = limits;
+    }
+
+    // listener: run handshakes on shards with SO_REUSEPORT acceptors of their own (see ShardedHandshakeServer)
+    void setListenerShards(const ShardOptions &options)
+    {
+        this->listenerShards_ = options;
+    }
+
+    // listener: how long a peer may take over each part of the handshake
+    void setHandshakeDeadlines(const HandshakeDeadlines &deadlines)
+    {
+        this->handshakeDeadlines_ = deadlines;
+    }
+
+    // listener: serve groups from a parameter file written by gen-params, instead of generating a fresh group per handshake
+    void setParameterStore(std::shared_ptr<ParameterStore> store)
+    {
+        this->parameterStore_ = std::move(store);
+    }
+
+    /**
+     * Sets the group both peers agreed on out of band. A connector then opens with the one round trip QUICK flight,
+     *      and a listener accepts QUICK flights for this group. Neither side checks the group itself, only the peer's key
+     * @param group The pre-agreed group, which must have a known subgroup order
+     */
+    void setPreagreedGroup(const DHGroup &group)
+    {
+        if (!group.hasKnownOrder())
+            throw std::invalid_argument("A pre-agreed group needs a known subgroup order");
+        this->preagreedGroup_ = group;
+    }
+
+    // connector: run parameter validation, step 1 and step 2 of a full handshake on three threads (see HandshakeConfig)
+    void setParallelValidation(bool enabled)
+    {
+        this->parallelValidation_ = enabled;
+    }
+
+    /**
+     * Captures every handshake line sent and received, and the type and size of every demo record, into a transcript
+     *      for offline replay (see dhke_bench replay)
+     * @param transcript The transcript, which may be shared with other clients
+     */
+    void setTranscript(std::shared_ptr<TranscriptWriter> transcript)
+    {
+        this->transcript_ = std::move(transcript);
+    }
+
+    // listener: how hard the connector's puzzle is when idle and when fully loaded, in leading zero bits
+    void setPuzzleDifficulty(const PuzzleDifficulty &difficulty)
+    {
+        this->puzzleDifficulty_ = difficulty;
+    }
+
+    // connector: the delay the listener asked for when it last turned us away as busy, zero otherwise
+    std::chrono::milliseconds getLastRetryAfter()
+    {
+        return this->lastRetryAfter_;
+    }
+
     /**
      * Performs the listener side of the DHKE handshake over the network. For the listener specifically, this involves:
      *
-     * - 1. Waiting for a connection from the connector, then generating the DHKE parameters (prime, generator, private key), and computing the partial key
+     * - 1. Waiting for a connection from the connector, and reading its opening line (HELLO, or RESUME with a session ticket)
+     *
+     * - 2. For a valid ticket: resuming the session with fresh nonces, no key exchange needed
+     *
+     * - 3. Otherwise, sending a cookie and waiting for the connector to return it with a puzzle solution and proof of its
+     *          identity, before any expensive work is done for it
      *
-     * - 2. Sending the partial key to the connector, and receiving the connector's partial key
+     * - 4. Generating the DHKE parameters (prime, generator, private key), computing the partial key and exchanging
+     *          partial keys with the connector
      *
-     * - 3. Computing the shared secret, and confirming it with the connector
+     * - 5. Computing the shared secret, confirming it with the connector and issuing a session ticket
+     *
+     * Handshakes run on a HandshakeServer, so several connectors can handshake at once (up to the admission limits),
+     *      each peer has to keep to the handshake deadlines, and connectors beyond the limits are told to retry later.
+     *      With listener shards set, a ShardedHandshakeServer runs them instead, one shard per core. Established
+     *      sessions are then run one after the other on the calling thread.
      *
      * @param authSecret The shared authentication secret for MAC computation
      * @param expectedPeerId The expected identity of the remote peer
      * @param primeBitLength The bit length for the generated prime number (default: 512)
-     * @returns True if handshake successful, false otherwise
+     * @param subgroupBitLength The bit length of the subgroup order q, or 0 for legacy full-length private keys (default: 0)
+     * @param connections The number of handshakes to run before returning; connectors turned away as busy don't count (default: 1)
+     * @returns True if every handshake was successful, false otherwise
      */
-    bool performListenerHandshake(const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength = 512)
+    bool performListenerHandshake(const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength = 512,
+                                  size_t subgroupBitLength = 0, int connections = 1)
     {
-        using asio::ip::tcp;
-        spdlog::info("[{}] Starting listener handshake on port {}", this->name, this->userListeningPort_);
+        if (this->listenTransport_.isLocal())
+            spdlog::info("[{}] Starting listener handshake on {}", this->name, this->listenTransport_.toString());
+        else
+            spdlog::info("[{}] Starting listener handshake on port {}", this->name, this->userListeningPort_);
 
         try
         {
-            // set up asio networking context
+            if (this->listenTransport_.isLocal())
+                return this->performLocalListenerHandshake(this->makeConfig(authSecret, expectedPeerId, primeBitLength, subgroupBitLength), connections);
+
+            // the server runs the handshakes on its own I/O thread (or its shards' threads) and hands every outcome back to us
+            HandshakeConfig config = this->makeConfig(authSecret, expectedPeerId, primeBitLength, subgroupBitLength);
+            std::mutex mutex;
+            std::condition_variable ready;
+            std::deque<HandshakeOutcome> outcomes;
+            auto onOutcome = [&](HandshakeOutcome outcome)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                outcomes.push_back(std::move(outcome));
+                ready.notify_one();
+            };
             asio::io_context io;
-            tcp::acceptor acceptor(io, tcp::endpoint(tcp::v4(), this->userListeningPort_));
-            tcp::socket socket(io);
-            acceptor.accept(socket);
-            spdlog::info("[{}] Peer connected", this->name);
-
-            // generate parameters: prime, generator, private key, public key
-            auto prime = KeyGenerator::getPrimeNumber(primeBitLength);
-            int generator = KeyGenerator::getLargeRandomInt(1, 10) % 2 == 0 ? 2 : 5;
-            this->setPublicPrime(prime);
-            this->setPublicGenerator(generator);
-            this->setPrivateKey(KeyGenerator::getLargeRandomInt(2, primeBitLength - 1));
-
-            // perform step 1 to get the partial key
-            auto myPublic = this->step1();
-
-            // send initial message to connector
-            auto macPayload = buildPayload(prime, generator, myPublic, "LISTENER", this->name, expectedPeerId);
-            // compute MAC, send data in expected format to connector
-            auto mac = computeMac(authSecret, macPayload);
-            sendLine(socket, "ID:" + this->name);
-            sendLine(socket, "P:" + prime.str());
-            sendLine(socket, "G:" + std::to_string(generator));
-            sendLine(socket, "PUB:" + myPublic.str());
-            sendLine(socket, "MAC:" + mac);
-
-            // receive peer response
-            asio::streambuf buffer;
-            boost::multiprecision::cpp_int peerPartial;
-            std::string peerMac;
-            std::string peerId;
-            std::string peerConfirm;
+            auto workGuard = asio::make_work_guard(io);
+            std::optional<HandshakeServer> server;
+            std::optional<ShardedHandshakeServer> sharded;
+            std::thread ioThread;
+            if (this->listenerShards_)
+            {
+                sharded.emplace(config, this->ticketManager_, *this->listenerShards_, this->admissionLimits_, this->handshakeDeadlines_, this->puzzleDifficulty_);
+                sharded->setTranscript(this->transcript_.get());
+                sharded->setOutcomeHandler(onOutcome);
+                sharded->start(this->userListeningPort_);
+            }
+            else
+            {
+                server.emplace(io, std::move(config), this->ticketManager_, this->admissionLimits_, this->handshakeDeadlines_, this->puzzleDifficulty_);
+                server->setTranscript(this->transcript_.get());
+                server->setOutcomeHandler(onOutcome);
+                server->start(this->userListeningPort_);
+                ioThread = std::thread([&io]
+                                       { io.run(); });
+            }
 
-            // expecting 4 lines: PUB, MAC, ID, CONFIRM
-            for (int i = 0; i < 4; ++i)
+            bool allOk = true;
+            for (int i = 0; i < connections; ++i)
             {
-                std::string line = readLine(socket, buffer);
-                if (line.rfind("PUB:", 0) == 0)
+                HandshakeOutcome outcome;
                 {
-                    peerPartial = boost::multiprecision::cpp_int(line.substr(4));
+                    std::unique_lock<std::mutex> lock(mutex);
+                    ready.wait(lock, [&]
+                               { return !outcomes.empty(); });
+                    outcome = std::move(outcomes.front());
+                    outcomes.pop_front();
                 }
-                else if (line.rfind("MAC:", 0) == 0)
+                if (!outcome.ok)
                 {
-                    peerMac = line.substr(4);
+                    allOk = false;
+                    continue;
                 }
-                else if (line.rfind("ID:", 0) == 0)
+
+                this->lastHandshakeResumed_ = outcome.resumed;
+                this->sessionKey_ = outcome.sessionKey;
+                this->lastHandshakeMillis_ = outcome.handshakeMillis;
+                spdlog::info("[{}] {} handshake completed in {:.2f} ms", this->name, this->lastHandshakeResumed_ ? "Resumed" : "Full", this->lastHandshakeMillis_);
+
+                // the server has no operations pending on an established connection, so we can use it with blocking calls
+                asio::streambuf buffer;
+                buffer.commit(asio::buffer_copy(buffer.prepare(outcome.leftover.size()), asio::buffer(outcome.leftover)));
+                try
                 {
-                    peerId = line.substr(3);
+                    allOk = this->runSession(*outcome.socket, buffer, outcome.sessionKey, true, outcome.transcriptConnection) && allOk;
                 }
-                else if (line.rfind("CONFIRM:", 0) == 0)
+                catch (const std::exception &ex)
                 {
-                    peerConfirm = line.substr(8);
+                    spdlog::error("[{}] Session with {} failed: {}", this->name, outcome.peerId, ex.what());
+                    allOk = false;
                 }
+                asio::error_code ignored;
+                outcome.socket->close(ignored);
             }
 
-            // check received data
-            if (peerMac.empty())
-            {
-                spdlog::error("[{}] Missing MAC from peer", this->name);
-                return false;
-            }
-            if (peerId.empty() || peerId != expectedPeerId)
+            if (sharded)
             {
-                spdlog::error("[{}] Unexpected peer identity '{}'", this->name, peerId);
-                return false;
+                sharded->logMetrics();
+                sharded->stop();
+                return allOk;
             }
-
-            auto expectedMac = computeMac(authSecret, buildPayload(prime, generator, peerPartial, "CONNECTOR", peerId, this->name));
-            if (peerMac != expectedMac)
-            {
-                spdlog::error("[{}] MAC mismatch, aborting handshake", this->name);
-                return false;
-            }
-
-            if (!validateParameters(prime, generator, peerPartial))
-            {
-                spdlog::error("[{}] Parameter validation failed", this->name);
-                return false;
-            }
-
-            // now perform step 2 to compute the complete shared secret, using the peer's partial key
-            auto shared = this->step2(peerPartial);
-            spdlog::info("[{}] Shared secret hash: {}", this->name, shortHash(shared));
-
-            // confirm peer knows the shared secret
-            auto expectedConfirm = deriveConfirmTag(shared, "CONNECTOR", peerId, this->name);
-            if (peerConfirm.empty() || peerConfirm != expectedConfirm)
-            {
-                spdlog::error("[{}] Confirmation tag mismatch", this->name);
-                return false;
-            }
-            // send our confirmation tag back to the connector
-            auto myConfirm = deriveConfirmTag(shared, "LISTENER", this->name, peerId);
-            sendLine(socket, "CONFIRM:" + myConfirm);
-
-            // demonstration of encrypted message exchange: send and receive two messages
-            // this is to show that both parties have derived the same session key from the shared secret, and can encrypt/decrypt communications successfully
-            // this uses the simplified XOR cipher
-            auto sessionKey = deriveSessionKey(shared);
-            std::string msg1 = "Hello from " + this->name + " (listener)";
-            sendLine(socket, "ENC:" + hexEncode(xorWithKey(msg1, sessionKey)));
-            std::string encReply1 = readLine(socket, buffer);
-            if (encReply1.rfind("ENC:", 0) != 0)
-            {
-                spdlog::error("[{}] Expected encrypted reply", this->name);
-                return false;
-            }
-            spdlog::info("[{}] Encrypted reply: {}", this->name, encReply1);
-            std::string reply1 = xorWithKey(hexDecode(encReply1.substr(4)), sessionKey);
-            spdlog::info("[{}] Decrypted reply: {}", this->name, reply1);
-
-            std::string msg2 = "Second message from " + this->name;
-            sendLine(socket, "ENC:" + hexEncode(xorWithKey(msg2, sessionKey)));
-            std::string encReply2 = readLine(socket, buffer);
-            if (encReply2.rfind("ENC:", 0) != 0)
-            {
-                spdlog::error("[{}] Expected second encrypted reply", this->name);
-                return false;
-            }
-            spdlog::info("[{}] Encrypted second reply: {}", this->name, encReply2);
-            std::string reply2 = xorWithKey(hexDecode(encReply2.substr(4)), sessionKey);
-            spdlog::info("[{}] Decrypted second reply: {}", this->name, reply2);
-            return true;
+            server->logMetrics();
+            server->stop();
+            workGuard.reset();
+            io.stop();
+            ioThread.join();
+            return allOk;
         }
         catch (const std::exception &ex)
         {
@@ -484,13 +605,14 @@ public:
     /**
      * Performs the connector side of the DHKE handshake over the network. For the connector specifically, this involves:
      *
-     * - 1. Connecting to the listener peer
+     * - 1. Connecting to the listener peer, over TCP, or over a Unix domain socket or shared memory if the peer host
+     *          is given as "unix:/path" or "shm:/name"
      *
-     * - 2. Receiving the listener's parameters and partial key
+     * - 2. If we hold a valid session ticket for this peer, presenting it to resume the session without a key exchange
      *
-     * - 3. Sending the connector's partial key
+     * - 3. Otherwise, receiving the listener's parameters and partial key, and sending the connector's partial key
      *
-     * - 4. Computing the shared secret, and confirming it with the listener
+     * - 4. Computing the shared secret, confirming it with the listener and storing the issued session ticket
      *
      * @param authSecret The shared authentication secret for MAC computation
      * @param expectedPeerId The expected identity of the remote peer
@@ -500,144 +622,141 @@ public:
     bool performConnectorHandshake(const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength = 512)
     {
         using asio::ip::tcp;
-        spdlog::info("[{}] Starting connector handshake to {}:{}", this->name, this->remotePeerHost_, this->remotePeerPort_);
+        TransportAddress address = TransportAddress::parse(this->remotePeerHost_);
+        if (address.isLocal())
+            spdlog::info("[{}] Starting connector handshake to {}", this->name, address.toString());
+        else
+            spdlog::info("[{}] Starting connector handshake to {}:{}", this->name, this->remotePeerHost_, this->remotePeerPort_);
 
         try
         {
+            auto start = std::chrono::steady_clock::now();
             // set up asio networking context
             asio::io_context io;
-            tcp::socket socket(io);
-            tcp::resolver resolver(io);
-            auto endpoints = resolver.resolve(this->remotePeerHost_, std::to_string(this->remotePeerPort_));
-            asio::connect(socket, endpoints);
-            spdlog::info("[{}] Connected to peer", this->name);
-
-            // receive parameters from listener
-            asio::streambuf buffer;
-            boost::multiprecision::cpp_int prime;
-            int generator = 0;
-            boost::multiprecision::cpp_int peerPartial;
-            std::string peerMac;
-            std::string peerId;
-
-            // expecting 5 lines: P, G, PUB, MAC, ID
-            for (int i = 0; i < 5; ++i)
+            // co-located peers skip the TCP loopback stack, a local listener is never busy so there is nothing to retry
+            if (address.isLocal())
             {
-                std::string line = readLine(socket, buffer);
-                if (line.rfind("P:", 0) == 0)
-                {
-                    prime = boost::multiprecision::cpp_int(line.substr(2));
-                }
-                else if (line.rfind("G:", 0) == 0)
-                {
-                    generator = std::stoi(line.substr(2));
-                }
-                else if (line.rfind("PUB:", 0) == 0)
-                {
-                    peerPartial = boost::multiprecision::cpp_int(line.substr(4));
-                }
-                else if (line.rfind("MAC:", 0) == 0)
+                bool ok = false;
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+                if (address.kind == TransportAddress::Kind::Unix)
                 {
-                    peerMac = line.substr(4);
+                    asio::local::stream_protocol::socket socket(io);
+                    socket.connect(asio::local::stream_protocol::endpoint(address.location));
+                    spdlog::info("[{}] Connected to peer", this->name);
+                    ok = this->runConnectorHandshake(socket, authSecret, expectedPeerId, primeBitLength);
                 }
-                else if (line.rfind("ID:", 0) == 0)
+#endif
+#if defined(__linux__)
+                if (address.kind == TransportAddress::Kind::Shm)
                 {
-                    peerId = line.substr(3);
+                    ShmStream stream = ShmAcceptor::connect(address.location);
+                    spdlog::info("[{}] Connected to peer", this->name);
+                    ok = this->runConnectorHandshake(stream, authSecret, expectedPeerId, primeBitLength);
                 }
+#endif
+                this->lastHandshakeMillis_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+                return ok;
             }
+            tcp::resolver resolver(io);
+            auto endpoints = resolver.resolve(this->remotePeerHost_, std::to_string(this->remotePeerPort_));
 
-            // check received data
-            if (peerMac.empty())
-            {
-                spdlog::error("[{}] Missing MAC from listener", this->name);
-                return false;
-            }
-            if (peerId.empty() || peerId != expectedPeerId)
-            {
-                spdlog::error("[{}] Unexpected listener identity '{}'", this->name, peerId);
-                return false;
-            }
-
-            auto expectedMac = computeMac(authSecret, buildPayload(prime, generator, peerPartial, "LISTENER", peerId, this->name));
-            if (peerMac != expectedMac)
-            {
-                spdlog::error("[{}] MAC mismatch, aborting handshake", this->name);
-                return false;
-            }
-
-            if (!validateParameters(prime, generator, peerPartial))
+            // a busy listener turns us away with a retry delay, so come back after it a few times before giving up
+            bool ok = false;
+            for (int attempt = 0; attempt < 4; ++attempt)
             {
-                spdlog::error("[{}] Parameter validation failed", this->name);
-                return false;
+                if (attempt > 0)
+                {
+                    spdlog::warn("[{}] Listener is busy, retrying in {} ms", this->name, this->lastRetryAfter_.count());
+                    std::this_thread::sleep_for(this->lastRetryAfter_);
+                }
+                tcp::socket socket(io);
+                asio::connect(socket, endpoints);
+                spdlog::info("[{}] Connected to peer", this->name);
+                ok = this->performConnectorHandshake(socket, authSecret, expectedPeerId, primeBitLength);
+                if (ok || this->lastRetryAfter_.count() == 0)
+                    break;
             }
+            // include the connection setup in the reported latency
+            this->lastHandshakeMillis_ = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            return ok;
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::error("[{}] Connector handshake failed: {}", this->name, ex.what());
+            return false;
+        }
+    }
 
-            // receive parameters from listener, now generate our own parameters via 'step1()'
-            this->setPublicPrime(prime);
-            this->setPublicGenerator(generator);
-            this->setPrivateKey(KeyGenerator::getLargeRandomInt(2, primeBitLength - 1));
-            auto myPublic = this->step1();
-
-            // send MAC + partial key response to listener
-            auto macPayload = buildPayload(prime, generator, myPublic, "CONNECTOR", this->name, peerId);
-            auto mac = computeMac(authSecret, macPayload);
-            sendLine(socket, "ID:" + this->name);
-            sendLine(socket, "PUB:" + myPublic.str());
-            sendLine(socket, "MAC:" + mac);
-
-            // compute shared secret using listener's partial key
-            auto shared = this->step2(peerPartial);
-            spdlog::info("[{}] Shared secret hash: {}", this->name, shortHash(shared));
-            auto myConfirm = deriveConfirmTag(shared, "CONNECTOR", this->name, peerId);
-            // confirm with listener
-            sendLine(socket, "CONFIRM:" + myConfirm);
-
-            // receive confirmation from listener
-            std::string peerConfirm = readLine(socket, buffer);
-            if (peerConfirm.rfind("CONFIRM:", 0) != 0)
+    /**
+     * Drives a HandshakeMachine over a blocking socket (or ShmStream): runs any pending work inline, writes everything
+     *      the machine has to send (one write per flight) and reads whenever it needs more input.
+     * @param machine The handshake to drive
+     * @param socket The connected socket
+     * @param buffer Receives any bytes that arrived after the handshake, for the session that follows
+     * @param transcript If set, every write and read is captured under the given connection
+     * @param connection The connection's id in the transcript
+     * @returns The session key, or std::nullopt if the handshake failed
+     */
+    template <typename SyncStream>
+    static std::optional<std::string> driveHandshake(HandshakeMachine &machine, SyncStream &socket, asio::streambuf &buffer,
+                                                     TranscriptWriter *transcript = nullptr, std::uint64_t connection = 0)
+    {
+        constexpr size_t readChunk = 16 * 1024;
+        while (true)
+        {
+            HandshakeStatus status = machine.status();
+            if (status == HandshakeStatus::NeedWork)
             {
-                spdlog::error("[{}] Missing confirmation from listener", this->name);
-                return false;
+                machine.runWork();
+                continue;
             }
-            auto confirmValue = peerConfirm.substr(8);
-            auto expectedConfirm = deriveConfirmTag(shared, "LISTENER", peerId, this->name);
-            if (confirmValue != expectedConfirm)
+            if (machine.hasOutput())
             {
-                spdlog::error("[{}] Confirmation tag mismatch", this->name);
-                return false;
+                std::string out = machine.takeOutput();
+                if (transcript)
+                    transcript->sent(connection, out);
+                LineIO::writeBuffers(socket, {asio::buffer(out)});
             }
-
-            // demo encrypted message exchange (connector replies to two messages)
-            auto sessionKey = deriveSessionKey(shared);
-            std::string enc1 = readLine(socket, buffer);
-            if (enc1.rfind("ENC:", 0) != 0)
+            if (status == HandshakeStatus::Failed)
+                return std::nullopt;
+            if (status == HandshakeStatus::Done)
             {
-                spdlog::error("[{}] Expected encrypted message from listener", this->name);
-                return false;
+                std::string rest = machine.takeRemainingInput();
+                buffer.commit(asio::buffer_copy(buffer.prepare(rest.size()), asio::buffer(rest)));
+                return machine.getSessionKey();
             }
-            std::string msg1 = xorWithKey(hexDecode(enc1.substr(4)), sessionKey);
-            spdlog::info("[{}] Decrypted message 1: {}", this->name, msg1);
-            std::string reply1 = "Ack from " + this->name + " #1";
-            sendLine(socket, "ENC:" + hexEncode(xorWithKey(reply1, sessionKey)));
 
-            std::string enc2 = readLine(socket, buffer);
-            if (enc2.rfind("ENC:", 0) != 0)
+            // feed anything left in the buffer first, then read
+            if (buffer.size() == 0)
             {
-                spdlog::error("[{}] Expected second encrypted message from listener", this->name);
-                return false;
+                size_t n = socket.read_some(buffer.prepare(readChunk));
+                buffer.commit(n);
+                TransportStats::reads++;
+                TransportStats::bytesRead += n;
             }
-            std::string msg2 = xorWithKey(hexDecode(enc2.substr(4)), sessionKey);
-            spdlog::info("[{}] Decrypted message 2: {}", this->name, msg2);
-            std::string reply2 = "Ack from " + this->name + " #2";
-            sendLine(socket, "ENC:" + hexEncode(xorWithKey(reply2, sessionKey)));
-
-            return true;
-        }
-        catch (const std::exception &ex)
-        {
-            spdlog::error("[{}] Connector handshake failed: {}", this->name, ex.what());
-            return false;
+            auto data = buffer.data();
+            std::string chunk(asio::buffers_begin(data), asio::buffers_end(data));
+            buffer.consume(chunk.size());
+            if (transcript)
+                transcript->received(connection, chunk);
+            machine.receive(chunk.data(), chunk.size());
         }
     }
+
+    /**
+     * Performs the connector side of the DHKE handshake on a socket that is already connected to the listener, see above.
+     *      The socket is left open afterwards, so callers that own a shared io_context can keep the session around.
+     *
+     * @param socket A connected socket, on any io_context
+     * @param authSecret The shared authentication secret for MAC computation
+     * @param expectedPeerId The expected identity of the remote peer
+     * @param primeBitLength The bit length for the generated prime number (default: 512)
+     * @returns True if handshake successful, false otherwise
+     */
+    bool performConnectorHandshake(asio::ip::tcp::socket &socket, const std::string &authSecret, const std::string &expectedPeerId, size_t primeBitLength = 512)
+    {
+        return this->runConnectorHandshake(socket, authSecret, expectedPeerId, primeBitLength);
+    }
 };
 
 #endif
@@ -0,0 +1,196 @@
+#ifndef COOKIE_HPP
+#define COOKIE_HPP
+
+#include <bit>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <functional>
+#include "crypto.hpp"
+
+/**
+ * The range the client puzzle's difficulty moves in. Difficulty is the number of leading zero bits the connector's
+ *      solution hash needs, so every extra bit doubles the connector's expected work (about 2^bits hashes)
+ */
+struct PuzzleDifficulty
+{
+    // difficulty when the listener is idle, 0 means cookie only
+    unsigned minBits = 0;
+    // difficulty when the listener is at capacity
+    unsigned maxBits = 20;
+};
+
+/**
+ * The CookieGate is the listener's pre-handshake check. Before the listener generates parameters or does any
+ *      exponentiation for a connector, the connector has to:
+ *
+ * - return a cookie the listener issued to its address, proving it can receive at that address
+ *
+ * - solve a hash puzzle bound to that cookie, at a difficulty that rises with the listener's load
+ *
+ * - authenticate its identity with the shared secret
+ *
+ * Cookies are stateless: a cookie carries its issue time and difficulty and is MAC'd under a secret only the listener
+ *      knows, so checking one is a single MAC and nothing is stored per connector. The secret is rotated every cookie
+ *      lifetime, and cookies issued under the previous secret are still accepted until they expire.
+ *
+ * Cookie wire format: <issued at>.<difficulty>.<mac>, where the MAC covers the connector's address as well
+ */
+class CookieGate
+{
+private:
+    std::chrono::seconds lifetime_;
+    PuzzleDifficulty difficulty_;
+    // fraction of the listener's capacity in use, 0 to 1
+    std::atomic<double> load_{0.0};
+    std::mutex mutex_;
+    // secrets for the current and previous lifetime-long epoch
+    std::int64_t epoch_ = 0;
+    std::string currentSecret_;
+    std::string previousSecret_;
+
+    static std::int64_t nowSeconds()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // the secret for the epoch a cookie was issued in, or empty if that epoch's secret is gone
+    std::string secretFor(std::int64_t issuedAt)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        std::int64_t epoch = issuedAt / this->lifetime_.count();
+        std::int64_t current = nowSeconds() / this->lifetime_.count();
+        if (current != this->epoch_)
+        {
+            // skipping more than one epoch means the old secret has expired as well
+            this->previousSecret_ = current == this->epoch_ + 1 ? this->currentSecret_ : CryptoUtils::randomHex(16);
+            this->currentSecret_ = CryptoUtils::randomHex(16);
+            this->epoch_ = current;
+        }
+        if (epoch == this->epoch_)
+            return this->currentSecret_;
+        if (epoch == this->epoch_ - 1)
+            return this->previousSecret_;
+        return {};
+    }
+
+    static std::string cookieMac(const std::string &secret, const std::string &address, std::int64_t issuedAt, unsigned difficulty)
+    {
+        return CryptoUtils::computeMac(secret, "COOKIE|" + address + "|" + std::to_string(issuedAt) + "|" + std::to_string(difficulty));
+    }
+
+public:
+    /**
+     * @param difficulty The range of puzzle difficulties, from idle to fully loaded
+     * @param lifetime How long a cookie can be returned for
+     */
+    explicit CookieGate(PuzzleDifficulty difficulty = PuzzleDifficulty(), std::chrono::seconds lifetime = std::chrono::seconds(30))
+        : lifetime_(std::max<std::chrono::seconds>(lifetime, std::chrono::seconds(1))), difficulty_(difficulty)
+    {
+        this->epoch_ = nowSeconds() / this->lifetime_.count();
+        this->currentSecret_ = CryptoUtils::randomHex(16);
+        this->previousSecret_ = CryptoUtils::randomHex(16);
+    }
+
+    /**
+     * Sets how busy the listener is, which sets the difficulty of newly issued cookies
+     * @param load The fraction of capacity in use, clamped to [0, 1]
+     */
+    void setLoad(double load)
+    {
+        this->load_ = std::clamp(load, 0.0, 1.0);
+    }
+
+    // the difficulty newly issued cookies get at the current load
+    unsigned currentDifficulty() const
+    {
+        unsigned range = this->difficulty_.maxBits > this->difficulty_.minBits ? this->difficulty_.maxBits - this->difficulty_.minBits : 0;
+        return this->difficulty_.minBits + static_cast<unsigned>(this->load_.load() * range + 0.5);
+    }
+
+    /**
+     * Issues a cookie for a connector
+     * @param address The connector's address, the cookie is only valid from there
+     * @returns The encoded cookie
+     */
+    std::string issue(const std::string &address)
+    {
+        std::int64_t now = nowSeconds();
+        unsigned difficulty = this->currentDifficulty();
+        return std::to_string(now) + "." + std::to_string(difficulty) + "." + cookieMac(this->secretFor(now), address, now, difficulty);
+    }
+
+    /**
+     * Checks a returned cookie and the puzzle solution that goes with it
+     * @param cookie The cookie, as issued
+     * @param address The address the connector is connecting from
+     * @param solution The connector's puzzle solution
+     * @param connectorId The identity the solution was computed for
+     * @returns True if the cookie is ours, was issued to this address, has not expired and the solution is valid
+     */
+    bool verify(const std::string &cookie, const std::string &address, const std::string &solution, const std::string &connectorId)
+    {
+        size_t first = cookie.find('.');
+        size_t second = first == std::string::npos ? first : cookie.find('.', first + 1);
+        if (second == std::string::npos)
+            return false;
+        try
+        {
+            std::int64_t issuedAt = std::stoll(cookie.substr(0, first));
+            unsigned difficulty = static_cast<unsigned>(std::stoul(cookie.substr(first + 1, second - first - 1)));
+            std::int64_t age = nowSeconds() - issuedAt;
+            if (age < 0 || age > this->lifetime_.count())
+                return false;
+            std::string secret = this->secretFor(issuedAt);
+            if (secret.empty() || cookie.substr(second + 1) != cookieMac(secret, address, issuedAt, difficulty))
+                return false;
+            return solves(cookie, connectorId, solution, difficulty);
+        }
+        catch (const std::exception &)
+        {
+            return false;
+        }
+    }
+
+    // the difficulty a cookie was issued with, as the connector reads it
+    static unsigned difficultyOf(const std::string &cookie)
+    {
+        size_t first = cookie.find('.');
+        size_t second = first == std::string::npos ? first : cookie.find('.', first + 1);
+        if (second == std::string::npos)
+            return 0;
+        return static_cast<unsigned>(std::strtoul(cookie.c_str() + first + 1, nullptr, 10));
+    }
+
+    // true if hashing the cookie, identity and solution gives at least 'difficulty' leading zero bits
+    static bool solves(const std::string &cookie, const std::string &connectorId, const std::string &solution, unsigned difficulty)
+    {
+        if (difficulty == 0)
+            return true;
+        std::uint64_t hash = std::hash<std::string>{}("PUZZLE|" + cookie + "|" + connectorId + "|" + solution);
+        return static_cast<unsigned>(std::countl_zero(hash)) >= difficulty;
+    }
+
+    /**
+     * Connector: searches for a puzzle solution, about 2^difficulty hashes on average
+     * @param cookie The cookie the listener issued
+     * @param connectorId Our identity
+     * @returns The solution
+     */
+    static std::string solve(const std::string &cookie, const std::string &connectorId)
+    {
+        unsigned difficulty = difficultyOf(cookie);
+        for (std::uint64_t counter = 0;; ++counter)
+        {
+            std::string solution = std::to_string(counter);
+            if (solves(cookie, connectorId, solution, difficulty))
+                return solution;
+        }
+    }
+};
+
+#endif
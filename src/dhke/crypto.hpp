@@ -0,0 +1,153 @@
+#ifndef CRYPTO_HPP
+#define CRYPTO_HPP
+
+#include <string>
+#include <sstream>
+#include <random>
+#include <functional>
+#include <stdexcept>
+#include <boost/multiprecision/cpp_int.hpp>
+
+/**
+ * Collection of the (simplified, demonstration only) cryptographic helpers shared by the network code:
+ *      MACs, key derivation, the XOR cipher and hex encoding.
+ */
+class CryptoUtils
+{
+public:
+    /**
+     * Computes a Message Authentication Code (MAC)
+     *
+     * @note Currently builds a simplified MAC using std::hash for demonstration purposes
+     * @param secret The secret key used for MAC computation
+     * @param payload The payload to be authenticated
+     * @returns The computed MAC as a hexadecimal string
+     */
+    static std::string computeMac(const std::string &secret, const std::string &payload)
+    {
+        std::hash<std::string> hasher;
+        std::ostringstream oss;
+        /**
+         * What's happening below:
+         *  1. 'oss' is essentially the buffer we want to write our data to. In C++, the stream insertion operator, "<<"
+         *           allows for passing data into a stream buffer object
+         *  2. 'std::hex' is an I/O manipulator, meaning it converts any supplied data into hexadecimal base
+         *  3. The hasher() function uses std::hash, which computes a hash of the supplied data, in our case the secret and the payload concatenated
+         *
+         * In summary: hashed secret + payload value -> converted into hexadecimal -> passed into the buffer, then returned as a regular string value
+         */
+        oss << std::hex << hasher(secret + "|" + payload);
+        return oss.str();
+    }
+
+    /**
+     * Helper method to create a shortened hash representation of a big integer
+     * @param value The big integer value
+     * @returns The shortened hash as a hexadecimal string
+     */
+    static std::string shortHash(const boost::multiprecision::cpp_int &value)
+    {
+        std::hash<std::string> hasher;
+        std::ostringstream oss;
+        oss << std::hex << hasher(value.str());
+        return oss.str();
+    }
+
+    /**
+     * Simple XOR cipher for demonstration purposes, uses the provided key to XOR the data
+     * @param data The data to perform XOR on
+     * @param key The key used for XOR operation
+     * @returns The XOR result
+     */
+    static std::string xorWithKey(const std::string &data, const std::string &key)
+    {
+        if (key.empty())
+            return {};
+        std::string out(data.size(), '\0');
+        for (size_t i = 0; i < data.size(); ++i)
+        {
+            out[i] = data[i] ^ key[i % key.size()];
+        }
+        return out;
+    }
+
+    /**
+     * Expands a key and nonce into a keystream of the requested length, by chaining MACs of an incrementing counter.
+     * Unlike xorWithKey, the key material does not repeat every few bytes, and a fresh nonce gives a fresh keystream.
+     * @param key The secret key
+     * @param nonce A value that must never be reused with the same key
+     * @param length The number of keystream bytes required
+     * @returns The keystream
+     */
+    static std::string keystream(const std::string &key, const std::string &nonce, size_t length)
+    {
+        std::string out;
+        out.reserve(length + 16);
+        for (size_t counter = 0; out.size() < length; ++counter)
+        {
+            out += computeMac(key, nonce + "|" + std::to_string(counter));
+        }
+        out.resize(length);
+        return out;
+    }
+
+    /**
+     * Encodes string data into hexadecimal representation
+     * @param data The data to encode
+     * @returns The hex-encoded string
+     */
+    static std::string hexEncode(const std::string &data)
+    {
+        static const char *hex = "0123456789abcdef"; // valid hex characters
+        std::string out;
+        // one hex character represents 4 bits, so each full byte requires two hex characters, hence reserving double the memory size of 'data'
+        out.reserve(data.size() * 2);
+        for (unsigned char c : data)
+        {
+            // shift right by 4 bits to get the first hex digit, and bitwise AND with 0x0F to get the second hex digit
+            out.push_back(hex[c >> 4]);
+            out.push_back(hex[c & 0x0F]);
+        }
+        return out;
+    }
+
+    /**
+     * Decodes a hex-encoded string back into its original representation
+     * @param hexData The hex-encoded string
+     * @returns The decoded string
+     */
+    static std::string hexDecode(const std::string &hexData)
+    {
+        if (hexData.size() % 2 != 0)
+            throw std::invalid_argument("Invalid hex length");
+        std::string out;
+        // opposite of above, each pair of hex characters represents one byte, so only need half the memory size
+        out.reserve(hexData.size() / 2);
+        for (size_t i = 0; i < hexData.size(); i += 2)
+        {
+            // the stoul function converts a substring of two hex characters into an unsigned long integer, base 16
+            // we then static_cast it to a char and append to the output string -> giving us the original string value
+            unsigned int byte = std::stoul(hexData.substr(i, 2), nullptr, 16);
+            out.push_back(static_cast<char>(byte));
+        }
+        return out;
+    }
+
+    /**
+     * Generates a random value for nonces and keys
+     * @param bytes The number of random bytes
+     * @returns The random bytes, hex-encoded (so twice as many characters)
+     */
+    static std::string randomHex(size_t bytes)
+    {
+        std::random_device rd;
+        std::string raw(bytes, '\0');
+        for (auto &c : raw)
+        {
+            c = static_cast<char>(rd() & 0xFF);
+        }
+        return hexEncode(raw);
+    }
+};
+
+#endif
@@ -0,0 +1,464 @@
+#ifndef FILE_TRANSFER_HPP
+#define FILE_TRANSFER_HPP
+
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <filesystem>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+#include "crypto.hpp"
+#include "line_io.hpp"
+#include "record_layer.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/**
+ * Read-only view of a whole file. On POSIX systems the file is memory-mapped, so chunks are encrypted straight out of
+ *      the page cache without being read into a buffer first. Elsewhere the file is read into memory once.
+ */
+class MappedFile
+{
+private:
+    const char *data_ = nullptr;
+    std::uint64_t size_ = 0;
+#if !defined(_WIN32)
+    int fd_ = -1;
+#else
+    std::vector<char> contents_;
+#endif
+
+public:
+    explicit MappedFile(const std::string &path)
+    {
+#if !defined(_WIN32)
+        this->fd_ = ::open(path.c_str(), O_RDONLY);
+        if (this->fd_ < 0)
+            throw std::runtime_error("Unable to open " + path);
+        struct stat info;
+        if (::fstat(this->fd_, &info) != 0)
+            throw std::runtime_error("Unable to stat " + path);
+        this->size_ = static_cast<std::uint64_t>(info.st_size);
+        if (this->size_ > 0)
+        {
+            void *mapped = ::mmap(nullptr, this->size_, PROT_READ, MAP_PRIVATE, this->fd_, 0);
+            if (mapped == MAP_FAILED)
+                throw std::runtime_error("Unable to map " + path);
+            // we read front to back exactly once, so ask the kernel for aggressive read-ahead
+            ::madvise(mapped, this->size_, MADV_SEQUENTIAL);
+            this->data_ = static_cast<const char *>(mapped);
+        }
+#else
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Unable to open " + path);
+        this->contents_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        this->data_ = this->contents_.data();
+        this->size_ = this->contents_.size();
+#endif
+    }
+
+    ~MappedFile()
+    {
+#if !defined(_WIN32)
+        if (this->data_ != nullptr)
+            ::munmap(const_cast<char *>(this->data_), this->size_);
+        if (this->fd_ >= 0)
+            ::close(this->fd_);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const char *data() const
+    {
+        return this->data_;
+    }
+
+    std::uint64_t size() const
+    {
+        return this->size_;
+    }
+};
+
+/**
+ * Destination of an incoming file. Data goes into "<name>.part", which is preallocated to the full size and written
+ *      at each chunk's offset with large writes. A small "<name>.part.progress" file records which file is being
+ *      received and how many chunks are safely on disk, so an interrupted transfer can pick up where it left off.
+ */
+class PartialFileSink
+{
+private:
+    std::filesystem::path finalPath_;
+    std::filesystem::path partPath_;
+    std::filesystem::path progressPath_;
+    std::string fileId_;
+    std::uint64_t committedChunks_ = 0;
+#if !defined(_WIN32)
+    int fd_ = -1;
+#else
+    std::fstream out_;
+#endif
+
+    void writeProgress()
+    {
+        std::ofstream progress(this->progressPath_, std::ios::trunc);
+        progress << this->fileId_ << "\n"
+                 << this->committedChunks_ << "\n";
+    }
+
+public:
+    /**
+     * @param directory The directory to receive into
+     * @param fileName The file's name (without any directories)
+     * @param fileId Identifies the exact file being sent, a resume is only allowed if this matches the progress file
+     * @param fileSize The file's total size, used for preallocation
+     */
+    PartialFileSink(const std::filesystem::path &directory, const std::string &fileName, const std::string &fileId, std::uint64_t fileSize)
+        : finalPath_(directory / fileName),
+          partPath_(directory / (fileName + ".part")),
+          progressPath_(directory / (fileName + ".part.progress")),
+          fileId_(fileId)
+    {
+        // pick up an earlier attempt at the same file, anything else starts over
+        std::ifstream progress(this->progressPath_);
+        std::string previousId;
+        std::uint64_t previousChunks = 0;
+        if (progress >> previousId >> previousChunks && previousId == fileId && std::filesystem::exists(this->partPath_))
+            this->committedChunks_ = previousChunks;
+
+#if !defined(_WIN32)
+        // starting over truncates whatever an earlier attempt left behind, since preallocation never shrinks a file
+        int flags = O_WRONLY | O_CREAT | (this->committedChunks_ == 0 ? O_TRUNC : 0);
+        this->fd_ = ::open(this->partPath_.c_str(), flags, 0644);
+        if (this->fd_ < 0)
+            throw std::runtime_error("Unable to open " + this->partPath_.string());
+#if defined(__linux__)
+        // reserve the whole file up front, so the filesystem can lay it out contiguously (and a full disk fails now)
+        if (fileSize > 0)
+        {
+            int result = ::posix_fallocate(this->fd_, 0, static_cast<off_t>(fileSize));
+            if (result != 0)
+                throw std::runtime_error("Unable to allocate " + this->partPath_.string() + ": " + std::strerror(result));
+        }
+#else
+        if (::ftruncate(this->fd_, static_cast<off_t>(fileSize)) != 0)
+            throw std::runtime_error("Unable to size " + this->partPath_.string());
+#endif
+#else
+        if (!std::filesystem::exists(this->partPath_))
+            std::ofstream(this->partPath_, std::ios::binary).close();
+        std::filesystem::resize_file(this->partPath_, fileSize);
+        this->out_.open(this->partPath_, std::ios::binary | std::ios::in | std::ios::out);
+#endif
+        this->writeProgress();
+    }
+
+    ~PartialFileSink()
+    {
+#if !defined(_WIN32)
+        if (this->fd_ >= 0)
+            ::close(this->fd_);
+#endif
+    }
+
+    PartialFileSink(const PartialFileSink &) = delete;
+    PartialFileSink &operator=(const PartialFileSink &) = delete;
+
+    // number of chunks already on disk, the sender resumes from here
+    std::uint64_t committedChunks() const
+    {
+        return this->committedChunks_;
+    }
+
+    /**
+     * Writes a chunk at the given offset. Chunks arrive in order, so the committed count only ever grows by one
+     */
+    void writeChunk(std::uint64_t offset, const char *data, size_t size)
+    {
+#if !defined(_WIN32)
+        size_t written = 0;
+        while (written < size)
+        {
+            ssize_t n = ::pwrite(this->fd_, data + written, size - written, static_cast<off_t>(offset + written));
+            if (n < 0)
+                throw std::runtime_error("Write to " + this->partPath_.string() + " failed");
+            written += static_cast<size_t>(n);
+        }
+#else
+        this->out_.seekp(static_cast<std::streamoff>(offset));
+        this->out_.write(data, static_cast<std::streamsize>(size));
+#endif
+        this->committedChunks_++;
+    }
+
+    /**
+     * Makes the chunks written so far durable, then records them in the progress file. Called every few chunks rather
+     *      than after each one, since syncing is far more expensive than writing
+     */
+    void checkpoint()
+    {
+#if !defined(_WIN32)
+        ::fsync(this->fd_);
+#else
+        this->out_.flush();
+#endif
+        this->writeProgress();
+    }
+
+    // moves the completed file into place and removes the progress file
+    void finish()
+    {
+        this->checkpoint();
+#if !defined(_WIN32)
+        ::close(this->fd_);
+        this->fd_ = -1;
+#else
+        this->out_.close();
+#endif
+        std::filesystem::rename(this->partPath_, this->finalPath_);
+        std::filesystem::remove(this->progressPath_);
+    }
+};
+
+/**
+ * Transfer statistics for one connection, reported by both sides
+ */
+struct TransferStats
+{
+    std::uint64_t bytes = 0;
+    double seconds = 0.0;
+
+    double megabytesPerSecond() const
+    {
+        return this->seconds > 0.0 ? static_cast<double>(this->bytes) / (1024.0 * 1024.0) / this->seconds : 0.0;
+    }
+};
+
+/**
+ * Encrypted bulk file transfer over an established session.
+ *
+ * Protocol, after the handshake:
+ *
+ * - 1. Sender: FILE:<size>|<chunk size>|<file id>|<name>|<mac>
+ *
+ * - 2. Receiver: RESUME_FROM:<chunk index>|<mac>, the number of chunks it already has from an earlier connection
+ *
+ * - 3. Sender: one binary frame per remaining chunk, [u64 index][u32 length][u32 reserved][u64 tag] (little-endian)
+ *          followed by the encrypted chunk. The chunks are encrypted in counter mode (as records are, see RecordLayer)
+ *          under keys derived from the session key and the whole FILE header, with the chunk index as the sequence
+ *          number.
+ *
+ * - 4. Receiver: COMPLETE|<mac> once every chunk is on disk
+ *
+ * The control lines carry a MAC keyed with the session key, and the later two also cover the FILE header, so a peer
+ *      on the path can't change the size or name, move the resume point or claim the file arrived.
+ *
+ * @note Like the rest of this project the cipher and tag are simplified, demonstration-only constructions
+ */
+class FileTransfer
+{
+private:
+    struct FrameHeader
+    {
+        std::uint64_t index;
+        std::uint32_t length;
+        std::uint32_t reserved;
+        std::uint64_t tag;
+    };
+
+    // a frame header on the wire, little-endian like a record header
+    static constexpr size_t frameHeaderBytes = 24;
+
+    static void encodeFrame(const FrameHeader &header, char *out)
+    {
+        RecordLayer::putLE(out, header.index, 8);
+        RecordLayer::putLE(out + 8, header.length, 4);
+        RecordLayer::putLE(out + 12, header.reserved, 4);
+        RecordLayer::putLE(out + 16, header.tag, 8);
+    }
+
+    static FrameHeader decodeFrame(const char *in)
+    {
+        return FrameHeader{RecordLayer::getLE(in, 8), static_cast<std::uint32_t>(RecordLayer::getLE(in + 8, 4)),
+                           static_cast<std::uint32_t>(RecordLayer::getLE(in + 12, 4)), RecordLayer::getLE(in + 16, 8)};
+    }
+
+    // the receiver syncs to disk and updates its progress file every this many chunks
+    static constexpr std::uint64_t checkpointInterval = 16;
+
+    // the chunk keys for one transfer, derived from the session key and everything the FILE header says about the file
+    static RecordLayer::DirectionKeys transferKeys(const std::string &sessionKey, const std::string &fileHeader)
+    {
+        std::string secret = CryptoUtils::keystream(sessionKey, "CHUNKS|" + fileHeader, RecordLayer::secretBytes);
+        RecordLayer::DirectionKeys keys = RecordLayer::deriveKeys(secret);
+        std::fill(secret.begin(), secret.end(), '\0');
+        return keys;
+    }
+
+    // tag over the chunk index, its length and the ciphertext
+    static std::uint64_t chunkTag(const RecordLayer::DirectionKeys &keys, const FrameHeader &header, const char *ciphertext)
+    {
+        char lengthWord[8];
+        RecordLayer::putLE(lengthWord, header.length, 4);
+        RecordLayer::putLE(lengthWord + 4, header.reserved, 4);
+        return RecordLayer::computeTag(keys, header.index, lengthWord, ciphertext, header.length);
+    }
+
+    // appends the MAC of a control line, covering the FILE header it belongs to (empty for the FILE line itself)
+    static std::string withMac(const std::string &sessionKey, const std::string &fileHeader, const std::string &line)
+    {
+        return line + "|" + CryptoUtils::computeMac(sessionKey, "FILE_CONTROL|" + fileHeader + "|" + line);
+    }
+
+    /**
+     * Checks and strips the MAC of a control line
+     * @throws std::runtime_error If the MAC is missing or wrong
+     */
+    static std::string checkMac(const std::string &sessionKey, const std::string &fileHeader, const std::string &received)
+    {
+        size_t split = received.rfind('|');
+        if (split == std::string::npos)
+            throw std::runtime_error("Control line without a MAC");
+        std::string line = received.substr(0, split);
+        if (withMac(sessionKey, fileHeader, line) != received)
+            throw std::runtime_error("Control line failed authentication");
+        return line;
+    }
+
+public:
+    static constexpr std::uint32_t defaultChunkSize = 1024 * 1024;
+
+    /**
+     * Identifies a particular version of a file: its name, size and modification time
+     */
+    static std::string fileIdFor(const std::filesystem::path &path)
+    {
+        auto modified = std::filesystem::last_write_time(path).time_since_epoch().count();
+        std::string raw = path.filename().string() + "|" + std::to_string(std::filesystem::file_size(path)) + "|" + std::to_string(modified);
+        return CryptoUtils::computeMac("FILE_ID", raw);
+    }
+
+    /**
+     * Sends a file over an established session, starting from whichever chunk the receiver asks for
+     * @returns True once the receiver has confirmed the whole file
+     */
+    template <typename SyncStream>
+    static bool send(SyncStream &socket, asio::streambuf &buffer, const std::string &sessionKey, const std::string &path,
+                     TransferStats &stats, std::uint32_t chunkSize = defaultChunkSize)
+    {
+        MappedFile file(path);
+        std::string fileId = fileIdFor(path);
+        std::string name = std::filesystem::path(path).filename().string();
+        std::uint64_t chunks = (file.size() + chunkSize - 1) / chunkSize;
+
+        std::string fileHeader = std::to_string(file.size()) + "|" + std::to_string(chunkSize) + "|" + fileId + "|" + name;
+        LineIO::sendLine(socket, withMac(sessionKey, "", "FILE:" + fileHeader));
+        std::string reply = checkMac(sessionKey, fileHeader, LineIO::readLine(socket, buffer));
+        if (reply.rfind("RESUME_FROM:", 0) != 0)
+            throw std::runtime_error("Unexpected reply to FILE: " + reply);
+        std::uint64_t next = std::stoull(reply.substr(12));
+        if (next > chunks)
+            throw std::runtime_error("Resume point beyond the end of the file");
+        if (next > 0)
+            spdlog::info("Resuming {} from chunk {}/{}", name, next, chunks);
+
+        auto start = std::chrono::steady_clock::now();
+        RecordLayer::DirectionKeys keys = transferKeys(sessionKey, fileHeader);
+        std::vector<char> ciphertext(chunkSize);
+        for (std::uint64_t index = next; index < chunks; ++index)
+        {
+            std::uint64_t offset = index * chunkSize;
+            size_t length = static_cast<size_t>(std::min<std::uint64_t>(chunkSize, file.size() - offset));
+            // the only copy on the send path: mapped file -> chunk buffer, encrypted in place
+            std::memcpy(ciphertext.data(), file.data() + offset, length);
+            RecordLayer::applyKeystream(keys, index, ciphertext.data(), length);
+
+            FrameHeader header{index, static_cast<std::uint32_t>(length), 0, 0};
+            header.tag = chunkTag(keys, header, ciphertext.data());
+            char frame[frameHeaderBytes];
+            encodeFrame(header, frame);
+            LineIO::writeBuffers(socket, {asio::buffer(frame), asio::buffer(ciphertext.data(), length)});
+            stats.bytes += length;
+        }
+
+        std::string done = checkMac(sessionKey, fileHeader, LineIO::readLine(socket, buffer));
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return done == "COMPLETE";
+    }
+
+    /**
+     * Receives a file over an established session into the given directory
+     * @param complete Set to true once the whole file has been received and moved into place
+     * @returns True if the connection ended cleanly with the file complete
+     */
+    template <typename SyncStream>
+    static bool receive(SyncStream &socket, asio::streambuf &buffer, const std::string &sessionKey, const std::string &directory,
+                        TransferStats &stats, bool &complete)
+    {
+        // FILE:<size>|<chunk size>|<file id>|<name>|<mac>
+        std::string line = checkMac(sessionKey, "", LineIO::readLine(socket, buffer));
+        if (line.rfind("FILE:", 0) != 0)
+            throw std::runtime_error("Expected FILE header");
+        std::string fields = line.substr(5);
+        size_t a = fields.find('|');
+        size_t b = a == std::string::npos ? a : fields.find('|', a + 1);
+        size_t c = b == std::string::npos ? b : fields.find('|', b + 1);
+        if (c == std::string::npos)
+            throw std::runtime_error("Malformed FILE header");
+        std::uint64_t fileSize = std::stoull(fields.substr(0, a));
+        std::uint32_t chunkSize = static_cast<std::uint32_t>(std::stoul(fields.substr(a + 1, b - a - 1)));
+        std::string fileId = fields.substr(b + 1, c - b - 1);
+        // never let the peer choose a path outside the target directory
+        std::string name = std::filesystem::path(fields.substr(c + 1)).filename().string();
+        if (name.empty() || name == "." || name == ".." || chunkSize == 0 || chunkSize > 64 * 1024 * 1024)
+            throw std::runtime_error("Invalid FILE header");
+        std::uint64_t chunks = (fileSize + chunkSize - 1) / chunkSize;
+
+        PartialFileSink sink(directory, name, fileId, fileSize);
+        LineIO::sendLine(socket, withMac(sessionKey, fields, "RESUME_FROM:" + std::to_string(sink.committedChunks())));
+
+        auto start = std::chrono::steady_clock::now();
+        RecordLayer::DirectionKeys keys = transferKeys(sessionKey, fields);
+        std::vector<char> chunk(chunkSize);
+        while (sink.committedChunks() < chunks)
+        {
+            char frame[frameHeaderBytes];
+            LineIO::readExact(socket, buffer, frame, frameHeaderBytes);
+            FrameHeader header = decodeFrame(frame);
+            std::uint64_t expectedLength = std::min<std::uint64_t>(chunkSize, fileSize - header.index * chunkSize);
+            if (header.index != sink.committedChunks() || header.length != expectedLength)
+                throw std::runtime_error("Out of order or malformed chunk");
+
+            // read straight into the chunk buffer, verify, then decrypt in place
+            LineIO::readExact(socket, buffer, chunk.data(), header.length);
+            if (header.reserved != 0 || chunkTag(keys, header, chunk.data()) != header.tag)
+                throw std::runtime_error("Chunk " + std::to_string(header.index) + " failed authentication");
+            RecordLayer::applyKeystream(keys, header.index, chunk.data(), header.length);
+
+            sink.writeChunk(header.index * chunkSize, chunk.data(), header.length);
+            stats.bytes += header.length;
+            if (sink.committedChunks() % checkpointInterval == 0)
+                sink.checkpoint();
+        }
+
+        sink.finish();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        complete = true;
+        LineIO::sendLine(socket, withMac(sessionKey, fields, "COMPLETE"));
+        spdlog::info("Received {} ({} bytes) into {}", name, fileSize, directory);
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef GROUP_HPP
+#define GROUP_HPP
+
+#include <boost/multiprecision/cpp_int.hpp>
+
+/**
+ * Holds the public parameters of a DHKE group.
+ *
+ * When the subgroup order q is known, the generator g produces a subgroup of exactly q elements, which means private
+ * keys only need to be drawn from [1, q) and received public keys can be checked with y^q = 1 (mod p).
+ */
+struct DHGroup
+{
+    // the public prime modulus, p
+    boost::multiprecision::cpp_int prime;
+    // the public generator, g
+    boost::multiprecision::cpp_int generator;
+    // the order of the subgroup generated by g, q -> zero when unknown (legacy full-length parameters)
+    boost::multiprecision::cpp_int order;
+
+    // true if the subgroup order is known, allowing short exponents and subgroup validation
+    bool hasKnownOrder() const
+    {
+        return this->order > 0;
+    }
+};
+
+#endif
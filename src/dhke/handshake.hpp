@@ -0,0 +1,1266 @@
+#ifndef HANDSHAKE_HPP
+#define HANDSHAKE_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <chrono>
+#include <cstdlib>
+#include <sstream>
+#include <algorithm>
+#include <future>
+#include <thread>
+#include <optional>
+#include <functional>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <boost/multiprecision/miller_rabin.hpp>
+#include <spdlog/spdlog.h>
+#include "arena.hpp"
+#include "crypto.hpp"
+#include "cookie.hpp"
+#include "logging.hpp"
+#include "group.hpp"
+#include "ticket.hpp"
+#include "key_gen.hpp"
+#include "param_store.hpp"
+#include "participant.hpp"
+
+/**
+ * What a HandshakeMachine needs from whoever drives it next
+ */
+enum class HandshakeStatus
+{
+    // waiting for more bytes from the peer, pass them to receive()
+    NeedInput,
+    // a CPU-heavy step (parameter generation, validation, modular exponentiation) is ready, call runWork()
+    NeedWork,
+    // the handshake succeeded, the session key is available
+    Done,
+    // the handshake failed, see getError()
+    Failed
+};
+
+/**
+ * Settings for one handshake
+ */
+struct HandshakeConfig
+{
+    // our own identity
+    std::string name;
+    // the shared authentication secret for MAC computation
+    std::string authSecret;
+    // the identity the remote peer must present
+    std::string expectedPeerId;
+    // the bit length for the generated prime number
+    size_t primeBitLength = 512;
+    // listener only: the bit length of the subgroup order q, or 0 for legacy full-length private keys
+    size_t subgroupBitLength = 0;
+    // listener only: use these group parameters instead of generating a fresh group for every handshake
+    std::optional<DHGroup> group;
+    // listener only: if set (and no fixed group is), take each handshake's group from this pre-generated store, must outlive the machine
+    ParameterStore *parameterStore = nullptr;
+    // listener only: if set, a full handshake only starts once the connector has passed the cookie check, must outlive the machine
+    CookieGate *cookieGate = nullptr;
+    // connector only: the hardest puzzle we are willing to solve, harder ones fail the handshake
+    unsigned maxPuzzleBits = 28;
+    // a group both peers agreed on out of band. A connector with one opens with a one round trip QUICK flight, a
+    //      listener with one accepts QUICK flights for it (and falls back to the full handshake for anything else)
+    std::optional<DHGroup> preagreedGroup;
+    // connector only: validate the listener's parameters on one thread while step 1 and step 2 run on two others,
+    //      instead of one after the other. Our reply still waits for validation to pass
+    bool parallelValidation = false;
+};
+
+/**
+ * The HandshakeMachine is the DHKE handshake protocol (full key exchange and session resumption) as an event-driven
+ *      state machine, with no sockets or threads of its own: bytes in, bytes out, plus "CPU work ready" events.
+ *
+ * - receive() takes whatever bytes arrived from the peer, in any split, and advances as far as it can.
+ *
+ * - takeOutput() hands back the bytes to send. Each protocol flight is produced in one piece, so writing everything
+ *      pending before waiting for input keeps the one-write-per-flight behaviour.
+ *
+ * - The expensive steps are never run from receive(). Instead status() reports NeedWork, and the driver calls runWork()
+ *      whenever it suits it (inline, or on a worker thread, as long as the machine isn't touched in the meantime).
+ *
+ * - MAC payloads, MACs, confirmation tags and outgoing lines are built in a per-machine HandshakeArena rather than in
+ *      temporary strings. It is reset at the start of every receive() and runWork(), so nothing built in it is kept
+ *      past the call; whatever has to last (keys, tags to check later) is copied into a member.
+ *
+ * Any transport can drive it: the blocking asio loop in DHKEClient, an async server, or in-memory pipes, where one
+ *      thread can interleave thousands of handshakes.
+ *
+ * Wire protocol (newline terminated lines, one flight per write):
+ *
+ * - Full handshake: connector HELLO:<id> / listener ID, P, Q, G, PUB, MAC / connector ID, PUB, MAC, CONFIRM /
+ *      listener CONFIRM, TICKET
+ *
+ * - With a CookieGate, the listener answers HELLO with COOKIE:<cookie> and the connector has to return COOKIE, SOLUTION
+ *      (to the puzzle) and AUTH (a MAC of its identity and the cookie) before the listener sends its parameter flight
+ *
+ * - Resumption: connector RESUME:<ticket>, NONCE, ID, MAC / listener RESUMED:<nonce>, CONFIRM, TICKET, or
+ *      RESUME_REJECTED followed by the full handshake from the listener's parameter flight on
+ *
+ * - One round trip, for a pre-agreed group: connector QUICK:<group id>, ID, PUB, MAC / listener ID, PUB, MAC, CONFIRM,
+ *      TICKET, or QUICK_REJECTED followed by the full handshake as for RESUME_REJECTED
+ */
+class HandshakeMachine
+{
+private:
+    enum class State
+    {
+        // listener: waiting for HELLO or RESUME
+        AwaitOpening,
+        // listener: waiting for the NONCE, ID and MAC that follow RESUME
+        AwaitResumeRequest,
+        // listener: waiting for the ID, PUB and MAC that follow QUICK
+        AwaitQuickRequest,
+        // listener: waiting for the connector's COOKIE, SOLUTION and AUTH
+        AwaitCookieReply,
+        // listener: waiting for the connector's ID, PUB, MAC and CONFIRM
+        AwaitConnectorFlight,
+        // connector: waiting for RESUMED or RESUME_REJECTED
+        AwaitResumeReply,
+        // connector: waiting for the CONFIRM and TICKET of a resumed session
+        AwaitResumeConfirm,
+        // connector: waiting for the listener's ID, PUB, MAC, CONFIRM and TICKET, or QUICK_REJECTED
+        AwaitQuickReply,
+        // connector: waiting for the listener's ID, P, Q, G, PUB and MAC
+        AwaitListenerFlight,
+        // connector: waiting for the CONFIRM and TICKET of a full handshake
+        AwaitConfirm,
+        Done,
+        Failed
+    };
+
+    // Miller-Rabin rounds for each prime received from the peer
+    static constexpr unsigned primalityRounds = 10;
+    // most bytes one flight may take, counting the lines collected for it and any unterminated line after them. The
+    //      largest legitimate flight, the listener's parameters, is four numbers of about 2,500 digits each for an 8192
+    //      bit group plus a few short lines
+    static constexpr size_t maxFlightBytes = 16 * 1024;
+
+    // scratch space for the strings built during one call. Numbers up to 8192 bits are formatted without allocating,
+    //      and a handshake whose strings outgrow the inline buffer (groups well above 2048 bits) spills to the heap
+    using Scratch = HandshakeArena<8192>;
+
+    HandshakeConfig config_;
+    DHKEParticipant *participant_;
+    bool isListener_;
+    // listener only: issues and redeems session tickets
+    SessionTicketManager *ticketManager_ = nullptr;
+    // connector only: the ticket to resume with, replaced by the one issued in this handshake
+    ResumptionState *resumption_ = nullptr;
+
+    State state_;
+    // unconsumed input, lines are taken from inputOffset_ onwards
+    std::string input_;
+    size_t inputOffset_ = 0;
+    // where to look for the next newline, everything before it from inputOffset_ on has already been searched
+    size_t scanOffset_ = 0;
+    // lines collected for the flight we are waiting for, and their size including the newlines
+    std::vector<std::string> lines_;
+    size_t expectedLines_ = 0;
+    size_t flightBytes_ = 0;
+    std::string output_;
+    // held by pointer, so the machine stays movable
+    std::unique_ptr<Scratch> scratch_;
+    // the pending CPU-heavy step, if any
+    std::function<void()> work_;
+    // connector only: the QUICK flight is due as work. Kept as a flag rather than in work_, because it is pending
+    //      from construction and the machine is moved out of connector()
+    bool quickFlightPending_ = false;
+
+    // per-handshake values
+    DHGroup group_;
+    boost::multiprecision::cpp_int peerPartial_;
+    std::string peerId_;
+    std::string peerConfirm_;
+    // listener only: the connector's address, cookies are bound to it
+    std::string peerAddress_;
+    // listener only: the group id from a QUICK opening
+    std::string quickGroupId_;
+    std::string resumeTicket_;
+    std::string resumeNonce_;
+    std::string resumeSecret_;
+    std::string sessionKey_;
+    bool resumed_ = false;
+    std::string error_;
+    // set if the listener replied BUSY
+    std::chrono::milliseconds retryAfter_{0};
+
+    HandshakeMachine(HandshakeConfig config, DHKEParticipant &participant, bool isListener)
+        : config_(std::move(config)), participant_(&participant), isListener_(isListener),
+          state_(isListener ? State::AwaitOpening : State::AwaitListenerFlight), scratch_(std::make_unique<Scratch>())
+    {
+    }
+
+    // current unix time in seconds, used for ticket expiry
+    static std::int64_t nowSeconds()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    // value of the line in the collected flight that starts with the given prefix, or empty
+    std::string field(const std::string &prefix) const
+    {
+        for (const auto &line : this->lines_)
+        {
+            if (line.rfind(prefix, 0) == 0)
+                return line.substr(prefix.size());
+        }
+        return {};
+    }
+
+    void emit(std::string_view line)
+    {
+        this->output_ += line;
+        this->output_ += '\n';
+    }
+
+    // emits one line made of the given pieces, without building it first
+    void emit(std::initializer_list<std::string_view> parts)
+    {
+        for (auto part : parts)
+            this->output_ += part;
+        this->output_ += '\n';
+    }
+
+    // concatenates the pieces in scratch space
+    std::string_view join(std::initializer_list<std::string_view> parts)
+    {
+        return this->scratch_->concat(parts);
+    }
+
+    // same as CryptoUtils::computeMac, in scratch space
+    std::string_view mac(std::string_view secret, std::string_view payload)
+    {
+        return this->scratch_->mac(secret, payload);
+    }
+
+    // a number in decimal, in scratch space
+    std::string_view decimal(const boost::multiprecision::cpp_int &value)
+    {
+        return this->scratch_->decimal(value);
+    }
+
+    // the MAC with our auth secret over a buildPayload formatted payload, in scratch space
+    std::string_view payloadMac(const DHGroup &group, const boost::multiprecision::cpp_int &publicKey, std::string_view role, std::string_view senderId, std::string_view receiverId)
+    {
+        return this->mac(this->config_.authSecret, this->join({this->decimal(group.prime), "|", this->decimal(group.order), "|", this->decimal(group.generator), "|",
+                                                               this->decimal(publicKey), "|", role, "|", senderId, "|", receiverId}));
+    }
+
+    // same as groupId, in scratch space
+    std::string_view scratchGroupId(const DHGroup &group)
+    {
+        return this->mac("GROUP_ID", this->join({this->decimal(group.prime), "|", this->decimal(group.order), "|", this->decimal(group.generator)}));
+    }
+
+    /**
+     * Derives the confirmation tag for the key exchange
+     * @param shared The shared secret, in decimal
+     * @param role The participant's role in the exchange (LISTENER or CONNECTOR)
+     * @param self The participant's identity
+     * @param peer The peer's identity
+     * @returns The confirmation tag as a hexadecimal string, in scratch space
+     */
+    std::string_view deriveConfirmTag(std::string_view shared, std::string_view role, std::string_view self, std::string_view peer)
+    {
+        return this->mac(shared, this->join({"CONFIRM|", role, "|", self, "|", peer}));
+    }
+
+    // the session MAC key, from the shared secret in decimal
+    std::string_view deriveSessionKey(std::string_view shared)
+    {
+        return this->mac(shared, "SESSION_KEY");
+    }
+
+    // the resumption secret the listener puts into session tickets, from the shared secret in decimal
+    std::string_view deriveResumptionSecret(std::string_view shared)
+    {
+        return this->mac(shared, "RESUMPTION");
+    }
+
+    /**
+     * Derives a fresh session key for a resumed session. Both nonces are fresh, so every resumption gets a different
+     *      key even though the resumption secret is reused
+     * @returns The session key as a hexadecimal string, in scratch space
+     */
+    std::string_view deriveResumedSessionKey(std::string_view resumptionSecret, std::string_view connectorNonce, std::string_view listenerNonce)
+    {
+        return this->mac(resumptionSecret, this->join({"RESUMED_SESSION_KEY|", connectorNonce, "|", listenerNonce}));
+    }
+
+    void expect(size_t lines, State next)
+    {
+        this->lines_.clear();
+        this->expectedLines_ = lines;
+        this->flightBytes_ = 0;
+        this->state_ = next;
+    }
+
+    void fail(const std::string &reason)
+    {
+        spdlog::error("[{}] {}", this->config_.name, reason);
+        this->error_ = reason;
+        this->state_ = State::Failed;
+        this->work_ = nullptr;
+        this->quickFlightPending_ = false;
+    }
+
+    void succeed(std::string_view sessionKey, bool resumed)
+    {
+        this->sessionKey_ = sessionKey;
+        this->resumed_ = resumed;
+        this->state_ = State::Done;
+    }
+
+    bool awaitingInput() const
+    {
+        return this->state_ != State::Done && this->state_ != State::Failed && !this->work_ && !this->quickFlightPending_;
+    }
+
+    // takes the next complete line out of the input, if there is one
+    bool nextLine(std::string &line)
+    {
+        size_t newline = this->input_.find('\n', std::max(this->inputOffset_, this->scanOffset_));
+        if (newline == std::string::npos)
+        {
+            this->scanOffset_ = this->input_.size();
+            return false;
+        }
+        line.assign(this->input_, this->inputOffset_, newline - this->inputOffset_);
+        this->inputOffset_ = newline + 1;
+        this->scanOffset_ = this->inputOffset_;
+        this->flightBytes_ += line.size() + 1;
+        return true;
+    }
+
+    // handles as many complete flights as the buffered input allows, stopping at any pending work
+    void advance()
+    {
+        std::string line;
+        while (this->awaitingInput() && this->nextLine(line))
+        {
+            if (this->flightBytes_ > maxFlightBytes)
+                break;
+            // an overloaded listener turns connectors away before doing any work, see HandshakeServer
+            if (!this->isListener_ && this->lines_.empty() && line.rfind("BUSY:", 0) == 0)
+            {
+                this->retryAfter_ = std::chrono::milliseconds(std::max<long long>(0, std::strtoll(line.c_str() + 5, nullptr, 10)));
+                this->fail("Listener is busy, retry in " + std::to_string(this->retryAfter_.count()) + " ms");
+                break;
+            }
+            // a listener that can't take our QUICK flight carries on with the full handshake, as for RESUME_REJECTED
+            if (!this->isListener_ && this->lines_.empty() && this->state_ == State::AwaitQuickReply && line == "QUICK_REJECTED")
+            {
+                spdlog::warn("[{}] Listener rejected the one round trip handshake, running full handshake", this->config_.name);
+                this->expect(6, State::AwaitListenerFlight);
+                continue;
+            }
+            // a listener with a cookie gate answers HELLO (or a rejected RESUME or QUICK) with a cookie first
+            if (!this->isListener_ && this->lines_.empty() && this->state_ == State::AwaitListenerFlight && line.rfind("COOKIE:", 0) == 0)
+            {
+                this->scheduleCookieReply(line.substr(7));
+                break;
+            }
+            this->lines_.push_back(std::move(line));
+            if (this->lines_.size() < this->expectedLines_)
+                continue;
+            try
+            {
+                this->handleFlight();
+            }
+            catch (const std::exception &ex)
+            {
+                this->fail(std::string("Malformed handshake message: ") + ex.what());
+            }
+        }
+        // a peer that keeps sending without finishing its flight is cut off, rather than buffered without limit
+        if (this->awaitingInput() && this->flightBytes_ + (this->input_.size() - this->inputOffset_) > maxFlightBytes)
+            this->fail("Handshake flight larger than " + std::to_string(maxFlightBytes) + " bytes, aborting handshake");
+        // drop consumed input once it makes up most of the buffer
+        if (this->inputOffset_ > 0 && this->inputOffset_ * 2 >= this->input_.size())
+        {
+            this->input_.erase(0, this->inputOffset_);
+            this->scanOffset_ -= this->inputOffset_;
+            this->inputOffset_ = 0;
+        }
+    }
+
+    void handleFlight()
+    {
+        switch (this->state_)
+        {
+        case State::AwaitOpening:
+            this->handleOpening();
+            break;
+        case State::AwaitResumeRequest:
+            this->handleResumeRequest();
+            break;
+        case State::AwaitQuickRequest:
+            this->handleQuickRequest();
+            break;
+        case State::AwaitCookieReply:
+            this->handleCookieReply();
+            break;
+        case State::AwaitConnectorFlight:
+            this->handleConnectorFlight();
+            break;
+        case State::AwaitResumeReply:
+            this->handleResumeReply();
+            break;
+        case State::AwaitResumeConfirm:
+            this->handleResumeConfirm();
+            break;
+        case State::AwaitQuickReply:
+            this->handleQuickReply();
+            break;
+        case State::AwaitListenerFlight:
+            this->handleListenerFlight();
+            break;
+        case State::AwaitConfirm:
+            this->handleConfirm();
+            break;
+        case State::Done:
+        case State::Failed:
+            break;
+        }
+    }
+
+    // listener: the connector opens with HELLO (full handshake), RESUME (session ticket) or QUICK (pre-agreed group)
+    void handleOpening()
+    {
+        const std::string &opening = this->lines_.front();
+        if (opening.rfind("RESUME:", 0) == 0)
+        {
+            this->resumeTicket_ = opening.substr(7);
+            this->expect(3, State::AwaitResumeRequest);
+        }
+        else if (opening.rfind("QUICK:", 0) == 0)
+        {
+            this->quickGroupId_ = opening.substr(6);
+            this->expect(3, State::AwaitQuickRequest);
+        }
+        else if (opening.rfind("HELLO:", 0) == 0)
+        {
+            this->peerId_ = opening.substr(6);
+            this->challengeOrScheduleParameters();
+        }
+        else
+        {
+            this->fail("Unexpected opening line from peer");
+        }
+    }
+
+    /**
+     * Listener side of session resumption. If the ticket is invalid, expired or replayed, the connector is told with
+     *      RESUME_REJECTED and we carry on with the full key exchange.
+     */
+    void handleResumeRequest()
+    {
+        std::string peerNonce = this->field("NONCE:");
+        std::string peerId = this->field("ID:");
+        std::string peerMac = this->field("MAC:");
+        const std::string &ticket = this->resumeTicket_;
+
+        std::optional<std::string> secret;
+        if (peerId == this->config_.expectedPeerId && !peerNonce.empty())
+            secret = this->ticketManager_->openTicket(ticket, peerId);
+        // the MAC proves the connector actually holds the resumption secret, not just a copy of the ticket
+        if (!secret || peerMac != this->mac(*secret, this->join({"RESUME|", ticket, "|", peerNonce, "|", peerId})) || !this->ticketManager_->markRedeemed(ticket))
+        {
+            spdlog::warn("[{}] Session ticket rejected, falling back to full handshake", this->config_.name);
+            this->emit("RESUME_REJECTED");
+            this->peerId_ = peerId;
+            this->challengeOrScheduleParameters();
+            return;
+        }
+
+        std::string myNonce = CryptoUtils::randomHex(16);
+        std::string_view sessionKey = this->deriveResumedSessionKey(*secret, peerNonce, myNonce);
+        // tickets are single use, so hand out a replacement bound to the new session
+        this->emit({"RESUMED:", myNonce});
+        this->emit({"CONFIRM:", this->mac(sessionKey, this->join({"CONFIRM|LISTENER|", this->config_.name, "|", peerId}))});
+        this->emitTicketLine(peerId, this->mac(sessionKey, "RESUMPTION"));
+        this->peerId_ = peerId;
+        this->succeed(sessionKey, true);
+    }
+
+    /**
+     * Listener side of the one round trip handshake. The connector's key share is checked as in the full handshake,
+     *      then one step computes our key share and the shared secret and answers with everything the connector needs.
+     *      The group is known to be sound, so only the connector's public key is validated, not the group.
+     *
+     * If the group isn't the one we agreed on, or the cookie gate is asking for puzzles (we are under load, and this
+     *      flight would have us do the exponentiations before the connector has proven anything), the connector is told
+     *      with QUICK_REJECTED and we carry on as for HELLO.
+     */
+    void handleQuickRequest()
+    {
+        this->peerPartial_ = boost::multiprecision::cpp_int(this->field("PUB:"));
+        std::string peerMac = this->field("MAC:");
+        this->peerId_ = this->field("ID:");
+
+        const auto &preagreed = this->config_.preagreedGroup;
+        bool gated = this->config_.cookieGate && this->config_.cookieGate->currentDifficulty() > 0;
+        if (!preagreed || this->quickGroupId_ != this->scratchGroupId(*preagreed) || gated)
+        {
+            spdlog::warn("[{}] One round trip handshake rejected ({}), falling back to full handshake", this->config_.name,
+                         gated ? "under load" : "unknown group");
+            this->emit("QUICK_REJECTED");
+            this->challengeOrScheduleParameters();
+            return;
+        }
+
+        // check received data
+        if (peerMac.empty())
+            return this->fail("Missing MAC from peer");
+        if (this->peerId_.empty() || this->peerId_ != this->config_.expectedPeerId)
+            return this->fail("Unexpected peer identity '" + this->peerId_ + "'");
+        this->group_ = *preagreed;
+        if (peerMac != this->payloadMac(this->group_, this->peerPartial_, "QUICK_CONNECTOR", this->peerId_, this->config_.name))
+            return this->fail("MAC mismatch, aborting handshake");
+
+        this->work_ = [this]
+        {
+            if (!validatePeerKey(this->group_, this->peerPartial_))
+                return this->fail("Peer public key validation failed");
+
+            this->participant_->setGroup(this->group_);
+            this->participant_->generatePrivateKey(this->config_.primeBitLength);
+            auto myPublic = this->participant_->step1();
+            auto shared = this->participant_->step2(this->peerPartial_);
+            SPDLOG_DEBUG("[{}] Shared secret hash: {}", this->config_.name, LazyShortHash{shared});
+            this->logExponentWork();
+
+            // the connector's MAC already authenticated it, and it proves it holds the session key with its first record
+            std::string_view sharedText = this->decimal(shared);
+            this->emit({"ID:", this->config_.name});
+            this->emit({"PUB:", this->decimal(myPublic)});
+            this->emit({"MAC:", this->payloadMac(this->group_, myPublic, "QUICK_LISTENER", this->config_.name, this->peerId_)});
+            this->emit({"CONFIRM:", this->deriveConfirmTag(sharedText, "LISTENER", this->config_.name, this->peerId_)});
+            this->emitTicketLine(this->peerId_, this->deriveResumptionSecret(sharedText));
+            this->succeed(this->deriveSessionKey(sharedText), false);
+        };
+    }
+
+    /**
+     * Listener: everything up to here has been cheap. Before generating parameters for a full handshake, a listener with
+     *      a cookie gate sends the connector a cookie and waits for it to come back with the puzzle solved
+     */
+    void challengeOrScheduleParameters()
+    {
+        if (!this->config_.cookieGate)
+            return this->scheduleParameterFlight();
+        this->emit({"COOKIE:", this->config_.cookieGate->issue(this->peerAddress_)});
+        this->expect(3, State::AwaitCookieReply);
+    }
+
+    /**
+     * Listener: checks the returned cookie, the puzzle solution and the connector's identity, which together cost a few
+     *      hashes. Only then is the expensive parameter flight scheduled
+     */
+    void handleCookieReply()
+    {
+        std::string problem = checkCookieReply(this->config_, this->peerAddress_, this->peerId_, this->field("COOKIE:"),
+                                               this->field("SOLUTION:"), this->field("AUTH:"));
+        if (!problem.empty())
+            return this->fail(problem);
+        this->scheduleParameterFlight();
+    }
+
+    /**
+     * Connector: solves the listener's puzzle (CPU work, about 2^difficulty hashes) and returns the cookie with the
+     *      solution and a MAC proving we know the shared secret
+     */
+    void scheduleCookieReply(const std::string &cookie)
+    {
+        unsigned difficulty = CookieGate::difficultyOf(cookie);
+        if (difficulty > this->config_.maxPuzzleBits)
+            return this->fail("Listener asked for a " + std::to_string(difficulty) + " bit puzzle, more than we are willing to solve");
+        this->work_ = [this, cookie]
+        {
+            std::string solution = CookieGate::solve(cookie, this->config_.name);
+            this->emit({"COOKIE:", cookie});
+            this->emit({"SOLUTION:", solution});
+            this->emit({"AUTH:", this->mac(this->config_.authSecret, this->join({"HELLO|", this->config_.name, "|", this->config_.expectedPeerId, "|", cookie}))});
+            // expecting 6 lines: P, Q, G, PUB, MAC, ID
+            this->expect(6, State::AwaitListenerFlight);
+        };
+    }
+
+    /**
+     * Listener: generates the parameters (prime, generator, subgroup order, private key) and the partial key, and
+     *      sends them to the connector. Runs as CPU work.
+     */
+    void scheduleParameterFlight()
+    {
+        this->lines_.clear();
+        this->work_ = [this]
+        {
+            if (this->config_.group)
+            {
+                this->group_ = *this->config_.group;
+            }
+            else if (this->config_.parameterStore)
+            {
+                this->group_ = this->config_.parameterStore->next();
+            }
+            else if (this->config_.subgroupBitLength > 0)
+            {
+                this->group_ = KeyGenerator::getSubgroupParameters(this->config_.primeBitLength, this->config_.subgroupBitLength);
+            }
+            else
+            {
+                this->group_ = DHGroup{};
+                this->group_.prime = KeyGenerator::getPrimeNumber(this->config_.primeBitLength);
+                this->group_.generator = KeyGenerator::getLargeRandomInt(1, 10) % 2 == 0 ? 2 : 5;
+            }
+            this->participant_->setGroup(this->group_);
+            this->participant_->generatePrivateKey(this->config_.primeBitLength);
+
+            // perform step 1 to get the partial key
+            auto myPublic = this->participant_->step1();
+
+            // compute MAC, send data in expected format to connector
+            this->emit({"ID:", this->config_.name});
+            this->emit({"P:", this->decimal(this->group_.prime)});
+            this->emit({"Q:", this->decimal(this->group_.order)});
+            this->emit({"G:", this->decimal(this->group_.generator)});
+            this->emit({"PUB:", this->decimal(myPublic)});
+            this->emit({"MAC:", this->payloadMac(this->group_, myPublic, "LISTENER", this->config_.name, this->config_.expectedPeerId)});
+            // expecting 4 lines: PUB, MAC, ID, CONFIRM
+            this->expect(4, State::AwaitConnectorFlight);
+        };
+    }
+
+    // listener: the connector's partial key and confirmation. Identity and MAC are checked before any expensive work
+    void handleConnectorFlight()
+    {
+        this->peerPartial_ = boost::multiprecision::cpp_int(this->field("PUB:"));
+        std::string peerMac = this->field("MAC:");
+        this->peerId_ = this->field("ID:");
+        this->peerConfirm_ = this->field("CONFIRM:");
+
+        // check received data
+        if (peerMac.empty())
+            return this->fail("Missing MAC from peer");
+        if (this->peerId_.empty() || this->peerId_ != this->config_.expectedPeerId)
+            return this->fail("Unexpected peer identity '" + this->peerId_ + "'");
+        if (peerMac != this->payloadMac(this->group_, this->peerPartial_, "CONNECTOR", this->peerId_, this->config_.name))
+            return this->fail("MAC mismatch, aborting handshake");
+
+        this->work_ = [this]
+        {
+            if (!validateParameters(this->group_, this->peerPartial_))
+                return this->fail("Parameter validation failed");
+
+            // now perform step 2 to compute the complete shared secret, using the peer's partial key
+            auto shared = this->participant_->step2(this->peerPartial_);
+            SPDLOG_DEBUG("[{}] Shared secret hash: {}", this->config_.name, LazyShortHash{shared});
+            this->logExponentWork();
+
+            // confirm peer knows the shared secret
+            std::string_view sharedText = this->decimal(shared);
+            if (this->peerConfirm_.empty() || this->peerConfirm_ != this->deriveConfirmTag(sharedText, "CONNECTOR", this->peerId_, this->config_.name))
+                return this->fail("Confirmation tag mismatch");
+            // send our confirmation tag back to the connector, along with a ticket so it can skip the key exchange next time
+            this->emit({"CONFIRM:", this->deriveConfirmTag(sharedText, "LISTENER", this->config_.name, this->peerId_)});
+            this->emitTicketLine(this->peerId_, this->deriveResumptionSecret(sharedText));
+            this->succeed(this->deriveSessionKey(sharedText), false);
+        };
+    }
+
+    /**
+     * Connector: presents our ticket with a fresh nonce and a MAC proving we hold the resumption secret, opens the one
+     *      round trip handshake if we have a pre-agreed group, or opens a full handshake with HELLO
+     */
+    void start()
+    {
+        if (this->resumption_->usableFor(this->config_.expectedPeerId, nowSeconds()))
+        {
+            // tickets are single use, whatever happens next this one is spent
+            ResumptionState state = *this->resumption_;
+            *this->resumption_ = ResumptionState{};
+            this->resumeSecret_ = state.secret;
+            this->resumeNonce_ = CryptoUtils::randomHex(16);
+            this->emit({"RESUME:", state.ticket});
+            this->emit({"NONCE:", this->resumeNonce_});
+            this->emit({"ID:", this->config_.name});
+            this->emit({"MAC:", this->mac(state.secret, this->join({"RESUME|", state.ticket, "|", this->resumeNonce_, "|", this->config_.name}))});
+            this->expect(1, State::AwaitResumeReply);
+        }
+        else if (this->config_.preagreedGroup)
+        {
+            this->scheduleQuickFlight();
+        }
+        else
+        {
+            this->emit({"HELLO:", this->config_.name});
+            // expecting 6 lines: P, Q, G, PUB, MAC, ID
+            this->expect(6, State::AwaitListenerFlight);
+        }
+    }
+
+    /**
+     * Connector: our key share for the pre-agreed group goes in the opening flight, so it is computed up front as CPU
+     *      work. It doesn't depend on anything from the listener, so a driver can run it while the connection is still
+     *      being set up. Only the flag is set here, runWork() builds the flight from the machine it is called on
+     */
+    void scheduleQuickFlight()
+    {
+        this->quickFlightPending_ = true;
+    }
+
+    // connector: the work behind scheduleQuickFlight
+    void buildQuickFlight()
+    {
+        this->group_ = *this->config_.preagreedGroup;
+        this->participant_->setGroup(this->group_);
+        this->participant_->generatePrivateKey(this->config_.primeBitLength);
+        auto myPublic = this->participant_->step1();
+
+        this->emit({"QUICK:", this->scratchGroupId(this->group_)});
+        this->emit({"ID:", this->config_.name});
+        this->emit({"PUB:", this->decimal(myPublic)});
+        this->emit({"MAC:", this->payloadMac(this->group_, myPublic, "QUICK_CONNECTOR", this->config_.name, this->config_.expectedPeerId)});
+        // expecting 5 lines: ID, PUB, MAC, CONFIRM, TICKET
+        this->expect(5, State::AwaitQuickReply);
+    }
+
+    // connector: the listener's key share and confirmation for the pre-agreed group
+    void handleQuickReply()
+    {
+        this->peerPartial_ = boost::multiprecision::cpp_int(this->field("PUB:"));
+        std::string peerMac = this->field("MAC:");
+        this->peerId_ = this->field("ID:");
+        this->peerConfirm_ = this->field("CONFIRM:");
+
+        // check received data
+        if (peerMac.empty())
+            return this->fail("Missing MAC from listener");
+        if (this->peerId_.empty() || this->peerId_ != this->config_.expectedPeerId)
+            return this->fail("Unexpected listener identity '" + this->peerId_ + "'");
+        if (peerMac != this->payloadMac(this->group_, this->peerPartial_, "QUICK_LISTENER", this->peerId_, this->config_.name))
+            return this->fail("MAC mismatch, aborting handshake");
+
+        this->work_ = [this]
+        {
+            if (!validatePeerKey(this->group_, this->peerPartial_))
+                return this->fail("Peer public key validation failed");
+            auto shared = this->participant_->step2(this->peerPartial_);
+            SPDLOG_DEBUG("[{}] Shared secret hash: {}", this->config_.name, LazyShortHash{shared});
+            this->logExponentWork();
+
+            std::string_view sharedText = this->decimal(shared);
+            if (this->peerConfirm_.empty() || this->peerConfirm_ != this->deriveConfirmTag(sharedText, "LISTENER", this->peerId_, this->config_.name))
+                return this->fail("Confirmation tag mismatch");
+            this->storeTicket(this->lines_[4], this->peerId_, this->deriveResumptionSecret(sharedText));
+            this->succeed(this->deriveSessionKey(sharedText), false);
+        };
+    }
+
+    void handleResumeReply()
+    {
+        const std::string &reply = this->lines_.front();
+        if (reply == "RESUME_REJECTED")
+        {
+            // the listener carries straight on with the full handshake on this connection
+            spdlog::warn("[{}] Listener rejected our session ticket, running full handshake", this->config_.name);
+            this->expect(6, State::AwaitListenerFlight);
+            return;
+        }
+        if (reply.rfind("RESUMED:", 0) != 0)
+            return this->fail("Unexpected reply to resumption request");
+        this->sessionKey_ = this->deriveResumedSessionKey(this->resumeSecret_, this->resumeNonce_, std::string_view(reply).substr(8));
+        this->expect(2, State::AwaitResumeConfirm);
+    }
+
+    void handleResumeConfirm()
+    {
+        const auto &peerId = this->config_.expectedPeerId;
+        if (this->lines_[0] != this->join({"CONFIRM:", this->mac(this->sessionKey_, this->join({"CONFIRM|LISTENER|", peerId, "|", this->config_.name}))}))
+            return this->fail("Resumption confirmation tag mismatch");
+        this->storeTicket(this->lines_[1], peerId, this->mac(this->sessionKey_, "RESUMPTION"));
+        this->peerId_ = peerId;
+        this->succeed(this->sessionKey_, true);
+    }
+
+    // connector: the listener's parameters and partial key. Identity and MAC are checked before any expensive work
+    void handleListenerFlight()
+    {
+        this->group_ = DHGroup{};
+        this->group_.prime = boost::multiprecision::cpp_int(this->field("P:"));
+        std::string order = this->field("Q:");
+        this->group_.order = order.empty() ? 0 : boost::multiprecision::cpp_int(order);
+        this->group_.generator = boost::multiprecision::cpp_int(this->field("G:"));
+        this->peerPartial_ = boost::multiprecision::cpp_int(this->field("PUB:"));
+        std::string peerMac = this->field("MAC:");
+        this->peerId_ = this->field("ID:");
+
+        // check received data
+        if (peerMac.empty())
+            return this->fail("Missing MAC from listener");
+        if (this->peerId_.empty() || this->peerId_ != this->config_.expectedPeerId)
+            return this->fail("Unexpected listener identity '" + this->peerId_ + "'");
+        if (peerMac != this->payloadMac(this->group_, this->peerPartial_, "LISTENER", this->peerId_, this->config_.name))
+            return this->fail("MAC mismatch, aborting handshake");
+
+        this->work_ = [this]
+        {
+            boost::multiprecision::cpp_int myPublic, shared;
+            if (this->config_.parallelValidation)
+            {
+                if (!this->exchangeWhileValidating(myPublic, shared))
+                    return this->fail("Parameter validation failed");
+            }
+            else
+            {
+                if (!validateParameters(this->group_, this->peerPartial_))
+                    return this->fail("Parameter validation failed");
+
+                // if the listener sent a subgroup order, the private key is drawn from [1, q) instead of being full length
+                this->participant_->setGroup(this->group_);
+                this->participant_->generatePrivateKey(this->config_.primeBitLength);
+                myPublic = this->participant_->step1();
+
+                // compute shared secret using listener's partial key, before replying so the confirmation tag can go in the same flight
+                shared = this->participant_->step2(this->peerPartial_);
+            }
+            SPDLOG_DEBUG("[{}] Shared secret hash: {}", this->config_.name, LazyShortHash{shared});
+            this->logExponentWork();
+
+            // send MAC + partial key response to listener, and confirm the shared secret
+            std::string_view sharedText = this->decimal(shared);
+            this->emit({"ID:", this->config_.name});
+            this->emit({"PUB:", this->decimal(myPublic)});
+            this->emit({"MAC:", this->payloadMac(this->group_, myPublic, "CONNECTOR", this->config_.name, this->peerId_)});
+            this->emit({"CONFIRM:", this->deriveConfirmTag(sharedText, "CONNECTOR", this->config_.name, this->peerId_)});
+            this->sessionKey_ = this->deriveSessionKey(sharedText);
+            this->peerConfirm_ = this->deriveConfirmTag(sharedText, "LISTENER", this->peerId_, this->config_.name);
+            this->resumeSecret_ = this->deriveResumptionSecret(sharedText);
+            // expecting CONFIRM, then TICKET
+            this->expect(2, State::AwaitConfirm);
+        };
+    }
+
+    /**
+     * Connector: validates the listener's parameters on worker threads while step 1 runs on this one and step 2 on
+     *      another. Once the private key is drawn, neither exponentiation needs the other's result, and neither needs
+     *      validation's. The Miller-Rabin rounds on the prime are full length exponentiations that dwarf the rest, so
+     *      they are split over the spare cores. Nothing computed here is sent until the caller sees validation pass
+     * @param myPublic Set to our public key
+     * @param shared Set to the shared secret
+     * @returns False if the parameters failed validation
+     */
+    bool exchangeWhileValidating(boost::multiprecision::cpp_int &myPublic, boost::multiprecision::cpp_int &shared)
+    {
+        // the cheap checks first, so the exponentiations never run against a nonsensical group
+        if (!checkRanges(this->group_, this->peerPartial_))
+            return false;
+
+        unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+        unsigned chunks = std::min(primalityRounds, cores > 3 ? cores - 2 : 1u);
+        std::vector<std::future<bool>> checks;
+        for (unsigned i = 0; i < chunks; ++i)
+        {
+            unsigned rounds = primalityRounds / chunks + (i < primalityRounds % chunks ? 1 : 0);
+            checks.push_back(std::async(std::launch::async, [this, rounds]
+                                        { return boost::multiprecision::miller_rabin_test(this->group_.prime, rounds, KeyGenerator::engine()); }));
+        }
+        checks.push_back(std::async(std::launch::async, [this]
+                                    { return checkSubgroup(this->group_, this->peerPartial_); }));
+        auto passed = [&checks]
+        {
+            bool valid = true;
+            for (auto &check : checks)
+                valid = check.get() && valid;
+            return valid;
+        };
+
+        try
+        {
+            this->participant_->setGroup(this->group_);
+            this->participant_->generatePrivateKey(this->config_.primeBitLength);
+            auto secondStep = std::async(std::launch::async, [this]
+                                         { return this->participant_->step2(this->peerPartial_); });
+            myPublic = this->participant_->step1();
+            shared = secondStep.get();
+        }
+        catch (const std::exception &)
+        {
+            // bad parameters can make the exponentiations throw too, report them as what they are
+            if (!passed())
+                return false;
+            throw;
+        }
+        return passed();
+    }
+
+    void handleConfirm()
+    {
+        const std::string &confirm = this->lines_[0];
+        if (confirm.rfind("CONFIRM:", 0) != 0)
+            return this->fail("Missing confirmation from listener");
+        if (confirm.substr(8) != this->peerConfirm_)
+            return this->fail("Confirmation tag mismatch");
+        this->storeTicket(this->lines_[1], this->peerId_, this->resumeSecret_);
+        this->succeed(this->sessionKey_, false);
+    }
+
+    // issues a ticket for the connector, and emits it as the line TICKET:<lifetime seconds>:<ticket>
+    void emitTicketLine(const std::string &peerId, std::string_view resumptionSecret)
+    {
+        std::string ticket = this->ticketManager_->issueTicket(peerId, std::string(resumptionSecret));
+        this->emit({"TICKET:", std::to_string(this->ticketManager_->getTicketLifetime().count()), ":", ticket});
+    }
+
+    // stores a ticket received from the listener, expected in the format TICKET:<lifetime seconds>:<ticket>
+    void storeTicket(const std::string &line, const std::string &peerId, std::string_view resumptionSecret)
+    {
+        size_t split = line.find(':', 7);
+        if (line.rfind("TICKET:", 0) != 0 || split == std::string::npos)
+        {
+            spdlog::warn("[{}] Listener did not issue a session ticket", this->config_.name);
+            return;
+        }
+        this->resumption_->ticket = line.substr(split + 1);
+        this->resumption_->secret = resumptionSecret;
+        this->resumption_->peerId = peerId;
+        this->resumption_->expiresAt = nowSeconds() + std::stoll(line.substr(7, split - 7));
+    }
+
+    /**
+     * Logs how much exponentiation work this handshake did compared to using full length private keys.
+     * Square-and-multiply performs one modular squaring per exponent bit, and each handshake runs step 1 and step 2.
+     */
+    void logExponentWork()
+    {
+        size_t exponentBits = this->participant_->getPrivateKeyBits();
+        size_t orderBits = this->group_.hasKnownOrder() ? boost::multiprecision::msb(this->group_.order) + 1 : 0;
+        size_t primeBits = boost::multiprecision::msb(this->group_.prime) + 1;
+        // step 1 + step 2, plus the y^q subgroup check on the peer's key
+        size_t work = 2 * exponentBits + orderBits;
+        size_t fullLengthWork = 2 * (primeBits - 1);
+        double saved = 100.0 * (1.0 - static_cast<double>(work) / static_cast<double>(fullLengthWork));
+        spdlog::info("[{}] Exponentiation work: ~{} modular squarings ({} bit private key, {} bit subgroup check) vs ~{} for full length keys ({:.1f}% saved)",
+                     this->config_.name, work, exponentBits, orderBits, fullLengthWork, saved);
+    }
+
+public:
+    /**
+     * Creates the listener side of a handshake, which waits for the connector's opening line
+     * @param config Handshake settings
+     * @param participant Holds the key material, must outlive the machine
+     * @param ticketManager Issues and redeems session tickets, must outlive the machine
+     */
+    static HandshakeMachine listener(HandshakeConfig config, DHKEParticipant &participant, SessionTicketManager &ticketManager)
+    {
+        HandshakeMachine machine(std::move(config), participant, true);
+        machine.ticketManager_ = &ticketManager;
+        machine.expect(1, State::AwaitOpening);
+        return machine;
+    }
+
+    /**
+     * Creates the connector side of a handshake. Its opening flight (HELLO, or RESUME if the resumption state holds a
+     *      usable ticket) is ready in takeOutput() straight away. With a pre-agreed group the QUICK flight carries our
+     *      key share, so the machine starts in NeedWork instead
+     * @param config Handshake settings
+     * @param participant Holds the key material, must outlive the machine
+     * @param resumption The ticket to resume with, replaced by the ticket issued in this handshake; must outlive the machine
+     */
+    static HandshakeMachine connector(HandshakeConfig config, DHKEParticipant &participant, ResumptionState &resumption)
+    {
+        HandshakeMachine machine(std::move(config), participant, false);
+        machine.resumption_ = &resumption;
+        machine.start();
+        return machine;
+    }
+
+    // work scheduled from receive() or runWork() captures 'this', so a machine must not be moved once it is being
+    //      driven. The factories return machines with no captured work, so moving their result is fine
+    HandshakeMachine(HandshakeMachine &&) = default;
+    HandshakeMachine &operator=(HandshakeMachine &&) = default;
+
+    HandshakeStatus status() const
+    {
+        if (this->state_ == State::Failed)
+            return HandshakeStatus::Failed;
+        if (this->work_ || this->quickFlightPending_)
+            return HandshakeStatus::NeedWork;
+        if (this->state_ == State::Done)
+            return HandshakeStatus::Done;
+        return HandshakeStatus::NeedInput;
+    }
+
+    /**
+     * Feeds bytes received from the peer, in any split. Complete flights are handled straight away, unless they need CPU
+     *      work. A flight that grows past maxFlightBytes fails the handshake
+     * @param data The received bytes
+     * @param size The number of bytes
+     */
+    void receive(const char *data, size_t size)
+    {
+        this->scratch_->reset();
+        this->input_.append(data, size);
+        this->advance();
+    }
+
+    /**
+     * Runs the pending CPU-heavy step, then carries on with any input that is already buffered
+     */
+    void runWork()
+    {
+        if (this->quickFlightPending_)
+        {
+            this->quickFlightPending_ = false;
+            this->work_ = [this]
+            { this->buildQuickFlight(); };
+        }
+        if (!this->work_)
+            return;
+        this->scratch_->reset();
+        auto work = std::move(this->work_);
+        this->work_ = nullptr;
+        try
+        {
+            work();
+        }
+        catch (const std::exception &ex)
+        {
+            this->fail(std::string("Handshake step failed: ") + ex.what());
+        }
+        this->advance();
+    }
+
+    // true if there are bytes waiting to be sent
+    bool hasOutput() const
+    {
+        return !this->output_.empty();
+    }
+
+    // the bytes to send to the peer, in order. Ownership passes to the caller
+    std::string takeOutput()
+    {
+        std::string out;
+        out.swap(this->output_);
+        return out;
+    }
+
+    // once the handshake is done: any bytes received after the handshake's last line (the start of the session data)
+    std::string takeRemainingInput()
+    {
+        std::string rest = this->input_.substr(this->inputOffset_);
+        this->input_.clear();
+        this->inputOffset_ = 0;
+        this->scanOffset_ = 0;
+        return rest;
+    }
+
+    /**
+     * Listener: checks a connector's reply to a cookie, for a server that runs the cookie exchange itself before
+     *      admitting the connection (and then hands the machine a config without a cookie gate)
+     * @param config The listener's settings, with the cookie gate that issued the cookie
+     * @param peerAddress The connector's address, which the cookie is bound to
+     * @param peerId The identity from the connector's HELLO
+     * @param cookie, solution, auth The values of the connector's COOKIE, SOLUTION and AUTH lines
+     * @returns Why the reply is refused, or an empty string if it is good
+     */
+    static std::string checkCookieReply(const HandshakeConfig &config, const std::string &peerAddress, const std::string &peerId,
+                                        const std::string &cookie, const std::string &solution, const std::string &auth)
+    {
+        if (peerId.empty() || peerId != config.expectedPeerId)
+            return "Unexpected peer identity '" + peerId + "'";
+        if (auth.empty() || auth != CryptoUtils::computeMac(config.authSecret, "HELLO|" + peerId + "|" + config.name + "|" + cookie))
+            return "Connector authentication failed";
+        if (!config.cookieGate || !config.cookieGate->verify(cookie, peerAddress, solution, peerId))
+            return "Invalid or expired cookie, or wrong puzzle solution";
+        return {};
+    }
+
+    // listener only: the connector's address, which issued cookies are bound to. Set before feeding any input
+    void setPeerAddress(std::string address)
+    {
+        this->peerAddress_ = std::move(address);
+    }
+
+    bool isListener() const
+    {
+        return this->isListener_;
+    }
+
+    const std::string &getSessionKey() const
+    {
+        return this->sessionKey_;
+    }
+
+    // true if the session was resumed from a ticket, rather than a full key exchange
+    bool wasResumed() const
+    {
+        return this->resumed_;
+    }
+
+    const std::string &getPeerId() const
+    {
+        return this->peerId_;
+    }
+
+    const std::string &getError() const
+    {
+        return this->error_;
+    }
+
+    // how long the listener asked us to wait before retrying, or zero if it did not reply BUSY
+    std::chrono::milliseconds getRetryAfter() const
+    {
+        return this->retryAfter_;
+    }
+
+    // the protocol step the machine is at, for logging (e.g. which step a peer stalled in)
+    const char *getPhase() const
+    {
+        switch (this->state_)
+        {
+        case State::AwaitOpening:
+            return "opening";
+        case State::AwaitResumeRequest:
+            return "resume request";
+        case State::AwaitQuickRequest:
+            return "quick request";
+        case State::AwaitCookieReply:
+            return "cookie reply";
+        case State::AwaitConnectorFlight:
+            return "connector key exchange";
+        case State::AwaitResumeReply:
+            return "resume reply";
+        case State::AwaitResumeConfirm:
+            return "resume confirmation";
+        case State::AwaitQuickReply:
+            return "quick reply";
+        case State::AwaitListenerFlight:
+            return "listener key exchange";
+        case State::AwaitConfirm:
+            return "confirmation";
+        case State::Done:
+            return "done";
+        case State::Failed:
+            return "failed";
+        }
+        return "unknown";
+    }
+
+    /**
+     * Helper method to format the payload sent over the P2P communication
+     * @param group The public group parameters (prime, generator, subgroup order)
+     * @param publicKey The participant's public key
+     * @param role The participant's role in the exchange (LISTENER or CONNECTOR)
+     * @param senderId The sender's identity
+     * @param receiverId The receiver's identity
+     * @returns The formatted payload string
+     */
+    static std::string buildPayload(
+        const DHGroup &group,
+        const boost::multiprecision::cpp_int &publicKey,
+        const std::string &role,
+        const std::string &senderId,
+        const std::string &receiverId)
+    {
+        std::ostringstream oss;
+        oss << group.prime << "|" << group.order << "|" << group.generator << "|" << publicKey << "|" << role << "|" << senderId << "|" << receiverId;
+        return oss.str();
+    }
+
+    /**
+     * Helper method to identify a group in a QUICK opening, so both sides can tell they agreed on the same one
+     * @param group The group parameters
+     * @returns The group id as a hexadecimal string
+     */
+    static std::string groupId(const DHGroup &group)
+    {
+        std::ostringstream oss;
+        oss << group.prime << "|" << group.order << "|" << group.generator;
+        return CryptoUtils::computeMac("GROUP_ID", oss.str());
+    }
+
+    /**
+     * Validates the peer's public key for a group that is already known to be sound, i.e. the public key checks of
+     *      validateParameters without the (far more expensive) primality tests on the group itself
+     * @param group The public group parameters (prime, generator, subgroup order)
+     * @param peerPartial The peer's public key
+     * @returns True if the public key is valid, false otherwise
+     */
+    static bool validatePeerKey(const DHGroup &group, const boost::multiprecision::cpp_int &peerPartial)
+    {
+        if (peerPartial <= 1 || peerPartial >= (group.prime - 1))
+            return false;
+        // a public key outside the subgroup would leak bits of our private key (small subgroup attack)
+        if (group.hasKnownOrder() && boost::multiprecision::powm(peerPartial, group.order, group.prime) != 1)
+            return false;
+        return true;
+    }
+
+    /**
+     * Validates the DHKE parameters received from the peer. Checks the following conditions:
+     *
+     * - Prime number is > 3 and odd
+     *
+     * - Prime number passes Miller-Rabin primality test
+     *
+     * - Generator is > 1 and < prime
+     *
+     * - Peer public key is > 1 and < (prime - 1)
+     *
+     * If the subgroup order q is known, additionally checks:
+     *
+     * - q passes Miller-Rabin and divides (prime - 1)
+     *
+     * - Generator and peer public key are both in the order q subgroup, i.e. g^q = 1 and y^q = 1 (mod p)
+     *
+     * @param group The public group parameters (prime, generator, subgroup order)
+     * @param peerPartial The peer's public key
+     * @returns True if parameters are valid, false otherwise
+     */
+    static bool validateParameters(const DHGroup &group,
+                                   const boost::multiprecision::cpp_int &peerPartial)
+    {
+        return checkRanges(group, peerPartial) && boost::multiprecision::miller_rabin_test(group.prime, primalityRounds, KeyGenerator::engine()) &&
+               checkSubgroup(group, peerPartial);
+    }
+
+    // the cheap checks of validateParameters: the prime is > 3 and odd, and the generator and public key are in range
+    static bool checkRanges(const DHGroup &group, const boost::multiprecision::cpp_int &peerPartial)
+    {
+        const auto &prime = group.prime;
+        if (prime <= 3 || (prime & 1) == 0)
+            return false;
+        if (group.generator <= 1 || group.generator >= prime)
+            return false;
+        if (peerPartial <= 1 || peerPartial >= (prime - 1))
+            return false;
+        return true;
+    }
+
+    // the subgroup checks of validateParameters, true if the subgroup order is unknown
+    static bool checkSubgroup(const DHGroup &group, const boost::multiprecision::cpp_int &peerPartial)
+    {
+        if (!group.hasKnownOrder())
+            return true;
+        const auto &prime = group.prime;
+        if (!boost::multiprecision::miller_rabin_test(group.order, primalityRounds, KeyGenerator::engine()))
+            return false;
+        if ((prime - 1) % group.order != 0)
+            return false;
+        if (boost::multiprecision::powm(group.generator, group.order, prime) != 1)
+            return false;
+        // a public key outside the subgroup would leak bits of our private key (small subgroup attack)
+        if (boost::multiprecision::powm(peerPartial, group.order, prime) != 1)
+            return false;
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,725 @@
+#ifndef HANDSHAKE_SERVER_HPP
+#define HANDSHAKE_SERVER_HPP
+
+#include <array>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <utility>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <functional>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+#include "cookie.hpp"
+#include "handshake.hpp"
+#include "participant.hpp"
+#include "ticket.hpp"
+#include "transcript.hpp"
+#include "transport_stats.hpp"
+
+/**
+ * How long a peer may take over each part of the handshake. The clock only runs while we are waiting on the peer,
+ *      never while our own CPU work (prime generation, exponentiation) is in progress
+ */
+struct HandshakeDeadlines
+{
+    // from accepting the connection until the connector's opening line (HELLO, RESUME or QUICK) has arrived
+    std::chrono::milliseconds opening{5000};
+    // for each later flight from the connector, including its reply to the cookie before admission
+    std::chrono::milliseconds flight{10000};
+    // for the whole handshake, from admission until done
+    std::chrono::milliseconds total{30000};
+};
+
+/**
+ * Admission control: how many handshakes run at once, and how many accepted connections may wait for a slot
+ */
+struct AdmissionLimits
+{
+    // handshakes in progress at once, which also bounds how much prime generation and exponentiation runs in parallel
+    size_t maxInProgress = std::max(1u, std::thread::hardware_concurrency());
+    // accepted connections waiting for a handshake slot, anything beyond this is turned away straight away
+    size_t maxQueued = 64;
+    // longest a connection may wait in the queue before it is turned away
+    std::chrono::milliseconds maxQueueWait{2000};
+    // the delay suggested to connectors that are turned away
+    std::chrono::milliseconds retryAfter{500};
+};
+
+/**
+ * Counters kept by a HandshakeServer, safe to read from any thread
+ */
+struct HandshakeServerMetrics
+{
+    std::atomic<std::uint64_t> accepted{0};
+    std::atomic<std::uint64_t> completed{0};
+    std::atomic<std::uint64_t> failed{0};
+    std::atomic<std::uint64_t> timedOut{0};
+    // turned away with BUSY because the queue was full
+    std::atomic<std::uint64_t> shedQueueFull{0};
+    // turned away with BUSY after waiting maxQueueWait in the queue
+    std::atomic<std::uint64_t> shedQueueExpired{0};
+    // closed before admission: the opening or the cookie reply was late, malformed or failed verification
+    std::atomic<std::uint64_t> notAdmitted{0};
+    // time admitted connections spent in the queue, in microseconds
+    std::atomic<std::uint64_t> queueWaitTotalMicros{0};
+    std::atomic<std::uint64_t> queueWaitMaxMicros{0};
+    std::atomic<std::uint64_t> admitted{0};
+    // current values
+    std::atomic<std::uint64_t> inProgress{0};
+    std::atomic<std::uint64_t> queued{0};
+
+    std::uint64_t shed() const
+    {
+        return this->shedQueueFull + this->shedQueueExpired;
+    }
+
+    double averageQueueWaitMillis() const
+    {
+        return this->admitted == 0 ? 0.0 : static_cast<double>(this->queueWaitTotalMicros) / 1000.0 / static_cast<double>(this->admitted);
+    }
+
+    /**
+     * Adds another server's counters to these, for exporting the totals of servers that each keep their own
+     * @param other The counters to add, the longest queue wait is the larger of the two
+     */
+    void mergeFrom(const HandshakeServerMetrics &other)
+    {
+        this->accepted += other.accepted;
+        this->completed += other.completed;
+        this->failed += other.failed;
+        this->timedOut += other.timedOut;
+        this->shedQueueFull += other.shedQueueFull;
+        this->shedQueueExpired += other.shedQueueExpired;
+        this->notAdmitted += other.notAdmitted;
+        this->queueWaitTotalMicros += other.queueWaitTotalMicros;
+        this->queueWaitMaxMicros = std::max(this->queueWaitMaxMicros.load(), other.queueWaitMaxMicros.load());
+        this->admitted += other.admitted;
+        this->inProgress += other.inProgress;
+        this->queued += other.queued;
+    }
+
+    // logs the counters in one line
+    void log(const std::string &name) const
+    {
+        spdlog::info("[{}] Handshakes: accepted {}, completed {}, failed {}, timed out {}, shed {} (queue full {}, queue wait expired {}), "
+                     "not admitted {}, in progress {}, queued {}, queue wait avg {:.2f} ms max {:.2f} ms",
+                     name, this->accepted.load(), this->completed.load(), this->failed.load(), this->timedOut.load(), this->shed(),
+                     this->shedQueueFull.load(), this->shedQueueExpired.load(), this->notAdmitted.load(), this->inProgress.load(), this->queued.load(),
+                     this->averageQueueWaitMillis(), static_cast<double>(this->queueWaitMaxMicros.load()) / 1000.0);
+    }
+};
+
+/**
+ * Result of one admitted connection, handed to the outcome handler
+ */
+struct HandshakeOutcome
+{
+    bool ok = false;
+    bool timedOut = false;
+    bool resumed = false;
+    std::string peerId;
+    std::string sessionKey;
+    double handshakeMillis = 0.0;
+    // the connection, for the session that follows a successful handshake (no async operations are pending on it)
+    std::shared_ptr<asio::ip::tcp::socket> socket;
+    // bytes that arrived after the handshake's last line
+    std::string leftover;
+    // the connection's id in the server's transcript, zero if not capturing
+    std::uint64_t transcriptConnection = 0;
+};
+
+/**
+ * The HandshakeServer accepts connections and runs listener handshakes asynchronously, driving a HandshakeMachine per
+ *      connection on a single I/O thread, with the CPU-heavy steps on a worker pool (or inline on the I/O thread, for
+ *      a server that is one shard of a ShardedHandshakeServer).
+ *
+ * - Deadlines: every wait on the peer runs against a steady_timer (see HandshakeDeadlines). A peer that connects and
+ *      stalls is disconnected instead of holding a slot forever.
+ *
+ * - Cookie gate: a connector opening with HELLO is answered with a cookie straight from the accept path, holding no
+ *      slot, and is only admitted once it has returned the cookie, solved the puzzle and authenticated its identity
+ *      (see CookieGate). The puzzle gets harder as the slots and queue fill up. RESUME and QUICK openings are admitted
+ *      as they arrive, their machine falls back to its own cookie if the ticket or group is refused.
+ *
+ * - Admission control: at most maxInProgress handshakes run at once. Further connections wait in a bounded queue, and
+ *      once that is full (or a connection has waited too long) the connector is sent "BUSY:<retry after ms>" and the
+ *      connection is closed, before any handshake work has been done for it. A connection that arrives to a full
+ *      queue is turned away before anything has been read from it.
+ *
+ * The io_context is owned by the caller, who must run it on one thread and keep the server alive until it has stopped.
+ */
+class HandshakeServer
+{
+public:
+    using OutcomeHandler = std::function<void(HandshakeOutcome)>;
+
+private:
+    struct Connection
+    {
+        explicit Connection(asio::io_context &io, const std::string &name)
+            : socket(std::make_shared<asio::ip::tcp::socket>(io)), timer(io), keys(name)
+        {
+        }
+
+        std::shared_ptr<asio::ip::tcp::socket> socket;
+        asio::steady_timer timer;
+        DHKEParticipant keys;
+        std::optional<HandshakeMachine> machine;
+        std::array<char, 16 * 1024> readBuffer;
+        std::string writeBuffer;
+        // what the connector sent before admission, fed to the machine once it is admitted
+        std::string preamble;
+        // the exchange before admission in order (true for what we sent), kept only while capturing a transcript
+        std::vector<std::pair<bool, std::string>> preambleExchange;
+        std::string peerAddress;
+        // the cookie reply was checked before admission, so the machine runs without a cookie gate of its own
+        bool cookieVerified = false;
+        std::chrono::steady_clock::time_point acceptedAt;
+        // when the connection was ready for a slot: accepted, and past the cookie exchange if it had one
+        std::chrono::steady_clock::time_point readyAt;
+        std::chrono::steady_clock::time_point admittedAt;
+        bool openingReceived = false;
+        bool queued = false;
+        bool finished = false;
+        // set while runWork() is queued or running, the machine belongs to the worker until the post-back clears it
+        bool workInFlight = false;
+        // bumped whenever the deadline is re-armed or set aside for work, a deadline handler from an older generation
+        //      may already have been queued with success when the timer was cancelled, and must not fire
+        std::uint64_t deadlineGeneration = 0;
+        std::uint64_t transcriptConnection = 0;
+    };
+
+    // most a connector may send before admission: its opening line, then its three line reply to the cookie
+    static constexpr size_t maxPreambleBytes = 4096;
+
+    asio::io_context &io_;
+    asio::ip::tcp::acceptor acceptor_;
+    HandshakeConfig config_;
+    SessionTicketManager &ticketManager_;
+    AdmissionLimits limits_;
+    HandshakeDeadlines deadlines_;
+    CookieGate cookieGate_;
+    // null when the CPU work runs inline on the I/O thread
+    std::unique_ptr<asio::thread_pool> workers_;
+    std::deque<std::shared_ptr<Connection>> queue_;
+    size_t inProgress_ = 0;
+    HandshakeServerMetrics metrics_;
+    OutcomeHandler onOutcome_;
+    TranscriptWriter *transcript_ = nullptr;
+
+    // the puzzle difficulty follows how much of the capacity (slots plus queue) is in use
+    void updateLoad()
+    {
+        double capacity = static_cast<double>(this->limits_.maxInProgress + this->limits_.maxQueued);
+        this->cookieGate_.setLoad(static_cast<double>(this->inProgress_ + this->queue_.size()) / capacity);
+    }
+
+    void accept()
+    {
+        auto connection = std::make_shared<Connection>(this->io_, this->config_.name);
+        this->acceptor_.async_accept(*connection->socket, [this, connection](const asio::error_code &ec)
+                                     {
+            if (ec)
+                return;
+            this->metrics_.accepted++;
+            connection->acceptedAt = std::chrono::steady_clock::now();
+            this->onAccepted(connection);
+            this->accept(); });
+    }
+
+    void onAccepted(const std::shared_ptr<Connection> &connection)
+    {
+        // with every slot taken and the queue full, there is no point reading anything
+        if (this->inProgress_ >= this->limits_.maxInProgress && this->queue_.size() >= this->limits_.maxQueued)
+        {
+            this->metrics_.shedQueueFull++;
+            this->shed(connection);
+            return;
+        }
+        asio::error_code ec;
+        auto remote = connection->socket->remote_endpoint(ec);
+        connection->peerAddress = ec ? std::string() : remote.address().to_string();
+        this->armPreambleDeadline(connection, this->deadlines_.opening);
+        this->readPreamble(connection, 1, [this, connection]
+                           { this->onOpening(connection); });
+    }
+
+    // before admission: the time left for the connector's next lines, after which the connection is turned away
+    void armPreambleDeadline(const std::shared_ptr<Connection> &connection, std::chrono::milliseconds deadline)
+    {
+        connection->timer.expires_after(deadline);
+        std::uint64_t generation = ++connection->deadlineGeneration;
+        connection->timer.async_wait([this, connection, generation](const asio::error_code &ec)
+                                     {
+            if (ec || connection->finished || generation != connection->deadlineGeneration)
+                return;
+            this->turnAway(connection, "Timed out before admission"); });
+    }
+
+    /**
+     * Before admission: reads until the preamble holds the given number of complete lines, then calls next
+     * @param connection The connection, holding no slot
+     * @param lines Complete lines wanted in the preamble, counting those already checked
+     * @param next Called once they have arrived, with the deadline stood down
+     */
+    void readPreamble(const std::shared_ptr<Connection> &connection, size_t lines, std::function<void()> next)
+    {
+        if (static_cast<size_t>(std::count(connection->preamble.begin(), connection->preamble.end(), '\n')) >= lines)
+        {
+            connection->timer.cancel();
+            connection->deadlineGeneration++;
+            next();
+            return;
+        }
+        if (connection->preamble.size() >= maxPreambleBytes)
+            return this->turnAway(connection, "Oversized opening");
+        connection->socket->async_read_some(asio::buffer(connection->readBuffer), [this, connection, lines, next = std::move(next)](const asio::error_code &ec, size_t n) mutable
+                                            {
+            if (connection->finished)
+                return;
+            if (ec)
+                return this->turnAway(connection, "Connection lost before admission: " + ec.message());
+            TransportStats::reads++;
+            TransportStats::bytesRead += n;
+            connection->preamble.append(connection->readBuffer.data(), n);
+            if (this->transcript_)
+                connection->preambleExchange.emplace_back(false, std::string(connection->readBuffer.data(), n));
+            this->readPreamble(connection, lines, std::move(next)); });
+    }
+
+    /**
+     * A HELLO is answered with a cookie from here, before the connection takes a slot or a place in the queue.
+     *      Anything else is the machine's to judge, so the connection goes on to admission as it is
+     */
+    void onOpening(const std::shared_ptr<Connection> &connection)
+    {
+        if (connection->preamble.rfind("HELLO:", 0) != 0)
+            return this->admitOrQueue(connection);
+        connection->writeBuffer = "COOKIE:" + this->cookieGate_.issue(connection->peerAddress) + "\n";
+        if (this->transcript_)
+            connection->preambleExchange.emplace_back(true, connection->writeBuffer);
+        asio::async_write(*connection->socket, asio::buffer(connection->writeBuffer), [this, connection](const asio::error_code &ec, size_t written)
+                          {
+            if (connection->finished)
+                return;
+            if (ec)
+                return this->turnAway(connection, "Connection lost before admission: " + ec.message());
+            TransportStats::writes++;
+            TransportStats::bytesWritten += written;
+            // the HELLO line, then COOKIE, SOLUTION and AUTH
+            this->armPreambleDeadline(connection, this->deadlines_.flight);
+            this->readPreamble(connection, 4, [this, connection]
+                               { this->onCookieReply(connection); }); });
+    }
+
+    // checks the cookie, the puzzle solution and the connector's identity. Only a connection that passes is admitted
+    void onCookieReply(const std::shared_ptr<Connection> &connection)
+    {
+        const std::string &preamble = connection->preamble;
+        size_t helloEnd = preamble.find('\n');
+        std::string hello = preamble.substr(0, helloEnd + 1);
+        std::string peerId = hello.substr(6, hello.size() - 7);
+        std::string cookie, solution, auth;
+        size_t start = helloEnd + 1;
+        for (int i = 0; i < 3; i++)
+        {
+            size_t end = preamble.find('\n', start);
+            std::string_view line(preamble.data() + start, end - start);
+            for (auto [prefix, value] : {std::pair{std::string_view("COOKIE:"), &cookie}, std::pair{std::string_view("SOLUTION:"), &solution},
+                                         std::pair{std::string_view("AUTH:"), &auth}})
+            {
+                if (line.substr(0, prefix.size()) == prefix)
+                    value->assign(line.substr(prefix.size()));
+            }
+            start = end + 1;
+        }
+
+        std::string problem = HandshakeMachine::checkCookieReply(this->config_, connection->peerAddress, peerId, cookie, solution, auth);
+        if (!problem.empty())
+            return this->turnAway(connection, problem);
+        // the machine picks up from the HELLO, and goes straight to the parameter flight
+        connection->cookieVerified = true;
+        connection->preamble = hello + preamble.substr(start);
+        this->admitOrQueue(connection);
+    }
+
+    // closes a connection before admission, it holds no slot and nothing else is waiting on it
+    void turnAway(const std::shared_ptr<Connection> &connection, const std::string &reason)
+    {
+        if (connection->finished)
+            return;
+        connection->finished = true;
+        connection->timer.cancel();
+        this->metrics_.notAdmitted++;
+        spdlog::warn("[{}] Connection from {} not admitted: {}", this->config_.name, connection->peerAddress, reason);
+        asio::error_code ignored;
+        connection->socket->close(ignored);
+    }
+
+    void admitOrQueue(const std::shared_ptr<Connection> &connection)
+    {
+        connection->readyAt = std::chrono::steady_clock::now();
+        if (this->inProgress_ < this->limits_.maxInProgress)
+        {
+            this->admit(connection);
+            return;
+        }
+        if (this->queue_.size() >= this->limits_.maxQueued)
+        {
+            this->metrics_.shedQueueFull++;
+            this->shed(connection);
+            return;
+        }
+
+        // wait for a slot, but not forever
+        connection->queued = true;
+        this->queue_.push_back(connection);
+        this->metrics_.queued = this->queue_.size();
+        this->updateLoad();
+        connection->timer.expires_after(this->limits_.maxQueueWait);
+        connection->timer.async_wait([this, connection](const asio::error_code &ec)
+                                     {
+            if (ec || !connection->queued)
+                return;
+            connection->queued = false;
+            this->queue_.erase(std::find(this->queue_.begin(), this->queue_.end(), connection));
+            this->metrics_.queued = this->queue_.size();
+            this->updateLoad();
+            this->metrics_.shedQueueExpired++;
+            this->shed(connection); });
+    }
+
+    /**
+     * Turns a connection away with BUSY. At most its opening (and cookie reply) has been read, and no handshake work
+     *      has been done for it.
+     *      Our side is shut down after the reply, and the socket closed once the connector has read it and hung up,
+     *      so the reply isn't lost to a reset
+     */
+    void shed(const std::shared_ptr<Connection> &connection)
+    {
+        connection->finished = true;
+        connection->writeBuffer = "BUSY:" + std::to_string(this->limits_.retryAfter.count()) + "\n";
+        asio::async_write(*connection->socket, asio::buffer(connection->writeBuffer), [this, connection](const asio::error_code &ec, size_t)
+                          {
+            asio::error_code ignored;
+            if (ec)
+            {
+                connection->socket->close(ignored);
+                return;
+            }
+            connection->socket->shutdown(asio::ip::tcp::socket::shutdown_send, ignored);
+            // give the connector a moment to read the reply and close, then close regardless
+            connection->timer.expires_after(std::chrono::seconds(1));
+            connection->timer.async_wait([connection](const asio::error_code &)
+                                         {
+                asio::error_code ignored;
+                connection->socket->close(ignored); });
+            this->drainUntilClosed(connection); });
+    }
+
+    void drainUntilClosed(const std::shared_ptr<Connection> &connection)
+    {
+        connection->socket->async_read_some(asio::buffer(connection->readBuffer), [this, connection](const asio::error_code &ec, size_t)
+                                            {
+            if (!ec)
+                return this->drainUntilClosed(connection);
+            asio::error_code ignored;
+            connection->timer.cancel();
+            connection->socket->close(ignored); });
+    }
+
+    void admit(const std::shared_ptr<Connection> &connection)
+    {
+        this->inProgress_++;
+        this->metrics_.inProgress = this->inProgress_;
+        this->metrics_.admitted++;
+        this->updateLoad();
+        connection->admittedAt = std::chrono::steady_clock::now();
+        auto waited = static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(connection->admittedAt - connection->readyAt).count());
+        this->metrics_.queueWaitTotalMicros += waited;
+        std::uint64_t previousMax = this->metrics_.queueWaitMaxMicros;
+        while (waited > previousMax && !this->metrics_.queueWaitMaxMicros.compare_exchange_weak(previousMax, waited))
+            ;
+
+        HandshakeConfig config = this->config_;
+        if (connection->cookieVerified)
+            config.cookieGate = nullptr;
+        connection->machine.emplace(HandshakeMachine::listener(std::move(config), connection->keys, this->ticketManager_));
+        connection->machine->setPeerAddress(connection->peerAddress);
+        if (this->transcript_)
+        {
+            connection->transcriptConnection = this->transcript_->begin(true, this->config_.name, this->config_.expectedPeerId, this->config_.preagreedGroup);
+            for (const auto &[sent, bytes] : connection->preambleExchange)
+            {
+                if (sent)
+                    this->transcript_->sent(connection->transcriptConnection, bytes);
+                else
+                    this->transcript_->received(connection->transcriptConnection, bytes);
+            }
+            connection->preambleExchange.clear();
+        }
+        // the opening line has already arrived, so the next wait on the connector is for a later flight
+        connection->openingReceived = true;
+        connection->machine->receive(connection->preamble.data(), connection->preamble.size());
+        connection->preamble.clear();
+        this->process(connection);
+    }
+
+    // lets the next queued connections in, as slots free up
+    void admitQueued()
+    {
+        while (this->inProgress_ < this->limits_.maxInProgress && !this->queue_.empty())
+        {
+            auto next = this->queue_.front();
+            this->queue_.pop_front();
+            this->metrics_.queued = this->queue_.size();
+            next->queued = false;
+            next->timer.cancel();
+            this->admit(next);
+        }
+    }
+
+    /**
+     * Does whatever the connection's machine needs next: work on the pool, output to the socket, or input with a deadline
+     */
+    void process(const std::shared_ptr<Connection> &connection)
+    {
+        if (connection->finished)
+            return;
+        HandshakeMachine &machine = *connection->machine;
+        HandshakeStatus status = machine.status();
+
+        if (status == HandshakeStatus::NeedWork)
+        {
+            // our own CPU time doesn't count against the peer's deadline. cancel() can't recall a handler that already
+            //      expired and is queued, so the generation and the in-flight flag make that handler stand down
+            connection->timer.cancel();
+            connection->deadlineGeneration++;
+            connection->workInFlight = true;
+            if (!this->workers_)
+            {
+                // posted rather than run here, so the connections already waiting on this thread get a turn first
+                asio::post(this->io_, [this, connection]
+                           {
+                    connection->machine->runWork();
+                    connection->workInFlight = false;
+                    this->process(connection); });
+                return;
+            }
+            asio::post(*this->workers_, [this, connection]
+                       {
+                connection->machine->runWork();
+                asio::post(this->io_, [this, connection]
+                           {
+                    connection->workInFlight = false;
+                    this->process(connection); }); });
+            return;
+        }
+        if (machine.hasOutput())
+        {
+            connection->writeBuffer = machine.takeOutput();
+            if (this->transcript_)
+                this->transcript_->sent(connection->transcriptConnection, connection->writeBuffer);
+            asio::async_write(*connection->socket, asio::buffer(connection->writeBuffer), [this, connection](const asio::error_code &ec, size_t written)
+                              {
+                if (ec)
+                    return this->finish(connection, false, false);
+                TransportStats::writes++;
+                TransportStats::bytesWritten += written;
+                this->process(connection); });
+            return;
+        }
+        if (status == HandshakeStatus::Done || status == HandshakeStatus::Failed)
+        {
+            this->finish(connection, status == HandshakeStatus::Done, false);
+            return;
+        }
+
+        this->armDeadline(connection);
+        connection->socket->async_read_some(asio::buffer(connection->readBuffer), [this, connection](const asio::error_code &ec, size_t n)
+                                            {
+            if (connection->finished)
+                return;
+            if (ec)
+            {
+                spdlog::warn("[{}] Connection lost during {}: {}", this->config_.name, connection->machine->getPhase(), ec.message());
+                return this->finish(connection, false, false);
+            }
+            TransportStats::reads++;
+            TransportStats::bytesRead += n;
+            connection->openingReceived = true;
+            if (this->transcript_)
+                this->transcript_->received(connection->transcriptConnection, std::string_view(connection->readBuffer.data(), n));
+            connection->machine->receive(connection->readBuffer.data(), n);
+            this->process(connection); });
+    }
+
+    // (re)starts the deadline for the current wait on the peer: the phase deadline, capped by the total deadline
+    void armDeadline(const std::shared_ptr<Connection> &connection)
+    {
+        auto phase = connection->openingReceived ? this->deadlines_.flight : this->deadlines_.opening;
+        auto now = std::chrono::steady_clock::now();
+        auto deadline = std::min(now + phase, connection->admittedAt + this->deadlines_.total);
+        connection->timer.expires_at(deadline);
+        std::uint64_t generation = ++connection->deadlineGeneration;
+        connection->timer.async_wait([this, connection, generation](const asio::error_code &ec)
+                                     {
+            // a stale expiry, or one that raced with work being posted: the machine isn't ours to finish
+            if (ec || connection->finished || connection->workInFlight || generation != connection->deadlineGeneration)
+                return;
+            spdlog::warn("[{}] Handshake timed out waiting for the peer's {}", this->config_.name, connection->machine->getPhase());
+            this->finish(connection, false, true); });
+    }
+
+    void finish(const std::shared_ptr<Connection> &connection, bool ok, bool timedOut)
+    {
+        if (connection->finished)
+            return;
+        connection->finished = true;
+        connection->timer.cancel();
+        this->inProgress_--;
+        this->metrics_.inProgress = this->inProgress_;
+        this->updateLoad();
+        if (ok)
+            this->metrics_.completed++;
+        else if (timedOut)
+            this->metrics_.timedOut++;
+        else
+            this->metrics_.failed++;
+        if (this->transcript_)
+            this->transcript_->end(connection->transcriptConnection, ok);
+
+        HandshakeOutcome outcome;
+        outcome.ok = ok;
+        outcome.timedOut = timedOut;
+        outcome.handshakeMillis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - connection->admittedAt).count();
+        if (ok)
+        {
+            outcome.resumed = connection->machine->wasResumed();
+            outcome.peerId = connection->machine->getPeerId();
+            outcome.sessionKey = connection->machine->getSessionKey();
+            outcome.leftover = connection->machine->takeRemainingInput();
+            outcome.socket = connection->socket;
+            outcome.transcriptConnection = connection->transcriptConnection;
+            // nothing is pending on a finished handshake, so its keys and buffers can go now rather than with the connection
+            connection->machine.reset();
+            connection->keys.releaseHandshakeState();
+        }
+        else
+        {
+            asio::error_code ignored;
+            connection->socket->close(ignored);
+        }
+
+        this->admitQueued();
+        if (this->onOutcome_)
+            this->onOutcome_(std::move(outcome));
+    }
+
+public:
+    /**
+     * @param io The io_context to run on, the caller runs it (on a single thread)
+     * @param config Settings for every handshake, as the listener
+     * @param ticketManager Issues and redeems session tickets
+     * @param limits Admission control limits
+     * @param deadlines Per-phase deadlines
+     * @param puzzle Puzzle difficulty range for the cookie gate, from idle to fully loaded
+     * @param inlineWork If true, the CPU-heavy steps run on the I/O thread itself instead of a worker pool
+     */
+    HandshakeServer(asio::io_context &io, HandshakeConfig config, SessionTicketManager &ticketManager,
+                    AdmissionLimits limits = AdmissionLimits(), HandshakeDeadlines deadlines = HandshakeDeadlines(),
+                    PuzzleDifficulty puzzle = PuzzleDifficulty(), bool inlineWork = false)
+        : io_(io),
+          acceptor_(io),
+          config_(std::move(config)),
+          ticketManager_(ticketManager),
+          limits_(limits),
+          deadlines_(deadlines),
+          cookieGate_(puzzle)
+    {
+        this->config_.cookieGate = &this->cookieGate_;
+        if (!inlineWork)
+            this->workers_ = std::make_unique<asio::thread_pool>(std::max<size_t>(1, std::min<size_t>(limits.maxInProgress, std::max(1u, std::thread::hardware_concurrency()))));
+    }
+
+    ~HandshakeServer()
+    {
+        if (this->workers_)
+            this->workers_->join();
+    }
+
+    HandshakeServer(const HandshakeServer &) = delete;
+    HandshakeServer &operator=(const HandshakeServer &) = delete;
+
+    // called on the I/O thread for every admitted connection, once its handshake has succeeded, failed or timed out
+    void setOutcomeHandler(OutcomeHandler handler)
+    {
+        this->onOutcome_ = std::move(handler);
+    }
+
+    // captures every admitted connection's handshake into the transcript, which must outlive the server
+    void setTranscript(TranscriptWriter *transcript)
+    {
+        this->transcript_ = transcript;
+    }
+
+    const HandshakeServerMetrics &getMetrics() const
+    {
+        return this->metrics_;
+    }
+
+    /**
+     * Starts listening and accepting connections
+     * @param port The port to listen on, 0 for any free port (see getPort)
+     * @param reusePort If true, sets SO_REUSEPORT so other servers can bind the same port, and the kernel spreads
+     *      incoming connections over all of them
+     * @throws std::runtime_error If reusePort is asked for on a platform without SO_REUSEPORT
+     */
+    void start(int port, bool reusePort = false)
+    {
+        asio::ip::tcp::endpoint endpoint(asio::ip::tcp::v4(), static_cast<unsigned short>(port));
+        this->acceptor_.open(endpoint.protocol());
+        this->acceptor_.set_option(asio::ip::tcp::acceptor::reuse_address(true));
+        if (reusePort)
+        {
+#if defined(SO_REUSEPORT)
+            this->acceptor_.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#else
+            throw std::runtime_error("SO_REUSEPORT is not supported on this platform");
+#endif
+        }
+        this->acceptor_.bind(endpoint);
+        this->acceptor_.listen();
+        this->accept();
+    }
+
+    // the port being listened on, once started
+    int getPort() const
+    {
+        return this->acceptor_.local_endpoint().port();
+    }
+
+    // stops accepting, handshakes in progress carry on
+    void stop()
+    {
+        asio::post(this->io_, [this]
+                   {
+            asio::error_code ignored;
+            this->acceptor_.close(ignored); });
+    }
+
+    // logs the metrics in one line
+    void logMetrics() const
+    {
+        this->metrics_.log(this->config_.name);
+    }
+};
+
+#endif
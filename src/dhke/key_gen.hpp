@@ -12,12 +12,33 @@
 // boost also has an implementation of the miller-rabin primality test - I use this library as to not detract from the main focus of this assignment
 #include <boost/multiprecision/miller_rabin.hpp>
 #include <spdlog/spdlog.h>
+#include "group.hpp"
+#include "logging.hpp"
 
 /**
  * Handles functionality related to obtaining values related to key generation for the DHKE
  */
 class KeyGenerator
 {
+public:
+    /**
+     * The random engine for the calling thread, seeded once from the random device. Each thread (and so each shard of a
+     *      sharded listener) draws from its own state, instead of opening the random device on every call or sharing one
+     *      engine behind a lock. Pass it to miller_rabin_test too, whose default generator is one static shared by all threads.
+     *
+     * @returns std::mt19937_64& This thread's engine
+     */
+    static std::mt19937_64 &engine()
+    {
+        thread_local std::mt19937_64 generator = []
+        {
+            std::random_device rd;
+            std::seed_seq seed{rd(), rd(), rd(), rd(), rd(), rd(), rd(), rd()};
+            return std::mt19937_64(seed);
+        }();
+        return generator;
+    }
+
 private:
     /**
      * Get a random number of a set bit size, intended to be used for generating candidate prime numbers
@@ -30,9 +51,8 @@ private:
         if (bitLength == 0)
             throw std::invalid_argument("bitLength must be >= 1");
 
-        // set up random number generation
-        std::random_device rd;
-        std::mt19937_64 randIntGenerator(rd());
+        // set up random number generation, drawing from this thread's engine
+        std::mt19937_64 &randIntGenerator = engine();
         std::uniform_int_distribution<std::uint64_t> randDistribution(0, std::numeric_limits<std::uint64_t>::max());
 
         // C++ natively deals with int sizes less than 64 bit, so we break the random number generation up into
@@ -88,12 +108,12 @@ public:
      */
     static boost::multiprecision::cpp_int getPrimeNumber(size_t bitLength = 64)
     {
-        spdlog::info("Starting KeyGenerator getPrimeNumber...");
+        SPDLOG_DEBUG("Starting KeyGenerator getPrimeNumber...");
 
         boost::multiprecision::cpp_int candidateValue;
         int numbersTested = 0;
 
-        spdlog::info("Starting KeyGenerator getCandidateNumber loop...");
+        SPDLOG_DEBUG("Starting KeyGenerator getCandidateNumber loop...");
 
         while (true)
         {
@@ -102,10 +122,10 @@ public:
             numbersTested++;
             // from the Boost docs, 25 trials is recommended:
             //  https://www.boost.org/doc/libs/latest/libs/multiprecision/doc/html/boost_multiprecision/tut/primetest.html
-            if (boost::multiprecision::miller_rabin_test(candidateValue, 25))
+            if (boost::multiprecision::miller_rabin_test(candidateValue, 25, engine()))
                 break;
         }
-        spdlog::info("[SecretKeyGenerator::getPrimeNumber] Numbers tested: {} - Prime number generated: {}", numbersTested, candidateValue.str());
+        SPDLOG_DEBUG("[SecretKeyGenerator::getPrimeNumber] Numbers tested: {} - Prime number generated: {}", numbersTested, LazyBigInt{candidateValue});
         return candidateValue;
     }
 
@@ -124,11 +144,10 @@ public:
         if (lower > 2)
             throw std::invalid_argument("Argument 'lower' must be >= 2");
 
-        spdlog::info("Starting KeyGenerator getLargeRandomInt...");
+        SPDLOG_DEBUG("Starting KeyGenerator getLargeRandomInt...");
 
-        // set up random number generation
-        std::random_device rd;
-        std::mt19937_64 randIntGenerator(rd());
+        // set up random number generation, drawing from this thread's engine
+        std::mt19937_64 &randIntGenerator = engine();
         std::uniform_int_distribution<std::uint64_t> randDistribution(0, std::numeric_limits<std::uint64_t>::max());
 
         // determine random digit size target
@@ -163,9 +182,110 @@ public:
         // ensure value is odd
         generatedValue |= 1;
 
-        spdlog::info("[SecretKeyGenerator::getLargeRandomInt] Bounds: {} - {} >> Random int generated (first 10 digits): {}...", lower, upper, generatedValue.str().substr(0, 10));
+        SPDLOG_DEBUG("[SecretKeyGenerator::getLargeRandomInt] Bounds: {} - {} >> Random int generated (first 10 digits): {}...", lower, upper, LazyDigits{generatedValue, 10});
         return generatedValue;
     }
+
+    /**
+     * Generate a random integer drawn uniformly from the range [1, upper).
+     *
+     * Unlike getLargeRandomInt, the bit length is NOT picked at random first - we draw a value with the same bit length
+     * as 'upper' and reject anything out of range (rejection sampling), so every value in the range is equally likely.
+     *
+     * @param upper The exclusive upper bound, must be > 1 (e.g. the subgroup order q)
+     * @returns boost::multiprecision::cpp_int A random integer in [1, upper)
+     */
+    static boost::multiprecision::cpp_int getRandomBelow(const boost::multiprecision::cpp_int &upper)
+    {
+        if (upper <= 1)
+            throw std::invalid_argument("Argument 'upper' must be > 1");
+
+        std::mt19937_64 &randIntGenerator = engine();
+        std::uniform_int_distribution<std::uint64_t> randDistribution(0, std::numeric_limits<std::uint64_t>::max());
+
+        constexpr std::size_t bitsPerChunk = 64;
+        // msb() returns the index of the highest set bit, so the bit length is one more than that
+        std::size_t bitLength = boost::multiprecision::msb(upper) + 1;
+        std::size_t chunks = (bitLength + bitsPerChunk - 1) / bitsPerChunk;
+        boost::multiprecision::cpp_int mask = (boost::multiprecision::cpp_int(1) << bitLength) - 1;
+
+        // each draw lands in range with probability > 1/2, so this loop finishes quickly
+        while (true)
+        {
+            boost::multiprecision::cpp_int value = 0;
+            for (std::size_t i = 0; i < chunks; i++)
+            {
+                value <<= bitsPerChunk;
+                value |= randDistribution(randIntGenerator);
+            }
+            value &= mask;
+            if (value >= 1 && value < upper)
+                return value;
+        }
+    }
+
+    /**
+     * Generate a prime-order subgroup (a "Schnorr group"): a large prime p, a smaller prime q that divides p - 1,
+     * and a generator g of the subgroup of order q.
+     *
+     * Because every element of the subgroup satisfies x^q = 1 (mod p), private keys only need to be drawn from [1, q)
+     * instead of being as long as p. Exponentiation cost grows with the exponent's bit length, so a 160 bit q with a
+     * 512 bit p makes every powm a fraction of the cost of a full length one.
+     *
+     * The methodology:
+     *
+     * - 1. Generate the prime q of 'orderBitLength' bits
+     *
+     * - 2. Pick random even multipliers k until p = k*q + 1 is a prime of exactly 'primeBitLength' bits
+     *
+     * - 3. Map small values h into the subgroup via g = h^((p-1)/q) mod p, until g != 1
+     *
+     * @param primeBitLength The desired BIT length of the prime modulus p
+     * @param orderBitLength The desired BIT length of the subgroup order q, must be smaller than primeBitLength
+     * @returns DHGroup The generated group parameters (p, g, q)
+     */
+    static DHGroup getSubgroupParameters(size_t primeBitLength, size_t orderBitLength)
+    {
+        if (orderBitLength < 2 || orderBitLength >= primeBitLength)
+            throw std::invalid_argument("orderBitLength must be >= 2 and < primeBitLength");
+
+        SPDLOG_DEBUG("Starting KeyGenerator getSubgroupParameters...");
+
+        DHGroup group;
+        group.order = getPrimeNumber(orderBitLength);
+
+        int numbersTested = 0;
+        while (true)
+        {
+            // k must be even, so that p = k*q + 1 is odd (q is odd)
+            boost::multiprecision::cpp_int k = getCandidateNumber(primeBitLength - orderBitLength);
+            k &= ~boost::multiprecision::cpp_int(1);
+            boost::multiprecision::cpp_int candidateValue = k * group.order + 1;
+            numbersTested++;
+
+            // the product of an a-bit and b-bit number is either a+b-1 or a+b bits long, so discard the short ones
+            if (boost::multiprecision::msb(candidateValue) + 1 != primeBitLength)
+                continue;
+            if (boost::multiprecision::miller_rabin_test(candidateValue, 25, engine()))
+            {
+                group.prime = candidateValue;
+                break;
+            }
+        }
+
+        // any h^((p-1)/q) is either 1 or an element of order exactly q (because q is prime)
+        boost::multiprecision::cpp_int cofactor = (group.prime - 1) / group.order;
+        for (boost::multiprecision::cpp_int h = 2;; ++h)
+        {
+            group.generator = boost::multiprecision::powm(h, cofactor, group.prime);
+            if (group.generator != 1)
+                break;
+        }
+
+        spdlog::info("[SecretKeyGenerator::getSubgroupParameters] Numbers tested: {} - {} bit group with {} bit subgroup generated",
+                     numbersTested, primeBitLength, orderBitLength);
+        return group;
+    }
 };
 
 #endif
\ No newline at end of file
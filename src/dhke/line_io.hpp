@@ -0,0 +1,123 @@
+#ifndef LINE_IO_HPP
+#define LINE_IO_HPP
+
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <initializer_list>
+#include <asio.hpp>
+#include "transport_stats.hpp"
+
+/**
+ * Blocking socket helpers shared by the handshake and the post-handshake protocols: newline delimited text lines,
+ *      and exact-length binary reads/writes on the same connection. They work on any blocking asio-style stream: a TCP
+ *      or Unix domain socket, or a ShmStream.
+ */
+class LineIO
+{
+public:
+    /**
+     * Helper method for sending a line over ASIO network socket
+     * @param socket The connected socket or stream
+     * @param line The string to send
+     */
+    template <typename SyncStream>
+    static void sendLine(SyncStream &socket, const std::string &line)
+    {
+        sendFlight(socket, {line});
+    }
+
+    /**
+     * Helper method for sending several lines (one protocol "flight") over ASIO network socket in a single write.
+     *      The lines and their newlines are passed as a list of buffers, so they go out in one gather write (one syscall)
+     *      without being copied into one big string first.
+     * @param socket The connected socket or stream
+     * @param lines The strings to send, in order
+     */
+    template <typename SyncStream>
+    static void sendFlight(SyncStream &socket, std::initializer_list<std::string> lines)
+    {
+        static const char newline = '\n';
+        std::vector<asio::const_buffer> buffers;
+        buffers.reserve(lines.size() * 2);
+        size_t total = 0;
+        for (const auto &line : lines)
+        {
+            buffers.push_back(asio::buffer(line));
+            buffers.push_back(asio::buffer(&newline, 1));
+            total += line.size() + 1;
+        }
+        asio::write(socket, buffers);
+        TransportStats::writes++;
+        TransportStats::bytesWritten += total;
+    }
+
+    /**
+     * Helper method for reading a line from ASIO network socket, delimited by a newline character.
+     *      Reads in large chunks, so a whole flight from the peer usually arrives with a single read call and the
+     *      following lines are served straight from the buffer.
+     * @param socket The connected socket or stream
+     * @param buffer The ASIO stream buffer to read into -> where to store the data temporarily
+     * @returns The read line as a string
+     */
+    template <typename SyncStream>
+    static std::string readLine(SyncStream &socket, asio::streambuf &buffer)
+    {
+        constexpr size_t readChunk = 16 * 1024;
+        while (true)
+        {
+            // look for a complete line in what we already have
+            auto data = buffer.data();
+            auto begin = asio::buffers_begin(data);
+            auto end = asio::buffers_end(data);
+            auto newline = std::find(begin, end, '\n');
+            if (newline != end)
+            {
+                std::string line(begin, newline);
+                buffer.consume(line.size() + 1);
+                return line;
+            }
+            size_t n = socket.read_some(buffer.prepare(readChunk));
+            buffer.commit(n);
+            TransportStats::reads++;
+            TransportStats::bytesRead += n;
+        }
+    }
+
+    /**
+     * Helper method for reading exactly 'size' bytes of binary data from ASIO network socket. Anything already sitting
+     *      in the line buffer is used first, the rest is read straight into the destination without an extra copy.
+     * @param socket The connected socket or stream
+     * @param buffer The stream buffer used by readLine, which may hold data that arrived after the last line
+     * @param destination Where to store the data
+     * @param size The number of bytes to read
+     */
+    template <typename SyncStream>
+    static void readExact(SyncStream &socket, asio::streambuf &buffer, void *destination, size_t size)
+    {
+        size_t buffered = std::min(size, buffer.size());
+        asio::buffer_copy(asio::buffer(destination, buffered), buffer.data());
+        buffer.consume(buffered);
+        if (buffered < size)
+        {
+            asio::read(socket, asio::buffer(static_cast<char *>(destination) + buffered, size - buffered));
+            TransportStats::reads++;
+            TransportStats::bytesRead += size - buffered;
+        }
+    }
+
+    /**
+     * Helper method for writing several binary buffers over ASIO network socket in a single gather write
+     * @param socket The connected socket or stream
+     * @param buffers The buffers to send, in order
+     */
+    template <typename SyncStream>
+    static void writeBuffers(SyncStream &socket, const std::vector<asio::const_buffer> &buffers)
+    {
+        size_t total = asio::write(socket, buffers);
+        TransportStats::writes++;
+        TransportStats::bytesWritten += total;
+    }
+};
+
+#endif
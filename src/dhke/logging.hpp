@@ -0,0 +1,105 @@
+#ifndef LOGGING_HPP
+#define LOGGING_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <spdlog/spdlog.h>
+#include <spdlog/async.h>
+#include <spdlog/sinks/stdout_color_sinks.h>
+#include "crypto.hpp"
+
+/**
+ * Logging helpers for the DHKE code.
+ *
+ * - Big values are logged through LazyBigInt (LazyDigits for a prefix, LazyShortHash for a hash), which only convert
+ *      the number to decimal when the message is actually written. cpp_int::str() is quadratic in the number of digits,
+ *      so calling it for a message below the log level is wasted work on the handshake path.
+ *
+ * - Per-handshake detail (key material, intermediate values) is logged with SPDLOG_DEBUG. Building with
+ *      DHKE_STRIP_DEBUG_LOGS (see CMakeLists.txt) sets SPDLOG_ACTIVE_LEVEL to info, which removes those calls from the
+ *      binary entirely, arguments included.
+ *
+ * - Logging::initAsync() replaces the default logger with an asynchronous one, so the calling thread only formats the
+ *      message and enqueues it, and the console writes happen on a background thread.
+ */
+
+// wraps a big integer so it is only converted to decimal if the log message is written
+struct LazyBigInt
+{
+    const boost::multiprecision::cpp_int &value;
+};
+
+// as LazyBigInt, but only the first 'digits' decimal digits are written
+struct LazyDigits
+{
+    const boost::multiprecision::cpp_int &value;
+    size_t digits;
+};
+
+// as LazyBigInt, but writes CryptoUtils::shortHash of the value instead of the value itself
+struct LazyShortHash
+{
+    const boost::multiprecision::cpp_int &value;
+};
+
+template <>
+struct fmt::formatter<LazyBigInt> : fmt::formatter<std::string_view>
+{
+    template <typename FormatContext>
+    auto format(const LazyBigInt &lazy, FormatContext &ctx) const
+    {
+        return fmt::formatter<std::string_view>::format(lazy.value.str(), ctx);
+    }
+};
+
+template <>
+struct fmt::formatter<LazyDigits> : fmt::formatter<std::string_view>
+{
+    template <typename FormatContext>
+    auto format(const LazyDigits &lazy, FormatContext &ctx) const
+    {
+        std::string digits = lazy.value.str();
+        return fmt::formatter<std::string_view>::format(std::string_view(digits).substr(0, lazy.digits), ctx);
+    }
+};
+
+template <>
+struct fmt::formatter<LazyShortHash> : fmt::formatter<std::string_view>
+{
+    template <typename FormatContext>
+    auto format(const LazyShortHash &lazy, FormatContext &ctx) const
+    {
+        return fmt::formatter<std::string_view>::format(CryptoUtils::shortHash(lazy.value), ctx);
+    }
+};
+
+class Logging
+{
+public:
+    /**
+     * Makes the default logger asynchronous: a bounded queue drained by one background thread. When the queue is full
+     *      the oldest queued messages are dropped, so a burst of logging never blocks a handshake.
+     *      Warnings and errors are flushed straight away.
+     * @param queueSize The most messages that can be waiting to be written
+     */
+    static void initAsync(size_t queueSize = 8192)
+    {
+        spdlog::init_thread_pool(queueSize, 1);
+        // unnamed like the default logger it replaces, so the output format stays the same
+        auto logger = std::make_shared<spdlog::async_logger>("", std::make_shared<spdlog::sinks::stdout_color_sink_mt>(),
+                                                             spdlog::thread_pool(), spdlog::async_overflow_policy::overrun_oldest);
+        logger->set_level(spdlog::default_logger()->level());
+        logger->flush_on(spdlog::level::warn);
+        spdlog::set_default_logger(logger);
+    }
+
+    // writes out everything still queued and stops the background thread, call before exiting
+    static void shutdown()
+    {
+        spdlog::shutdown();
+    }
+};
+
+#endif
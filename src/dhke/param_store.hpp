@@ -0,0 +1,430 @@
+#ifndef PARAM_STORE_HPP
+#define PARAM_STORE_HPP
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <filesystem>
+#include <boost/multiprecision/cpp_int.hpp>
+#include <boost/multiprecision/miller_rabin.hpp>
+#include <spdlog/spdlog.h>
+#include "group.hpp"
+#include "key_gen.hpp"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+/**
+ * The ParameterStore serves pre-generated DH groups out of a memory-mapped parameter file, so the listener never has
+ *      to generate a prime while a connector waits. Parameter files are written offline by 'app gen-params'.
+ *
+ * File format (version 1, all integers little-endian, big integers big-endian and zero-padded to a fixed width):
+ *
+ * - 64 byte header: magic "DHKEPRMS", u32 version, u32 record size, u32 prime bits, u32 order bits, u32 prime bytes,
+ *      u32 order bytes, u64 record count, u64 checksum (FNV-1a over the header, with the checksum zeroed, and the records),
+ *      zero padding
+ *
+ * - count fixed-size records, each: prime (prime bytes), generator (prime bytes), order (order bytes), padded to 8 bytes
+ *
+ * Reading a group is a fixed-offset copy out of the mapping, no text is parsed. The file is checked once when it is
+ *      mapped. Replacing the file (write to a temporary, then rename over it, as gen-params does) is picked up by the
+ *      next lookup after the reload interval, and handshakes still using the old mapping keep it alive until they are done.
+ */
+class ParameterStore
+{
+private:
+    static constexpr char magic_[8] = {'D', 'H', 'K', 'E', 'P', 'R', 'M', 'S'};
+    static constexpr std::uint32_t version_ = 1;
+    static constexpr size_t headerSize_ = 64;
+
+    struct Layout
+    {
+        std::uint32_t recordSize = 0;
+        std::uint32_t primeBits = 0;
+        std::uint32_t orderBits = 0;
+        std::uint32_t primeBytes = 0;
+        std::uint32_t orderBytes = 0;
+        std::uint64_t count = 0;
+    };
+
+    // one mapped, checked parameter file
+    class Mapping
+    {
+    private:
+        const unsigned char *data_ = nullptr;
+        std::uint64_t size_ = 0;
+#if defined(_WIN32)
+        std::vector<unsigned char> contents_;
+#endif
+
+    public:
+        Layout layout;
+        // identifies the file on disk, to notice when it has been replaced
+        std::uint64_t inode = 0;
+        std::int64_t modified = 0;
+
+        explicit Mapping(const std::string &path)
+        {
+#if !defined(_WIN32)
+            int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                throw std::runtime_error("Unable to open " + path);
+            struct stat info;
+            if (::fstat(fd, &info) != 0)
+            {
+                ::close(fd);
+                throw std::runtime_error("Unable to stat " + path);
+            }
+            this->size_ = static_cast<std::uint64_t>(info.st_size);
+            this->inode = static_cast<std::uint64_t>(info.st_ino);
+            this->modified = static_cast<std::int64_t>(info.st_mtime);
+            if (this->size_ < headerSize_)
+            {
+                ::close(fd);
+                throw std::runtime_error("Not a parameter file");
+            }
+            void *mapped = ::mmap(nullptr, this->size_, PROT_READ, MAP_SHARED, fd, 0);
+            // the mapping stays valid after the descriptor is closed, and after the file is renamed over or deleted
+            ::close(fd);
+            if (mapped == MAP_FAILED)
+                throw std::runtime_error("Unable to map " + path);
+            // lookups jump around the file, and it is small, so fault it all in now rather than on the first handshakes
+            ::madvise(mapped, this->size_, MADV_WILLNEED);
+            this->data_ = static_cast<const unsigned char *>(mapped);
+#else
+            std::ifstream in(path, std::ios::binary);
+            if (!in)
+                throw std::runtime_error("Unable to open " + path);
+            this->contents_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            this->data_ = this->contents_.data();
+            this->size_ = this->contents_.size();
+#endif
+            try
+            {
+                this->layout = readHeader(this->data_, this->size_);
+            }
+            catch (...)
+            {
+                this->unmap();
+                throw;
+            }
+        }
+
+        ~Mapping()
+        {
+            this->unmap();
+        }
+
+        Mapping(const Mapping &) = delete;
+        Mapping &operator=(const Mapping &) = delete;
+
+        void unmap()
+        {
+#if !defined(_WIN32)
+            if (this->data_ != nullptr)
+                ::munmap(const_cast<unsigned char *>(this->data_), this->size_);
+#endif
+            this->data_ = nullptr;
+        }
+
+        // the group in the given record
+        DHGroup group(std::uint64_t index) const
+        {
+            const unsigned char *record = this->data_ + headerSize_ + index * this->layout.recordSize;
+            DHGroup group;
+            boost::multiprecision::import_bits(group.prime, record, record + this->layout.primeBytes);
+            record += this->layout.primeBytes;
+            boost::multiprecision::import_bits(group.generator, record, record + this->layout.primeBytes);
+            record += this->layout.primeBytes;
+            boost::multiprecision::import_bits(group.order, record, record + this->layout.orderBytes);
+            return group;
+        }
+    };
+
+    std::string path_;
+    std::chrono::milliseconds reloadInterval_;
+    mutable std::mutex mutex_;
+    std::shared_ptr<const Mapping> current_;
+    std::atomic<std::uint64_t> next_{0};
+    std::atomic<std::int64_t> lastCheck_{0};
+    // a replacement that failed its checks, so it is only reported once
+    std::uint64_t rejectedInode_ = 0;
+    std::int64_t rejectedModified_ = 0;
+
+    static void putLE(unsigned char *out, std::uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    static std::uint64_t getLE(const unsigned char *in, size_t bytes)
+    {
+        std::uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<std::uint64_t>(in[i]) << (8 * i);
+        return value;
+    }
+
+    // FNV-1a, continuing from 'hash'
+    static std::uint64_t fnv1a(const unsigned char *data, size_t size, std::uint64_t hash = 14695981039346656037ull)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash ^= data[i];
+            hash *= 1099511628211ull;
+        }
+        return hash;
+    }
+
+    static std::uint64_t checksum(const unsigned char *data, std::uint64_t size)
+    {
+        unsigned char header[headerSize_];
+        std::memcpy(header, data, headerSize_);
+        std::memset(header + 40, 0, 8);
+        return fnv1a(data + headerSize_, size - headerSize_, fnv1a(header, headerSize_));
+    }
+
+    // checks the header, sizes and checksum of a parameter file
+    static Layout readHeader(const unsigned char *data, std::uint64_t size)
+    {
+        if (size < headerSize_ || std::memcmp(data, magic_, sizeof(magic_)) != 0)
+            throw std::runtime_error("Not a parameter file");
+        if (getLE(data + 8, 4) != version_)
+            throw std::runtime_error("Unsupported parameter file version " + std::to_string(getLE(data + 8, 4)));
+        Layout layout;
+        layout.recordSize = static_cast<std::uint32_t>(getLE(data + 12, 4));
+        layout.primeBits = static_cast<std::uint32_t>(getLE(data + 16, 4));
+        layout.orderBits = static_cast<std::uint32_t>(getLE(data + 20, 4));
+        layout.primeBytes = static_cast<std::uint32_t>(getLE(data + 24, 4));
+        layout.orderBytes = static_cast<std::uint32_t>(getLE(data + 28, 4));
+        layout.count = getLE(data + 32, 8);
+        if (layout.count == 0 || layout.recordSize < 2 * layout.primeBytes + layout.orderBytes ||
+            size != headerSize_ + layout.count * layout.recordSize)
+            throw std::runtime_error("Parameter file is truncated or has an inconsistent layout");
+        if (getLE(data + 40, 8) != checksum(data, size))
+            throw std::runtime_error("Parameter file checksum mismatch");
+        return layout;
+    }
+
+    static std::int64_t nowMillis()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // remaps the file if it has been replaced since it was mapped. A replacement that fails its checks is ignored
+    void reloadIfReplaced()
+    {
+        std::int64_t now = nowMillis();
+        std::int64_t last = this->lastCheck_;
+        if (now - last < this->reloadInterval_.count() || !this->lastCheck_.compare_exchange_strong(last, now))
+            return;
+
+        std::shared_ptr<const Mapping> current = this->snapshot();
+#if !defined(_WIN32)
+        struct stat info;
+        if (::stat(this->path_.c_str(), &info) != 0)
+            return;
+        if (current && static_cast<std::uint64_t>(info.st_ino) == current->inode && static_cast<std::int64_t>(info.st_mtime) == current->modified)
+            return;
+        if (static_cast<std::uint64_t>(info.st_ino) == this->rejectedInode_ && static_cast<std::int64_t>(info.st_mtime) == this->rejectedModified_)
+            return;
+#else
+        if (current)
+            return;
+#endif
+        try
+        {
+            auto replacement = std::make_shared<const Mapping>(this->path_);
+            spdlog::info("[ParameterStore] Loaded {} groups ({} bit prime, {} bit order) from {}",
+                         replacement->layout.count, replacement->layout.primeBits, replacement->layout.orderBits, this->path_);
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            this->current_ = std::move(replacement);
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::warn("[ParameterStore] Keeping the current parameters, could not load {}: {}", this->path_, ex.what());
+#if !defined(_WIN32)
+            this->rejectedInode_ = static_cast<std::uint64_t>(info.st_ino);
+            this->rejectedModified_ = static_cast<std::int64_t>(info.st_mtime);
+#endif
+        }
+    }
+
+    std::shared_ptr<const Mapping> snapshot() const
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        return this->current_;
+    }
+
+public:
+    /**
+     * Maps a parameter file
+     * @param path The parameter file written by gen-params
+     * @param reloadInterval How often lookups check whether the file has been replaced
+     * @throws std::runtime_error If the file is missing or fails its checks
+     */
+    explicit ParameterStore(std::string path, std::chrono::milliseconds reloadInterval = std::chrono::milliseconds(1000))
+        : path_(std::move(path)), reloadInterval_(reloadInterval)
+    {
+        this->current_ = std::make_shared<const Mapping>(this->path_);
+        this->lastCheck_ = nowMillis();
+        spdlog::info("[ParameterStore] Mapped {} groups ({} bit prime, {} bit order) from {}",
+                     this->current_->layout.count, this->current_->layout.primeBits, this->current_->layout.orderBits, this->path_);
+    }
+
+    /**
+     * Hands out the stored groups in turn, so consecutive handshakes use different groups
+     * @returns The next group
+     */
+    DHGroup next()
+    {
+        this->reloadIfReplaced();
+        std::shared_ptr<const Mapping> mapping = this->snapshot();
+        return mapping->group(this->next_++ % mapping->layout.count);
+    }
+
+    // the first stored group, which peers sharing the file can use as their pre-agreed group
+    DHGroup first() const
+    {
+        return this->snapshot()->group(0);
+    }
+
+    // number of groups in the currently mapped file
+    std::uint64_t size() const
+    {
+        return this->snapshot()->layout.count;
+    }
+
+    size_t getPrimeBitLength() const
+    {
+        return this->snapshot()->layout.primeBits;
+    }
+
+    const std::string &getPath() const
+    {
+        return this->path_;
+    }
+
+    std::chrono::milliseconds getReloadInterval() const
+    {
+        return this->reloadInterval_;
+    }
+
+    /**
+     * Full check of a group: p and q prime, q divides p - 1, and g generates the subgroup of order q
+     * @param group The group to check
+     * @returns True if the group is sound
+     */
+    static bool verifyGroup(const DHGroup &group)
+    {
+        return group.hasKnownOrder() && group.prime > 3 &&
+               boost::multiprecision::miller_rabin_test(group.prime, 25, KeyGenerator::engine()) &&
+               boost::multiprecision::miller_rabin_test(group.order, 25, KeyGenerator::engine()) &&
+               (group.prime - 1) % group.order == 0 &&
+               group.generator > 1 && group.generator < group.prime &&
+               boost::multiprecision::powm(group.generator, group.order, group.prime) == 1;
+    }
+
+    /**
+     * Generates and verifies groups on several threads
+     * @param primeBits The bit length of each prime p
+     * @param orderBits The bit length of each subgroup order q
+     * @param count The number of groups
+     * @param threads The number of threads to generate on
+     * @returns The groups, every one verified
+     */
+    static std::vector<DHGroup> generate(size_t primeBits, size_t orderBits, size_t count, size_t threads)
+    {
+        std::vector<DHGroup> groups(count);
+        std::atomic<size_t> nextIndex{0};
+        std::atomic<size_t> rejected{0};
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < std::max<size_t>(1, threads); ++t)
+        {
+            workers.emplace_back([&]
+                                 {
+                for (size_t i = nextIndex++; i < count; i = nextIndex++)
+                {
+                    do
+                    {
+                        groups[i] = KeyGenerator::getSubgroupParameters(primeBits, orderBits);
+                    } while (!verifyGroup(groups[i]) && ++rejected);
+                } });
+        }
+        for (auto &worker : workers)
+            worker.join();
+        if (rejected > 0)
+            spdlog::warn("[ParameterStore] {} generated groups failed verification and were regenerated", rejected.load());
+        return groups;
+    }
+
+    /**
+     * Writes groups to a parameter file. The file is written under a temporary name and renamed into place, so a
+     *      listener serving from the old file sees either the old or the new contents, never a partial file
+     * @param path The file to write
+     * @param groups The groups, all with the same prime and order bit lengths
+     * @param primeBits The prime bit length
+     * @param orderBits The subgroup order bit length
+     */
+    static void write(const std::string &path, const std::vector<DHGroup> &groups, size_t primeBits, size_t orderBits)
+    {
+        if (groups.empty())
+            throw std::invalid_argument("No groups to write");
+        const std::uint32_t primeBytes = static_cast<std::uint32_t>((primeBits + 7) / 8);
+        const std::uint32_t orderBytes = static_cast<std::uint32_t>((orderBits + 7) / 8);
+        // round records up to 8 bytes, so every record starts aligned
+        const std::uint32_t recordSize = (2 * primeBytes + orderBytes + 7) & ~7u;
+
+        std::vector<unsigned char> file(headerSize_ + groups.size() * recordSize, 0);
+        std::memcpy(file.data(), magic_, sizeof(magic_));
+        putLE(file.data() + 8, version_, 4);
+        putLE(file.data() + 12, recordSize, 4);
+        putLE(file.data() + 16, primeBits, 4);
+        putLE(file.data() + 20, orderBits, 4);
+        putLE(file.data() + 24, primeBytes, 4);
+        putLE(file.data() + 28, orderBytes, 4);
+        putLE(file.data() + 32, groups.size(), 8);
+
+        // writes a big integer big-endian, right-aligned in a fixed-width field
+        auto putInt = [](unsigned char *out, const boost::multiprecision::cpp_int &value, size_t width)
+        {
+            std::vector<unsigned char> bytes;
+            boost::multiprecision::export_bits(value, std::back_inserter(bytes), 8);
+            if (bytes.size() > width)
+                throw std::invalid_argument("Group value is wider than its record field");
+            std::memcpy(out + width - bytes.size(), bytes.data(), bytes.size());
+        };
+        for (size_t i = 0; i < groups.size(); ++i)
+        {
+            unsigned char *record = file.data() + headerSize_ + i * recordSize;
+            putInt(record, groups[i].prime, primeBytes);
+            putInt(record + primeBytes, groups[i].generator, primeBytes);
+            putInt(record + 2 * primeBytes, groups[i].order, orderBytes);
+        }
+        putLE(file.data() + 40, checksum(file.data(), file.size()), 8);
+
+        std::string temporary = path + ".tmp";
+        {
+            std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(file.data()), static_cast<std::streamsize>(file.size()));
+            if (!out)
+                throw std::runtime_error("Unable to write " + temporary);
+        }
+        std::filesystem::rename(temporary, path);
+    }
+};
+
+#endif
@@ -2,9 +2,11 @@
 #define PARTICIPANT_HPP
 
 #include <string>
-#include <iostream>
 #include <spdlog/spdlog.h>
 #include <boost/multiprecision/cpp_int.hpp>
+#include "group.hpp"
+#include "key_gen.hpp"
+#include "logging.hpp"
 
 /**
  * The DHKEParticipant class handles functionality required for a client to participate in the DHKE process.
@@ -19,6 +21,8 @@ private:
     boost::multiprecision::cpp_int publicGenerator_;
     boost::multiprecision::cpp_int publicPrime_;
     boost::multiprecision::cpp_int privateKey_;
+    // order of the subgroup generated by the public generator, zero when unknown
+    boost::multiprecision::cpp_int subgroupOrder_;
     // intermediary key generated by participant: computation of s = B^a mod p
     boost::multiprecision::cpp_int step1Key;
     // final shared secret key from step 2
@@ -70,7 +74,7 @@ public:
         this->privateKey_ = privateKey;
     }
 
-    void setPublicGenerator(int generator)
+    void setPublicGenerator(boost::multiprecision::cpp_int generator)
     {
         this->publicGenerator_ = generator;
     }
@@ -80,6 +84,52 @@ public:
         this->publicPrime_ = prime;
     }
 
+    void setSubgroupOrder(boost::multiprecision::cpp_int order)
+    {
+        this->subgroupOrder_ = order;
+    }
+
+    // sets the prime, generator and subgroup order in one go
+    void setGroup(const DHGroup &group)
+    {
+        this->publicPrime_ = group.prime;
+        this->publicGenerator_ = group.generator;
+        this->subgroupOrder_ = group.order;
+    }
+
+    /**
+     * Frees the state only the handshake needs, once the session key has been derived: the private key, both public
+     *      values and the shared secret, along with the group parameters. Setting a group and generating a new private
+     *      key makes the participant usable again
+     */
+    void releaseHandshakeState()
+    {
+        for (auto *value : {&this->publicGenerator_, &this->publicPrime_, &this->privateKey_, &this->subgroupOrder_, &this->step1Key, &this->sharedSecretKey})
+            boost::multiprecision::cpp_int().swap(*value);
+    }
+
+    // bit length of the current private key, i.e. the number of modular squarings each powm will perform
+    size_t getPrivateKeyBits()
+    {
+        return this->privateKey_ == 0 ? 0 : boost::multiprecision::msb(this->privateKey_) + 1;
+    }
+
+    /**
+     * Generates and stores a new private key for the current group parameters.
+     *
+     * If the subgroup order q is known, the key is drawn uniformly from [1, q), so it is only as long as q.
+     * Otherwise we fall back to a random key up to the full length of the prime.
+     *
+     * @param primeBitLength The bit length of the public prime, used for the fallback case
+     */
+    void generatePrivateKey(size_t primeBitLength)
+    {
+        if (this->subgroupOrder_ > 0)
+            this->privateKey_ = KeyGenerator::getRandomBelow(this->subgroupOrder_);
+        else
+            this->privateKey_ = KeyGenerator::getLargeRandomInt(2, primeBitLength - 1);
+    }
+
     /**
      * The 'step 1' function performs the initial combination of the participant's secret key and the public parameters.
      * For public prime = p, generator = g, and private key = a, the following is comupted: g^a mod p
@@ -87,12 +137,13 @@ public:
      */
     boost::multiprecision::cpp_int step1()
     {
-        spdlog::info("Starting {} step 1...", this->name_);
-        spdlog::info("{} parameters: g = {}, private = {}, prime = {}",
+        // the values are only converted to decimal if debug logging is on, see logging.hpp
+        SPDLOG_DEBUG("Starting {} step 1...", this->name_);
+        SPDLOG_DEBUG("{} parameters: g = {}, private = {}, prime = {}",
                      this->name_,
-                     this->publicGenerator_.str(),
-                     this->privateKey_.str(),
-                     this->publicPrime_.str());
+                     LazyBigInt{this->publicGenerator_},
+                     LazyBigInt{this->privateKey_},
+                     LazyBigInt{this->publicPrime_});
 
         // from the Boost documentation: https://www.boost.org/doc/libs/latest/libs/multiprecision/doc/html/boost_multiprecision/tut/gen_int.html
         // for params b,p,m the 'powm' function returns b^p % m
@@ -101,8 +152,7 @@ public:
             this->privateKey_,
             this->publicPrime_);
 
-        spdlog::info("Step 1 value generated for {}: ", this->name_);
-        std::cout << value << std::endl;
+        SPDLOG_DEBUG("Step 1 value generated for {}: {}", this->name_, LazyBigInt{value});
         // store value in 'this' object's state
         this->step1Key = value;
         return value;
@@ -116,7 +166,7 @@ public:
      */
     boost::multiprecision::cpp_int step2(boost::multiprecision::cpp_int publicKey)
     {
-        spdlog::info("Starting DHKEParticipant step 2...");
+        SPDLOG_DEBUG("Starting {} step 2...", this->name_);
 
         // for public key = B, private key = a, and public prime = p, to compute the shared secret key (s) we use:
         //      s = B^a mod p
@@ -125,8 +175,7 @@ public:
             this->privateKey_,
             this->publicPrime_);
 
-        spdlog::info("Step 2 shared secret generated for {}: ", this->name_);
-        std::cout << sharedSecret << std::endl;
+        SPDLOG_DEBUG("Step 2 shared secret generated for {}: {}", this->name_, LazyBigInt{sharedSecret});
         // store shared secret in 'this' object's state
         this->sharedSecretKey = sharedSecret;
         return sharedSecret;
@@ -0,0 +1,465 @@
+#ifndef PEER_MANAGER_HPP
+#define PEER_MANAGER_HPP
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <future>
+#include <chrono>
+#include <random>
+#include <optional>
+#include <ostream>
+#include <functional>
+#include <algorithm>
+#include <unordered_map>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+#include "client.hpp"
+
+/**
+ * Connection state of a single peer in the PeerManager
+ */
+enum class PeerState
+{
+    // no session, and no handshake in progress
+    Idle,
+    // a handshake is in progress
+    Connecting,
+    // the handshake succeeded and the connection is still open
+    Established,
+    // the last attempt failed or the session closed, waiting out the backoff before reconnecting
+    Backoff
+};
+
+// human readable name of a peer state, for logging
+inline const char *toString(PeerState state)
+{
+    switch (state)
+    {
+    case PeerState::Idle:
+        return "idle";
+    case PeerState::Connecting:
+        return "connecting";
+    case PeerState::Established:
+        return "established";
+    case PeerState::Backoff:
+        return "backoff";
+    }
+    return "unknown";
+}
+
+/**
+ * Snapshot of a peer's session state, as exposed by the PeerManager
+ */
+struct PeerStatus
+{
+    std::string peerId;
+    std::string host;
+    int port = 0;
+    PeerState state = PeerState::Idle;
+    // total time of the last successful connect + handshake, in milliseconds
+    double lastHandshakeMillis = 0.0;
+    // true if the last handshake resumed from a session ticket
+    bool lastResumed = false;
+    int handshakes = 0;
+    int failures = 0;
+};
+
+/**
+ * An established session with a peer, as handed out by the PeerManager. The connection is ours as the connector, so
+ *      a RecordLayer on it is built with isListener false.
+ */
+struct PeerSession
+{
+    std::string peerId;
+    std::shared_ptr<asio::ip::tcp::socket> socket;
+    // whatever the peer sent right behind its last handshake flight, to be read before anything else on the socket
+    asio::streambuf buffer;
+    std::string sessionKey;
+    // true if the handshake resumed from a session ticket
+    bool resumed = false;
+};
+
+/**
+ * The PeerManager keeps a table of sessions with many remote peers, keyed by peer ID.
+ *
+ * - All peers share one io_context, run by a single thread, for the maintenance timer and the connection watches.
+ *      Handshakes block on resolving, connecting and the key exchange, so they run on a separate fixed pool of threads
+ *      and never hold up the timer. Connecting to hundreds of peers does not need hundreds of threads or io_contexts.
+ *
+ * - connect() hands out the peer's PeerSession, reusing a live one if there is one. Concurrent calls for the same peer
+ *      while a handshake is in progress all wait on that single handshake instead of starting their own. A session
+ *      handler, if set, is also given every session the manager establishes, including background reconnects.
+ *
+ * - Established connections are watched in the background, and the maintenance timer reconnects dead peers with
+ *      exponential backoff. Each peer keeps its own DHKEClient, so reconnects can resume from the peer's session ticket.
+ */
+class PeerManager
+{
+private:
+    struct PeerEntry
+    {
+        std::string peerId;
+        std::string host;
+        int port = 0;
+        std::string authSecret;
+        // keeps the resumption ticket for this peer between connections
+        std::unique_ptr<DHKEClient> client;
+        // bytes left over from the handshake in progress, moved into its session once it succeeds
+        std::string leftover;
+        std::shared_ptr<PeerSession> session;
+        PeerState state = PeerState::Idle;
+        // the in-progress handshake, shared by every concurrent connect() call for this peer
+        std::shared_ptr<std::promise<std::shared_ptr<PeerSession>>> pending;
+        std::shared_future<std::shared_ptr<PeerSession>> inFlight;
+        std::chrono::milliseconds backoff{0};
+        std::chrono::steady_clock::time_point nextAttempt{};
+        double lastHandshakeMillis = 0.0;
+        bool lastResumed = false;
+        int handshakes = 0;
+        int failures = 0;
+    };
+
+    std::string name_;
+    size_t primeBitLength_;
+    std::chrono::milliseconds initialBackoff_;
+    std::chrono::milliseconds maxBackoff_;
+
+    asio::io_context io_;
+    asio::executor_work_guard<asio::io_context::executor_type> workGuard_;
+    asio::steady_timer maintenanceTimer_;
+    std::chrono::milliseconds maintenanceInterval_{0};
+    // how long to wait before looking at a session again while the data on it hasn't been read yet
+    std::chrono::milliseconds watchRecheck_{100};
+    std::thread ioThread_;
+    asio::thread_pool handshakes_;
+    bool running_ = true;
+    std::function<void(std::shared_ptr<PeerSession>)> sessionHandler_;
+
+    std::unordered_map<std::string, std::shared_ptr<PeerEntry>> peers_;
+    std::mutex mutex_;
+
+    /**
+     * Runs on a handshake thread: connects to the peer and performs the handshake, then publishes the outcome
+     */
+    void runHandshake(std::shared_ptr<PeerEntry> entry, std::shared_ptr<std::promise<std::shared_ptr<PeerSession>>> promise)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto socket = std::make_shared<asio::ip::tcp::socket>(this->io_);
+        bool ok = false;
+        try
+        {
+            asio::ip::tcp::resolver resolver(this->io_);
+            asio::connect(*socket, resolver.resolve(entry->host, std::to_string(entry->port)));
+            // the client is only ever used by the one in-flight handshake for this peer, so no lock is needed here
+            ok = entry->client->performConnectorHandshake(*socket, entry->authSecret, entry->peerId, this->primeBitLength_);
+        }
+        catch (const std::exception &ex)
+        {
+            spdlog::warn("[PeerManager] Connecting to {} failed: {}", entry->peerId, ex.what());
+        }
+        double millis = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        std::shared_ptr<PeerSession> session;
+        if (ok)
+        {
+            session = std::make_shared<PeerSession>();
+            session->peerId = entry->peerId;
+            session->socket = socket;
+            session->sessionKey = entry->client->getSessionKey();
+            session->resumed = entry->client->wasLastHandshakeResumed();
+            std::ostream(&session->buffer) << entry->leftover;
+        }
+        entry->leftover.clear();
+
+        std::function<void(std::shared_ptr<PeerSession>)> handler;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            if (ok)
+            {
+                entry->session = session;
+                entry->state = PeerState::Established;
+                entry->backoff = std::chrono::milliseconds(0);
+                entry->lastHandshakeMillis = millis;
+                entry->lastResumed = session->resumed;
+                entry->handshakes++;
+                handler = this->sessionHandler_;
+            }
+            else
+            {
+                entry->session.reset();
+                entry->failures++;
+                this->scheduleBackoff(*entry);
+            }
+            entry->pending.reset();
+        }
+        if (ok)
+        {
+            this->watchConnection(entry, session);
+            if (handler)
+                handler(session);
+        }
+        promise->set_value(session);
+    }
+
+    // must be called with the mutex held
+    void scheduleBackoff(PeerEntry &entry)
+    {
+        // double the backoff on every consecutive failure, with +-25% jitter so peers don't reconnect in lockstep
+        entry.backoff = entry.backoff.count() == 0 ? this->initialBackoff_ : std::min(entry.backoff * 2, this->maxBackoff_);
+        static thread_local std::mt19937 rng(std::random_device{}());
+        std::uniform_real_distribution<double> jitter(0.75, 1.25);
+        auto delay = std::chrono::milliseconds(static_cast<long long>(entry.backoff.count() * jitter(rng)));
+        // a busy listener told us how long to stay away, never come back sooner than that
+        if (entry.client)
+            delay = std::max(delay, entry.client->getLastRetryAfter());
+        entry.nextAttempt = std::chrono::steady_clock::now() + delay;
+        entry.state = PeerState::Backoff;
+    }
+
+    /**
+     * Waits for the connection to become readable with nothing to read, which is how a closed connection shows up
+     */
+    void watchConnection(std::shared_ptr<PeerEntry> entry, std::shared_ptr<PeerSession> session)
+    {
+        session->socket->async_wait(asio::ip::tcp::socket::wait_read, [this, entry, session](const asio::error_code &ec)
+                                    {
+            asio::error_code availableEc;
+            // application data waiting is for whoever reads the session, look again once they have had time to read it
+            // (waiting again straight away would only spin, the socket stays readable until the data is read)
+            if (!ec && session->socket->available(availableEc) > 0 && !availableEc)
+            {
+                auto recheck = std::make_shared<asio::steady_timer>(this->io_, this->watchRecheck_);
+                recheck->async_wait([this, entry, session, recheck](const asio::error_code &timerEc)
+                                    {
+                    if (!timerEc)
+                        this->watchConnection(entry, session); });
+                return;
+            }
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            // only act if this is still the peer's current session
+            if (entry->session == session)
+            {
+                spdlog::info("[PeerManager] Session with {} closed", entry->peerId);
+                entry->session.reset();
+                this->scheduleBackoff(*entry);
+            } });
+    }
+
+    void scheduleMaintenance()
+    {
+        this->maintenanceTimer_.expires_after(this->maintenanceInterval_);
+        this->maintenanceTimer_.async_wait([this](const asio::error_code &ec)
+                                           {
+            if (ec)
+                return;
+            this->reconnectDuePeers();
+            this->scheduleMaintenance(); });
+    }
+
+    void reconnectDuePeers()
+    {
+        std::vector<std::string> due;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            auto now = std::chrono::steady_clock::now();
+            for (auto &[peerId, entry] : this->peers_)
+            {
+                if (entry->state == PeerState::Idle || (entry->state == PeerState::Backoff && now >= entry->nextAttempt))
+                    due.push_back(peerId);
+            }
+        }
+        for (auto &peerId : due)
+            this->connect(peerId);
+    }
+
+public:
+    /**
+     * @param name Our own identity, presented to every peer
+     * @param threads Number of threads running handshakes (default: one per core)
+     * @param primeBitLength The prime bit length passed to the handshake (default: 512)
+     */
+    PeerManager(std::string name, size_t threads = std::max(1u, std::thread::hardware_concurrency()), size_t primeBitLength = 512)
+        : name_(std::move(name)),
+          primeBitLength_(primeBitLength),
+          initialBackoff_(250),
+          maxBackoff_(30000),
+          workGuard_(asio::make_work_guard(io_)),
+          maintenanceTimer_(io_),
+          ioThread_([this]
+                    { this->io_.run(); }),
+          handshakes_(std::max<size_t>(1, threads))
+    {
+    }
+
+    ~PeerManager()
+    {
+        this->stop();
+    }
+
+    PeerManager(const PeerManager &) = delete;
+    PeerManager &operator=(const PeerManager &) = delete;
+
+    // the io_context shared by every peer connection
+    asio::io_context &getIoContext()
+    {
+        return this->io_;
+    }
+
+    /**
+     * Sets a handler given every session the manager establishes, including those of background reconnects. It runs on
+     *      the handshake thread, before connect()'s future is ready, and may keep the session to read and write on it.
+     */
+    void setSessionHandler(std::function<void(std::shared_ptr<PeerSession>)> handler)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->sessionHandler_ = std::move(handler);
+    }
+
+    /**
+     * Adds a peer to the table, without connecting to it
+     * @param peerId The peer's identity, which is also its key in the table
+     * @param host The peer's host address
+     * @param port The port the peer is listening on
+     * @param authSecret The authentication secret shared with the peer
+     */
+    void addPeer(const std::string &peerId, const std::string &host, int port, const std::string &authSecret)
+    {
+        auto entry = std::make_shared<PeerEntry>();
+        entry->peerId = peerId;
+        entry->host = host;
+        entry->port = port;
+        entry->authSecret = authSecret;
+        entry->client = std::make_unique<DHKEClient>(this->name_, 0, host, port);
+        // keep the connection open once the key is agreed, it is handed out as the peer's session
+        PeerEntry *raw = entry.get();
+        entry->client->setSessionHandler([raw](StreamRef, asio::streambuf &buffer, const std::string &)
+                                         {
+            raw->leftover.assign(asio::buffers_begin(buffer.data()), asio::buffers_end(buffer.data()));
+            buffer.consume(buffer.size());
+            return true; });
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->peers_[peerId] = entry;
+    }
+
+    /**
+     * Makes sure there is an established session with the peer.
+     *
+     * - A live session is reused as is.
+     *
+     * - If a handshake with the peer is already in progress, the caller gets that handshake's future.
+     *
+     * - Otherwise a new handshake is queued on the handshake threads.
+     *
+     * @param peerId The peer's identity
+     * @returns A future for the peer's session once it is established, or for nullptr if the handshake failed or the
+     *      manager was stopped first
+     */
+    std::shared_future<std::shared_ptr<PeerSession>> connect(const std::string &peerId)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        auto it = this->peers_.find(peerId);
+        if (it == this->peers_.end())
+            throw std::invalid_argument("Unknown peer '" + peerId + "'");
+        auto entry = it->second;
+
+        if (entry->state == PeerState::Established && entry->session && entry->session->socket->is_open())
+        {
+            std::promise<std::shared_ptr<PeerSession>> ready;
+            ready.set_value(entry->session);
+            return ready.get_future().share();
+        }
+        if (entry->state == PeerState::Connecting)
+            return entry->inFlight;
+        if (!this->running_)
+        {
+            std::promise<std::shared_ptr<PeerSession>> stopped;
+            stopped.set_value(nullptr);
+            return stopped.get_future().share();
+        }
+
+        auto promise = std::make_shared<std::promise<std::shared_ptr<PeerSession>>>();
+        entry->pending = promise;
+        entry->inFlight = promise->get_future().share();
+        entry->state = PeerState::Connecting;
+        asio::post(this->handshakes_, [this, entry, promise]
+                   { this->runHandshake(entry, promise); });
+        return entry->inFlight;
+    }
+
+    /**
+     * Starts the background maintenance timer, which reconnects idle and failed peers once their backoff has passed
+     * @param interval How often to check the peer table
+     */
+    void startMaintenance(std::chrono::milliseconds interval = std::chrono::milliseconds(500))
+    {
+        this->maintenanceInterval_ = interval;
+        asio::post(this->io_, [this]
+                   { this->scheduleMaintenance(); });
+    }
+
+    // snapshot of a single peer's state, or std::nullopt if the peer is unknown
+    std::optional<PeerStatus> getStatus(const std::string &peerId)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        auto it = this->peers_.find(peerId);
+        if (it == this->peers_.end())
+            return std::nullopt;
+        const auto &entry = *it->second;
+        return PeerStatus{entry.peerId, entry.host, entry.port, entry.state, entry.lastHandshakeMillis, entry.lastResumed, entry.handshakes, entry.failures};
+    }
+
+    // snapshot of every peer's state, sorted by peer ID
+    std::vector<PeerStatus> listPeers()
+    {
+        std::vector<PeerStatus> out;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            for (auto &[peerId, entry] : this->peers_)
+                out.push_back(PeerStatus{entry->peerId, entry->host, entry->port, entry->state, entry->lastHandshakeMillis, entry->lastResumed, entry->handshakes, entry->failures});
+        }
+        std::sort(out.begin(), out.end(), [](const PeerStatus &a, const PeerStatus &b)
+                  { return a.peerId < b.peerId; });
+        return out;
+    }
+
+    // stops the maintenance timer and the threads, closing every session
+    void stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            if (!this->running_)
+                return;
+            this->running_ = false;
+        }
+        // handshakes already running finish (they use blocking calls), anything still queued is dropped
+        this->handshakes_.stop();
+        this->handshakes_.join();
+        this->workGuard_.reset();
+        this->io_.stop();
+        if (this->ioThread_.joinable())
+            this->ioThread_.join();
+
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        for (auto &[peerId, entry] : this->peers_)
+        {
+            if (entry->session)
+            {
+                asio::error_code ec;
+                entry->session->socket->close(ec);
+                entry->session.reset();
+            }
+            // a dropped handshake never published its outcome, so whoever waits on it would wait forever
+            if (entry->pending)
+            {
+                entry->pending->set_value(nullptr);
+                entry->pending.reset();
+            }
+            entry->state = PeerState::Idle;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,431 @@
+#ifndef SESSION_TABLE_HPP
+#define SESSION_TABLE_HPP
+
+#include <array>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <optional>
+#include <algorithm>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include "group.hpp"
+#include "handshake.hpp"
+#include "record_layer.hpp"
+
+/**
+ * Refers to one session in a SessionTable. The generation makes a handle to an erased session stale, even once its
+ *      slot has been reused by another session
+ */
+struct SessionHandle
+{
+    std::uint32_t index = 0;
+    std::uint32_t generation = 0;
+};
+
+/**
+ * Server-side table of established sessions, for when there are far too many for an object per session.
+ *
+ * Once a handshake is done, a session only needs its record keys, its sequence numbers, who the peer is and when it was
+ *      last heard from. The participant's big integers (private key, public values, shared secret), the session key
+ *      and the handshake buffers are not needed any more, so they are left behind when the session is inserted.
+ *
+ * Storage is a structure of arrays: one dense column per field, indexed by the session's slot. Sealing a record only
+ *      touches the send keys and sequence (40 bytes), and the idle sweep only reads the timestamp and generation
+ *      columns (8 bytes per session), instead of chasing a pointer to a few hundred scattered bytes per session.
+ *      Peer ids and groups are interned (groups by value, so equal groups from different handshakes share an entry)
+ *      and released with their last session, so each costs the session an index.
+ *
+ * Records are in RecordLayer's format, keyed and ratcheted the same way, so the peer can use a RecordLayer.
+ *
+ * Not thread safe, like a HandshakeServer it belongs to one thread.
+ */
+class SessionTable
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+private:
+    using Secret = std::array<char, RecordLayer::secretBytes>;
+
+    // one direction's keys and its next sequence number, everything sealing or opening a record needs
+    struct DirectionState
+    {
+        RecordLayer::DirectionKeys keys;
+        std::uint64_t sequence;
+    };
+
+    // the columns, all indexed by slot
+    std::vector<DirectionState> send_;
+    std::vector<DirectionState> receive_;
+    // traffic secrets, only read when a direction ratchets
+    std::vector<Secret> sendSecret_;
+    std::vector<Secret> receiveSecret_;
+    std::vector<std::uint32_t> peer_;
+    std::vector<std::uint16_t> group_;
+    // seconds since epoch_
+    std::vector<std::uint32_t> lastActive_;
+    // odd while the slot holds a session, bumped on insert and on erase
+    std::vector<std::uint32_t> generation_;
+    std::vector<std::uint32_t> freeSlots_;
+    size_t size_ = 0;
+
+    // interned peer ids, with the number of sessions using each
+    std::vector<std::string> peerIds_;
+    std::vector<std::uint32_t> peerSessions_;
+    std::unordered_map<std::string, std::uint32_t> peerIndex_;
+    std::vector<std::uint32_t> freePeers_;
+
+    // interned groups, keyed by HandshakeMachine::groupId, with the number of sessions using each
+    std::vector<std::shared_ptr<const DHGroup>> groups_;
+    std::vector<std::uint32_t> groupSessions_;
+    std::vector<std::string> groupIds_;
+    std::unordered_map<std::string, std::uint16_t> groupIndex_;
+    std::vector<std::uint16_t> freeGroups_;
+
+    Clock::time_point epoch_;
+
+    std::uint32_t secondsSinceEpoch(Clock::time_point now) const
+    {
+        return static_cast<std::uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(now - this->epoch_).count());
+    }
+
+    // the slot of a live session, throws for a stale handle
+    std::uint32_t slot(SessionHandle handle) const
+    {
+        if (handle.index >= this->generation_.size() || this->generation_[handle.index] != handle.generation || !(handle.generation & 1))
+            throw std::runtime_error("Unknown or expired session");
+        return handle.index;
+    }
+
+    std::uint32_t internPeer(const std::string &peerId)
+    {
+        auto found = this->peerIndex_.find(peerId);
+        if (found != this->peerIndex_.end())
+        {
+            this->peerSessions_[found->second]++;
+            return found->second;
+        }
+        std::uint32_t index;
+        if (!this->freePeers_.empty())
+        {
+            index = this->freePeers_.back();
+            this->freePeers_.pop_back();
+            this->peerIds_[index] = peerId;
+            this->peerSessions_[index] = 1;
+        }
+        else
+        {
+            index = static_cast<std::uint32_t>(this->peerIds_.size());
+            this->peerIds_.push_back(peerId);
+            this->peerSessions_.push_back(1);
+        }
+        this->peerIndex_.emplace(peerId, index);
+        return index;
+    }
+
+    void releasePeer(std::uint32_t index)
+    {
+        if (--this->peerSessions_[index] > 0)
+            return;
+        this->peerIndex_.erase(this->peerIds_[index]);
+        std::string().swap(this->peerIds_[index]);
+        this->freePeers_.push_back(index);
+    }
+
+    std::uint16_t internGroup(const std::shared_ptr<const DHGroup> &group)
+    {
+        std::string id = HandshakeMachine::groupId(*group);
+        auto found = this->groupIndex_.find(id);
+        if (found != this->groupIndex_.end())
+        {
+            this->groupSessions_[found->second]++;
+            return found->second;
+        }
+        std::uint16_t index;
+        if (!this->freeGroups_.empty())
+        {
+            index = this->freeGroups_.back();
+            this->freeGroups_.pop_back();
+            this->groups_[index] = group;
+            this->groupIds_[index] = id;
+            this->groupSessions_[index] = 1;
+        }
+        else
+        {
+            if (this->groups_.size() > UINT16_MAX)
+                throw std::runtime_error("Too many distinct groups in use in the session table");
+            index = static_cast<std::uint16_t>(this->groups_.size());
+            this->groups_.push_back(group);
+            this->groupIds_.push_back(id);
+            this->groupSessions_.push_back(1);
+        }
+        this->groupIndex_.emplace(std::move(id), index);
+        return index;
+    }
+
+    void releaseGroup(std::uint16_t index)
+    {
+        if (--this->groupSessions_[index] > 0)
+            return;
+        this->groupIndex_.erase(this->groupIds_[index]);
+        std::string().swap(this->groupIds_[index]);
+        this->groups_[index].reset();
+        this->freeGroups_.push_back(index);
+    }
+
+    // RecordLayer::ratchet, with the secret kept in a fixed-size column instead of a string
+    static void ratchet(Secret &secret, DirectionState &state)
+    {
+        std::string current(secret.data(), secret.size());
+        RecordLayer::ratchet(current, state.keys);
+        std::copy(current.begin(), current.end(), secret.begin());
+        std::fill(current.begin(), current.end(), '\0');
+    }
+
+    static void wipe(void *data, size_t size)
+    {
+        volatile char *bytes = static_cast<volatile char *>(data);
+        for (size_t i = 0; i < size; ++i)
+            bytes[i] = 0;
+    }
+
+public:
+    /**
+     * @param expectedSessions Sessions to reserve room for up front, so the columns don't reallocate as the table fills
+     */
+    explicit SessionTable(size_t expectedSessions = 0) : epoch_(Clock::now())
+    {
+        this->reserve(expectedSessions);
+    }
+
+    SessionTable(const SessionTable &) = delete;
+    SessionTable &operator=(const SessionTable &) = delete;
+
+    ~SessionTable()
+    {
+        wipe(this->send_.data(), this->send_.size() * sizeof(DirectionState));
+        wipe(this->receive_.data(), this->receive_.size() * sizeof(DirectionState));
+        wipe(this->sendSecret_.data(), this->sendSecret_.size() * sizeof(Secret));
+        wipe(this->receiveSecret_.data(), this->receiveSecret_.size() * sizeof(Secret));
+    }
+
+    void reserve(size_t sessions)
+    {
+        this->send_.reserve(sessions);
+        this->receive_.reserve(sessions);
+        this->sendSecret_.reserve(sessions);
+        this->receiveSecret_.reserve(sessions);
+        this->peer_.reserve(sessions);
+        this->group_.reserve(sessions);
+        this->lastActive_.reserve(sessions);
+        this->generation_.reserve(sessions);
+    }
+
+    /**
+     * Adds an established session. Only the record keys are kept: the session key is wiped once they are derived
+     * @param peerId The authenticated peer id from the handshake
+     * @param sessionKey The session key agreed by the handshake, wiped before returning
+     * @param isListener Which side of the handshake we were, as for RecordLayer
+     * @param group The group the session was agreed in, shared by every session using it
+     * @param now The time the session starts being idle from
+     * @returns The new session's handle
+     */
+    SessionHandle insert(const std::string &peerId, std::string &sessionKey, bool isListener,
+                         const std::shared_ptr<const DHGroup> &group, Clock::time_point now = Clock::now())
+    {
+        std::uint32_t index;
+        if (!this->freeSlots_.empty())
+        {
+            index = this->freeSlots_.back();
+            this->freeSlots_.pop_back();
+        }
+        else
+        {
+            index = static_cast<std::uint32_t>(this->generation_.size());
+            this->send_.emplace_back();
+            this->receive_.emplace_back();
+            this->sendSecret_.emplace_back();
+            this->receiveSecret_.emplace_back();
+            this->peer_.push_back(0);
+            this->group_.push_back(0);
+            this->lastActive_.push_back(0);
+            this->generation_.push_back(0);
+        }
+
+        std::string sendSecret = RecordLayer::initialSecret(sessionKey, isListener);
+        std::string receiveSecret = RecordLayer::initialSecret(sessionKey, !isListener);
+        std::fill(sessionKey.begin(), sessionKey.end(), '\0');
+        this->send_[index] = {RecordLayer::deriveKeys(sendSecret), 0};
+        this->receive_[index] = {RecordLayer::deriveKeys(receiveSecret), 0};
+        std::copy(sendSecret.begin(), sendSecret.end(), this->sendSecret_[index].begin());
+        std::copy(receiveSecret.begin(), receiveSecret.end(), this->receiveSecret_[index].begin());
+        std::fill(sendSecret.begin(), sendSecret.end(), '\0');
+        std::fill(receiveSecret.begin(), receiveSecret.end(), '\0');
+
+        this->peer_[index] = this->internPeer(peerId);
+        this->group_[index] = this->internGroup(group);
+        this->lastActive_[index] = this->secondsSinceEpoch(now);
+        this->generation_[index]++;
+        this->size_++;
+        return {index, this->generation_[index]};
+    }
+
+    // removes a session and wipes its keys, its handle (and any copy of it) becomes stale
+    void erase(SessionHandle handle)
+    {
+        std::uint32_t index = this->slot(handle);
+        wipe(&this->send_[index], sizeof(DirectionState));
+        wipe(&this->receive_[index], sizeof(DirectionState));
+        wipe(this->sendSecret_[index].data(), sizeof(Secret));
+        wipe(this->receiveSecret_[index].data(), sizeof(Secret));
+        this->releasePeer(this->peer_[index]);
+        this->releaseGroup(this->group_[index]);
+        this->generation_[index]++;
+        this->freeSlots_.push_back(index);
+        this->size_--;
+    }
+
+    bool contains(SessionHandle handle) const
+    {
+        return handle.index < this->generation_.size() && this->generation_[handle.index] == handle.generation && (handle.generation & 1);
+    }
+
+    /**
+     * Encrypts and tags one record for the session's peer, ratcheting the send keys after a Rekey record
+     * @param handle The session
+     * @param type The record type
+     * @param stream The stream id, zero for records that aren't on a stream
+     * @param payload At most RecordLayer::maxPayloadBytes
+     * @param out Room for RecordLayer::headerBytes + payload.size() + RecordLayer::tagBytes bytes
+     * @returns The number of bytes written to out
+     */
+    size_t seal(SessionHandle handle, RecordType type, std::uint32_t stream, std::string_view payload, char *out)
+    {
+        if (payload.size() > RecordLayer::maxPayloadBytes || stream > RecordLayer::maxStreamId)
+            throw std::runtime_error("Record too large or stream id out of range");
+        std::uint32_t index = this->slot(handle);
+        DirectionState &state = this->send_[index];
+        RecordLayer::sealRecord(state.keys, state.sequence++, type, stream, payload, out);
+        if (type == RecordType::Rekey)
+            ratchet(this->sendSecret_[index], state);
+        return RecordLayer::headerBytes + payload.size() + RecordLayer::tagBytes;
+    }
+
+    size_t seal(SessionHandle handle, std::string_view payload, char *out)
+    {
+        return this->seal(handle, RecordType::Application, 0, payload, out);
+    }
+
+    /**
+     * Checks and decrypts one complete record from the session's peer, in place, ratcheting the receive keys after a
+     *      Rekey record. Doesn't count as activity, see touch()
+     * @param handle The session
+     * @param record The whole record, header first, as framed by the caller
+     * @returns The record, with the payload pointing into the given buffer, or std::nullopt if it fails authentication
+     *      (the session should then be dropped, as a RecordLayer would)
+     */
+    std::optional<Record> open(SessionHandle handle, char *record)
+    {
+        std::uint32_t index = this->slot(handle);
+        std::uint32_t length = static_cast<std::uint32_t>(RecordLayer::getLE(record, 4));
+        if (length > RecordLayer::maxPayloadBytes)
+            return std::nullopt;
+        DirectionState &state = this->receive_[index];
+        if (!RecordLayer::openRecord(state.keys, state.sequence, record, length))
+            return std::nullopt;
+        std::uint32_t stream = static_cast<unsigned char>(record[5]) | static_cast<unsigned char>(record[6]) << 8 |
+                               static_cast<std::uint32_t>(static_cast<unsigned char>(record[7])) << 16;
+        Record out{static_cast<RecordType>(record[4]), state.sequence++, std::string_view(record + RecordLayer::headerBytes, length), stream};
+        if (out.type == RecordType::Rekey)
+            ratchet(this->receiveSecret_[index], state);
+        return out;
+    }
+
+    // marks the session as active now, resetting its idle time (second resolution)
+    void touch(SessionHandle handle, Clock::time_point now = Clock::now())
+    {
+        this->lastActive_[this->slot(handle)] = this->secondsSinceEpoch(now);
+    }
+
+    /**
+     * Erases every session idle for longer than maxIdle, in one pass over the timestamp column
+     * @param maxIdle How long a session may go without a touch()
+     * @param now The current time
+     * @param onExpired Called with each expired session's handle and peer id, before it is erased
+     * @returns The number of sessions erased
+     */
+    template <typename Callback>
+    size_t expireIdle(std::chrono::seconds maxIdle, Clock::time_point now, Callback &&onExpired)
+    {
+        std::uint32_t current = this->secondsSinceEpoch(now);
+        std::uint32_t limit = static_cast<std::uint32_t>(std::min<std::chrono::seconds::rep>(maxIdle.count(), UINT32_MAX));
+        size_t expired = 0;
+        for (std::uint32_t i = 0; i < this->generation_.size(); ++i)
+        {
+            if (!(this->generation_[i] & 1) || current - this->lastActive_[i] <= limit)
+                continue;
+            SessionHandle handle{i, this->generation_[i]};
+            onExpired(handle, this->peerIds_[this->peer_[i]]);
+            this->erase(handle);
+            expired++;
+        }
+        return expired;
+    }
+
+    size_t expireIdle(std::chrono::seconds maxIdle, Clock::time_point now = Clock::now())
+    {
+        return this->expireIdle(maxIdle, now, [](SessionHandle, const std::string &) {});
+    }
+
+    const std::string &getPeerId(SessionHandle handle) const
+    {
+        return this->peerIds_[this->peer_[this->slot(handle)]];
+    }
+
+    const DHGroup &getGroup(SessionHandle handle) const
+    {
+        return *this->groups_[this->group_[this->slot(handle)]];
+    }
+
+    // the number of live sessions
+    size_t size() const
+    {
+        return this->size_;
+    }
+
+    /**
+     * @returns The bytes held by the table: the columns' capacity, the free lists, and an estimate for the interned
+     *      peer and group ids (hash map nodes and buckets, and any id too long for the short string buffer). The groups
+     *      themselves are shared with the rest of the process, and not counted
+     */
+    size_t memoryBytes() const
+    {
+        size_t slots = this->generation_.capacity();
+        size_t bytes = slots * (2 * sizeof(DirectionState) + 2 * sizeof(Secret) + sizeof(std::uint32_t) * 3 + sizeof(std::uint16_t));
+        bytes += this->freeSlots_.capacity() * sizeof(std::uint32_t);
+        bytes += this->peerIds_.capacity() * sizeof(std::string) + this->peerSessions_.capacity() * sizeof(std::uint32_t);
+        bytes += this->freePeers_.capacity() * sizeof(std::uint32_t) + this->groups_.capacity() * sizeof(std::shared_ptr<const DHGroup>);
+        bytes += this->groupSessions_.capacity() * sizeof(std::uint32_t) + this->freeGroups_.capacity() * sizeof(std::uint16_t);
+        bytes += this->groupIds_.capacity() * sizeof(std::string) + this->groupIndex_.bucket_count() * sizeof(void *);
+        bytes += this->groupIndex_.size() * (sizeof(void *) + sizeof(size_t) + sizeof(std::pair<const std::string, std::uint16_t>));
+        for (const auto &id : this->groupIds_)
+        {
+            if (id.capacity() > 15)
+                bytes += 2 * (id.capacity() + 1);
+        }
+        bytes += this->peerIndex_.bucket_count() * sizeof(void *);
+        bytes += this->peerIndex_.size() * (sizeof(void *) + sizeof(size_t) + sizeof(std::pair<const std::string, std::uint32_t>));
+        for (const auto &id : this->peerIds_)
+        {
+            if (id.capacity() > 15)
+                bytes += 2 * (id.capacity() + 1);
+        }
+        return bytes;
+    }
+};
+
+#endif
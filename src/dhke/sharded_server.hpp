@@ -0,0 +1,243 @@
+#ifndef SHARDED_SERVER_HPP
+#define SHARDED_SERVER_HPP
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+#include "cookie.hpp"
+#include "handshake.hpp"
+#include "handshake_server.hpp"
+#include "param_store.hpp"
+#include "ticket.hpp"
+#include "transcript.hpp"
+
+/**
+ * How a ShardedHandshakeServer splits itself up
+ */
+struct ShardOptions
+{
+    // the number of shards, 0 for one per hardware thread
+    size_t shards = 0;
+    // pin each shard's thread to its own CPU (of those this process may run on), Linux only
+    bool pinThreads = false;
+};
+
+/**
+ * The ShardedHandshakeServer runs one HandshakeServer per core, sharing nothing on the handshake path. Each shard has:
+ *
+ * - its own io_context and thread, running the I/O and the CPU-heavy steps inline, so a handshake never changes threads
+ *
+ * - its own acceptor on the same port with SO_REUSEPORT, so the kernel spreads incoming connections over the shards
+ *      rather than one accept loop handing them out
+ *
+ * - its own group settings and, when parameters come from a store, its own mapping of the file; its own cookie gate,
+ *      admission limits and metrics; and (through KeyGenerator::engine) its own random state
+ *
+ * The one thing the shards share is the SessionTicketManager, so a ticket issued by one shard can be redeemed on any
+ *      other, and is still only redeemed once. It is only touched once per handshake, to issue or redeem a ticket.
+ *      Metrics are kept per shard and only added up when asked for (see collectMetrics).
+ */
+class ShardedHandshakeServer
+{
+private:
+    struct Shard
+    {
+        asio::io_context io{1};
+        // set when the shard takes its groups from a store of its own
+        std::unique_ptr<ParameterStore> parameters;
+        std::unique_ptr<HandshakeServer> server;
+        std::thread thread;
+    };
+
+    std::string name_;
+    ShardOptions options_;
+    std::vector<std::unique_ptr<Shard>> shards_;
+    int port_ = 0;
+    bool running_ = false;
+
+    // the CPU for the given shard, going round the CPUs this process is allowed on, -1 if it can't be told
+    static int cpuFor(size_t shard)
+    {
+#if defined(__linux__)
+        cpu_set_t allowed;
+        CPU_ZERO(&allowed);
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || CPU_COUNT(&allowed) == 0)
+            return -1;
+        size_t skip = shard % static_cast<size_t>(CPU_COUNT(&allowed));
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+        {
+            if (CPU_ISSET(cpu, &allowed) && skip-- == 0)
+                return cpu;
+        }
+#endif
+        return -1;
+    }
+
+    void pin(size_t shard)
+    {
+#if defined(__linux__)
+        int cpu = cpuFor(shard);
+        if (cpu < 0)
+        {
+            spdlog::warn("[{}] Unable to pick a CPU for shard {}, leaving it unpinned", this->name_, shard);
+            return;
+        }
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int result = pthread_setaffinity_np(this->shards_[shard]->thread.native_handle(), sizeof(set), &set);
+        if (result != 0)
+            spdlog::warn("[{}] Unable to pin shard {} to CPU {} (error {})", this->name_, shard, cpu, result);
+        else
+            SPDLOG_DEBUG("[{}] Shard {} pinned to CPU {}", this->name_, shard, cpu);
+#else
+        spdlog::warn("[{}] Pinning shard threads is only supported on Linux, shard {} is unpinned", this->name_, shard);
+#endif
+    }
+
+public:
+    /**
+     * @param config Settings for every handshake, as the listener. A parameter store in it is only used for its path,
+     *      each shard maps the file itself
+     * @param ticketManager Issues and redeems session tickets for all shards, must outlive the server
+     * @param options The number of shards, and whether to pin them
+     * @param limits Admission control limits, for each shard
+     * @param deadlines Per-phase deadlines
+     * @param puzzle Puzzle difficulty range for each shard's cookie gate
+     */
+    ShardedHandshakeServer(const HandshakeConfig &config, SessionTicketManager &ticketManager, ShardOptions options = ShardOptions(),
+                           AdmissionLimits limits = AdmissionLimits(), HandshakeDeadlines deadlines = HandshakeDeadlines(),
+                           PuzzleDifficulty puzzle = PuzzleDifficulty())
+        : name_(config.name), options_(options)
+    {
+        size_t count = options.shards > 0 ? options.shards : std::max(1u, std::thread::hardware_concurrency());
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto shard = std::make_unique<Shard>();
+            HandshakeConfig shardConfig = config;
+            if (config.parameterStore && !config.group)
+            {
+                shard->parameters = std::make_unique<ParameterStore>(config.parameterStore->getPath(), config.parameterStore->getReloadInterval());
+                shardConfig.parameterStore = shard->parameters.get();
+            }
+            shard->server = std::make_unique<HandshakeServer>(shard->io, std::move(shardConfig), ticketManager, limits, deadlines, puzzle, true);
+            this->shards_.push_back(std::move(shard));
+        }
+    }
+
+    ~ShardedHandshakeServer()
+    {
+        this->stop();
+    }
+
+    ShardedHandshakeServer(const ShardedHandshakeServer &) = delete;
+    ShardedHandshakeServer &operator=(const ShardedHandshakeServer &) = delete;
+
+    // called on the shard's thread for every admitted connection, once its handshake has succeeded, failed or timed out
+    void setOutcomeHandler(const HandshakeServer::OutcomeHandler &handler)
+    {
+        for (auto &shard : this->shards_)
+            shard->server->setOutcomeHandler(handler);
+    }
+
+    // captures every shard's handshakes into the transcript, which must outlive the server
+    void setTranscript(TranscriptWriter *transcript)
+    {
+        for (auto &shard : this->shards_)
+            shard->server->setTranscript(transcript);
+    }
+
+    /**
+     * Binds every shard to the port and starts their threads
+     * @param port The port to listen on, 0 for any free port (see getPort)
+     * @throws std::runtime_error If SO_REUSEPORT isn't supported, or asio::system_error if the port can't be bound
+     */
+    void start(int port)
+    {
+        if (this->running_)
+            throw std::runtime_error("Sharded server already started");
+        // the first shard settles the port, so the rest join the same one even when it was picked by the kernel
+        this->shards_[0]->server->start(port, true);
+        this->port_ = this->shards_[0]->server->getPort();
+        for (size_t i = 1; i < this->shards_.size(); ++i)
+            this->shards_[i]->server->start(this->port_, true);
+
+        this->running_ = true;
+        for (size_t i = 0; i < this->shards_.size(); ++i)
+        {
+            Shard &shard = *this->shards_[i];
+            shard.thread = std::thread([&shard]
+                                       { shard.io.run(); });
+            if (this->options_.pinThreads)
+                this->pin(i);
+        }
+        spdlog::info("[{}] Listening on port {} with {} shards{}", this->name_, this->port_, this->shards_.size(),
+                     this->options_.pinThreads ? ", pinned" : "");
+    }
+
+    // stops accepting on every shard and stops their threads, handshakes still in progress are abandoned
+    void stop()
+    {
+        if (!this->running_)
+            return;
+        this->running_ = false;
+        for (auto &shard : this->shards_)
+        {
+            shard->server->stop();
+            shard->io.stop();
+        }
+        for (auto &shard : this->shards_)
+        {
+            if (shard->thread.joinable())
+                shard->thread.join();
+        }
+    }
+
+    int getPort() const
+    {
+        return this->port_;
+    }
+
+    size_t shardCount() const
+    {
+        return this->shards_.size();
+    }
+
+    const HandshakeServerMetrics &getShardMetrics(size_t shard) const
+    {
+        return this->shards_.at(shard)->server->getMetrics();
+    }
+
+    /**
+     * Adds up the metrics of all shards
+     * @param into The counters to add to, normally fresh ones
+     */
+    void collectMetrics(HandshakeServerMetrics &into) const
+    {
+        for (const auto &shard : this->shards_)
+            into.mergeFrom(shard->server->getMetrics());
+    }
+
+    // logs the totals in one line, and how the completed handshakes were spread over the shards in another
+    void logMetrics() const
+    {
+        HandshakeServerMetrics total;
+        this->collectMetrics(total);
+        total.log(this->name_);
+        std::string spread;
+        for (size_t i = 0; i < this->shards_.size(); ++i)
+            spread += (i ? " " : "") + std::to_string(this->getShardMetrics(i).completed.load());
+        spdlog::info("[{}] Completed per shard: {}", this->name_, spread);
+    }
+};
+
+#endif
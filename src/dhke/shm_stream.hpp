@@ -0,0 +1,641 @@
+#ifndef SHM_STREAM_HPP
+#define SHM_STREAM_HPP
+
+#include <array>
+#include <atomic>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <string>
+#include <utility>
+#include <system_error>
+#include <thread>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <asio.hpp>
+#include <spdlog/spdlog.h>
+
+/**
+ * Settings for a shared memory connection
+ */
+struct ShmOptions
+{
+    // bytes per direction, rounded up to a power of two. Chosen by the connector, the listener uses whatever it finds
+    size_t ringBytes = 256 * 1024;
+    // how many times a blocked reader or writer checks the ring again before going to sleep on the futex. Spinning
+    //      only pays off when the peer runs on another core at the same time, so there is none on a single CPU
+    unsigned spinIterations = std::thread::hardware_concurrency() > 1 ? 100 : 0;
+};
+
+/**
+ * Futex waits and wakes on 32-bit words in memory shared between processes (so not FUTEX_PRIVATE)
+ */
+class ShmFutex
+{
+public:
+    static_assert(std::atomic<std::uint32_t>::is_always_lock_free && sizeof(std::atomic<std::uint32_t>) == sizeof(std::uint32_t),
+                  "shared memory words must be plain lock-free 32-bit atomics");
+
+    // sleeps while word still holds seen, for at most the timeout. Spurious wakeups are possible, callers recheck
+    static void wait(std::atomic<std::uint32_t> &word, std::uint32_t seen, std::chrono::milliseconds timeout)
+    {
+        timespec ts{static_cast<time_t>(timeout.count() / 1000), static_cast<long>(timeout.count() % 1000) * 1000000L};
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAIT, seen, &ts, nullptr, 0);
+    }
+
+    // changes the word and wakes everyone sleeping on it
+    static void signal(std::atomic<std::uint32_t> &word)
+    {
+        word.fetch_add(1, std::memory_order_seq_cst);
+        syscall(SYS_futex, reinterpret_cast<std::uint32_t *>(&word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+    }
+
+    static void relax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+
+    // false only if the process is known to be gone
+    static bool isAlive(std::int32_t pid)
+    {
+        return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+    }
+
+    // shm_open names need exactly one leading slash
+    static std::string objectName(const std::string &name)
+    {
+        return name.empty() || name[0] != '/' ? "/" + name : name;
+    }
+};
+
+/**
+ * A connected byte stream between two processes on the same host, through two single-producer/single-consumer rings
+ *      in a shared memory segment, one per direction. It has the same blocking read_some/write_some interface as an
+ *      asio socket, so the handshake and the record layer run over it unchanged.
+ *
+ * - Each ring has a head (bytes written, only the writer moves it) and a tail (bytes read, only the reader moves it),
+ *      on separate cache lines. Both are free-running 32-bit counters, so the ring never needs a lock: the writer
+ *      publishes data by storing the head, the reader frees space by storing the tail.
+ *
+ * - A side that finds nothing to do spins briefly, then sets its waiting flag and sleeps on a futex. The other side
+ *      only makes the wake system call when that flag is set, so a busy connection runs without any system calls at all.
+ *
+ * - Either side closing (or its process dying) ends the stream: the reader drains what is left and then gets
+ *      asio::error::eof, the writer gets asio::error::broken_pipe.
+ *
+ * - The counters live in memory the peer can write, so they are checked before every copy: a ring claiming more than
+ *      its capacity is in use closes the stream with asio::error::connection_aborted rather than copying out of bounds.
+ *
+ * The connector creates the segment and hands its name to the listener through the listener's rendezvous object (see
+ *      ShmAcceptor). The listener unlinks the segment once it has mapped it, so nothing is left behind in /dev/shm.
+ */
+class ShmStream
+{
+private:
+    static constexpr char magic[8] = {'D', 'H', 'K', 'E', 'R', 'I', 'N', 'G'};
+    static constexpr std::uint32_t version = 1;
+    static constexpr auto sleepSlice = std::chrono::milliseconds(100);
+
+    // one direction, lives in the shared segment
+    struct Ring
+    {
+        alignas(64) std::atomic<std::uint32_t> head;
+        std::atomic<std::uint32_t> readerWaiting;
+        // bumped to wake a sleeping reader
+        std::atomic<std::uint32_t> dataSignal;
+        alignas(64) std::atomic<std::uint32_t> tail;
+        std::atomic<std::uint32_t> writerWaiting;
+        // bumped to wake a sleeping writer
+        std::atomic<std::uint32_t> spaceSignal;
+    };
+
+    // the start of the shared segment, followed by the two rings' data
+    struct Segment
+    {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t ringBytes;
+        // set once either side has hung up
+        std::atomic<std::uint32_t> closed;
+        std::atomic<std::int32_t> connectorPid;
+        std::atomic<std::int32_t> listenerPid;
+        // [0] connector to listener, [1] listener to connector
+        Ring rings[2];
+    };
+
+    static constexpr size_t dataOffset = (sizeof(Segment) + 4095) / 4096 * 4096;
+
+    void *base_ = nullptr;
+    size_t mappedBytes_ = 0;
+    Segment *segment_ = nullptr;
+    Ring *in_ = nullptr;
+    Ring *out_ = nullptr;
+    char *inData_ = nullptr;
+    char *outData_ = nullptr;
+    std::uint32_t capacity_ = 0;
+    bool isListener_ = false;
+    ShmOptions options_;
+
+    static void *map(int fd, size_t bytes)
+    {
+        void *base = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        return base;
+    }
+
+    ShmStream(void *base, size_t mappedBytes, bool isListener, ShmOptions options)
+        : base_(base), mappedBytes_(mappedBytes), segment_(static_cast<Segment *>(base)), isListener_(isListener), options_(options)
+    {
+        this->capacity_ = this->segment_->ringBytes;
+        char *data = static_cast<char *>(base) + dataOffset;
+        this->in_ = &this->segment_->rings[isListener ? 0 : 1];
+        this->out_ = &this->segment_->rings[isListener ? 1 : 0];
+        this->inData_ = data + (isListener ? 0 : this->capacity_);
+        this->outData_ = data + (isListener ? this->capacity_ : 0);
+    }
+
+    bool isClosed() const
+    {
+        return this->segment_->closed.load(std::memory_order_seq_cst) != 0;
+    }
+
+    bool isPeerAlive() const
+    {
+        return ShmFutex::isAlive(this->isListener_ ? this->segment_->connectorPid.load() : this->segment_->listenerPid.load());
+    }
+
+    /**
+     * Blocks until ready() holds or the stream is closed: spins for a while, then sleeps on the signal word. The
+     *      waiting flag is set before the last check, so a peer that makes ready() true afterwards sees it and wakes us
+     * @returns True if ready() holds
+     */
+    template <typename Ready>
+    bool waitFor(Ready ready, std::atomic<std::uint32_t> &waiting, std::atomic<std::uint32_t> &signal)
+    {
+        for (unsigned i = 0; i < this->options_.spinIterations; ++i)
+        {
+            if (ready())
+                return true;
+            if (this->isClosed())
+                return ready();
+            ShmFutex::relax();
+        }
+        while (true)
+        {
+            std::uint32_t seen = signal.load(std::memory_order_seq_cst);
+            waiting.store(1, std::memory_order_seq_cst);
+            if (ready() || this->isClosed())
+            {
+                waiting.store(0, std::memory_order_relaxed);
+                return ready();
+            }
+            ShmFutex::wait(signal, seen, sleepSlice);
+            waiting.store(0, std::memory_order_relaxed);
+            // a peer that died can't close the stream itself, so we notice it when a sleep times out
+            if (!this->isPeerAlive())
+                this->segment_->closed.store(1, std::memory_order_seq_cst);
+        }
+    }
+
+    std::array<asio::mutable_buffer, 2> ringSpan(char *data, std::uint32_t position, size_t n) const
+    {
+        size_t index = position & (this->capacity_ - 1);
+        size_t first = std::min<size_t>(n, this->capacity_ - index);
+        return {asio::buffer(data + index, first), asio::buffer(data, n - first)};
+    }
+
+    void release()
+    {
+        if (this->base_ == nullptr)
+            return;
+        this->close();
+        munmap(this->base_, this->mappedBytes_);
+        this->base_ = nullptr;
+    }
+
+public:
+    ShmStream() = default;
+
+    ShmStream(ShmStream &&other) noexcept
+    {
+        *this = std::move(other);
+    }
+
+    ShmStream &operator=(ShmStream &&other) noexcept
+    {
+        if (this != &other)
+        {
+            this->release();
+            this->base_ = std::exchange(other.base_, nullptr);
+            this->mappedBytes_ = other.mappedBytes_;
+            this->segment_ = other.segment_;
+            this->in_ = other.in_;
+            this->out_ = other.out_;
+            this->inData_ = other.inData_;
+            this->outData_ = other.outData_;
+            this->capacity_ = other.capacity_;
+            this->isListener_ = other.isListener_;
+            this->options_ = other.options_;
+        }
+        return *this;
+    }
+
+    ~ShmStream()
+    {
+        this->release();
+    }
+
+    /**
+     * Connector side: creates a new segment for a connection, sized from the options
+     * @param name The shared memory object name for the segment
+     * @throws std::system_error If the segment can't be created
+     */
+    static ShmStream create(const std::string &name, ShmOptions options = ShmOptions())
+    {
+        std::uint32_t capacity = 4096;
+        while (capacity < options.ringBytes && capacity < (1u << 30))
+            capacity <<= 1;
+        size_t bytes = dataOffset + 2 * static_cast<size_t>(capacity);
+        std::string object = ShmFutex::objectName(name);
+        int fd = shm_open(object.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "shm_open " + object);
+        if (ftruncate(fd, static_cast<off_t>(bytes)) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            shm_unlink(object.c_str());
+            throw std::system_error(error, std::generic_category(), "ftruncate " + object);
+        }
+        void *base = map(fd, bytes);
+        auto *segment = new (base) Segment();
+        std::memcpy(segment->magic, magic, sizeof(magic));
+        segment->version = version;
+        segment->ringBytes = capacity;
+        segment->connectorPid = static_cast<std::int32_t>(getpid());
+        return ShmStream(base, bytes, false, options);
+    }
+
+    /**
+     * Listener side: maps a segment created by a connector, then unlinks it, since both sides now hold it
+     * @param name The shared memory object name the connector handed over
+     * @throws std::system_error If the segment is missing or malformed
+     */
+    static ShmStream open(const std::string &name, ShmOptions options = ShmOptions())
+    {
+        std::string object = ShmFutex::objectName(name);
+        int fd = shm_open(object.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "shm_open " + object);
+        shm_unlink(object.c_str());
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < dataOffset)
+        {
+            ::close(fd);
+            throw std::system_error(EINVAL, std::generic_category(), "Not a connection segment: " + object);
+        }
+        size_t bytes = static_cast<size_t>(info.st_size);
+        void *base = map(fd, bytes);
+        auto *segment = static_cast<Segment *>(base);
+        std::uint32_t capacity = segment->ringBytes;
+        if (std::memcmp(segment->magic, magic, sizeof(magic)) != 0 || segment->version != version || capacity == 0 ||
+            (capacity & (capacity - 1)) != 0 || dataOffset + 2 * static_cast<size_t>(capacity) != bytes)
+        {
+            munmap(base, bytes);
+            throw std::system_error(EINVAL, std::generic_category(), "Not a connection segment: " + object);
+        }
+        segment->listenerPid = static_cast<std::int32_t>(getpid());
+        return ShmStream(base, bytes, true, options);
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers, asio::error_code &ec)
+    {
+        ec = asio::error_code();
+        size_t wanted = asio::buffer_size(buffers);
+        if (wanted == 0)
+            return 0;
+        std::uint32_t tail = this->in_->tail.load(std::memory_order_relaxed);
+        std::uint32_t readable = 0;
+        bool ready = this->waitFor([&]
+                                   {
+            readable = this->in_->head.load(std::memory_order_seq_cst) - tail;
+            return readable > 0; }, this->in_->readerWaiting, this->in_->dataSignal);
+        if (!ready)
+        {
+            ec = asio::error::eof;
+            return 0;
+        }
+        if (readable > this->capacity_)
+        {
+            this->close();
+            ec = asio::error::connection_aborted;
+            return 0;
+        }
+        size_t n = std::min<size_t>(readable, wanted);
+        asio::buffer_copy(buffers, this->ringSpan(this->inData_, tail, n), n);
+        this->in_->tail.store(tail + static_cast<std::uint32_t>(n), std::memory_order_seq_cst);
+        if (this->in_->writerWaiting.load(std::memory_order_seq_cst))
+            ShmFutex::signal(this->in_->spaceSignal);
+        return n;
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers)
+    {
+        asio::error_code ec;
+        size_t n = this->read_some(buffers, ec);
+        if (ec)
+            throw asio::system_error(ec);
+        return n;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers, asio::error_code &ec)
+    {
+        ec = asio::error_code();
+        size_t wanted = asio::buffer_size(buffers);
+        if (wanted == 0)
+            return 0;
+        std::uint32_t head = this->out_->head.load(std::memory_order_relaxed);
+        std::uint32_t used = 0;
+        bool ready = this->waitFor([&]
+                                   {
+            used = head - this->out_->tail.load(std::memory_order_seq_cst);
+            return used != this->capacity_; }, this->out_->writerWaiting, this->out_->spaceSignal);
+        if (!ready || this->isClosed())
+        {
+            ec = asio::error::broken_pipe;
+            return 0;
+        }
+        if (used > this->capacity_)
+        {
+            this->close();
+            ec = asio::error::connection_aborted;
+            return 0;
+        }
+        size_t n = std::min<size_t>(this->capacity_ - used, wanted);
+        asio::buffer_copy(this->ringSpan(this->outData_, head, n), buffers, n);
+        this->out_->head.store(head + static_cast<std::uint32_t>(n), std::memory_order_seq_cst);
+        if (this->out_->readerWaiting.load(std::memory_order_seq_cst))
+            ShmFutex::signal(this->out_->dataSignal);
+        return n;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers)
+    {
+        asio::error_code ec;
+        size_t n = this->write_some(buffers, ec);
+        if (ec)
+            throw asio::system_error(ec);
+        return n;
+    }
+
+    // bytes that can be read without blocking (a ring in a state it can't be in counts as empty, read_some fails on it)
+    size_t available() const
+    {
+        std::uint32_t readable = this->in_->head.load(std::memory_order_acquire) - this->in_->tail.load(std::memory_order_relaxed);
+        return readable > this->capacity_ ? 0 : readable;
+    }
+
+    bool is_open() const
+    {
+        return this->base_ != nullptr && !this->isClosed();
+    }
+
+    // hangs up both directions and wakes the peer, whatever it is waiting for
+    void close()
+    {
+        if (this->base_ == nullptr || this->segment_->closed.exchange(1, std::memory_order_seq_cst) != 0)
+            return;
+        for (Ring &ring : this->segment_->rings)
+        {
+            ShmFutex::signal(ring.dataSignal);
+            ShmFutex::signal(ring.spaceSignal);
+        }
+    }
+};
+
+/**
+ * The listener's end of the shared memory transport: a small rendezvous object under the listening name, through
+ *      which connectors hand over the segments they created. It has one slot, claimed by one connector at a time
+ *      (free -> claimed -> posted -> free), so a connector only waits while another one is being handed over.
+ *
+ * The slot word holds the claiming connector's pid next to the state, set by the same compare-and-swap that claims
+ *      it, so a slot left claimed by a connector that died is taken back by accept(). A posted segment that can't be
+ *      mapped frees the slot too, so one bad connector can't wedge the listener.
+ */
+class ShmAcceptor
+{
+private:
+    static constexpr char magic[8] = {'D', 'H', 'K', 'E', 'S', 'H', 'M', 'L'};
+    static constexpr std::uint32_t slotFree = 0;
+    static constexpr std::uint32_t slotClaimed = 1;
+    static constexpr std::uint32_t slotPosted = 2;
+    static constexpr size_t maxNameBytes = 128;
+
+    static_assert(std::atomic<std::uint64_t>::is_always_lock_free, "the rendezvous slot must be a lock-free 64-bit atomic");
+
+    struct Rendezvous
+    {
+        char magic[8];
+        std::atomic<std::int32_t> listenerPid;
+        // the slot state in the low half, the pid of the connector that claimed it in the high half
+        std::atomic<std::uint64_t> slot;
+        // bumped on every change of the slot
+        std::atomic<std::uint32_t> slotSignal;
+        char segment[maxNameBytes];
+    };
+
+    std::string name_;
+    ShmOptions options_;
+    Rendezvous *rendezvous_ = nullptr;
+
+    static std::uint64_t slotWord(std::uint32_t state, std::int32_t pid)
+    {
+        return static_cast<std::uint64_t>(static_cast<std::uint32_t>(pid)) << 32 | state;
+    }
+
+    static std::uint32_t slotState(std::uint64_t word)
+    {
+        return static_cast<std::uint32_t>(word);
+    }
+
+    static std::int32_t slotPid(std::uint64_t word)
+    {
+        return static_cast<std::int32_t>(word >> 32);
+    }
+
+    // hands the slot to the next connector, whatever became of the last one
+    void freeSlot()
+    {
+        this->rendezvous_->slot.store(slotWord(slotFree, 0), std::memory_order_seq_cst);
+        ShmFutex::signal(this->rendezvous_->slotSignal);
+    }
+
+    static Rendezvous *map(int fd)
+    {
+        void *base = mmap(nullptr, sizeof(Rendezvous), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (base == MAP_FAILED)
+            throw std::system_error(errno, std::generic_category(), "mmap");
+        return static_cast<Rendezvous *>(base);
+    }
+
+public:
+    /**
+     * Creates the rendezvous object, replacing any left over by a listener that didn't shut down cleanly
+     * @param name The shared memory name connectors will use
+     * @param options Options for the accepted connections
+     * @throws std::system_error If the object can't be created
+     */
+    explicit ShmAcceptor(const std::string &name, ShmOptions options = ShmOptions())
+        : name_(ShmFutex::objectName(name)), options_(options)
+    {
+        shm_unlink(this->name_.c_str());
+        int fd = shm_open(this->name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::generic_category(), "shm_open " + this->name_);
+        if (ftruncate(fd, sizeof(Rendezvous)) != 0)
+        {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), "ftruncate " + this->name_);
+        }
+        this->rendezvous_ = new (map(fd)) Rendezvous();
+        std::memcpy(this->rendezvous_->magic, magic, sizeof(magic));
+        this->rendezvous_->listenerPid = static_cast<std::int32_t>(getpid());
+    }
+
+    ~ShmAcceptor()
+    {
+        // a connection handed over but never accepted would otherwise stay in /dev/shm
+        if (slotState(this->rendezvous_->slot.load()) == slotPosted)
+            shm_unlink(this->rendezvous_->segment);
+        munmap(this->rendezvous_, sizeof(Rendezvous));
+        shm_unlink(this->name_.c_str());
+    }
+
+    ShmAcceptor(const ShmAcceptor &) = delete;
+    ShmAcceptor &operator=(const ShmAcceptor &) = delete;
+
+    /**
+     * Waits for the next connector. A connector whose segment can't be mapped (gone, or not a connection segment) is
+     *      logged and skipped
+     * @returns The connection
+     */
+    ShmStream accept()
+    {
+        Rendezvous &rendezvous = *this->rendezvous_;
+        while (true)
+        {
+            std::uint32_t seen = rendezvous.slotSignal.load(std::memory_order_seq_cst);
+            std::uint64_t word = rendezvous.slot.load(std::memory_order_seq_cst);
+            if (slotState(word) == slotPosted)
+            {
+                std::string segment(rendezvous.segment, strnlen(rendezvous.segment, maxNameBytes));
+                // map the segment before freeing the slot, the destructor cleans up anything still posted
+                struct FreeSlot
+                {
+                    ShmAcceptor *acceptor;
+                    ~FreeSlot()
+                    {
+                        this->acceptor->freeSlot();
+                    }
+                } freeSlot{this};
+                try
+                {
+                    return ShmStream::open(segment, this->options_);
+                }
+                catch (const std::exception &ex)
+                {
+                    spdlog::warn("[ShmAcceptor] Dropping connection from pid {}: {}", slotPid(word), ex.what());
+                    continue;
+                }
+            }
+            // a connector that died between claiming the slot and posting its segment never frees it
+            if (slotState(word) == slotClaimed && !ShmFutex::isAlive(slotPid(word)) &&
+                rendezvous.slot.compare_exchange_strong(word, slotWord(slotFree, 0), std::memory_order_seq_cst))
+            {
+                spdlog::warn("[ShmAcceptor] Reclaiming the slot from pid {}, which exited before handing over", slotPid(word));
+                ShmFutex::signal(rendezvous.slotSignal);
+                continue;
+            }
+            ShmFutex::wait(rendezvous.slotSignal, seen, std::chrono::milliseconds(1000));
+        }
+    }
+
+    /**
+     * Connects to a listener: creates a segment and hands its name over. Like a TCP connect that completes in the
+     *      kernel's backlog, this returns as soon as the segment is posted, the listener maps it when it next accepts
+     * @param name The listener's shared memory name
+     * @param options Ring size and spinning for the connection
+     * @throws asio::system_error With asio::error::connection_refused if no listener is running under the name
+     */
+    static ShmStream connect(const std::string &name, ShmOptions options = ShmOptions())
+    {
+        static std::atomic<std::uint32_t> counter{0};
+        std::string object = ShmFutex::objectName(name);
+        int fd = shm_open(object.c_str(), O_RDWR, 0);
+        if (fd < 0)
+            throw asio::system_error(asio::error::connection_refused);
+        struct stat info;
+        if (fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Rendezvous))
+        {
+            ::close(fd);
+            throw asio::system_error(asio::error::connection_refused);
+        }
+        Rendezvous *rendezvous = map(fd);
+        struct Unmap
+        {
+            Rendezvous *rendezvous;
+            ~Unmap()
+            {
+                munmap(this->rendezvous, sizeof(Rendezvous));
+            }
+        } unmap{rendezvous};
+        if (std::memcmp(rendezvous->magic, magic, sizeof(magic)) != 0 || !ShmFutex::isAlive(rendezvous->listenerPid.load()))
+            throw asio::system_error(asio::error::connection_refused);
+
+        auto pid = static_cast<std::int32_t>(getpid());
+        std::string segment = object + "." + std::to_string(pid) + "." + std::to_string(counter++);
+        if (segment.size() >= maxNameBytes)
+            throw std::system_error(ENAMETOOLONG, std::generic_category(), "shm name " + object);
+        ShmStream stream = ShmStream::create(segment, options);
+
+        while (true)
+        {
+            std::uint32_t seen = rendezvous->slotSignal.load(std::memory_order_seq_cst);
+            std::uint64_t expected = slotWord(slotFree, 0);
+            if (rendezvous->slot.compare_exchange_strong(expected, slotWord(slotClaimed, pid), std::memory_order_seq_cst))
+                break;
+            if (!ShmFutex::isAlive(rendezvous->listenerPid.load()))
+            {
+                shm_unlink(segment.c_str());
+                throw asio::system_error(asio::error::connection_refused);
+            }
+            ShmFutex::wait(rendezvous->slotSignal, seen, std::chrono::milliseconds(100));
+        }
+        std::memcpy(rendezvous->segment, segment.c_str(), segment.size() + 1);
+        rendezvous->slot.store(slotWord(slotPosted, pid), std::memory_order_seq_cst);
+        ShmFutex::signal(rendezvous->slotSignal);
+        return stream;
+    }
+};
+
+#endif
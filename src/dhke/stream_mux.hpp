@@ -0,0 +1,436 @@
+#ifndef STREAM_MUX_HPP
+#define STREAM_MUX_HPP
+
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include "record_layer.hpp"
+
+/**
+ * Flow control and scheduling settings for a StreamMux
+ */
+struct StreamMuxOptions
+{
+    // the most a stream buffers for us before we read() it, at least StreamMux::openingCredit. The side opening a
+    //      stream announces its own, and a stream the peer opens gets the smaller of the peer's and ours
+    std::uint32_t initialWindow = 256 * 1024;
+    // streams the peer may have open at once, a StreamOpen beyond that breaks the session
+    size_t maxStreams = 1024;
+    // the most one stream sends in its turn, before the next stream with data gets to send
+    size_t quantum = 16 * 1024;
+    // the most one pump() call sends, so the caller gets back to reading regularly
+    size_t maxPumpBytes = 256 * 1024;
+};
+
+/**
+ * Per-session counters kept by a StreamMux
+ */
+struct StreamMuxStats
+{
+    std::uint64_t streamsOpened = 0;
+    std::uint64_t streamsAccepted = 0;
+    std::uint64_t bytesSent = 0;
+    std::uint64_t bytesReceived = 0;
+    // StreamWindow records sent, each one hands the peer more credit on a stream
+    std::uint64_t windowUpdatesSent = 0;
+    // times a stream had data to send but had run out of credit
+    std::uint64_t creditStalls = 0;
+};
+
+/**
+ * Something that happened on a stream, as reported by StreamMux::poll()
+ */
+struct StreamEvent
+{
+    enum class Type
+    {
+        // the peer opened a new stream
+        Opened,
+        // data arrived on the stream, collect it with read()
+        Data,
+        // the peer will not send any more data on the stream
+        Finished
+    };
+    Type type;
+    std::uint32_t stream;
+};
+
+/**
+ * Many logical streams over one encrypted session, so concurrent conversations with a peer don't each need their own
+ *      handshake. Every stream message is a record (see RecordLayer) carrying the stream id in its header, so opening
+ *      a stream is a single StreamOpen record with a 4 byte payload.
+ *
+ * - Stream ids: the connector opens odd ids and the listener even ones, so both sides can open streams without
+ *      agreeing on ids first.
+ *
+ * - Flow control: each side has a receive window per stream, and the sender only sends as much as it has credit for.
+ *      StreamOpen carries the opener's window, which is the acceptor's starting credit. The opener starts with
+ *      openingCredit, which every StreamMux accepts, so it can send straight away. The acceptor's window is the
+ *      smaller of the opener's and its own, and it grants the opener whatever that adds over openingCredit with a
+ *      StreamWindow record. When the application read()s data, the credit is handed back the same way, once half the
+ *      window has been consumed. A stream whose reader falls behind stops sending, without holding up any other
+ *      stream, and a peer that sends beyond its credit or opens more than maxStreams streams breaks the session.
+ *
+ * - Scheduling: write() only queues data. pump() sends it, taking the streams with data and credit in round-robin
+ *      order and sending at most one quantum from each per turn. A bulk transfer therefore delays a small message on
+ *      another stream by at most one quantum per busy stream, rather than by everything it has queued.
+ *
+ * Like RecordLayer, a StreamMux is driven from a single thread: write(), pump() to send, poll() for incoming events.
+ *      pump() flushes the record layer when it is done, so a RecordLayer with a flush latency set puts each round of
+ *      records in one write.
+ */
+class StreamMux
+{
+public:
+    // what the opener of a stream may send before the acceptor grants more, so every window is at least this big
+    static constexpr std::uint32_t openingCredit = 64 * 1024;
+
+private:
+    struct Stream
+    {
+        // queued by write(), not sent yet from sendOffset onwards
+        std::string sendBuffer;
+        size_t sendOffset = 0;
+        // bytes we may still send before the peer hands back more credit
+        std::uint64_t credit = 0;
+        bool finishQueued = false;
+        bool finishSent = false;
+        // true while the stream is in the round-robin queue
+        bool scheduled = false;
+        // received, not read() yet
+        std::string received;
+        // read(), but not credited back to the peer yet
+        std::uint64_t consumed = 0;
+        std::uint32_t window = 0;
+        bool peerFinished = false;
+
+        size_t pending() const
+        {
+            return this->sendBuffer.size() - this->sendOffset;
+        }
+    };
+
+    RecordLayer &records_;
+    StreamMuxOptions options_;
+    std::uint32_t nextStreamId_;
+    std::unordered_map<std::uint32_t, Stream> streams_;
+    // streams with something to send, in turn order
+    std::deque<std::uint32_t> ready_;
+    std::deque<StreamEvent> events_;
+    bool peerClosed_ = false;
+    // streams opened by the peer that haven't been retired yet
+    size_t peerStreams_ = 0;
+    StreamMuxStats stats_;
+
+    // windows go on the wire as 4 byte little-endian integers
+    static std::string encodeWindow(std::uint32_t bytes)
+    {
+        std::string payload(4, '\0');
+        RecordLayer::putLE(payload.data(), bytes, 4);
+        return payload;
+    }
+
+    static std::uint32_t decodeWindow(std::string_view payload)
+    {
+        if (payload.size() != 4)
+            throw std::runtime_error("Malformed stream window");
+        return static_cast<std::uint32_t>(RecordLayer::getLE(payload.data(), 4));
+    }
+
+    Stream &find(std::uint32_t id)
+    {
+        auto it = this->streams_.find(id);
+        if (it == this->streams_.end())
+            throw std::invalid_argument("Unknown stream " + std::to_string(id));
+        return it->second;
+    }
+
+    // puts the stream in the round-robin queue if it can send anything now
+    void schedule(std::uint32_t id, Stream &stream)
+    {
+        if (stream.scheduled || stream.finishSent)
+            return;
+        bool canSend = (stream.pending() > 0 && stream.credit > 0) || (stream.finishQueued && stream.pending() == 0);
+        if (!canSend)
+            return;
+        stream.scheduled = true;
+        this->ready_.push_back(id);
+    }
+
+    // forgets a stream once both directions are finished and everything received has been read
+    void retireIfDone(std::uint32_t id)
+    {
+        auto it = this->streams_.find(id);
+        if (it != this->streams_.end() && it->second.finishSent && it->second.peerFinished && it->second.received.empty())
+        {
+            if (this->isPeerStreamId(id))
+                this->peerStreams_--;
+            this->streams_.erase(it);
+        }
+    }
+
+    // streams opened by the peer have the other parity from ours
+    bool isPeerStreamId(std::uint32_t id) const
+    {
+        return id != 0 && (id & 1) != (this->nextStreamId_ & 1);
+    }
+
+    void handle(const Record &record)
+    {
+        switch (record.type)
+        {
+        case RecordType::StreamOpen:
+        {
+            if (!this->isPeerStreamId(record.stream) || this->streams_.count(record.stream) > 0)
+                throw std::runtime_error("Peer opened invalid stream " + std::to_string(record.stream));
+            if (this->peerStreams_ >= this->options_.maxStreams)
+                throw std::runtime_error("Peer opened more than " + std::to_string(this->options_.maxStreams) + " streams");
+            std::uint32_t peerWindow = decodeWindow(record.payload);
+            if (peerWindow < openingCredit)
+                throw std::runtime_error("Peer opened stream " + std::to_string(record.stream) + " with a window below the opening credit");
+            Stream &stream = this->streams_[record.stream];
+            this->peerStreams_++;
+            // the peer's window is what we may send, ours is what we buffer, however much the peer would like to send
+            stream.credit = peerWindow;
+            stream.window = std::min(peerWindow, this->options_.initialWindow);
+            if (stream.window > openingCredit)
+            {
+                this->records_.send(encodeWindow(stream.window - openingCredit), RecordType::StreamWindow, record.stream);
+                this->stats_.windowUpdatesSent++;
+            }
+            this->stats_.streamsAccepted++;
+            this->events_.push_back({StreamEvent::Type::Opened, record.stream});
+            break;
+        }
+        case RecordType::StreamData:
+        {
+            Stream &stream = this->find(record.stream);
+            if (stream.peerFinished)
+                throw std::runtime_error("Data after the end of stream " + std::to_string(record.stream));
+            if (stream.received.size() + stream.consumed + record.payload.size() > stream.window)
+                throw std::runtime_error("Peer exceeded the flow control window of stream " + std::to_string(record.stream));
+            stream.received.append(record.payload);
+            this->stats_.bytesReceived += record.payload.size();
+            this->events_.push_back({StreamEvent::Type::Data, record.stream});
+            break;
+        }
+        case RecordType::StreamWindow:
+        {
+            // credit can arrive for a stream we have already finished and retired, which is harmless
+            auto it = this->streams_.find(record.stream);
+            if (it == this->streams_.end())
+                break;
+            it->second.credit += decodeWindow(record.payload);
+            this->schedule(record.stream, it->second);
+            break;
+        }
+        case RecordType::StreamClose:
+        {
+            this->find(record.stream).peerFinished = true;
+            this->events_.push_back({StreamEvent::Type::Finished, record.stream});
+            break;
+        }
+        default:
+            throw std::runtime_error("Unexpected record type " + std::to_string(static_cast<int>(record.type)) + " on a multiplexed session");
+        }
+    }
+
+public:
+    /**
+     * @param records The session's record layer, must outlive the mux
+     * @param isListener Which side of the handshake we were, which decides the ids of the streams we open
+     * @param options Flow control and scheduling settings
+     */
+    StreamMux(RecordLayer &records, bool isListener, StreamMuxOptions options = StreamMuxOptions())
+        : records_(records), options_(options), nextStreamId_(isListener ? 2 : 1)
+    {
+        if (options.quantum == 0)
+            throw std::invalid_argument("Stream quantum must be non-zero");
+        if (options.initialWindow < openingCredit)
+            throw std::invalid_argument("Stream window must be at least " + std::to_string(openingCredit) + " bytes");
+    }
+
+    StreamMux(const StreamMux &) = delete;
+    StreamMux &operator=(const StreamMux &) = delete;
+
+    const StreamMuxStats &getStats() const
+    {
+        return this->stats_;
+    }
+
+    /**
+     * Opens a new stream, costing one small record and no round trip: up to openingCredit bytes can be sent straight
+     *      away, the rest once the peer's grant arrives
+     * @returns The new stream's id
+     */
+    std::uint32_t open()
+    {
+        if (this->nextStreamId_ > RecordLayer::maxStreamId)
+            throw std::runtime_error("Out of stream ids");
+        std::uint32_t id = this->nextStreamId_;
+        this->nextStreamId_ += 2;
+        Stream &stream = this->streams_[id];
+        stream.window = this->options_.initialWindow;
+        // the peer's window isn't known yet, but it is at least openingCredit and the peer grants the rest
+        stream.credit = openingCredit;
+        this->records_.send(encodeWindow(stream.window), RecordType::StreamOpen, id);
+        this->stats_.streamsOpened++;
+        return id;
+    }
+
+    /**
+     * Queues data on a stream, it is sent by pump() as credit and the stream's turn allow
+     * @param id The stream
+     * @param data The data to send
+     */
+    void write(std::uint32_t id, std::string_view data)
+    {
+        Stream &stream = this->find(id);
+        if (stream.finishQueued)
+            throw std::logic_error("Write after finishing stream " + std::to_string(id));
+        // compact once the sent part makes up most of the buffer
+        if (stream.sendOffset > 0 && stream.sendOffset * 2 >= stream.sendBuffer.size())
+        {
+            stream.sendBuffer.erase(0, stream.sendOffset);
+            stream.sendOffset = 0;
+        }
+        stream.sendBuffer.append(data);
+        this->schedule(id, stream);
+    }
+
+    // ends our side of the stream, once everything already written has been sent
+    void finish(std::uint32_t id)
+    {
+        Stream &stream = this->find(id);
+        stream.finishQueued = true;
+        this->schedule(id, stream);
+    }
+
+    /**
+     * Takes everything received on a stream so far, and hands the credit back to the peer once half the window is consumed
+     * @param id The stream
+     * @returns The data, empty if there is none (or the stream has been retired)
+     */
+    std::string read(std::uint32_t id)
+    {
+        auto it = this->streams_.find(id);
+        if (it == this->streams_.end())
+            return {};
+        Stream &stream = it->second;
+        std::string data;
+        data.swap(stream.received);
+        stream.consumed += data.size();
+        if (stream.consumed >= stream.window / 2 && !stream.peerFinished)
+        {
+            this->records_.send(encodeWindow(static_cast<std::uint32_t>(stream.consumed)), RecordType::StreamWindow, id);
+            stream.consumed = 0;
+            this->stats_.windowUpdatesSent++;
+        }
+        this->retireIfDone(id);
+        return data;
+    }
+
+    // how much written data on the stream is still waiting to be sent
+    size_t pending(std::uint32_t id)
+    {
+        return this->find(id).pending();
+    }
+
+    // true if any stream has something it can send right now
+    bool hasSendable() const
+    {
+        return !this->ready_.empty();
+    }
+
+    /**
+     * Sends queued stream data, one quantum per stream per turn in round-robin order, until nothing more can be sent or
+     *      maxPumpBytes has gone out. Everything sent is flushed to the socket before returning
+     * @returns The number of payload bytes sent
+     */
+    size_t pump()
+    {
+        size_t sent = 0;
+        while (!this->ready_.empty() && sent < this->options_.maxPumpBytes)
+        {
+            std::uint32_t id = this->ready_.front();
+            this->ready_.pop_front();
+            Stream &stream = this->streams_.at(id);
+            stream.scheduled = false;
+
+            size_t chunk = std::min({stream.pending(), this->options_.quantum, RecordLayer::maxPayloadBytes, static_cast<size_t>(stream.credit)});
+            if (chunk > 0)
+            {
+                this->records_.send(std::string_view(stream.sendBuffer).substr(stream.sendOffset, chunk), RecordType::StreamData, id);
+                stream.sendOffset += chunk;
+                stream.credit -= chunk;
+                sent += chunk;
+                this->stats_.bytesSent += chunk;
+                if (stream.credit == 0 && stream.pending() > 0)
+                    this->stats_.creditStalls++;
+            }
+            if (stream.finishQueued && stream.pending() == 0)
+            {
+                this->records_.send({}, RecordType::StreamClose, id);
+                stream.finishSent = true;
+                this->retireIfDone(id);
+                continue;
+            }
+            // back to the end of the line, if it still has something it can send
+            this->schedule(id, stream);
+        }
+        this->records_.flush();
+        return sent;
+    }
+
+    /**
+     * Returns the next stream event, reading records from the peer as needed
+     * @param wait Block until there is an event. Otherwise only reads what has already arrived
+     * @returns The event, or std::nullopt if there is none yet (without wait), the peer has handed back credit that
+     *      gives pump() something to send, or the peer has closed the session
+     * @throws std::runtime_error if the peer breaks the stream protocol, plus anything RecordLayer::receive() throws
+     */
+    std::optional<StreamEvent> poll(bool wait)
+    {
+        while (this->events_.empty() && !this->peerClosed_)
+        {
+            if (!wait && !this->records_.hasInput())
+                break;
+            std::optional<Record> record = this->records_.receive();
+            if (!record)
+            {
+                this->peerClosed_ = true;
+                break;
+            }
+            this->handle(*record);
+            // a window update doesn't make an event, but the caller has to pump() before waiting any longer
+            if (this->events_.empty() && this->hasSendable())
+                break;
+        }
+        if (this->events_.empty())
+            return std::nullopt;
+        StreamEvent event = this->events_.front();
+        this->events_.pop_front();
+        return event;
+    }
+
+    // true once the peer has closed the whole session
+    bool isPeerClosed() const
+    {
+        return this->peerClosed_;
+    }
+
+    // closes the whole session, after sending everything that can be sent
+    void close()
+    {
+        while (this->hasSendable())
+            this->pump();
+        this->records_.close();
+    }
+};
+
+#endif
@@ -0,0 +1,240 @@
+#ifndef TICKET_HPP
+#define TICKET_HPP
+
+#include <string>
+#include <deque>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <unordered_set>
+#include <spdlog/spdlog.h>
+#include "crypto.hpp"
+
+/**
+ * What the connector keeps after a successful handshake, so it can resume the session later without a new key exchange
+ */
+struct ResumptionState
+{
+    // the opaque ticket issued by the listener
+    std::string ticket;
+    // the resumption secret, derived from the shared secret of the handshake that issued the ticket
+    std::string secret;
+    // identity of the listener that issued the ticket
+    std::string peerId;
+    // unix time (seconds) after which the listener will no longer accept the ticket
+    std::int64_t expiresAt = 0;
+
+    // true if the ticket can still be presented to the given peer
+    bool usableFor(const std::string &peer, std::int64_t now) const
+    {
+        return !this->ticket.empty() && this->peerId == peer && now < this->expiresAt;
+    }
+};
+
+/**
+ * The SessionTicketManager issues and redeems session resumption tickets on the listener side.
+ *
+ * A ticket carries everything the listener needs to resume a session (peer identity, expiry and the resumption secret),
+ * encrypted and MAC'd under a ticket key that only the listener knows. This means the listener does not have to keep
+ * any per-session state around, it just needs its ticket keys.
+ *
+ * - Ticket keys are rotated on a fixed interval. Tickets issued under the previous key are still accepted, anything older is rejected.
+ *
+ * - Tickets are single use. Redeemed tickets go into a bounded anti-replay cache; once the cache is full the oldest
+ *      entries are evicted and every ticket issued before them is rejected, so eviction can never re-enable a replay.
+ *
+ * Ticket wire format: <key id>.<nonce>.<hex ciphertext>.<mac>, where the plaintext is issuedAt|expiresAt|secret|peerId
+ */
+class SessionTicketManager
+{
+private:
+    struct TicketKey
+    {
+        std::uint32_t id = 0;
+        std::string encryptionKey;
+        std::string macKey;
+        std::int64_t createdAt = 0;
+    };
+
+    std::chrono::seconds ticketLifetime_;
+    std::chrono::seconds keyRotationInterval_;
+    size_t replayCacheCapacity_;
+
+    TicketKey currentKey_;
+    std::optional<TicketKey> previousKey_;
+    std::uint32_t nextKeyId_ = 1;
+
+    // anti-replay cache: nonces of redeemed tickets, in redemption order so the oldest can be evicted
+    std::deque<std::pair<std::string, std::int64_t>> redeemedOrder_;
+    std::unordered_set<std::string> redeemed_;
+    // tickets issued at or before this time are rejected, because their cache entries may have been evicted
+    std::int64_t replayFloor_ = 0;
+
+    std::mutex mutex_;
+
+    static std::int64_t nowSeconds()
+    {
+        return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+    TicketKey makeKey(std::int64_t now)
+    {
+        TicketKey key;
+        key.id = this->nextKeyId_++;
+        key.encryptionKey = CryptoUtils::randomHex(32);
+        key.macKey = CryptoUtils::randomHex(32);
+        key.createdAt = now;
+        return key;
+    }
+
+    void rotateKeysIfDue(std::int64_t now)
+    {
+        if (now - this->currentKey_.createdAt < this->keyRotationInterval_.count())
+            return;
+        spdlog::info("[SessionTicketManager] Rotating ticket key {}", this->currentKey_.id);
+        this->previousKey_ = this->currentKey_;
+        this->currentKey_ = this->makeKey(now);
+    }
+
+    const TicketKey *findKey(std::uint32_t id) const
+    {
+        if (this->currentKey_.id == id)
+            return &this->currentKey_;
+        if (this->previousKey_ && this->previousKey_->id == id)
+            return &*this->previousKey_;
+        return nullptr;
+    }
+
+    static std::string ticketMac(const TicketKey &key, const std::string &nonce, const std::string &ciphertextHex)
+    {
+        return CryptoUtils::computeMac(key.macKey, "TICKET|" + std::to_string(key.id) + "|" + nonce + "|" + ciphertextHex);
+    }
+
+public:
+    /**
+     * @param ticketLifetime How long an issued ticket can be redeemed for
+     * @param keyRotationInterval How long each ticket key is used to issue tickets before a new one is generated
+     * @param replayCacheCapacity The maximum number of redeemed tickets remembered for anti-replay
+     */
+    SessionTicketManager(std::chrono::seconds ticketLifetime = std::chrono::hours(1),
+                         std::chrono::seconds keyRotationInterval = std::chrono::hours(1),
+                         size_t replayCacheCapacity = 4096)
+        : ticketLifetime_(ticketLifetime), keyRotationInterval_(keyRotationInterval), replayCacheCapacity_(replayCacheCapacity)
+    {
+        this->currentKey_ = this->makeKey(nowSeconds());
+    }
+
+    std::chrono::seconds getTicketLifetime() const
+    {
+        return this->ticketLifetime_;
+    }
+
+    /**
+     * Issues a new ticket for a peer
+     * @param peerId The identity of the peer the ticket is issued to
+     * @param resumptionSecret The resumption secret shared with that peer
+     * @returns The encoded ticket
+     */
+    std::string issueTicket(const std::string &peerId, const std::string &resumptionSecret)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        std::int64_t now = nowSeconds();
+        this->rotateKeysIfDue(now);
+
+        std::string nonce = CryptoUtils::randomHex(16);
+        std::string plaintext = std::to_string(now) + "|" + std::to_string(now + this->ticketLifetime_.count()) + "|" + resumptionSecret + "|" + peerId;
+        std::string ciphertextHex = CryptoUtils::hexEncode(
+            CryptoUtils::xorWithKey(plaintext, CryptoUtils::keystream(this->currentKey_.encryptionKey, nonce, plaintext.size())));
+
+        return std::to_string(this->currentKey_.id) + "." + nonce + "." + ciphertextHex + "." + ticketMac(this->currentKey_, nonce, ciphertextHex);
+    }
+
+    /**
+     * Decrypts and checks a ticket, WITHOUT marking it as used (see markRedeemed)
+     * @param ticket The encoded ticket
+     * @param peerId The identity the peer claims, must match the identity the ticket was issued to
+     * @returns The resumption secret, or std::nullopt if the ticket is invalid, expired or already redeemed
+     */
+    std::optional<std::string> openTicket(const std::string &ticket, const std::string &peerId)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        std::int64_t now = nowSeconds();
+        this->rotateKeysIfDue(now);
+
+        // split the four '.' separated fields
+        size_t first = ticket.find('.');
+        size_t second = first == std::string::npos ? first : ticket.find('.', first + 1);
+        size_t third = second == std::string::npos ? second : ticket.find('.', second + 1);
+        if (third == std::string::npos)
+            return std::nullopt;
+
+        try
+        {
+            std::uint32_t keyId = static_cast<std::uint32_t>(std::stoul(ticket.substr(0, first)));
+            std::string nonce = ticket.substr(first + 1, second - first - 1);
+            std::string ciphertextHex = ticket.substr(second + 1, third - second - 1);
+            std::string mac = ticket.substr(third + 1);
+
+            const TicketKey *key = this->findKey(keyId);
+            if (key == nullptr || mac != ticketMac(*key, nonce, ciphertextHex))
+                return std::nullopt;
+            if (this->redeemed_.count(nonce) != 0)
+            {
+                spdlog::warn("[SessionTicketManager] Replayed ticket rejected");
+                return std::nullopt;
+            }
+
+            std::string ciphertext = CryptoUtils::hexDecode(ciphertextHex);
+            std::string plaintext = CryptoUtils::xorWithKey(ciphertext, CryptoUtils::keystream(key->encryptionKey, nonce, ciphertext.size()));
+
+            size_t a = plaintext.find('|');
+            size_t b = a == std::string::npos ? a : plaintext.find('|', a + 1);
+            size_t c = b == std::string::npos ? b : plaintext.find('|', b + 1);
+            if (c == std::string::npos)
+                return std::nullopt;
+            std::int64_t issuedAt = std::stoll(plaintext.substr(0, a));
+            std::int64_t expiresAt = std::stoll(plaintext.substr(a + 1, b - a - 1));
+            std::string secret = plaintext.substr(b + 1, c - b - 1);
+            std::string ticketPeer = plaintext.substr(c + 1);
+
+            if (now >= expiresAt || issuedAt <= this->replayFloor_ || ticketPeer != peerId)
+                return std::nullopt;
+            return secret;
+        }
+        catch (const std::exception &)
+        {
+            return std::nullopt;
+        }
+    }
+
+    /**
+     * Records a ticket as redeemed, so that it can't be used again
+     * @param ticket The encoded ticket, previously accepted by openTicket
+     * @returns False if the ticket had already been redeemed
+     */
+    bool markRedeemed(const std::string &ticket)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        size_t first = ticket.find('.');
+        size_t second = first == std::string::npos ? first : ticket.find('.', first + 1);
+        if (second == std::string::npos)
+            return false;
+        std::string nonce = ticket.substr(first + 1, second - first - 1);
+        if (!this->redeemed_.insert(nonce).second)
+            return false;
+
+        std::int64_t now = nowSeconds();
+        this->redeemedOrder_.emplace_back(nonce, now);
+        while (this->redeemedOrder_.size() > this->replayCacheCapacity_)
+        {
+            // anything issued before the evicted ticket was redeemed can no longer be checked, so reject it from now on
+            this->replayFloor_ = std::max(this->replayFloor_, this->redeemedOrder_.front().second);
+            this->redeemed_.erase(this->redeemedOrder_.front().first);
+            this->redeemedOrder_.pop_front();
+        }
+        return true;
+    }
+};
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef TRANSCRIPT_HPP
+#define TRANSCRIPT_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <spdlog/spdlog.h>
+#include "group.hpp"
+
+/**
+ * What a transcript entry records
+ */
+enum class TranscriptEvent : std::uint8_t
+{
+    // a new connection, the data holds ROLE, NAME and PEER lines (plus P, Q and G if a group was pre-agreed)
+    Begin = 1,
+    // handshake bytes written to the peer, exactly as sent
+    Sent = 2,
+    // handshake bytes read from the peer, exactly as received (in whatever split they arrived)
+    Received = 3,
+    // a record written or read after the handshake: type, stream id and payload length, never the payload
+    RecordSent = 4,
+    RecordReceived = 5,
+    // the connection's handshake has finished, the data is "1" if it succeeded and "0" if not
+    End = 6
+};
+
+/**
+ * One entry read back from a transcript
+ */
+struct TranscriptEntry
+{
+    TranscriptEvent event;
+    std::uint64_t connection;
+    // time since the capture started
+    std::chrono::microseconds at;
+    std::string data;
+};
+
+/**
+ * The metadata of a record entry
+ */
+struct TranscriptRecord
+{
+    std::uint8_t type;
+    std::uint32_t stream;
+    std::uint64_t length;
+};
+
+/**
+ * Transcript file format, shared by the writer and the reader.
+ *
+ * Header (24 bytes): magic "DHKETRNS", u32 version, u32 reserved, u64 capture start (unix time in microseconds), all
+ *      little endian. Then one entry after another:
+ *
+ * [u8 event][varint connection][varint microseconds since the previous entry][varint data length][data]
+ *
+ * Handshake flights are a few hundred bytes of text, so the per-entry overhead is usually 4 to 6 bytes.
+ */
+class TranscriptFormat
+{
+public:
+    static constexpr char magic[8] = {'D', 'H', 'K', 'E', 'T', 'R', 'N', 'S'};
+    static constexpr std::uint32_t version = 1;
+    static constexpr size_t headerSize = 24;
+
+    static void putVarint(std::string &out, std::uint64_t value)
+    {
+        while (value >= 0x80)
+        {
+            out.push_back(static_cast<char>((value & 0x7F) | 0x80));
+            value >>= 7;
+        }
+        out.push_back(static_cast<char>(value));
+    }
+
+    // reads a varint at offset, advancing it. Returns false if the data ends first
+    static bool getVarint(std::string_view in, size_t &offset, std::uint64_t &value)
+    {
+        value = 0;
+        for (unsigned shift = 0; shift < 64 && offset < in.size(); shift += 7)
+        {
+            auto byte = static_cast<unsigned char>(in[offset++]);
+            value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+            if ((byte & 0x80) == 0)
+                return true;
+        }
+        return false;
+    }
+
+    static void putLE(std::string &out, std::uint64_t value, size_t bytes)
+    {
+        for (size_t i = 0; i < bytes; ++i)
+            out.push_back(static_cast<char>(value >> (8 * i)));
+    }
+
+    static std::uint64_t getLE(std::string_view in, size_t offset, size_t bytes)
+    {
+        std::uint64_t value = 0;
+        for (size_t i = 0; i < bytes; ++i)
+            value |= static_cast<std::uint64_t>(static_cast<unsigned char>(in[offset + i])) << (8 * i);
+        return value;
+    }
+
+    static std::string encodeRecord(std::uint8_t type, std::uint32_t stream, std::uint64_t length)
+    {
+        std::string out(1, static_cast<char>(type));
+        putVarint(out, stream);
+        putVarint(out, length);
+        return out;
+    }
+
+    static TranscriptRecord decodeRecord(std::string_view data)
+    {
+        TranscriptRecord record{};
+        size_t offset = 1;
+        std::uint64_t stream = 0;
+        if (data.empty() || !getVarint(data, offset, stream) || !getVarint(data, offset, record.length))
+            throw std::runtime_error("Malformed transcript record entry");
+        record.type = static_cast<std::uint8_t>(data[0]);
+        record.stream = static_cast<std::uint32_t>(stream);
+        return record;
+    }
+};
+
+/**
+ * Captures the traffic of any number of connections into one transcript file, so it can be replayed offline (see
+ *      dhke_bench replay). Handshake bytes are stored exactly as they went over the wire. Records are stored as their
+ *      type, stream and length only, since their contents are encrypted under a key the transcript doesn't have.
+ *
+ * Safe to use from several threads. Entries are buffered, and the file is flushed as each connection ends.
+ */
+class TranscriptWriter
+{
+private:
+    std::mutex mutex_;
+    std::ofstream out_;
+    std::string path_;
+    std::string buffer_;
+    std::chrono::steady_clock::time_point last_;
+    std::uint64_t nextConnection_ = 1;
+
+    void append(TranscriptEvent event, std::uint64_t connection, std::string_view data)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        auto now = std::chrono::steady_clock::now();
+        auto delta = std::chrono::duration_cast<std::chrono::microseconds>(now - this->last_).count();
+        this->last_ = now;
+        this->buffer_.push_back(static_cast<char>(event));
+        TranscriptFormat::putVarint(this->buffer_, connection);
+        TranscriptFormat::putVarint(this->buffer_, static_cast<std::uint64_t>(std::max<std::int64_t>(0, delta)));
+        TranscriptFormat::putVarint(this->buffer_, data.size());
+        this->buffer_.append(data);
+        if (event == TranscriptEvent::End || this->buffer_.size() >= 64 * 1024)
+            this->flushLocked();
+    }
+
+    void flushLocked()
+    {
+        this->out_.write(this->buffer_.data(), static_cast<std::streamsize>(this->buffer_.size()));
+        this->out_.flush();
+        this->buffer_.clear();
+    }
+
+public:
+    /**
+     * Creates (or truncates) the transcript file and writes its header
+     * @param path The file to write
+     * @throws std::runtime_error If the file can't be opened
+     */
+    explicit TranscriptWriter(std::string path)
+        : out_(path, std::ios::binary | std::ios::trunc), path_(std::move(path)), last_(std::chrono::steady_clock::now())
+    {
+        if (!this->out_)
+            throw std::runtime_error("Unable to open transcript file " + this->path_);
+        std::string header(TranscriptFormat::magic, sizeof(TranscriptFormat::magic));
+        TranscriptFormat::putLE(header, TranscriptFormat::version, 4);
+        TranscriptFormat::putLE(header, 0, 4);
+        auto started = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        TranscriptFormat::putLE(header, static_cast<std::uint64_t>(started), 8);
+        this->buffer_ = std::move(header);
+        spdlog::info("[Transcript] Capturing to {}", this->path_);
+    }
+
+    ~TranscriptWriter()
+    {
+        std::lock_guard<std::mutex> lock(this->mutex_);
+        this->flushLocked();
+    }
+
+    TranscriptWriter(const TranscriptWriter &) = delete;
+    TranscriptWriter &operator=(const TranscriptWriter &) = delete;
+
+    /**
+     * Starts a new connection in the transcript
+     * @param isListener Which side of the handshake we are
+     * @param name Our identity
+     * @param peer The identity we expect from the peer
+     * @param preagreed The pre-agreed group, if any, which a replay needs to check one round trip handshakes
+     * @returns The connection's id, for the other calls
+     */
+    std::uint64_t begin(bool isListener, const std::string &name, const std::string &peer, const std::optional<DHGroup> &preagreed = std::nullopt)
+    {
+        std::uint64_t connection;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex_);
+            connection = this->nextConnection_++;
+        }
+        std::string data = std::string("ROLE:") + (isListener ? "LISTENER" : "CONNECTOR") + "\nNAME:" + name + "\nPEER:" + peer + "\n";
+        if (preagreed)
+            data += "P:" + preagreed->prime.str() + "\nQ:" + preagreed->order.str() + "\nG:" + preagreed->generator.str() + "\n";
+        this->append(TranscriptEvent::Begin, connection, data);
+        return connection;
+    }
+
+    void sent(std::uint64_t connection, std::string_view bytes)
+    {
+        this->append(TranscriptEvent::Sent, connection, bytes);
+    }
+
+    void received(std::uint64_t connection, std::string_view bytes)
+    {
+        this->append(TranscriptEvent::Received, connection, bytes);
+    }
+
+    void record(std::uint64_t connection, bool sent, std::uint8_t type, std::uint32_t stream, std::uint64_t length)
+    {
+        this->append(sent ? TranscriptEvent::RecordSent : TranscriptEvent::RecordReceived, connection, TranscriptFormat::encodeRecord(type, stream, length));
+    }
+
+    void end(std::uint64_t connection, bool ok)
+    {
+        this->append(TranscriptEvent::End, connection, ok ? "1" : "0");
+    }
+};
+
+/**
+ * Reads a transcript file back, entry by entry. The whole file is loaded up front, so replaying it involves no I/O
+ */
+class TranscriptReader
+{
+private:
+    std::string data_;
+    size_t offset_ = TranscriptFormat::headerSize;
+    std::chrono::microseconds at_{0};
+    bool truncated_ = false;
+
+public:
+    /**
+     * @param path A transcript written by TranscriptWriter
+     * @throws std::runtime_error If the file is missing or isn't a transcript
+     */
+    explicit TranscriptReader(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Unable to open transcript file " + path);
+        this->data_.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+        if (this->data_.size() < TranscriptFormat::headerSize || std::memcmp(this->data_.data(), TranscriptFormat::magic, sizeof(TranscriptFormat::magic)) != 0)
+            throw std::runtime_error("Not a transcript file: " + path);
+        if (TranscriptFormat::getLE(this->data_, 8, 4) != TranscriptFormat::version)
+            throw std::runtime_error("Unsupported transcript version in " + path);
+    }
+
+    /**
+     * @returns The next entry, or std::nullopt at the end of the file. A final entry cut short (e.g. by a crash during
+     *      capture) ends the transcript early, see isTruncated()
+     */
+    std::optional<TranscriptEntry> next()
+    {
+        std::string_view in(this->data_);
+        if (this->offset_ >= in.size())
+            return std::nullopt;
+        size_t offset = this->offset_ + 1;
+        std::uint64_t connection, delta, length;
+        if (!TranscriptFormat::getVarint(in, offset, connection) || !TranscriptFormat::getVarint(in, offset, delta) ||
+            !TranscriptFormat::getVarint(in, offset, length) || in.size() - offset < length)
+        {
+            this->truncated_ = true;
+            this->offset_ = in.size();
+            return std::nullopt;
+        }
+        this->at_ += std::chrono::microseconds(delta);
+        TranscriptEntry entry{static_cast<TranscriptEvent>(in[this->offset_]), connection, this->at_, std::string(in.substr(offset, length))};
+        this->offset_ = offset + length;
+        return entry;
+    }
+
+    // starts again from the first entry
+    void rewind()
+    {
+        this->offset_ = TranscriptFormat::headerSize;
+        this->at_ = std::chrono::microseconds(0);
+        this->truncated_ = false;
+    }
+
+    // unix time in microseconds when the capture started
+    std::int64_t getStartedAt() const
+    {
+        return static_cast<std::int64_t>(TranscriptFormat::getLE(this->data_, 16, 8));
+    }
+
+    size_t getFileSize() const
+    {
+        return this->data_.size();
+    }
+
+    bool isTruncated() const
+    {
+        return this->truncated_;
+    }
+};
+
+#endif
@@ -0,0 +1,194 @@
+#ifndef TRANSPORT_HPP
+#define TRANSPORT_HPP
+
+#include <array>
+#include <string>
+#include <cstddef>
+#include <iterator>
+#include <stdexcept>
+#include <vector>
+#include <asio.hpp>
+
+/**
+ * Where a peer can be reached: a TCP host (and a port kept separately, as before), a Unix domain socket path given as
+ *      "unix:/path", or a shared memory ring given as "shm:/name" (see ShmStream). The local transports skip the TCP
+ *      loopback stack for peers on the same host. Shared memory needs Linux (it waits on futexes), and Unix sockets
+ *      need a platform asio supports them on, other platforms reject those addresses when they are parsed.
+ */
+struct TransportAddress
+{
+    enum class Kind
+    {
+        Tcp,
+        Unix,
+        Shm
+    };
+
+    Kind kind = Kind::Tcp;
+    // the host name for TCP, the socket path for Unix, the shared memory object name for Shm
+    std::string location;
+
+    /**
+     * @param spec "unix:/path", "shm:/name", or anything else for a TCP host
+     * @returns The parsed address
+     * @throws std::invalid_argument For a local transport this platform doesn't have
+     */
+    static TransportAddress parse(const std::string &spec)
+    {
+        if (spec.rfind("unix:", 0) == 0)
+        {
+#if defined(ASIO_HAS_LOCAL_SOCKETS)
+            return {Kind::Unix, spec.substr(5)};
+#else
+            throw std::invalid_argument("Unix domain sockets are not supported on this platform: " + spec);
+#endif
+        }
+        if (spec.rfind("shm:", 0) == 0)
+        {
+#if defined(__linux__)
+            return {Kind::Shm, spec.substr(4)};
+#else
+            throw std::invalid_argument("Shared memory transport is only supported on Linux: " + spec);
+#endif
+        }
+        return {Kind::Tcp, spec};
+    }
+
+    static bool isLocal(const std::string &spec)
+    {
+        return spec.rfind("unix:", 0) == 0 || spec.rfind("shm:", 0) == 0;
+    }
+
+    bool isLocal() const
+    {
+        return this->kind != Kind::Tcp;
+    }
+
+    std::string toString() const
+    {
+        switch (this->kind)
+        {
+        case Kind::Unix:
+            return "unix:" + this->location;
+        case Kind::Shm:
+            return "shm:" + this->location;
+        default:
+            return this->location;
+        }
+    }
+};
+
+/**
+ * A non-owning reference to any blocking byte stream (a TCP or Unix socket, or a ShmStream), so that the record layer
+ *      and session handlers can run over all of them without becoming templates. Costs one indirect call per read or
+ *      write, which is noise next to the system call or copy behind it. It is itself a blocking asio-style stream
+ *      (read_some and write_some), so LineIO and asio::read/asio::write work on it too.
+ */
+class StreamRef
+{
+public:
+    using ReadBuffers = std::array<asio::mutable_buffer, 2>;
+
+private:
+    void *stream_;
+    size_t (*readSome_)(void *, const ReadBuffers &);
+    void (*write_)(void *, const asio::const_buffer &);
+    void (*writeGather_)(void *, const std::vector<asio::const_buffer> &);
+    size_t (*available_)(void *);
+
+public:
+    /**
+     * @param stream Any type with asio's blocking read_some and write_some and an available(), must outlive the reference
+     */
+    template <typename SyncStream>
+    StreamRef(SyncStream &stream)
+        : stream_(&stream),
+          readSome_([](void *s, const ReadBuffers &buffers)
+                    { return static_cast<SyncStream *>(s)->read_some(buffers); }),
+          write_([](void *s, const asio::const_buffer &buffer)
+                 { asio::write(*static_cast<SyncStream *>(s), buffer); }),
+          writeGather_([](void *s, const std::vector<asio::const_buffer> &buffers)
+                       { asio::write(*static_cast<SyncStream *>(s), buffers); }),
+          available_([](void *s)
+                     { return static_cast<size_t>(static_cast<SyncStream *>(s)->available()); })
+    {
+    }
+
+    // blocks until at least one byte has arrived, throws asio::system_error on errors and at the end of the stream
+    size_t readSome(const ReadBuffers &buffers)
+    {
+        return this->readSome_(this->stream_, buffers);
+    }
+
+    // blocks until the whole buffer has been written
+    void write(const asio::const_buffer &buffer)
+    {
+        this->write_(this->stream_, buffer);
+    }
+
+    // bytes that can be read without blocking
+    size_t available()
+    {
+        return this->available_(this->stream_);
+    }
+
+    // asio SyncReadStream: fills the first two buffers of the sequence, which is all the callers here ever pass
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers)
+    {
+        ReadBuffers first{};
+        size_t count = 0;
+        for (auto it = asio::buffer_sequence_begin(buffers); it != asio::buffer_sequence_end(buffers) && count < first.size(); ++it)
+            first[count++] = asio::mutable_buffer(*it);
+        return this->readSome(first);
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some(const MutableBufferSequence &buffers, asio::error_code &ec)
+    {
+        ec = asio::error_code();
+        try
+        {
+            return this->read_some(buffers);
+        }
+        catch (const asio::system_error &error)
+        {
+            ec = error.code();
+            return 0;
+        }
+    }
+
+    // asio SyncWriteStream: writes the whole sequence, a gather write stays one write on the stream underneath
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers)
+    {
+        auto begin = asio::buffer_sequence_begin(buffers);
+        auto end = asio::buffer_sequence_end(buffers);
+        if (begin == end || std::next(begin) == end)
+        {
+            asio::const_buffer buffer = begin == end ? asio::const_buffer() : asio::const_buffer(*begin);
+            this->write(buffer);
+            return buffer.size();
+        }
+        std::vector<asio::const_buffer> gathered(begin, end);
+        this->writeGather_(this->stream_, gathered);
+        return asio::buffer_size(gathered);
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some(const ConstBufferSequence &buffers, asio::error_code &ec)
+    {
+        ec = asio::error_code();
+        try
+        {
+            return this->write_some(buffers);
+        }
+        catch (const asio::system_error &error)
+        {
+            ec = error.code();
+            return 0;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef TRANSPORT_STATS_HPP
+#define TRANSPORT_STATS_HPP
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * A counter many threads bump at once, such as the shards of a sharded listener. Each thread adds to one of a fixed set
+ *      of stripes, each on its own cache line, so they don't bounce a shared line between cores on every socket call.
+ *      The stripes are only summed when the counter is read, which is rare (a bench report, a metrics export).
+ */
+class StripedCounter
+{
+private:
+    static constexpr size_t stripes = 64;
+    static constexpr size_t cacheLine = 64;
+
+    struct alignas(cacheLine) Stripe
+    {
+        std::atomic<std::uint64_t> value{0};
+    };
+
+    std::array<Stripe, stripes> stripes_;
+
+    // threads are handed stripes round robin as they first count something, and keep theirs
+    static size_t stripeIndex()
+    {
+        static std::atomic<size_t> next{0};
+        thread_local size_t index = next.fetch_add(1, std::memory_order_relaxed) % stripes;
+        return index;
+    }
+
+public:
+    StripedCounter &operator+=(std::uint64_t amount)
+    {
+        this->stripes_[stripeIndex()].value.fetch_add(amount, std::memory_order_relaxed);
+        return *this;
+    }
+
+    void operator++(int)
+    {
+        *this += 1;
+    }
+
+    /**
+     * Resets the counter, should only be called while nothing else is counting
+     */
+    StripedCounter &operator=(std::uint64_t value)
+    {
+        for (auto &stripe : this->stripes_)
+            stripe.value.store(0, std::memory_order_relaxed);
+        this->stripes_[0].value.store(value, std::memory_order_relaxed);
+        return *this;
+    }
+
+    /**
+     * @returns std::uint64_t The sum over all stripes
+     */
+    std::uint64_t load() const
+    {
+        std::uint64_t total = 0;
+        for (const auto &stripe : this->stripes_)
+            total += stripe.value.load(std::memory_order_relaxed);
+        return total;
+    }
+
+    operator std::uint64_t() const
+    {
+        return this->load();
+    }
+};
+
+/**
+ * Process-wide counters for the socket I/O done by the handshake code. Every write and read counted here is one
+ *      completed socket operation (one syscall for the blocking connector, one completed async operation for the
+ *      HandshakeServer), so dividing by the number of handshakes gives socket operations per handshake.
+ */
+struct TransportStats
+{
+    static inline StripedCounter writes;
+    static inline StripedCounter reads;
+    static inline StripedCounter bytesWritten;
+    static inline StripedCounter bytesRead;
+
+    static void reset()
+    {
+        writes = 0;
+        reads = 0;
+        bytesWritten = 0;
+        bytesRead = 0;
+    }
+};
+
+#endif
@@ -1,12 +1,59 @@
 #include <iostream>
+#include <cstdlib>
+#include <optional>
 #include <spdlog/spdlog.h>
+#include <spdlog/cfg/env.h>
 #include <boost/multiprecision/cpp_int.hpp>
 
 #include "dhke/key_gen.hpp"
+#include "dhke/logging.hpp"
 #include "dhke/participant.hpp"
 #include "dhke/client.hpp"
+#include "dhke/peer_manager.hpp"
+#include "dhke/file_transfer.hpp"
+#include "dhke/param_store.hpp"
+#include "dhke/transcript.hpp"
+#include "dhke/transport.hpp"
 
 const int PRIME_BIT_LENGTH = 512;
+// bit length of the subgroup order q -> private keys are drawn from [1, q), roughly 2x the security level of the prime
+const int SUBGROUP_BIT_LENGTH = 160;
+
+/**
+ * If DHKE_TRANSCRIPT names a file, the listen and connect modes capture their traffic there (see dhke_bench replay)
+ * @returns The transcript, or nullptr if capture is off
+ */
+std::shared_ptr<TranscriptWriter> transcriptFromEnvironment()
+{
+    const char *path = std::getenv("DHKE_TRANSCRIPT");
+    if (path == nullptr || *path == '\0')
+        return nullptr;
+    return std::make_shared<TranscriptWriter>(path);
+}
+
+// true if DHKE_PARALLEL_VALIDATION is set to 1, the connect mode then validates parameters while computing its key
+bool parallelValidationFromEnvironment()
+{
+    const char *value = std::getenv("DHKE_PARALLEL_VALIDATION");
+    return value != nullptr && std::string(value) == "1";
+}
+
+/**
+ * If DHKE_SHARDS is set, the listen mode runs its handshakes on that many shards (0 for one per core), each with its
+ *      own SO_REUSEPORT acceptor and thread. DHKE_PIN_SHARDS=1 also pins each shard's thread to a CPU
+ * @returns The shard options, or nothing to run on a single I/O thread
+ */
+std::optional<ShardOptions> shardsFromEnvironment()
+{
+    const char *shards = std::getenv("DHKE_SHARDS");
+    if (shards == nullptr || *shards == '\0')
+        return std::nullopt;
+    ShardOptions options;
+    options.shards = static_cast<size_t>(std::stoul(shards));
+    const char *pin = std::getenv("DHKE_PIN_SHARDS");
+    options.pinThreads = pin != nullptr && std::string(pin) == "1";
+    return options;
+}
 
 /**
  * Prints help info for each application mode
@@ -14,13 +61,33 @@ const int PRIME_BIT_LENGTH = 512;
 void printNetworkUsage()
 {
     std::cout << "Network mode usage:\n";
-    std::cout << "  Listener: app listen <name> <expected_peer_name> <listen_port> <auth_secret>\n";
-    std::cout << "  Connector: app connect <name> <expected_peer_name> <listen_port> <peer_host> <peer_port> <auth_secret>\n";
+    std::cout << "  Listener: app listen <name> <expected_peer_name> <listen_port> <auth_secret> [connections] [params_file]\n";
+    std::cout << "  Connector: app connect <name> <expected_peer_name> <listen_port> <peer_host> <peer_port> <auth_secret> [reconnects] [params_file]\n";
+    std::cout << "  Peer manager: app peers <name> <auth_secret> <run_seconds> <peer_name>@<host>:<port> [...]\n";
+    std::cout << "  Send file: app send <name> <expected_peer_name> <peer_host> <peer_port> <auth_secret> <file>\n";
+    std::cout << "  Receive file: app recv <name> <expected_peer_name> <listen_port> <auth_secret> <directory>\n";
+    std::cout << "  Generate parameters: app gen-params --bits N --count K --threads T --out params.bin [--order-bits Q]\n";
+    std::cout << "  For peers on the same host, listen, connect, send and recv take unix:/path or shm:/name (Linux only) in place of the listen port and peer host\n";
+    std::cout << "  Set DHKE_TRANSCRIPT=<file> to capture the traffic of listen and connect, for dhke_bench replay\n";
+    std::cout << "  Set DHKE_PARALLEL_VALIDATION=1 to have connect validate the listener's parameters while computing its own key\n";
+    std::cout << "  Set DHKE_SHARDS=N (0 for one per core) to have a TCP listen run its handshakes on N shards, DHKE_PIN_SHARDS=1 to pin them to CPUs\n";
     std::cout << std::endl;
 }
 
 int main(int argc, char *argv[])
 {
+    // log from a background thread, at the level set by SPDLOG_LEVEL (e.g. SPDLOG_LEVEL=debug or SPDLOG_LEVEL=off)
+    Logging::initAsync();
+    spdlog::cfg::load_env_levels();
+    // write out whatever is still queued on every return path
+    struct LoggingShutdown
+    {
+        ~LoggingShutdown()
+        {
+            Logging::shutdown();
+        }
+    } loggingShutdown;
+
     spdlog::info("Starting DH key demo");
 
     // we have two network modes: 'listen', and 'connect'
@@ -32,7 +99,7 @@ int main(int argc, char *argv[])
         // if listener mode, grab the relevant args and start listening
         if (role == "listen")
         {
-            if (argc != 6)
+            if (argc < 6 || argc > 8)
             {
                 // display help info
                 printNetworkUsage();
@@ -42,17 +109,34 @@ int main(int argc, char *argv[])
             // extract CLI arguments
             std::string name = argv[2];
             std::string expectedPeerName = argv[3];
-            int listenPort = std::stoi(argv[4]);
+            // a TCP port, or unix:/path or shm:/name for co-located peers
+            TransportAddress listenAddress = TransportAddress::parse(argv[4]);
+            int listenPort = listenAddress.isLocal() ? 0 : std::stoi(argv[4]);
             std::string authSecret = argv[5];
+            // optionally keep accepting connections, so reconnecting peers can resume with their session ticket
+            int connections = argc >= 7 ? std::stoi(argv[6]) : 1;
             DHKEClient listener(name, listenPort, "localhost", 0);
+            if (listenAddress.isLocal())
+                listener.setListenTransport(listenAddress);
+            listener.setTranscript(transcriptFromEnvironment());
+            if (auto shards = shardsFromEnvironment())
+                listener.setListenerShards(*shards);
+            // optionally serve pre-generated groups (see gen-params), so no handshake waits on prime generation
+            // its first group also serves as the pre-agreed group for connectors holding the same file
+            if (argc == 8)
+            {
+                auto store = std::make_shared<ParameterStore>(argv[7]);
+                listener.setPreagreedGroup(store->first());
+                listener.setParameterStore(store);
+            }
             // start listener handshake -> blocking call that waits for peer connection
-            bool ok = listener.performListenerHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH);
+            bool ok = listener.performListenerHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH, SUBGROUP_BIT_LENGTH, connections);
             return ok ? 0 : 1;
         }
         // in connector mode, grab the relevant args and attempt to connect to the listener
         else if (role == "connect")
         {
-            if (argc != 8)
+            if (argc < 8 || argc > 10)
             {
                 // display help info
                 printNetworkUsage();
@@ -62,13 +146,236 @@ int main(int argc, char *argv[])
             std::string name = argv[2];
             std::string expectedPeerName = argv[3];
             int listenPort = std::stoi(argv[4]);
+            // a host name, or unix:/path or shm:/name for a listener on the same host (the peer port is then ignored)
             std::string peerHost = argv[5];
             int peerPort = std::stoi(argv[6]);
             std::string authSecret = argv[7];
+            // optionally reconnect afterwards, each reconnect resumes the session from the ticket issued by the listener
+            int reconnects = argc >= 9 ? std::stoi(argv[8]) : 0;
             DHKEClient connector(name, listenPort, peerHost, peerPort);
-            bool ok = connector.performConnectorHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH);
+            connector.setTranscript(transcriptFromEnvironment());
+            connector.setParallelValidation(parallelValidationFromEnvironment());
+            // optionally use the first group of the listener's parameter file for a one round trip handshake
+            if (argc == 10)
+                connector.setPreagreedGroup(ParameterStore(argv[9]).first());
+
+            bool ok = true;
+            double fullMillis = 0.0, resumedMillis = 0.0;
+            int fullCount = 0, resumedCount = 0;
+            for (int i = 0; i <= reconnects; ++i)
+            {
+                ok = connector.performConnectorHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH) && ok;
+                if (connector.wasLastHandshakeResumed())
+                {
+                    resumedMillis += connector.getLastHandshakeMillis();
+                    resumedCount++;
+                }
+                else
+                {
+                    fullMillis += connector.getLastHandshakeMillis();
+                    fullCount++;
+                }
+            }
+            if (resumedCount > 0)
+            {
+                spdlog::info("Average handshake latency: full {:.2f} ms ({}), resumed {:.2f} ms ({})",
+                             fullMillis / std::max(fullCount, 1), fullCount, resumedMillis / resumedCount, resumedCount);
+            }
             return ok ? 0 : 1;
         }
+        // in peers mode, keep sessions with several listeners at once through a PeerManager
+        else if (role == "peers")
+        {
+            if (argc < 6)
+            {
+                printNetworkUsage();
+                return 1;
+            }
+            std::string name = argv[2];
+            std::string authSecret = argv[3];
+            int runSeconds = std::stoi(argv[4]);
+
+            PeerManager manager(name);
+            // answer the two messages each listener sends on a new session, the listener then closes it and the
+            // manager reconnects once the backoff has passed
+            manager.setSessionHandler([&name](std::shared_ptr<PeerSession> session)
+                                      {
+                try
+                {
+                    RecordLayer records(*session->socket, session->buffer, session->sessionKey, false);
+                    for (int i = 1; i <= 2; ++i)
+                    {
+                        auto message = records.receive();
+                        if (!message)
+                            return;
+                        spdlog::info("[{}] Message {} from {}: {}", name, i, session->peerId, message->payload);
+                        records.send("Ack from " + name + " #" + std::to_string(i));
+                    }
+                    records.flush();
+                }
+                catch (const std::exception &ex)
+                {
+                    spdlog::warn("[{}] Session with {} failed: {}", name, session->peerId, ex.what());
+                } });
+            std::vector<std::string> peerIds;
+            for (int i = 5; i < argc; ++i)
+            {
+                // peer spec format: <peer_name>@<host>:<port>
+                std::string spec = argv[i];
+                size_t at = spec.find('@');
+                size_t colon = spec.rfind(':');
+                if (at == std::string::npos || colon == std::string::npos || colon < at)
+                {
+                    printNetworkUsage();
+                    return 1;
+                }
+                peerIds.push_back(spec.substr(0, at));
+                manager.addPeer(peerIds.back(), spec.substr(at + 1, colon - at - 1), std::stoi(spec.substr(colon + 1)), authSecret);
+            }
+
+            // connect to every peer twice at once - the second call joins the first handshake instead of starting another
+            std::vector<std::shared_future<std::shared_ptr<PeerSession>>> pending;
+            for (auto &peerId : peerIds)
+            {
+                pending.push_back(manager.connect(peerId));
+                pending.push_back(manager.connect(peerId));
+            }
+            for (size_t i = 0; i < pending.size(); i += 2)
+            {
+                auto session = pending[i].get();
+                if (session && session == pending[i + 1].get())
+                    spdlog::info("Session with {} established{}, both connects got it", session->peerId, session->resumed ? " (resumed)" : "");
+            }
+
+            manager.startMaintenance();
+            for (int second = 0; second <= runSeconds; ++second)
+            {
+                for (auto &status : manager.listPeers())
+                {
+                    spdlog::info("Peer {} ({}:{}) state={} handshakes={} failures={} last={:.2f} ms{}",
+                                 status.peerId, status.host, status.port, toString(status.state), status.handshakes,
+                                 status.failures, status.lastHandshakeMillis, status.lastResumed ? " (resumed)" : "");
+                }
+                if (second < runSeconds)
+                    std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            manager.stop();
+            return 0;
+        }
+        // in send mode, stream a file to a receiving peer, reconnecting and resuming if the connection drops
+        else if (role == "send")
+        {
+            if (argc != 8)
+            {
+                printNetworkUsage();
+                return 1;
+            }
+            std::string name = argv[2];
+            std::string expectedPeerName = argv[3];
+            std::string peerHost = argv[4];
+            int peerPort = std::stoi(argv[5]);
+            std::string authSecret = argv[6];
+            std::string path = argv[7];
+            DHKEClient connector(name, 0, peerHost, peerPort);
+
+            bool complete = false;
+            connector.setSessionHandler([&](StreamRef socket, asio::streambuf &buffer, const std::string &sessionKey)
+                                        {
+                TransferStats stats;
+                complete = FileTransfer::send(socket, buffer, sessionKey, path, stats);
+                spdlog::info("Sent {:.1f} MB in {:.2f} s ({:.1f} MB/s)", stats.bytes / (1024.0 * 1024.0), stats.seconds, stats.megabytesPerSecond());
+                return complete; });
+
+            // each reconnect resumes the session from the ticket, and the transfer from the last chunk on disk
+            const int maxAttempts = 10;
+            auto backoff = std::chrono::milliseconds(250);
+            for (int attempt = 1; attempt <= maxAttempts && !complete; ++attempt)
+            {
+                if (connector.performConnectorHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH) || complete)
+                    break;
+                spdlog::warn("Transfer attempt {} failed, retrying in {} ms", attempt, backoff.count());
+                std::this_thread::sleep_for(backoff);
+                backoff = std::min(backoff * 2, std::chrono::milliseconds(8000));
+            }
+            return complete ? 0 : 1;
+        }
+        // in recv mode, accept connections until a complete file has been received
+        else if (role == "recv")
+        {
+            if (argc != 7)
+            {
+                printNetworkUsage();
+                return 1;
+            }
+            std::string name = argv[2];
+            std::string expectedPeerName = argv[3];
+            // a TCP port, or unix:/path or shm:/name for a sender on the same host
+            TransportAddress listenAddress = TransportAddress::parse(argv[4]);
+            int listenPort = listenAddress.isLocal() ? 0 : std::stoi(argv[4]);
+            std::string authSecret = argv[5];
+            std::string directory = argv[6];
+            DHKEClient listener(name, listenPort, "localhost", 0);
+            if (listenAddress.isLocal())
+                listener.setListenTransport(listenAddress);
+
+            bool complete = false;
+            listener.setSessionHandler([&](StreamRef socket, asio::streambuf &buffer, const std::string &sessionKey)
+                                       {
+                TransferStats stats;
+                try
+                {
+                    FileTransfer::receive(socket, buffer, sessionKey, directory, stats, complete);
+                }
+                catch (const std::exception &ex)
+                {
+                    // keep what we have, the sender resumes from the last checkpoint when it reconnects
+                    spdlog::warn("Transfer interrupted after {:.1f} MB: {}", stats.bytes / (1024.0 * 1024.0), ex.what());
+                    return false;
+                }
+                spdlog::info("Received {:.1f} MB in {:.2f} s ({:.1f} MB/s)", stats.bytes / (1024.0 * 1024.0), stats.seconds, stats.megabytesPerSecond());
+                return true; });
+
+            while (!complete)
+                listener.performListenerHandshake(authSecret, expectedPeerName, PRIME_BIT_LENGTH, SUBGROUP_BIT_LENGTH, 1);
+            return 0;
+        }
+        // in gen-params mode, generate groups offline into a parameter file for listeners to serve from
+        else if (role == "gen-params")
+        {
+            size_t bits = PRIME_BIT_LENGTH, orderBits = SUBGROUP_BIT_LENGTH, count = 64;
+            size_t threads = std::max(1u, std::thread::hardware_concurrency());
+            std::string out;
+            for (int i = 2; i + 1 < argc; i += 2)
+            {
+                std::string option = argv[i];
+                if (option == "--bits")
+                    bits = std::stoul(argv[i + 1]);
+                else if (option == "--order-bits")
+                    orderBits = std::stoul(argv[i + 1]);
+                else if (option == "--count")
+                    count = std::stoul(argv[i + 1]);
+                else if (option == "--threads")
+                    threads = std::stoul(argv[i + 1]);
+                else if (option == "--out")
+                    out = argv[i + 1];
+            }
+            if (out.empty() || argc % 2 != 0 || count == 0)
+            {
+                printNetworkUsage();
+                return 1;
+            }
+
+            // the per-group logging of the key generator would swamp the progress output
+            auto level = spdlog::get_level();
+            spdlog::set_level(std::max(level, spdlog::level::warn));
+            auto start = std::chrono::steady_clock::now();
+            std::vector<DHGroup> groups = ParameterStore::generate(bits, orderBits, count, threads);
+            ParameterStore::write(out, groups, bits, orderBits);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+            spdlog::set_level(level);
+            spdlog::info("Wrote {} verified {}/{} bit groups to {} in {:.2f} s on {} threads", count, bits, orderBits, out, seconds, threads);
+            return 0;
+        }
         else
         {
             // fallback: display help info